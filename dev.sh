@@ -4,14 +4,66 @@ set -eu
 
 project_dir="$( dirname "$( realpath "$0" )" )"
 
-cc -ggdb -DDEV -Wall -Werror \
+# HTTPS (--tls-cert) needs OpenSSL. Build without it where its headers are
+# missing.
+tls_cflags=""
+tls_libs=""
+if echo "#include <openssl/ssl.h>" | cc -E - > /dev/null 2>&1; then
+    tls_cflags="-DHTTPSRVDEV_TLS"
+    tls_libs="-lssl -lcrypto"
+fi
+
+cc -ggdb -DDEV -Wall -Werror -fsanitize=address,undefined $tls_cflags \
     -o "$project_dir/httpsrvdev-dev" \
-    "$project_dir/httpsrvdev_lib.c" "$project_dir/httpsrvdev_cli.c"
+    "$project_dir/httpsrvdev_lib.c" "$project_dir/httpsrvdev_cli.c" -pthread $tls_libs
 
-# TODO: Fix overflow detected when optimizations are turned on!!!!!!
-cc -Wall -Werror -Wno-unused-result \
+cc -O3 -D_FORTIFY_SOURCE=3 -Wall -Werror $tls_cflags \
     -o "$project_dir/httpsrvdev" \
-    "$project_dir/httpsrvdev_lib.c" "$project_dir/httpsrvdev_cli.c"
+    "$project_dir/httpsrvdev_lib.c" "$project_dir/httpsrvdev_cli.c" -pthread $tls_libs
 
-"$project_dir/httpsrvdev-dev" $@
+cc -O2 -Wall -Werror \
+    -o "$project_dir/httpsrvdev-bench" \
+    "$project_dir/httpsrvdev_bench.c"
+
+cc -O2 -Wall -Werror \
+    -o "$project_dir/httpsrvdev-replay" \
+    "$project_dir/httpsrvdev_replay.c"
+
+cc -O2 -Wall -Werror -DHTTPSRVDEV_TEST_HOOKS $tls_cflags \
+    -o "$project_dir/httpsrvdev-microbench" \
+    "$project_dir/httpsrvdev_microbench.c" "$project_dir/httpsrvdev_lib.c" -lm -pthread $tls_libs
+
+# `./dev.sh bench [BENCH OPTIONS]` runs the release build against
+# test_files_for_serving/ and appends the results to bench_output.txt
+if [ "${1:-}" = "bench" ]; then
+    shift
+    bench_port=8089
+    files_dir="$project_dir/test_files_for_serving"
 
+    # Serve two sources so that "/" is a generated listing
+    "$project_dir/httpsrvdev" --port $bench_port \
+        "$files_dir" "$files_dir/hello_world.txt" > /dev/null &
+    server_pid=$!
+    trap 'kill $server_pid 2> /dev/null || true' EXIT
+    sleep 0.2
+
+    "$project_dir/httpsrvdev-bench" --port $bench_port \
+        --req "$files_dir/hello_world.txt:4" \
+        --req "$files_dir/index.html:4" \
+        --req "$files_dir/1MiB_file.txt:1" \
+        --req "/:1" \
+        $@ | tee -a "$project_dir/bench_output.txt"
+    exit
+fi
+
+# `./dev.sh microbench [MICROBENCH OPTIONS]` runs the function-level
+# benchmarks and appends the results to bench_output.txt
+if [ "${1:-}" = "microbench" ]; then
+    shift
+    "$project_dir/httpsrvdev-microbench" \
+        --files-dir "$project_dir/test_files_for_serving" \
+        $@ | tee -a "$project_dir/bench_output.txt"
+    exit
+fi
+
+"$project_dir/httpsrvdev-dev" $@
@@ -0,0 +1,761 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// HTTP load generator for benchmarking httpsrvdev over loopback.
+//
+// Drives a running server with a fixed number of concurrent connections from
+// a single epoll loop, optionally using keep-alive and request pipelining, and
+// prints the results as a single JSON object on stdout, e.g. for appending to
+// bench_output.txt (see `dev.sh bench`).
+
+#define INFO 1
+#define WARN 2
+#define ERR  3
+
+#define MAX_CONNS      4096
+#define MAX_PIPELINE   64
+#define MAX_REQ_KINDS  32
+#define IN_BUF_SIZE    (64*1024)
+
+// --------------------------------------------------------
+// Options
+// --------------------------------------------------------
+
+char*    opt_host        = "127.0.0.1";
+int      opt_port        = 8080;
+size_t   opt_conns       = 8;
+bool     opt_keep_alive  = false;
+size_t   opt_pipeline    = 1;
+double   opt_duration_s  = 5.0;
+uint64_t opt_max_reqs    = 0; // 0 = run for `opt_duration_s`
+
+struct req_kind {
+    char*    path;
+    size_t   weight;
+    char     raw[1024];
+    size_t   raw_len;
+
+    uint64_t n_completed;
+    uint64_t n_bytes;
+};
+struct req_kind req_kinds[MAX_REQ_KINDS];
+size_t          req_kinds_count = 0;
+size_t          req_kinds_weight_sum = 0;
+
+// --------------------------------------------------------
+// Results
+// --------------------------------------------------------
+
+struct sample {
+    uint64_t latency_ns;
+    uint32_t req_kind_idx;
+};
+struct sample* samples = NULL;
+size_t         samples_count = 0;
+size_t         samples_cap   = 0;
+
+uint64_t n_errors   = 0;
+uint64_t n_non_2xx  = 0;
+uint64_t n_connects = 0;
+uint64_t n_bytes    = 0;
+
+// --------------------------------------------------------
+// Connections
+// --------------------------------------------------------
+
+#define RES_STATUS_LINE   1
+#define RES_HEADERS       2
+#define RES_BODY_LEN      3
+#define RES_BODY_CHUNKED  4
+#define RES_CHUNK_DATA    5
+#define RES_CHUNK_CRLF    6
+#define RES_CHUNK_TRAILER 7
+#define RES_BODY_UNTIL_EOF 8
+
+// Special values of `res_remaining` while parsing headers
+#define BODY_LEN_UNKNOWN  UINT64_MAX
+#define BODY_LEN_CHUNKED (UINT64_MAX - 1)
+
+struct conn {
+    int      fd;
+    bool     connected;
+    // What the connection is registered for with epoll
+    uint32_t events;
+    uint64_t rng;
+
+    // Requests written but not yet answered, as a ring buffer
+    uint64_t inflight_sent_ns [MAX_PIPELINE];
+    uint32_t inflight_kind_idx[MAX_PIPELINE];
+    size_t   inflight_head;
+    size_t   inflight_count;
+    // Requests issued since the connection was opened. Without keep-alive
+    // only a single request is sent per connection.
+    size_t   n_issued;
+
+    size_t   out_len;
+    size_t   out_off;
+    char     out_buf[MAX_PIPELINE*1024];
+
+    char     in_buf[IN_BUF_SIZE];
+    size_t   in_len;
+
+    int      res_state;
+    int      res_status;
+    uint64_t res_remaining;
+    uint64_t res_bytes;
+    bool     res_conn_close;
+};
+struct conn* conns;
+
+int      epoll_fd;
+struct sockaddr_in server_addr;
+bool     stopping = false;
+
+void log_(int log_level, char* msg) {
+    FILE* out_file = stderr;
+    char* prefix = "";
+    switch (log_level) {
+        case INFO: prefix = "(httpsrvdev-bench) INFO : "; break;
+        case WARN: prefix = "(httpsrvdev-bench) WARN : "; break;
+        case ERR:  prefix = "(httpsrvdev-bench) ERROR: "; break;
+    }
+    fputs(prefix, out_file);
+    fputs(msg, out_file);
+    fputc('\n', out_file);
+    fflush(out_file);
+}
+
+void log_fmt(int log_level, char* fmt, ...) {
+    va_list sprintf_args;
+    va_start(sprintf_args, fmt);
+    char msg_buf[1024];
+    vsnprintf(msg_buf, sizeof(msg_buf), fmt, sprintf_args);
+    va_end(sprintf_args);
+
+    log_(log_level, msg_buf);
+}
+
+uint64_t now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec*1000000000 + now.tv_nsec;
+}
+
+uint64_t xorshift64(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+void add_sample(uint64_t latency_ns, uint32_t req_kind_idx) {
+    if (samples_count == samples_cap) {
+        samples_cap = samples_cap == 0 ? 1<<16 : samples_cap*2;
+        samples = realloc(samples, samples_cap*sizeof(samples[0]));
+        if (samples == NULL) {
+            log_(ERR, "Out of memory!");
+            exit(1);
+        }
+    }
+    samples[samples_count++] = (struct sample) {
+        .latency_ns   = latency_ns,
+        .req_kind_idx = req_kind_idx,
+    };
+}
+
+bool add_req_kind(char* spec) {
+    if (req_kinds_count == MAX_REQ_KINDS) {
+        log_fmt(ERR, "At most %d --req options may be provided!", MAX_REQ_KINDS);
+        return false;
+    }
+    struct req_kind* kind = &req_kinds[req_kinds_count];
+
+    // PATH[:WEIGHT] -- paths containing ':' must provide a weight
+    kind->path   = spec;
+    kind->weight = 1;
+    char* weight_str = strrchr(spec, ':');
+    if (weight_str != NULL) {
+        char* end;
+        long weight = strtol(weight_str + 1, &end, 10);
+        if (*end != '\0' || weight < 1) {
+            log_fmt(ERR, "Invalid request weight in '%s'!", spec);
+            return false;
+        }
+        *weight_str  = '\0';
+        kind->weight = weight;
+    }
+    if (kind->path[0] != '/') {
+        log_fmt(ERR, "Request path '%s' must start with '/'!", kind->path);
+        return false;
+    }
+
+    req_kinds_weight_sum += kind->weight;
+    ++req_kinds_count;
+    return true;
+}
+
+bool build_raw_reqs() {
+    for (size_t i = 0; i < req_kinds_count; ++i) {
+        struct req_kind* kind = &req_kinds[i];
+        int len = snprintf(kind->raw, sizeof(kind->raw),
+            "GET %s HTTP/1.1\r\n"
+            "Host: %s:%d\r\n"
+            "User-Agent: httpsrvdev-bench\r\n"
+            "Connection: %s\r\n"
+            "\r\n",
+            kind->path, opt_host, opt_port, opt_keep_alive ? "keep-alive" : "close");
+        if (len < 0 || len >= sizeof(kind->raw)) {
+            log_fmt(ERR, "Request path '%s' is too long!", kind->path);
+            return false;
+        }
+        kind->raw_len = len;
+    }
+    return true;
+}
+
+uint32_t pick_req_kind(struct conn* conn) {
+    uint64_t r = xorshift64(&conn->rng) % req_kinds_weight_sum;
+    for (uint32_t i = 0; i < req_kinds_count; ++i) {
+        if (r < req_kinds[i].weight) return i;
+        r -= req_kinds[i].weight;
+    }
+    return 0;
+}
+
+bool reqs_budget_exhausted() {
+    return opt_max_reqs != 0 && samples_count + n_errors >= opt_max_reqs;
+}
+
+void conn_close(struct conn* conn) {
+    if (conn->fd != -1) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+        close(conn->fd);
+    }
+    conn->fd             = -1;
+    conn->connected      = false;
+    conn->inflight_count = 0;
+    conn->inflight_head  = 0;
+    conn->n_issued       = 0;
+    conn->out_len        = 0;
+    conn->out_off        = 0;
+    conn->in_len         = 0;
+    conn->res_state      = RES_STATUS_LINE;
+}
+
+bool conn_open(struct conn* conn) {
+    conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (conn->fd == -1) {
+        log_fmt(ERR, "Failed to create socket: %s", strerror(errno));
+        return false;
+    }
+    if (connect(conn->fd, (struct sockaddr*) &server_addr, sizeof(server_addr)) == -1 &&
+        errno != EINPROGRESS
+    ) {
+        close(conn->fd);
+        conn->fd = -1;
+        return false;
+    }
+    // Writable once connected
+    conn->events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+    struct epoll_event event = {
+        .events   = conn->events,
+        .data.ptr = conn,
+    };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->fd, &event);
+    ++n_connects;
+    return true;
+}
+
+// Only wait for the connection to become writable while there's something to
+// write, or the level-triggered EPOLLOUT would wake the loop up all the time
+void conn_update_events(struct conn* conn) {
+    if (conn->fd == -1) return;
+    uint32_t events = EPOLLIN | EPOLLRDHUP;
+    if (!conn->connected || conn->out_off < conn->out_len) events |= EPOLLOUT;
+    if (events == conn->events) return;
+    conn->events = events;
+    struct epoll_event event = {
+        .events   = events,
+        .data.ptr = conn,
+    };
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+}
+
+// Queue as many requests as the pipeline depth allows
+void conn_fill_pipeline(struct conn* conn) {
+    if (stopping) return;
+
+    size_t depth = opt_keep_alive ? opt_pipeline : 1;
+    if (!opt_keep_alive && conn->n_issued > 0) return;
+
+    // Compact pending output
+    if (conn->out_off > 0) {
+        memmove(conn->out_buf, conn->out_buf + conn->out_off, conn->out_len - conn->out_off);
+        conn->out_len -= conn->out_off;
+        conn->out_off  = 0;
+    }
+
+    uint64_t now = now_ns();
+    while (conn->inflight_count < depth && !reqs_budget_exhausted()) {
+        uint32_t kind_idx = pick_req_kind(conn);
+        struct req_kind* kind = &req_kinds[kind_idx];
+        if (conn->out_len + kind->raw_len > sizeof(conn->out_buf)) break;
+
+        memcpy(conn->out_buf + conn->out_len, kind->raw, kind->raw_len);
+        conn->out_len += kind->raw_len;
+
+        size_t slot = (conn->inflight_head + conn->inflight_count) % MAX_PIPELINE;
+        conn->inflight_sent_ns [slot] = now;
+        conn->inflight_kind_idx[slot] = kind_idx;
+        ++conn->inflight_count;
+        ++conn->n_issued;
+    }
+}
+
+void conn_res_complete(struct conn* conn) {
+    if (conn->inflight_count == 0) {
+        // Response without a request, e.g. an error page -- count and ignore
+        ++n_errors;
+    } else {
+        size_t   slot     = conn->inflight_head;
+        uint32_t kind_idx = conn->inflight_kind_idx[slot];
+        if (!stopping) {
+            add_sample(now_ns() - conn->inflight_sent_ns[slot], kind_idx);
+            req_kinds[kind_idx].n_completed += 1;
+            req_kinds[kind_idx].n_bytes     += conn->res_bytes;
+            n_bytes += conn->res_bytes;
+            if (conn->res_status < 200 || conn->res_status > 299) ++n_non_2xx;
+        }
+        conn->inflight_head = (conn->inflight_head + 1) % MAX_PIPELINE;
+        --conn->inflight_count;
+    }
+    conn->res_state = RES_STATUS_LINE;
+}
+
+// Find "\r\n" in `buf[0..len)`, returning the length of the line or -1
+ssize_t find_line(char* buf, size_t len) {
+    char* end = memchr(buf, '\n', len);
+    if (end == NULL) return -1;
+    return end - buf + 1;
+}
+
+// Consume as many complete responses as possible from `conn->in_buf`.
+// Returns false on a malformed response.
+bool conn_parse(struct conn* conn) {
+    size_t i = 0;
+    while (i < conn->in_len) {
+        char*  p     = conn->in_buf + i;
+        size_t avail = conn->in_len - i;
+        ssize_t line_len;
+
+        switch (conn->res_state) {
+            case RES_STATUS_LINE:
+                // Tolerate stray CRLFs between responses
+                if (p[0] == '\r' || p[0] == '\n') { ++i; continue; }
+                if ((line_len = find_line(p, avail)) == -1) goto need_more;
+                if (line_len < 12 || memcmp(p, "HTTP/1.", 7) != 0) return false;
+                conn->res_status     = atoi(p + 9);
+                conn->res_remaining  = BODY_LEN_UNKNOWN;
+                conn->res_bytes      = line_len;
+                conn->res_conn_close = !opt_keep_alive;
+                conn->res_state      = RES_HEADERS;
+                i += line_len;
+                break;
+
+            case RES_HEADERS:
+                if ((line_len = find_line(p, avail)) == -1) goto need_more;
+                conn->res_bytes += line_len;
+                i += line_len;
+                if (line_len <= 2) {
+                    if (conn->res_remaining == BODY_LEN_CHUNKED) {
+                        conn->res_state = RES_BODY_CHUNKED;
+                    } else if (conn->res_remaining == BODY_LEN_UNKNOWN) {
+                        conn->res_state = RES_BODY_UNTIL_EOF;
+                    } else if (conn->res_remaining == 0) {
+                        conn_res_complete(conn);
+                    } else {
+                        conn->res_state = RES_BODY_LEN;
+                    }
+                } else if (strncasecmp(p, "Content-Length:", 15) == 0) {
+                    conn->res_remaining = strtoull(p + 15, NULL, 10);
+                } else if (strncasecmp(p, "Transfer-Encoding:", 18) == 0) {
+                    conn->res_remaining = BODY_LEN_CHUNKED;
+                } else if (strncasecmp(p, "Connection:", 11) == 0) {
+                    char* value = p + 11;
+                    while (*value == ' ') ++value;
+                    if (strncasecmp(value, "close", 5) == 0) conn->res_conn_close = true;
+                }
+                break;
+
+            case RES_BODY_LEN: {
+                size_t n = avail < conn->res_remaining ? avail : conn->res_remaining;
+                conn->res_remaining -= n;
+                conn->res_bytes     += n;
+                i += n;
+                if (conn->res_remaining == 0) conn_res_complete(conn);
+                break;
+            }
+
+            case RES_BODY_CHUNKED:
+                if ((line_len = find_line(p, avail)) == -1) goto need_more;
+                conn->res_remaining = strtoull(p, NULL, 16);
+                conn->res_bytes    += line_len;
+                i += line_len;
+                conn->res_state = conn->res_remaining == 0 ? RES_CHUNK_TRAILER
+                                                           : RES_CHUNK_DATA;
+                break;
+
+            case RES_CHUNK_DATA: {
+                size_t n = avail < conn->res_remaining ? avail : conn->res_remaining;
+                conn->res_remaining -= n;
+                conn->res_bytes     += n;
+                i += n;
+                if (conn->res_remaining == 0) conn->res_state = RES_CHUNK_CRLF;
+                break;
+            }
+
+            case RES_CHUNK_CRLF:
+                if ((line_len = find_line(p, avail)) == -1) goto need_more;
+                conn->res_bytes += line_len;
+                i += line_len;
+                conn->res_state = RES_BODY_CHUNKED;
+                break;
+
+            case RES_CHUNK_TRAILER:
+                if ((line_len = find_line(p, avail)) == -1) goto need_more;
+                conn->res_bytes += line_len;
+                i += line_len;
+                if (line_len <= 2) conn_res_complete(conn);
+                break;
+
+            case RES_BODY_UNTIL_EOF:
+                conn->res_bytes += avail;
+                i += avail;
+                break;
+        }
+    }
+
+need_more:
+    memmove(conn->in_buf, conn->in_buf + i, conn->in_len - i);
+    conn->in_len -= i;
+    if (conn->in_len == sizeof(conn->in_buf)) return false;
+    return true;
+}
+
+void conn_restart(struct conn* conn, bool dropped_inflight_are_errors) {
+    if (dropped_inflight_are_errors && !stopping) n_errors += conn->inflight_count;
+    conn_close(conn);
+    if (!stopping && !reqs_budget_exhausted() && conn_open(conn)) {
+        conn_fill_pipeline(conn);
+    }
+}
+
+void conn_on_event(struct conn* conn, uint32_t events) {
+    if (!conn->connected && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        int err = 0;
+        socklen_t err_len = sizeof(err);
+        getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+        if (err != 0) {
+            ++n_errors;
+            conn_restart(conn, false);
+            return;
+        }
+        conn->connected = true;
+    }
+
+    if (events & EPOLLOUT) {
+        while (conn->out_off < conn->out_len) {
+            ssize_t n = write(conn->fd, conn->out_buf + conn->out_off,
+                              conn->out_len - conn->out_off);
+            if (n == -1) {
+                if (errno == EAGAIN) break;
+                conn_restart(conn, true);
+                return;
+            }
+            conn->out_off += n;
+        }
+    }
+
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        while (true) {
+            ssize_t n = read(conn->fd, conn->in_buf + conn->in_len,
+                             sizeof(conn->in_buf) - conn->in_len);
+            if (n == -1) {
+                if (errno == EAGAIN) break;
+                conn_restart(conn, true);
+                return;
+            }
+            if (n == 0) {
+                // Server closed the connection: a close-delimited body ends
+                // here, anything else still in flight was dropped.
+                if (conn->res_state == RES_BODY_UNTIL_EOF) conn_res_complete(conn);
+                // A reused connection closed before any of the next response
+                // arrived was idle on the server's side, so the requests are
+                // reissued on a fresh one rather than counted as errors.
+                bool idle_close = conn->n_issued > conn->inflight_count &&
+                                  conn->res_state == RES_STATUS_LINE && conn->in_len == 0;
+                conn_restart(conn, !idle_close);
+                return;
+            }
+            conn->in_len += n;
+            if (!conn_parse(conn)) {
+                log_(WARN, "Malformed response!");
+                conn_restart(conn, true);
+                return;
+            }
+            if (conn->res_state == RES_STATUS_LINE &&
+                conn->inflight_count == 0 && conn->res_conn_close
+            ) {
+                conn_restart(conn, false);
+                return;
+            }
+        }
+    }
+
+    conn_fill_pipeline(conn);
+    conn_update_events(conn);
+}
+
+// --------------------------------------------------------
+// Reporting
+// --------------------------------------------------------
+
+int cmp_u64(const void* a, const void* b) {
+    uint64_t x = *(uint64_t*) a;
+    uint64_t y = *(uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+// Percentile in microseconds of an already sorted array
+double percentile_us(uint64_t* sorted, size_t n, double p) {
+    if (n == 0) return 0;
+    size_t idx = (size_t) (p*(n - 1) + 0.5);
+    return sorted[idx]/1000.0;
+}
+
+// Print `str` as a JSON string, quotes included
+void print_json_str(char* str) {
+    putchar('"');
+    for (unsigned char* c = (unsigned char*) str; *c != '\0'; ++c) {
+        if (*c == '"' || *c == '\\') {
+            printf("\\%c", *c);
+        } else if (*c < 0x20) {
+            printf("\\u%04x", *c);
+        } else {
+            putchar(*c);
+        }
+    }
+    putchar('"');
+}
+
+void print_latencies_json(uint64_t* latencies, size_t n) {
+    qsort(latencies, n, sizeof(latencies[0]), cmp_u64);
+    printf("{\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}",
+           percentile_us(latencies, n, 0.50),
+           percentile_us(latencies, n, 0.99),
+           percentile_us(latencies, n, 0.999),
+           n > 0 ? latencies[n - 1]/1000.0 : 0.0);
+}
+
+void print_results_json(double elapsed_s) {
+    uint64_t* latencies = malloc((samples_count + 1)*sizeof(uint64_t));
+
+    printf("{\"host\":\"%s\",\"port\":%d,\"connections\":%zu,\"keep_alive\":%s,"
+           "\"pipeline\":%zu,\"duration_s\":%.3f,",
+           opt_host, opt_port, opt_conns, opt_keep_alive ? "true" : "false",
+           opt_pipeline, elapsed_s);
+    printf("\"requests\":%zu,\"errors\":%lu,\"non_2xx\":%lu,\"connects\":%lu,"
+           "\"bytes\":%lu,\"req_per_s\":%.1f,\"mb_per_s\":%.3f,",
+           samples_count, n_errors, n_non_2xx, n_connects, n_bytes,
+           samples_count/elapsed_s, n_bytes/elapsed_s/(1024.0*1024.0));
+
+    for (size_t i = 0; i < samples_count; ++i) latencies[i] = samples[i].latency_ns;
+    printf("\"latency_us\":");
+    print_latencies_json(latencies, samples_count);
+
+    printf(",\"paths\":[");
+    for (size_t k = 0; k < req_kinds_count; ++k) {
+        size_t n = 0;
+        for (size_t i = 0; i < samples_count; ++i) {
+            if (samples[i].req_kind_idx == k) latencies[n++] = samples[i].latency_ns;
+        }
+        printf("%s{\"path\":", k == 0 ? "" : ",");
+        print_json_str(req_kinds[k].path);
+        printf(",\"weight\":%zu,\"requests\":%lu,\"bytes\":%lu,\"latency_us\":",
+               req_kinds[k].weight, req_kinds[k].n_completed, req_kinds[k].n_bytes);
+        print_latencies_json(latencies, n);
+        printf("}");
+    }
+    printf("]}\n");
+
+    free(latencies);
+}
+
+// --------------------------------------------------------
+
+void print_usage(char* this_exe_name) {
+    printf(
+        "%s [OPTIONS/FLAGS]\n"
+        "\n"
+        "Benchmark a running httpsrvdev server and print the results as JSON.\n"
+        "\n"
+        "[OPTIONS/FLAGS]\n"
+        "--host ADDRESS ....... IPv4 address of the server. Default \"127.0.0.1\".\n"
+        "-p/--port PORT ....... Port of the server.         Default \"8080\".\n"
+        "-c/--conns N ......... Number of concurrent connections. Default 8.\n"
+        "-d/--duration SECS ... Run for SECS seconds.       Default 5.\n"
+        "-n/--requests N ...... Stop after N requests instead of after --duration.\n"
+        "-k/--keep-alive ...... Reuse connections for multiple requests.\n"
+        "--pipeline DEPTH ..... Number of requests in flight per connection\n"
+        "                       (requires --keep-alive). Default 1.\n"
+        "--req PATH[:WEIGHT] .. Add PATH to the request mix with relative WEIGHT.\n"
+        "                       May be repeated. Default mix (for a server\n"
+        "                       serving test_files_for_serving/):\n"
+        "                           /hello_world.txt /index.html /1MiB_file.txt /\n"
+        "-h/--help ............ Display this usage message.\n",
+        this_exe_name);
+}
+
+char* arg_value(int argc, char* argv[], int* i) {
+    if (*i + 1 >= argc) {
+        log_fmt(ERR, "No value provided after %s!", argv[*i]);
+        exit(1);
+    }
+    return argv[++*i];
+}
+
+void handle_cli_args(int argc, char* argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        char* arg = argv[i];
+        if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+            print_usage(argv[0]);
+            exit(0);
+        } else if (strcmp(arg, "--host") == 0) {
+            opt_host = arg_value(argc, argv, &i);
+        } else if (strcmp(arg, "-p") == 0 || strcmp(arg, "--port") == 0) {
+            opt_port = atoi(arg_value(argc, argv, &i));
+        } else if (strcmp(arg, "-c") == 0 || strcmp(arg, "--conns") == 0) {
+            opt_conns = strtoul(arg_value(argc, argv, &i), NULL, 10);
+        } else if (strcmp(arg, "-d") == 0 || strcmp(arg, "--duration") == 0) {
+            opt_duration_s = strtod(arg_value(argc, argv, &i), NULL);
+        } else if (strcmp(arg, "-n") == 0 || strcmp(arg, "--requests") == 0) {
+            opt_max_reqs = strtoull(arg_value(argc, argv, &i), NULL, 10);
+        } else if (strcmp(arg, "-k") == 0 || strcmp(arg, "--keep-alive") == 0) {
+            opt_keep_alive = true;
+        } else if (strcmp(arg, "--pipeline") == 0) {
+            opt_pipeline = strtoul(arg_value(argc, argv, &i), NULL, 10);
+        } else if (strcmp(arg, "--req") == 0) {
+            if (!add_req_kind(arg_value(argc, argv, &i))) exit(1);
+        } else {
+            log_fmt(ERR, "Unknown option/flag '%s'!", arg);
+            exit(1);
+        }
+    }
+
+    if (opt_port < 1 || opt_port > 0xFFFF) {
+        log_(ERR, "Invalid port!");
+        exit(1);
+    }
+    if (opt_conns < 1 || opt_conns > MAX_CONNS) {
+        log_fmt(ERR, "Number of connections must be between 1 and %d!", MAX_CONNS);
+        exit(1);
+    }
+    if (opt_pipeline < 1 || opt_pipeline > MAX_PIPELINE) {
+        log_fmt(ERR, "Pipeline depth must be between 1 and %d!", MAX_PIPELINE);
+        exit(1);
+    }
+    if (opt_pipeline > 1 && !opt_keep_alive) {
+        log_(ERR, "--pipeline requires --keep-alive!");
+        exit(1);
+    }
+    if (opt_max_reqs == 0 && opt_duration_s <= 0) {
+        log_(ERR, "Duration must be positive!");
+        exit(1);
+    }
+    if (inet_pton(AF_INET, opt_host, &server_addr.sin_addr) != 1) {
+        log_fmt(ERR, "Failed to parse IPv4 address '%s'!", opt_host);
+        exit(1);
+    }
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port   = htons(opt_port);
+
+    if (req_kinds_count == 0) {
+        static char default_mix[][32] = {
+            "/hello_world.txt", "/index.html", "/1MiB_file.txt", "/",
+        };
+        for (size_t i = 0; i < sizeof(default_mix)/sizeof(default_mix[0]); ++i) {
+            add_req_kind(default_mix[i]);
+        }
+    }
+    if (!build_raw_reqs()) exit(1);
+}
+
+int main(int argc, char* argv[]) {
+    handle_cli_args(argc, argv);
+
+    epoll_fd = epoll_create1(0);
+    conns    = calloc(opt_conns, sizeof(conns[0]));
+    if (epoll_fd == -1 || conns == NULL) {
+        log_(ERR, "Failed to set up event loop!");
+        return 1;
+    }
+
+    log_fmt(INFO, "Benchmarking http://%s:%d with %zu connection(s)...",
+            opt_host, opt_port, opt_conns);
+
+    for (size_t i = 0; i < opt_conns; ++i) {
+        struct conn* conn = &conns[i];
+        conn->fd  = -1;
+        conn->rng = 0x9E3779B97F4A7C15ull*(i + 1);
+        conn_close(conn);
+        if (!conn_open(conn)) {
+            log_fmt(ERR, "Failed to connect: %s", strerror(errno));
+            return 1;
+        }
+        conn_fill_pipeline(conn);
+    }
+
+    uint64_t start_ns    = now_ns();
+    uint64_t deadline_ns = start_ns + (uint64_t) (opt_duration_s*1e9);
+    struct epoll_event events[256];
+    while (true) {
+        uint64_t now = now_ns();
+        if (opt_max_reqs == 0 ? now >= deadline_ns : reqs_budget_exhausted()) break;
+
+        int timeout_ms = opt_max_reqs == 0 ? (deadline_ns - now)/1000000 + 1 : 1000;
+        int n_events = epoll_wait(epoll_fd, events, 256, timeout_ms);
+        if (n_events == -1) {
+            if (errno == EINTR) continue;
+            log_fmt(ERR, "epoll_wait failed: %s", strerror(errno));
+            return 1;
+        }
+        if (n_events == 0 && opt_max_reqs != 0) {
+            log_(WARN, "No progress for 1s, stopping early!");
+            break;
+        }
+        for (int i = 0; i < n_events; ++i) {
+            conn_on_event(events[i].data.ptr, events[i].events);
+        }
+    }
+    double elapsed_s = (now_ns() - start_ns)/1e9;
+
+    stopping = true;
+    for (size_t i = 0; i < opt_conns; ++i) conn_close(&conns[i]);
+
+    print_results_json(elapsed_s);
+
+    return 0;
+}
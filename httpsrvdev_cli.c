@@ -1,10 +1,12 @@
 #include <errno.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 #include "httpsrvdev_lib.h"
 
@@ -12,14 +14,48 @@
 #define WARN 2
 #define ERR  3
 
-char   argv        [16][256];
-bool   argv_handled[16];
-bool   argv_is_src[16] = {false};
+char** argv;
+bool*  argv_handled;
+bool*  argv_is_src;
 char*  stdin_mime_type = "text/plain";
+bool   live_reload = false;
+bool   preload = false;
+int    grace_period_ms = 5000;
 size_t argv_srcs_count = 0;
 size_t argc;
 struct httpsrvdev_inst inst;
 
+// Requests whose route starts with `prefix` are forwarded to `upstream`
+#define PROXY_RULES_MAX 16
+struct proxy_rule {
+    char*  prefix;
+    size_t prefix_len;
+    char*  url;
+    struct httpsrvdev_upstream* upstream;
+};
+struct proxy_rule proxy_rules[PROXY_RULES_MAX];
+int               proxy_rules_count = 0;
+
+// Files with the extension `ext` are run by the FastCGI backend at `addr`
+#define FCGI_RULES_MAX 16
+struct fcgi_rule {
+    char* ext;
+    char* addr;
+    struct httpsrvdev_fcgi* fcgi;
+};
+struct fcgi_rule fcgi_rules[FCGI_RULES_MAX];
+int              fcgi_rules_count = 0;
+
+// What is known about the current response, kept per coroutine
+struct res_info {
+    // The proxied server or FastCGI backend that the response came from
+    char* upstream;
+    // Whether the connection timed out during the response, which closed it,
+    // so that there's no one left to send an error page to
+    bool  timed_out;
+};
+struct res_info res_info = { .upstream = NULL, .timed_out = false };
+
 void unexpected_err_and_exit() {
     perror("Unexpected Implementation Error: "
             "Unexpected log level!");
@@ -56,7 +92,7 @@ void log_fmt(int log_level, char* fmt, ...) {
     va_list sprintf_args;
     va_start(sprintf_args, fmt);
     char msg_buf[1024];
-    vsprintf(msg_buf, fmt, sprintf_args);
+    vsnprintf(msg_buf, sizeof(msg_buf), fmt, sprintf_args);
     va_end(sprintf_args);
 
     log_(log_level, msg_buf);
@@ -77,12 +113,61 @@ int argv_find_unhandled_idx(char* short_arg, char* long_arg) {
     return -1;
 }
 
+// Parse the value after the unhandled option `long_opt`, if present, as an
+// integer in [min, max]. Exits on invalid values.
+bool argv_handle_int_opt(char* long_opt, long min, long max, int* val) {
+    int opt_idx = argv_find_unhandled_idx(NULL, long_opt);
+    if (opt_idx == -1) return false;
+
+    int val_idx = opt_idx + 1;
+    if (val_idx >= argc) {
+        log_fmt(ERR, "No value provided after %s!", long_opt);
+        exit(1);
+    }
+    char* val_str = argv[val_idx];
+    char* val_str_end;
+    long  val_long = strtol(val_str, &val_str_end, 10);
+    if (*val_str == '\0' || *val_str_end != '\0' || val_long < min || val_long > max) {
+        log_fmt(ERR, "Invalid value '%s' for %s! Expected %ld to %ld.",
+                val_str, long_opt, min, max);
+        exit(1);
+    }
+    *val = val_long;
+    argv_handled[opt_idx] = true;
+    argv_handled[val_idx] = true;
+    return true;
+}
+
 void argv_err_on_duplicate_opts_or_flags(void) {
     char* possible_duplicate_opts[][2] = {
         {NULL, "--ip"        },
         {"-p", "--port"      },
         {"-h", "--help"      },
         {NULL, "--stdin-type"},
+        {NULL, "--live-reload"},
+        {NULL, "--fs-workers"},
+        {NULL, "--preload"},
+        {NULL, "--backlog"},
+        {NULL, "--tcp-nodelay"},
+        {NULL, "--tcp-fastopen"},
+        {NULL, "--tcp-defer-accept"},
+        {NULL, "--sndbuf"},
+        {NULL, "--rcvbuf"},
+        {NULL, "--hot-restart"},
+        {NULL, "--grace-period"},
+        {NULL, "--max-conns"},
+        {NULL, "--max-queued"},
+        {NULL, "--ip-rate"},
+        {NULL, "--ip-burst"},
+        {NULL, "--retry-after"},
+        {NULL, "--header-timeout"},
+        {NULL, "--idle-timeout"},
+        {NULL, "--min-send-rate"},
+        {NULL, "--coroutines"},
+        {NULL, "--h2c"},
+        {NULL, "--tls-cert"},
+        {NULL, "--tls-key"},
+        {NULL, "--record"},
         // Not checked: {NULL, "--override-opts"},
     };
     for (size_t i = 0;
@@ -116,6 +201,8 @@ bool read_stdin(char** buf_ptr, size_t* len) {
     *len = n;
     *buf_ptr = malloc(n);
     char* buf = *buf_ptr;
+    if (buf == NULL) return false;
+    buf[0] = '\0';
 
     bool result = false;
     while (n > 0 && fgets(buf, n, stdin)) {
@@ -136,6 +223,30 @@ void handle_sigint() {
     exit(0);
 }
 
+// Summarize refused requests at most once a second, so that logging doesn't
+// add to the overload
+void log_shed(void) {
+    static time_t   last_log_time   = 0;
+    static uint64_t last_shed_count = 0;
+
+    if (inst.admission_shed_count == last_shed_count) return;
+    time_t now = time(NULL);
+    if (now == last_log_time) return;
+    log_fmt(WARN, "Overloaded! Refused %llu request(s) since the last report; "
+                  "%d connection(s) queued.",
+            (unsigned long long) (inst.admission_shed_count - last_shed_count),
+            inst.admission_queued_count);
+    last_log_time   = now;
+    last_shed_count = inst.admission_shed_count;
+}
+
+// Refused requests never reach `serve_req`, so they're also reported as
+// they're refused
+void on_conn_shed(struct httpsrvdev_inst* inst_ptr, struct httpsrvdev_hook_event* event) {
+    log_shed();
+}
+struct httpsrvdev_hooks hooks = { .conn_shed = on_conn_shed };
+
 void res_with_err_page_from_status(size_t status) {
     switch (status) {
         case 404:
@@ -143,6 +254,23 @@ void res_with_err_page_from_status(size_t status) {
             httpsrvdev_res_header(&inst, "Content-Type", "text/plain; charset=utf-8");
             httpsrvdev_res_body  (&inst, "File not found!");
             break;
+        case 405:
+            // Only GET routes are added that are particular about the method
+            httpsrvdev_res_status_line(&inst, 405);
+            httpsrvdev_res_header(&inst, "Allow", "GET, HEAD");
+            httpsrvdev_res_header(&inst, "Content-Type", "text/plain; charset=utf-8");
+            httpsrvdev_res_body  (&inst, "Method not allowed!");
+            break;
+        case 406:
+            httpsrvdev_res_status_line(&inst, 406);
+            httpsrvdev_res_header(&inst, "Content-Type", "text/plain; charset=utf-8");
+            httpsrvdev_res_body  (&inst, "File is only available with Accept-Encoding: deflate!");
+            break;
+        case 414:
+            httpsrvdev_res_status_line(&inst, 414);
+            httpsrvdev_res_header(&inst, "Content-Type", "text/plain; charset=utf-8");
+            httpsrvdev_res_body  (&inst, "URI too long!");
+            break;
         case 500:
             httpsrvdev_res_status_line(&inst, 500);
             httpsrvdev_res_header(&inst, "Content-Type", "text/plain; charset=utf-8");
@@ -153,9 +281,161 @@ void res_with_err_page_from_status(size_t status) {
     }
 }
 
+// Whether the call that just failed did so because the connection timed out
+bool conn_timed_out(void) {
+    if ((inst.err & ~httpsrvdev_MASK_ERRNO) == httpsrvdev_TIMED_OUT) res_info.timed_out = true;
+    return res_info.timed_out;
+}
+
+void res_with_snapshot_or_err(struct httpsrvdev_snapshot* snapshot, char* path) {
+    if (!httpsrvdev_res_snapshot(&inst, snapshot, path)) {
+        if (conn_timed_out()) {
+            return;
+        } else if ((inst.err & httpsrvdev_MASK_ERRNO) == ENOENT) {
+            res_with_err_page_from_status(404);
+        } else {
+            res_with_err_page_from_status(500);
+        }
+    }
+}
+
+void res_with_archive_member_or_err(struct httpsrvdev_archive* archive, char* path) {
+    if (!httpsrvdev_res_archive_member(&inst, archive, path)) {
+        if (conn_timed_out()) {
+            return;
+        } else if (inst.err == httpsrvdev_UNACCEPTABLE_ENCODING) {
+            res_with_err_page_from_status(406);
+        } else if ((inst.err & httpsrvdev_MASK_ERRNO) == ENOENT) {
+            res_with_err_page_from_status(404);
+        } else {
+            res_with_err_page_from_status(500);
+        }
+    }
+}
+
+// Respond to a failed `httpsrvdev_res_proxy` or `httpsrvdev_res_fcgi`, where
+// `action` is what failed, e.g. "proxy"
+void res_with_upstream_err(char* action) {
+    // Failures on the client's side, e.g. it going away, aren't the upstream's
+    char* err_str = NULL;
+    switch (inst.err & ~httpsrvdev_MASK_ERRNO) {
+        case httpsrvdev_UPSTREAM_CONN_FAILED:
+        case httpsrvdev_COULD_NOT_CREATE_SOCK:
+        case httpsrvdev_COULD_NOT_SET_SOCK_OPT:
+            err_str = strerror(inst.err & httpsrvdev_MASK_ERRNO);
+            break;
+        case httpsrvdev_UPSTREAM_TIMED_OUT: err_str = "Timed out.";        break;
+        case httpsrvdev_BAD_UPSTREAM_RES:   err_str = "Invalid response."; break;
+    }
+    if (err_str != NULL) {
+        log_fmt(WARN, "Failed to %s %s at %s! %s",
+                action, inst.conn->req_target, res_info.upstream, err_str);
+    }
+    // Once the upstream's response has begun, the connection was closed instead
+    if (conn_timed_out() || inst.conn->res_bytes_sent > 0) return;
+    switch (inst.err & ~httpsrvdev_MASK_ERRNO) {
+        case httpsrvdev_UNSUPPORTED_REQ_BODY:
+            httpsrvdev_res_status_line(&inst, 501);
+            httpsrvdev_res_header(&inst, "Content-Type", "text/plain; charset=utf-8");
+            httpsrvdev_res_body  (&inst, "Only request bodies with a Content-Length sent "
+                                         "over HTTP/1.1 can be forwarded!");
+            break;
+        case httpsrvdev_UPSTREAM_TIMED_OUT:
+            httpsrvdev_res_status_line(&inst, 504);
+            httpsrvdev_res_header(&inst, "Content-Type", "text/plain; charset=utf-8");
+            httpsrvdev_res_body  (&inst, "The upstream server didn't respond in time!");
+            break;
+        default:
+            httpsrvdev_res_status_line(&inst, 502);
+            httpsrvdev_res_header(&inst, "Content-Type", "text/plain; charset=utf-8");
+            httpsrvdev_res_body  (&inst, "Failed to get a response from the upstream server!");
+            break;
+    }
+}
+
+void res_with_proxy_or_err(struct proxy_rule* rule) {
+    res_info.upstream = rule->url;
+    if (!httpsrvdev_res_proxy(&inst, rule->upstream, rule->prefix_len)) {
+        res_with_upstream_err("proxy");
+    }
+}
+
+// Route handlers. Whatever goes wrong is responded to, so they always succeed.
+
+bool route_live_reload_events(struct httpsrvdev_inst* inst, void* ctx) {
+    if (!httpsrvdev_res_live_reload_events(inst) && !conn_timed_out()) {
+        res_with_err_page_from_status(500);
+    }
+    return true;
+}
+
+bool route_proxy(struct httpsrvdev_inst* inst, void* rule) {
+    res_with_proxy_or_err(rule);
+    return true;
+}
+
+// The rule for the extension of the script that `path` leads to, if any. The
+// script is the first path segment with a rule's extension, e.g. "t.php" in
+// "/t.php/extra/info"; `path_info` is set to what follows it.
+struct fcgi_rule* fcgi_rule_match(char* path, char** path_info) {
+    for (char* ext = strchr(path, '.'); ext != NULL; ext = strchr(ext + 1, '.')) {
+        size_t ext_len = strcspn(ext, "/");
+        for (int i = 0; i < fcgi_rules_count; ++i) {
+            if (strlen(fcgi_rules[i].ext) == ext_len &&
+                strncasecmp(ext, fcgi_rules[i].ext, ext_len) == 0
+            ) {
+                *path_info = ext + ext_len;
+                return &fcgi_rules[i];
+            }
+        }
+    }
+    return NULL;
+}
+
+// Whether the file system lookup that just failed did so because there's
+// nothing at the path, e.g. also for "/a.txt/b" where a.txt is a file
+bool err_is_not_found(void) {
+    int err_no = inst.err & httpsrvdev_MASK_ERRNO;
+    return err_no == ENOENT || err_no == ENOTDIR;
+}
+
+void res_with_fcgi_or_err(struct fcgi_rule* rule, char* path, char* path_info) {
+    // The script's path without the path info
+    char script_path[PATH_MAX];
+    size_t script_path_len = path_info - path;
+    if (script_path_len >= sizeof(script_path)) {
+        res_with_err_page_from_status(414);
+        return;
+    }
+    memcpy(script_path, path, script_path_len);
+    script_path[script_path_len] = '\0';
+
+    res_info.upstream = rule->addr;
+    if (httpsrvdev_res_rel_fcgi(&inst, rule->fcgi, script_path, path_info)) return;
+    if (conn_timed_out()) return;
+    if ((inst.err & ~httpsrvdev_MASK_ERRNO) == httpsrvdev_COULD_NOT_STAT) {
+        res_info.upstream = NULL;
+        if (err_is_not_found()) {
+            res_with_err_page_from_status(404);
+        } else {
+            res_with_err_page_from_status(500);
+        }
+        return;
+    }
+    res_with_upstream_err("run");
+}
+
 void res_with_path_or_err(char* path) {
-    if (!httpsrvdev_res_rel_file_sys_entryf(&inst, path)) {
-        if ((inst.err & httpsrvdev_MASK_ERRNO) == ENOENT) {
+    char*             path_info;
+    struct fcgi_rule* fcgi_rule = fcgi_rule_match(path, &path_info);
+    if (fcgi_rule != NULL) {
+        res_with_fcgi_or_err(fcgi_rule, path, path_info);
+        return;
+    }
+    if (!httpsrvdev_res_rel_file_sys_entry(&inst, path)) {
+        if (conn_timed_out()) {
+            return;
+        } else if (err_is_not_found()) {
             res_with_err_page_from_status(404);
         } else {
             res_with_err_page_from_status(500);
@@ -163,11 +443,278 @@ void res_with_path_or_err(char* path) {
     }
 }
 
+bool path_is_archive(char* path) {
+    size_t path_len = strlen(path);
+    return path_len > 4 &&
+           (strcmp(path + path_len - 4, ".tar") == 0 ||
+            strcmp(path + path_len - 4, ".zip") == 0);
+}
+
 void res_with_stdin(char* stdin_buf) {
     httpsrvdev_res_status_line(&inst, 200);
     httpsrvdev_res_headerf(&inst,
             "Content-Type", "%s; charset=utf-8", stdin_mime_type);
-    httpsrvdev_res_body(&inst, stdin_buf);
+    if (!httpsrvdev_res_body(&inst, stdin_buf)) conn_timed_out();
+}
+
+// Sources, resolved once at startup
+struct src {
+    char* arg;           // As provided on the command line
+    char* resolved_path; // NULL for the standard input or if unresolvable
+    bool  is_stdin;
+    bool  is_dir;
+    // Non-NULL if the source is a .tar or .zip archive whose members are served
+    struct httpsrvdev_archive* archive;
+};
+
+// Prefix trie over the components of the sources' resolved paths, for
+// finding the source that serves a route in multi-source mode. Node 0 is "/".
+// The edges of all nodes share one open-addressing hash table keyed on
+// (parent node, component), so each step of a lookup is O(1) no matter how
+// many sources there are or how many share a directory.
+struct route_trie_edge {
+    uint64_t hash;
+    char*    name;   // Not null terminated; NULL for an empty slot
+    size_t   name_len;
+    uint32_t parent;
+    uint32_t child;
+};
+
+struct route_trie {
+    // Index into `srcs` of the source at each node, or -1
+    int*   node_srcs;
+    size_t nodes_count;
+    size_t nodes_cap;
+
+    struct route_trie_edge* edges;
+    size_t                  edges_count;
+    size_t                  edges_cap; // Power of 2
+};
+
+uint64_t route_trie_hash(uint32_t parent, char* name, size_t name_len) {
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325 ^ parent;
+    for (size_t i = 0; i < name_len; ++i) {
+        hash ^= (unsigned char) name[i];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+struct route_trie_edge* route_trie_find_edge(struct route_trie* trie,
+    uint32_t parent, char* name, size_t name_len, uint64_t hash
+) {
+    size_t mask = trie->edges_cap - 1;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        struct route_trie_edge* edge = &trie->edges[i];
+        if (edge->name == NULL ||
+            (edge->hash == hash && edge->parent == parent &&
+             edge->name_len == name_len && memcmp(edge->name, name, name_len) == 0)
+        ) {
+            return edge;
+        }
+    }
+}
+
+bool route_trie_grow_edges(struct route_trie* trie) {
+    size_t old_cap = trie->edges_cap;
+    struct route_trie_edge* old_edges = trie->edges;
+    trie->edges_cap = old_cap == 0 ? 64 : 2*old_cap;
+    trie->edges = calloc(trie->edges_cap, sizeof(trie->edges[0]));
+    if (trie->edges == NULL) return false;
+    for (size_t i = 0; i < old_cap; ++i) {
+        if (old_edges[i].name == NULL) continue;
+        *route_trie_find_edge(trie, old_edges[i].parent,
+                              old_edges[i].name, old_edges[i].name_len,
+                              old_edges[i].hash) = old_edges[i];
+    }
+    free(old_edges);
+    return true;
+}
+
+int route_trie_add_node(struct route_trie* trie) {
+    if (trie->nodes_count == trie->nodes_cap) {
+        size_t new_cap = trie->nodes_cap == 0 ? 64 : 2*trie->nodes_cap;
+        int* new_node_srcs = realloc(trie->node_srcs, new_cap*sizeof(trie->node_srcs[0]));
+        if (new_node_srcs == NULL) return -1;
+        trie->node_srcs = new_node_srcs;
+        trie->nodes_cap = new_cap;
+    }
+    trie->node_srcs[trie->nodes_count] = -1;
+    return trie->nodes_count++;
+}
+
+// Add source `src_idx` at `resolved_path`. The path must outlive the trie.
+bool route_trie_insert(struct route_trie* trie, char* resolved_path, int src_idx) {
+    if (trie->nodes_count == 0 && route_trie_add_node(trie) == -1) return false;
+
+    uint32_t node = 0;
+    for (char* name = resolved_path; *name != '\0'; ) {
+        size_t name_len = strcspn(name, "/");
+        if (name_len > 0) {
+            if (2*(trie->edges_count + 1) > trie->edges_cap &&
+                !route_trie_grow_edges(trie)
+            ) return false;
+
+            uint64_t hash = route_trie_hash(node, name, name_len);
+            struct route_trie_edge* edge =
+                route_trie_find_edge(trie, node, name, name_len, hash);
+            if (edge->name == NULL) {
+                int child = route_trie_add_node(trie);
+                if (child == -1) return false;
+                *edge = (struct route_trie_edge) {
+                    .hash = hash, .name = name, .name_len = name_len,
+                    .parent = node, .child = child,
+                };
+                ++trie->edges_count;
+            }
+            node = edge->child;
+        }
+        name += name_len;
+        if (*name == '/') ++name;
+    }
+
+    // If two sources resolve to the same path the first one wins
+    if (trie->node_srcs[node] == -1) {
+        trie->node_srcs[node] = src_idx;
+    }
+    return true;
+}
+
+// Find the source with the longest resolved path that is a prefix of
+// `route`, by whole components, and point `rest` at the remainder of the
+// route. Returns -1 if there is none or if the route has "." or ".."
+// components, which could otherwise escape the source.
+int route_trie_lookup(struct route_trie* trie, char* route, char** rest) {
+    if (trie->nodes_count == 0) return -1;
+
+    int  src_idx = trie->node_srcs[0];
+    *rest = route;
+    bool in_trie = true;
+    uint32_t node = 0;
+    for (char* name = route; *name != '\0'; ) {
+        size_t name_len = strcspn(name, "/");
+        if ((name_len == 1 && name[0] == '.') ||
+            (name_len == 2 && name[0] == '.' && name[1] == '.')
+        ) {
+            return -1;
+        }
+        if (name_len > 0 && in_trie) {
+            uint64_t hash = route_trie_hash(node, name, name_len);
+            struct route_trie_edge* edge =
+                route_trie_find_edge(trie, node, name, name_len, hash);
+            if (edge->name == NULL) {
+                in_trie = false;
+            } else {
+                node = edge->child;
+                if (trie->node_srcs[node] != -1) {
+                    src_idx = trie->node_srcs[node];
+                    *rest   = name + name_len;
+                }
+            }
+        }
+        name += name_len;
+        if (*name == '/') ++name;
+    }
+    return src_idx;
+}
+
+// What `serve_req` serves
+struct serve_ctx {
+    struct src*                     srcs;
+    size_t                          srcs_count;
+    char*                           stdin_buf;
+    struct httpsrvdev_snapshot*     snapshot;
+    struct route_trie*              route_trie;
+    struct httpsrvdev_prebuilt_res* root_listing;
+};
+
+// Serve a request that `httpsrvdev_serve` received on `inst`, which
+// `inst_ptr` points to
+bool serve_req(struct httpsrvdev_inst* inst_ptr, void* ctx) {
+    struct serve_ctx*               serve_ctx    = ctx;
+    struct src*                     srcs         = serve_ctx->srcs;
+    size_t                          srcs_count   = serve_ctx->srcs_count;
+    char*                           stdin_buf    = serve_ctx->stdin_buf;
+    struct httpsrvdev_snapshot*     snapshot     = serve_ctx->snapshot;
+    struct route_trie*              route_trie   = serve_ctx->route_trie;
+    struct httpsrvdev_prebuilt_res* root_listing = serve_ctx->root_listing;
+
+    res_info = (struct res_info) { .upstream = NULL, .timed_out = false };
+
+    // The "route" is the normalized path of the HTTP target, without
+    // the query, e.g. the cache-busting one added when live reload
+    // swaps stylesheets
+    char* abs_route = inst.conn->req_path;
+    char* rel_route = abs_route + 1;
+
+    // The live reload event stream and the --proxy prefixes
+    if (httpsrvdev_res_route(&inst)) goto end;
+    if (inst.err == httpsrvdev_METHOD_NOT_ALLOWED) {
+        res_with_err_page_from_status(405);
+        goto end;
+    }
+
+    if (srcs_count == 1) {
+        if (srcs[0].is_stdin) {
+            res_with_stdin(stdin_buf);
+        } else if (srcs[0].archive != NULL) {
+            res_with_archive_member_or_err(srcs[0].archive, rel_route);
+        } else if (snapshot != NULL) {
+            res_with_snapshot_or_err(snapshot, rel_route);
+        } else {
+            char* path = srcs[0].arg;
+            if (httpsrvdev_root_path_from_str(&inst, path)) {
+                res_with_path_or_err(rel_route);
+            } else {
+                res_with_err_page_from_status(500);
+            }
+        }
+    } else {
+        bool  is_root_route  = rel_route[0] == '\0';
+        bool  is_stdin_route = rel_route[0] == '-' && rel_route[1] == '\0';
+        char* route_rest;
+        int   src_idx = -1;
+        if (!is_root_route && !is_stdin_route) {
+            src_idx = route_trie_lookup(route_trie, abs_route, &route_rest);
+        }
+
+        if (is_root_route) {
+            if (!httpsrvdev_res_prebuilt(&inst, root_listing)) conn_timed_out();
+        } else if (is_stdin_route && stdin_buf != NULL) {
+            res_with_stdin(stdin_buf);
+        } else if (src_idx != -1 && srcs[src_idx].archive != NULL) {
+            res_with_archive_member_or_err(srcs[src_idx].archive, route_rest);
+        } else if (src_idx != -1) {
+            httpsrvdev_root_path_from_str(&inst, "");
+            res_with_path_or_err(abs_route);
+        } else {
+            res_with_err_page_from_status(404);
+        }
+    }
+end:
+    if (res_info.timed_out) {
+        log_fmt(WARN, "%s %s timed out after %zu byte(s) of the response! "
+                      "Closed the connection.",
+                inst.conn->req_method_str, inst.conn->req_target, inst.conn->res_bytes_sent);
+    } else if (res_info.upstream == NULL || !inst.conn->res_upstream_conn_taken) {
+        // Not forwarded, or refused before the upstream was contacted
+        log_fmt(INFO, "%s %s %d",
+                inst.conn->req_method_str, inst.conn->req_target, inst.conn->res_status);
+    } else if (inst.conn->res_upstream_reused) {
+        log_fmt(INFO, "%s %s %d <- %s (reused connection, response %.2f ms)",
+                inst.conn->req_method_str, inst.conn->req_target, inst.conn->res_status,
+                res_info.upstream,
+                inst.conn->res_upstream_response_ns/1e6);
+    } else {
+        log_fmt(INFO, "%s %s %d <- %s (connect %.2f ms, response %.2f ms)",
+                inst.conn->req_method_str, inst.conn->req_target, inst.conn->res_status,
+                res_info.upstream,
+                inst.conn->res_upstream_connect_ns/1e6, inst.conn->res_upstream_response_ns/1e6);
+    }
+    // Report requests refused since the last report
+    log_shed();
+    return true;
 }
 
 void handle_cli_args() {
@@ -175,8 +722,8 @@ void handle_cli_args() {
     char* this_exe_name = argv[0];
     argv_handled[0] = true;
 
-    char usage_msg[4096];
-    sprintf(usage_msg,
+    char usage_msg[16384];
+    snprintf(usage_msg, sizeof(usage_msg),
         "%s [OPTIONS/FLAGS] [SRC1 SRC2 ...]\n"
         "\n"
         "Serve files and directories via HTTP.\n"
@@ -195,13 +742,100 @@ void handle_cli_args() {
         "                           'index.html' or 'index.htm' if contained within\n"
         "                           directory; otherwise, a directory listing will be\n"
         "                           served.\n"
+        "                           A .tar or .zip archive is served like a\n"
+        "                           directory, straight from the archive without\n"
+        "                           extracting it.\n"
         "[OPTIONS/FLAGS]\n"
         "--ip ADDRESS ......... Set the server's IPv4 address. Default \"127.0.0.1\".\n"
         "-p/--port PORT ....... Set the server's port.         Default \"8080\".\n"
+        "--listen ADDRESS ..... Listen on ADDRESS instead of --ip and --port. May be\n"
+        "                       repeated to listen on several addresses at once.\n"
+        "                       ADDRESS is one of\n"
+        "                           IPV4:PORT,   e.g. 127.0.0.1:8080\n"
+        "                           [IPV6]:PORT, e.g. [::1]:8080\n"
+        "                           unix:PATH,   e.g. unix:/tmp/httpsrvdev.sock\n"
         "-h/--help ............ Display this usage message.\n"
         "--stdin-type ......... Set the MIME type that the standard input will be\n"
         "                       served as (if \"-\" is provided as a source).\n"
         "                       Default \"text/plain\".\n"
+        "--live-reload ........ Reload pages in the browser when the served files\n"
+        "                       change. A small script is added to HTML pages that\n"
+        "                       listens for changes; changed stylesheets are\n"
+        "                       swapped without reloading the page.\n"
+        "--fs-workers N ....... Offload file metadata lookups, directory listings\n"
+        "                       and reads of files that aren't cached in memory\n"
+        "                       to N threads. Useful when serving from network\n"
+        "                       file systems or slow disks. Default 0 (off).\n"
+        "--preload ............ Load the source directory into memory at startup\n"
+        "                       and serve it from there, without touching the\n"
+        "                       file system. For build outputs that don't change;\n"
+        "                       with --live-reload, changes are loaded as they\n"
+        "                       happen. Requires a single directory source.\n"
+        "--backlog N .......... Queue up to N connections that haven't been\n"
+        "                       accepted yet. Default SOMAXCONN.\n"
+        "--tcp-nodelay ........ Disable Nagle's algorithm on connections.\n"
+        "--tcp-fastopen QLEN .. Enable TCP Fast Open with up to QLEN pending\n"
+        "                       connections. Default 0 (off).\n"
+        "--tcp-defer-accept S . Only accept connections once their request has\n"
+        "                       arrived, waiting up to S seconds. Default 0 (off).\n"
+        "--sndbuf BYTES ....... Set the socket send buffer size.\n"
+        "--rcvbuf BYTES ....... Set the socket receive buffer size.\n"
+        "                       Both default to the system's.\n"
+        "--hot-restart PATH ... Restart without refusing connections: take over\n"
+        "                       the listening sockets of a server running with\n"
+        "                       the same PATH, which then finishes its open\n"
+        "                       connections and exits. PATH is the Unix domain\n"
+        "                       socket the servers hand over on.\n"
+        "--grace-period MS .... How long a server that was taken over from waits\n"
+        "                       for its open connections. Default 5000.\n"
+        "--max-conns N ........ Refuse requests with 503 Service Unavailable\n"
+        "                       while N connections are open, counting live\n"
+        "                       reload event streams. Default 0 (no limit).\n"
+        "--max-queued N ....... Refuse requests while more than N connections\n"
+        "                       are waiting to be accepted. Default 0 (no limit).\n"
+        "--ip-rate R .......... Refuse requests of clients that make more than R\n"
+        "                       requests per second...\n"
+        "--ip-burst N ......... ...in bursts of more than N. Default R.\n"
+        "--retry-after S ...... Ask refused clients to retry after S seconds.\n"
+        "                       Default 1.\n"
+        "--header-timeout MS .. Close connections that haven't sent their request\n"
+        "                       headers within MS milliseconds. Default 10000.\n"
+        "--idle-timeout MS .... Close connections that neither send nor receive\n"
+        "                       anything for MS milliseconds. Default 5000.\n"
+        "--min-send-rate B .... Close connections that receive the response at\n"
+        "                       less than B bytes per second. Default 0 (off).\n"
+        "                       The timeouts are off when set to 0.\n"
+        "--coroutines N ....... Serve up to N connections at once, each on a\n"
+        "                       small stack of its own, so that slow clients and\n"
+        "                       upstreams don't hold up the others. 0 serves one\n"
+        "                       connection at a time. Default 64.\n"
+        "--h2c ................ Also serve HTTP/2 without TLS, to clients that\n"
+        "                       know to use it or ask to upgrade to it. Many\n"
+        "                       small files, e.g. ES modules, then share one\n"
+        "                       connection.\n"
+        "--tls-cert PATH ...... Serve HTTPS with the PEM certificate (chain) at\n"
+        "                       PATH. Needed for secure contexts, e.g. service\n"
+        "                       workers, on hosts other than localhost. Files\n"
+        "                       are still sent with sendfile, without copying\n"
+        "                       them through the server, where the kernel\n"
+        "                       supports TLS (kTLS).\n"
+        "--tls-key PATH ....... The PEM private key of the certificate.\n"
+        "                       Default the --tls-cert file.\n"
+        "--proxy PREFIX=URL ... Forward requests for routes under PREFIX to the\n"
+        "                       server at URL, e.g. /api=http://127.0.0.1:9000,\n"
+        "                       over kept-alive connections. If URL has a path,\n"
+        "                       it replaces PREFIX. May be repeated; the longest\n"
+        "                       matching PREFIX wins.\n"
+        "--fastcgi EXT=ADDR ... Run files with the extension EXT, e.g. .php, on\n"
+        "                       the FastCGI server (e.g. php-fpm) at ADDR,\n"
+        "                       e.g. .php=127.0.0.1:9000 or\n"
+        "                       .php=unix:/run/php/php-fpm.sock, over kept-alive\n"
+        "                       connections. Paths below a script, e.g.\n"
+        "                       /t.php/extra, run it with PATH_INFO /extra.\n"
+        "                       May be repeated.\n"
+        "--record FILE ........ Append each request, as received, to FILE with\n"
+        "                       its arrival time, for replaying the traffic\n"
+        "                       later with httpsrvdev-replay.\n"
         "--override-opts ...... Allow the last duplicate of a flag or option to\n"
         "                       override the first. If not provided, duplicates will\n"
         "                       causes an error. When provided this flag additionally\n"
@@ -266,6 +900,38 @@ void handle_cli_args() {
         argv_handled[port_val_idx] = true;
     }
 
+    // Check for and handle listen address CLI options. These may be
+    // repeated, so are added in the order they were given.
+    bool has_listen_opt = false;
+    for (int listen_opt_idx = 0; listen_opt_idx < argc; ++listen_opt_idx) {
+        if (argv_handled[listen_opt_idx] ||
+            strcmp(argv[listen_opt_idx], "--listen") != 0
+        ) continue;
+
+        int listen_val_idx = listen_opt_idx + 1;
+        if (listen_val_idx >= argc) {
+            log_(ERR, "No value provided after --listen!");
+            exit(1);
+        }
+        char* addr_str = argv[listen_val_idx];
+        if (!httpsrvdev_listen_addr_from_str(&inst, addr_str)) {
+            if (inst.err == httpsrvdev_BUF_TOO_SMALL) {
+                log_fmt(ERR, "Too many --listen addresses! At most %d are supported.",
+                        httpsrvdev_LISTEN_ADDRS_MAX);
+            } else {
+                log_fmt(ERR, "Failed to parse listen address '%s'!", addr_str);
+            }
+            exit(1);
+        }
+        argv_handled[listen_opt_idx] = true;
+        argv_handled[listen_val_idx] = true;
+        has_listen_opt = true;
+    }
+    if (has_listen_opt && (ip_opt_idx != -1 || port_opt_idx != -1)) {
+        log_(ERR, "--listen can't be combined with --ip or --port!");
+        exit(1);
+    }
+
     // Check for and handle stdin MIME type CLI option
     int stdin_mime_type_opt_idx = argv_find_unhandled_idx(NULL, "--stdin-type");
     if (stdin_mime_type_opt_idx != -1) {
@@ -279,6 +945,212 @@ void handle_cli_args() {
         argv_handled[stdin_mime_type_val_idx] = true;
     }
 
+    // Check for and handle file system workers CLI option
+    int fs_workers_opt_idx = argv_find_unhandled_idx(NULL, "--fs-workers");
+    if (fs_workers_opt_idx != -1) {
+        int fs_workers_val_idx = fs_workers_opt_idx + 1;
+        if (fs_workers_val_idx >= argc) {
+            log_(ERR, "No value provided after --fs-workers!");
+            exit(1);
+        }
+        char* fs_workers_str = argv[fs_workers_val_idx];
+        char* fs_workers_str_end;
+        long  fs_workers = strtol(fs_workers_str, &fs_workers_str_end, 10);
+        if (*fs_workers_str == '\0' || *fs_workers_str_end != '\0' ||
+            fs_workers < 0 || fs_workers > 256
+        ) {
+            log_fmt(ERR, "Invalid number of file system workers '%s'! "
+                         "Expected 0 to 256.", fs_workers_str);
+            exit(1);
+        }
+        inst.fs_workers_count = fs_workers;
+        argv_handled[fs_workers_opt_idx] = true;
+        argv_handled[fs_workers_val_idx] = true;
+    }
+
+    // Check for and handle socket tuning CLI options
+    argv_handle_int_opt("--backlog",          1, INT_MAX, &inst.listen_backlog);
+    argv_handle_int_opt("--tcp-fastopen",     0, INT_MAX, &inst.tcp_fastopen_qlen);
+    argv_handle_int_opt("--tcp-defer-accept", 0, INT_MAX, &inst.tcp_defer_accept_s);
+    argv_handle_int_opt("--sndbuf",           0, INT_MAX, &inst.sock_sndbuf_size);
+    argv_handle_int_opt("--rcvbuf",           0, INT_MAX, &inst.sock_rcvbuf_size);
+    int tcp_nodelay_flag_idx = argv_find_unhandled_idx(NULL, "--tcp-nodelay");
+    if (tcp_nodelay_flag_idx != -1) {
+        inst.tcp_nodelay = true;
+        argv_handled[tcp_nodelay_flag_idx] = true;
+    }
+
+    // Check for and handle hot restart CLI options
+    int hot_restart_opt_idx = argv_find_unhandled_idx(NULL, "--hot-restart");
+    if (hot_restart_opt_idx != -1) {
+        int hot_restart_val_idx = hot_restart_opt_idx + 1;
+        if (hot_restart_val_idx >= argc) {
+            log_(ERR, "No control socket path provided after --hot-restart!");
+            exit(1);
+        }
+        inst.handoff_path = argv[hot_restart_val_idx];
+        argv_handled[hot_restart_opt_idx] = true;
+        argv_handled[hot_restart_val_idx] = true;
+    }
+    argv_handle_int_opt("--grace-period", 0, INT_MAX, &grace_period_ms);
+
+    // Check for and handle admission control CLI options
+    argv_handle_int_opt("--max-conns",   0, INT_MAX, &inst.admission_max_conns);
+    argv_handle_int_opt("--max-queued",  0, INT_MAX, &inst.admission_max_queued);
+    argv_handle_int_opt("--ip-rate",     0, INT_MAX, &inst.admission_ip_rate);
+    argv_handle_int_opt("--ip-burst",    0, INT_MAX, &inst.admission_ip_burst);
+    argv_handle_int_opt("--retry-after", 0, INT_MAX, &inst.admission_retry_after_s);
+    inst.hooks = &hooks;
+
+    // Check for and handle connection timeout CLI options
+    argv_handle_int_opt("--header-timeout", 0, INT_MAX, &inst.conn_header_timeout_ms);
+    argv_handle_int_opt("--idle-timeout",   0, INT_MAX, &inst.conn_idle_timeout_ms);
+    argv_handle_int_opt("--min-send-rate",  0, INT_MAX, &inst.conn_min_send_rate);
+
+    // Check for and handle the concurrency CLI option
+    argv_handle_int_opt("--coroutines", 0, 65536, &inst.coros_max);
+
+    // Check for and handle TLS CLI options
+    int tls_cert_opt_idx = argv_find_unhandled_idx(NULL, "--tls-cert");
+    if (tls_cert_opt_idx != -1) {
+        int tls_cert_val_idx = tls_cert_opt_idx + 1;
+        if (tls_cert_val_idx >= argc) {
+            log_(ERR, "No certificate path provided after --tls-cert!");
+            exit(1);
+        }
+        inst.tls_cert_path = argv[tls_cert_val_idx];
+        argv_handled[tls_cert_opt_idx] = true;
+        argv_handled[tls_cert_val_idx] = true;
+    }
+    int tls_key_opt_idx = argv_find_unhandled_idx(NULL, "--tls-key");
+    if (tls_key_opt_idx != -1) {
+        int tls_key_val_idx = tls_key_opt_idx + 1;
+        if (tls_key_val_idx >= argc) {
+            log_(ERR, "No private key path provided after --tls-key!");
+            exit(1);
+        }
+        if (inst.tls_cert_path == NULL) {
+            log_(ERR, "--tls-key requires --tls-cert!");
+            exit(1);
+        }
+        inst.tls_key_path = argv[tls_key_val_idx];
+        argv_handled[tls_key_opt_idx] = true;
+        argv_handled[tls_key_val_idx] = true;
+    }
+
+    // Check for and handle the traffic recording CLI option
+    int record_opt_idx = argv_find_unhandled_idx(NULL, "--record");
+    if (record_opt_idx != -1) {
+        int record_val_idx = record_opt_idx + 1;
+        if (record_val_idx >= argc) {
+            log_(ERR, "No file path provided after --record!");
+            exit(1);
+        }
+        inst.record_path = argv[record_val_idx];
+        argv_handled[record_opt_idx] = true;
+        argv_handled[record_val_idx] = true;
+    }
+
+    // Check for and handle reverse proxy CLI options. These may be repeated.
+    for (int proxy_opt_idx = 0; proxy_opt_idx < argc; ++proxy_opt_idx) {
+        if (argv_handled[proxy_opt_idx] ||
+            strcmp(argv[proxy_opt_idx], "--proxy") != 0
+        ) continue;
+
+        int proxy_val_idx = proxy_opt_idx + 1;
+        if (proxy_val_idx >= argc) {
+            log_(ERR, "No PREFIX=URL provided after --proxy!");
+            exit(1);
+        }
+        if (proxy_rules_count == PROXY_RULES_MAX) {
+            log_fmt(ERR, "Too many --proxy rules! At most %d are supported.",
+                    PROXY_RULES_MAX);
+            exit(1);
+        }
+        char* rule_str = argv[proxy_val_idx];
+        char* url      = strchr(rule_str, '=');
+        if (rule_str[0] != '/' || url == NULL) {
+            log_fmt(ERR, "Invalid --proxy rule '%s'! Expected PREFIX=URL, "
+                         "e.g. /api=http://127.0.0.1:9000.", rule_str);
+            exit(1);
+        }
+        struct proxy_rule* rule = &proxy_rules[proxy_rules_count++];
+        rule->prefix     = rule_str;
+        rule->prefix_len = url - rule_str;
+        rule->url        = url + 1;
+        rule->upstream   = httpsrvdev_upstream_open(&inst, rule->url);
+        if (rule->upstream == NULL) {
+            log_fmt(ERR, "Invalid --proxy URL '%s'! Expected http://HOST:PORT[/PATH] "
+                         "with an IP address or localhost as HOST.", rule->url);
+            exit(1);
+        }
+        argv_handled[proxy_opt_idx] = true;
+        argv_handled[proxy_val_idx] = true;
+    }
+
+    // Check for and handle FastCGI CLI options. These may be repeated.
+    for (int fcgi_opt_idx = 0; fcgi_opt_idx < argc; ++fcgi_opt_idx) {
+        if (argv_handled[fcgi_opt_idx] ||
+            strcmp(argv[fcgi_opt_idx], "--fastcgi") != 0
+        ) continue;
+
+        int fcgi_val_idx = fcgi_opt_idx + 1;
+        if (fcgi_val_idx >= argc) {
+            log_(ERR, "No EXT=ADDR provided after --fastcgi!");
+            exit(1);
+        }
+        if (fcgi_rules_count == FCGI_RULES_MAX) {
+            log_fmt(ERR, "Too many --fastcgi rules! At most %d are supported.",
+                    FCGI_RULES_MAX);
+            exit(1);
+        }
+        char* rule_str = argv[fcgi_val_idx];
+        char* addr     = strchr(rule_str, '=');
+        if (rule_str[0] != '.' || addr == NULL) {
+            log_fmt(ERR, "Invalid --fastcgi rule '%s'! Expected EXT=ADDR, "
+                         "e.g. .php=127.0.0.1:9000.", rule_str);
+            exit(1);
+        }
+        *addr = '\0';
+        struct fcgi_rule* rule = &fcgi_rules[fcgi_rules_count++];
+        rule->ext  = rule_str;
+        rule->addr = addr + 1;
+        rule->fcgi = NULL;
+        // Extensions run by the same backend share its connections
+        for (int i = 0; i < fcgi_rules_count - 1; ++i) {
+            if (strcmp(fcgi_rules[i].addr, rule->addr) == 0) rule->fcgi = fcgi_rules[i].fcgi;
+        }
+        if (rule->fcgi == NULL) rule->fcgi = httpsrvdev_fcgi_open(&inst, rule->addr);
+        if (rule->fcgi == NULL) {
+            log_fmt(ERR, "Invalid --fastcgi address '%s'! Expected IPV4:PORT, "
+                         "[IPV6]:PORT or unix:PATH.", rule->addr);
+            exit(1);
+        }
+        argv_handled[fcgi_opt_idx] = true;
+        argv_handled[fcgi_val_idx] = true;
+    }
+
+    // Check for and handle HTTP/2 CLI flag
+    int h2c_flag_idx = argv_find_unhandled_idx(NULL, "--h2c");
+    if (h2c_flag_idx != -1) {
+        inst.h2c = true;
+        argv_handled[h2c_flag_idx] = true;
+    }
+
+    // Check for and handle preload CLI flag
+    int preload_flag_idx = argv_find_unhandled_idx(NULL, "--preload");
+    if (preload_flag_idx != -1) {
+        preload = true;
+        argv_handled[preload_flag_idx] = true;
+    }
+
+    // Check for and handle live reload CLI flag
+    int live_reload_flag_idx = argv_find_unhandled_idx(NULL, "--live-reload");
+    if (live_reload_flag_idx != -1) {
+        live_reload = true;
+        argv_handled[live_reload_flag_idx] = true;
+    }
+
     // Assume that remaining unhandled args are sources and check that
     // all sources args are at the end unless --override-opts is provided.
     bool last_was_handled = false;
@@ -311,11 +1183,14 @@ void handle_cli_args() {
 
 int main(int argc_local, char* argv_local[]) {
     // Populate globals
-    for (size_t i = 0; i < argc_local; ++i) {
-        strcpy(argv[i], argv_local[i]);
-        argv_handled[i] = false;
+    argv         = argv_local;
+    argc         = argc_local;
+    argv_handled = calloc(argc, sizeof(bool));
+    argv_is_src  = calloc(argc, sizeof(bool));
+    if (argv_handled == NULL || argv_is_src == NULL) {
+        log_(ERR, "Out of memory!");
+        exit(1);
     }
-    argc = argc_local;
 
     // Initialize httpsrvdev instance from CLI args
     inst = httpsrvdev_init_begin(); {
@@ -325,7 +1200,11 @@ int main(int argc_local, char* argv_local[]) {
     signal(SIGINT, handle_sigint);
 
     // Preprocess sources
-    char*  srcs[argv_srcs_count + 1];
+    struct src* srcs = calloc(argv_srcs_count + 1, sizeof(struct src));
+    if (srcs == NULL) {
+        log_(ERR, "Out of memory!");
+        exit(1);
+    }
     size_t srcs_count = 0;
     char*  stdin_buf = NULL;
     size_t stdin_len = 0;
@@ -336,106 +1215,211 @@ int main(int argc_local, char* argv_local[]) {
             if (src_is_stdin) {
                 read_stdin(&stdin_buf, &stdin_len);
             }
-            srcs[srcs_count++] = src;
+            srcs[srcs_count++] = (struct src) { .arg = src, .is_stdin = src_is_stdin };
         }
     }
     if (srcs_count == 0) {
-        srcs[srcs_count++] = ".";
+        srcs[srcs_count++] = (struct src) { .arg = "." };
     }
 
-    // Run file server
-    httpsrvdev_start(&inst); {
-        log_fmt(INFO, "Listening on http://%d.%d.%d.%d:%d...",
-                (inst.ip>>24)&0xFF, (inst.ip>>16)&0xFF, (inst.ip>>8)&0xFF, (inst.ip>>0)&0xFF,
-                inst.port);
-
-        size_t abs_route_buf_len = 512;
-        char   abs_route[abs_route_buf_len];
-        char*  rel_route = abs_route + 1;
-        // Main loop
-        while (true) {
-            while (!httpsrvdev_res_begin(&inst)) {
-                // Request parsing intermittently fails here when a request finishes
-                // after another one has been started -- e.g. when switching back
-                // and forth between a page and a directory listing. This is possibly
-                // some sort of race condition because we're handling requests
-                // synchronously or an implementation error.
-                // It hasn't prevented any functionality yet and would probably take
-                // a bit of time to diagnose so I'm not going to look into it yet.
-                // TODO: Diagnose later
-                // TODO: Log warning
+    // Resolve sources once so that requests don't have to
+    for (size_t i = 0; i < srcs_count; ++i) {
+        struct src* src = &srcs[i];
+        if (src->is_stdin) continue;
+        src->resolved_path = realpath(src->arg, NULL);
+        if (src->resolved_path == NULL) {
+            log_fmt(WARN, "Failed to resolve source '%s'!", src->arg);
+            continue;
+        }
+        struct stat path_stat;
+        src->is_dir = stat(src->resolved_path, &path_stat) != -1 &&
+                      (path_stat.st_mode & S_IFMT) == S_IFDIR;
+
+        // Index archives once, here, instead of extracting them
+        if (!src->is_dir && path_is_archive(src->resolved_path)) {
+            src->archive = httpsrvdev_archive_open(&inst, src->resolved_path);
+            if (src->archive == NULL) {
+                log_fmt(WARN, "Failed to read archive '%s'! Serving it as a file.", src->arg);
+            }
+        }
+    }
+
+    if (live_reload) {
+        for (size_t i = 0; i < srcs_count; ++i) {
+            struct src* src = &srcs[i];
+            if (src->is_stdin) continue;
+            if (!httpsrvdev_live_reload_watch(&inst, src->arg)) {
+                log_fmt(WARN, "Failed to watch '%s' for changes!", src->arg);
             }
+        }
+    }
 
-            // Set the "route" from the HTTP target
-            //    TODO: Add proper target parsing
-            //    TODO: HTTP error response when slice is larger than route_buf_len
-            strcpy(abs_route, inst.req_target);
-
-            if (srcs_count == 1) {
-                bool src_is_stdin = srcs[0][0] == '-' && srcs[0][1] == '\0';
-                if (src_is_stdin) {
-                    res_with_stdin(stdin_buf);
-                } else {
-                    char* path = srcs[0];
-                    strcpy(inst.root_path, path);
-                    res_with_path_or_err(rel_route);
-                }
-            } else {
-                bool is_root_route  = rel_route[0] == '\0';
-                bool is_stdin_route = rel_route[0] == '-' && rel_route[1] == '\0';
-
-                if (is_root_route) {
-                    httpsrvdev_res_listing_begin(&inst);
-                    for (size_t i = 0; i < srcs_count; ++i) {
-                        char* src = srcs[i];
-                        bool  src_is_stdin = src[0] == '-' && src[1] == '\0';
-                        if (src_is_stdin) {
-                            httpsrvdev_res_listing_entry(&inst, "-", "STDIN");
-                        } else {
-                            char* path = src;
-                            char resolved_path[512];
-                            realpath(path, resolved_path);
-
-                            // Add trailing '/' to resolved path if it's a path
-                            // to a directory. This ensures that the path will
-                            // be added to the URL
-                            struct stat path_stat;
-                            if (stat(resolved_path, &path_stat) != -1 &&
-                                (path_stat.st_mode & S_IFMT) == S_IFDIR
-                            ) {
-                                size_t path_len = strlen(resolved_path);
-                                resolved_path[path_len    ] = '/';
-                                resolved_path[path_len + 1] = '\0';
-                            }
-
-                            httpsrvdev_res_listing_entry(&inst, resolved_path, path);
-                        }
-                    }
-                    httpsrvdev_res_listing_end(&inst);
-                } else if (is_stdin_route && stdin_buf != NULL) {
-                    res_with_stdin(stdin_buf);
-                } else {
-                    for (size_t i = 0; i < srcs_count; ++i) {
-                        char* path = srcs[i];
-                        char resolved_path[512];
-                        realpath(path, resolved_path);
-
-                        if (strncmp(resolved_path, abs_route, strlen(resolved_path))
-                            == 0
-                        ) {
-                            strcpy(inst.root_path, "");
-                            res_with_path_or_err(abs_route);
-                            goto main_loop_iter_end;
-                        }
-                    }
+    // Load the snapshot for --preload
+    struct httpsrvdev_snapshot* snapshot = NULL;
+    if (preload) {
+        if (srcs_count != 1 || !srcs[0].is_dir) {
+            log_(ERR, "--preload requires a single directory source!");
+            exit(1);
+        }
+        long threads_count = sysconf(_SC_NPROCESSORS_ONLN);
+        snapshot = httpsrvdev_snapshot_build(&inst, srcs[0].arg, threads_count > 0 ? threads_count : 1);
+        if (snapshot == NULL) {
+            log_fmt(ERR, "Failed to preload '%s'!", srcs[0].arg);
+            exit(1);
+        }
+        struct httpsrvdev_snapshot_stats stats = httpsrvdev_snapshot_stats(snapshot);
+        log_fmt(INFO, "Preloaded %zu files and %zu directories into a %.1f MiB image%s in %.1f ms",
+                stats.files_count, stats.dirs_count,
+                stats.image_size/(1024.0*1024.0),
+                stats.huge_pages ? " (huge pages)" : "",
+                stats.build_ns/1e6);
+        if (live_reload) inst.snapshot = snapshot;
+    }
 
-                    res_with_err_page_from_status(404);
-                }
+    // In multi-source mode, build the route trie and render the root listing
+    struct route_trie route_trie = {0};
+    struct httpsrvdev_prebuilt_res root_listing;
+    if (srcs_count > 1) {
+        for (size_t i = 0; i < srcs_count; ++i) {
+            if (srcs[i].resolved_path == NULL) continue;
+            if (!route_trie_insert(&route_trie, srcs[i].resolved_path, i)) {
+                log_(ERR, "Out of memory!");
+                exit(1);
             }
-        main_loop_iter_end: 
-            log_fmt(INFO, "%s %s %d", inst.req_method_str, inst.req_target, inst.res_status);
-            continue;
         }
+
+        httpsrvdev_prebuilt_begin(&inst, &root_listing);
+        bool ok = httpsrvdev_res_listing_begin(&inst);
+        for (size_t i = 0; ok && i < srcs_count; ++i) {
+            struct src* src = &srcs[i];
+            if (src->is_stdin) {
+                ok = httpsrvdev_res_listing_entry(&inst, "-", "STDIN");
+            } else if (src->resolved_path != NULL) {
+                // Add trailing '/' to directories. This ensures that the path
+                // will be added to the URL
+                char entry_path[PATH_MAX + 1];
+                snprintf(entry_path, sizeof(entry_path), "%s%s",
+                         src->resolved_path,
+                         src->is_dir || src->archive != NULL ? "/" : "");
+                ok = httpsrvdev_res_listing_entry(&inst, entry_path, src->arg);
+            }
+        }
+        if (!ok || !httpsrvdev_res_listing_end(&inst)) {
+            log_(ERR, "Failed to render the sources listing!");
+            exit(1);
+        }
+    }
+
+    // Add the routes that are served before the sources
+    if (live_reload &&
+        !httpsrvdev_route_add(&inst, httpsrvdev_METHOD_BIT(httpsrvdev_GET),
+                              httpsrvdev_LIVE_RELOAD_EVENTS_PATH, route_live_reload_events, NULL)
+    ) {
+        unexpected_err_and_exit();
+    }
+    for (int i = 0; i < proxy_rules_count; ++i) {
+        // "/api" covers "/api" and "/api/users" but not "/apiary"; "/api/"
+        // only the latter. The longest prefix wins as the router prefers the
+        // deepest match.
+        struct proxy_rule* rule = &proxy_rules[i];
+        char pattern[PATH_MAX];
+        bool ok = rule->prefix_len + 2 < sizeof(pattern);
+        if (ok && rule->prefix[rule->prefix_len - 1] != '/') {
+            snprintf(pattern, sizeof(pattern), "%.*s", (int) rule->prefix_len, rule->prefix);
+            ok = httpsrvdev_route_add(&inst, httpsrvdev_ANY_METHOD, pattern, route_proxy, rule);
+        }
+        if (ok) {
+            snprintf(pattern, sizeof(pattern), "%.*s%s*", (int) rule->prefix_len, rule->prefix,
+                     rule->prefix[rule->prefix_len - 1] != '/' ? "/" : "");
+            ok = httpsrvdev_route_add(&inst, httpsrvdev_ANY_METHOD, pattern, route_proxy, rule);
+        }
+        if (!ok) {
+            log_fmt(ERR, "Invalid --proxy PREFIX '%.*s'! Prefixes must be distinct and can't "
+                         "contain ':' or '*'.",
+                    (int) rule->prefix_len, rule->prefix);
+            exit(1);
+        }
+    }
+
+    // Run file server
+    if (!httpsrvdev_start(&inst)) {
+        char* err_str = strerror(inst.err & httpsrvdev_MASK_ERRNO);
+        if ((inst.err & ~httpsrvdev_MASK_ERRNO) == httpsrvdev_TLS_NOT_BUILT_IN) {
+            log_(ERR, "HTTPS isn't supported by this build! Build with OpenSSL.");
+            exit(1);
+        }
+        if ((inst.err & ~httpsrvdev_MASK_ERRNO) == httpsrvdev_COULD_NOT_LOAD_TLS_CERT) {
+            log_fmt(ERR, "Failed to load the TLS certificate and key! %s",
+                    inst.err & httpsrvdev_MASK_ERRNO ? err_str : "Check that they are "
+                    "PEM files and that the key belongs to the certificate.");
+            exit(1);
+        }
+        if ((inst.err & ~httpsrvdev_MASK_ERRNO) == httpsrvdev_COULD_NOT_OPEN_RECORDING) {
+            log_fmt(ERR, "Failed to open the recording '%s'! %s", inst.record_path,
+                    (inst.err & httpsrvdev_MASK_ERRNO) == EINVAL ? "It isn't a recording."
+                                                                 : err_str);
+            exit(1);
+        }
+        if ((inst.err & ~httpsrvdev_MASK_ERRNO) == httpsrvdev_COULD_NOT_HAND_OFF) {
+            log_fmt(ERR, "Failed to take over from the running server! %s", err_str);
+            exit(1);
+        }
+        if (inst.listen_addr_failed == -1) {
+            log_fmt(ERR, "Failed to start the file system workers! %s", err_str);
+            exit(1);
+        }
+        char addr_str[128];
+        httpsrvdev_addr_to_str(&inst, &inst.listen_addrs[inst.listen_addr_failed],
+                               addr_str, sizeof(addr_str));
+        char* what;
+        switch (inst.err & ~httpsrvdev_MASK_ERRNO) {
+            case httpsrvdev_COULD_NOT_CREATE_SOCK:  what = "create a socket for";    break;
+            case httpsrvdev_COULD_NOT_SET_SOCK_OPT: what = "set socket options for"; break;
+            case httpsrvdev_COULD_NOT_BIND:         what = "bind to";                break;
+            default:                                what = "listen on";              break;
+        }
+        log_fmt(ERR, "Failed to %s %s! %s", what, addr_str, err_str);
+        exit(1);
+    }
+    {
+        if (inst.listen_socks_taken_over > 0) {
+            log_fmt(INFO, "Took over %d listening socket%s from the running server",
+                    inst.listen_socks_taken_over,
+                    inst.listen_socks_taken_over == 1 ? "" : "s");
+        }
+        for (int i = 0; i < inst.listen_addrs_count; ++i) {
+            struct httpsrvdev_addr* addr = &inst.listen_addrs[i];
+            char addr_str[128];
+            if (!httpsrvdev_addr_to_str(&inst, addr, addr_str, sizeof(addr_str))) continue;
+            log_fmt(INFO, "Listening on %s%s...",
+                    addr->sock_addr.ss_family == AF_UNIX ? "" :
+                    inst.tls_cert_path != NULL           ? "https://" : "http://",
+                    addr_str);
+        }
+
+        // Main loop. Each request is served by `serve_req`, on a coroutine
+        // unless --coroutines is 0; `res_info` is kept per coroutine.
+        struct serve_ctx serve_ctx = {
+            .srcs         = srcs,
+            .srcs_count   = srcs_count,
+            .stdin_buf    = stdin_buf,
+            .snapshot     = snapshot,
+            .route_trie   = &route_trie,
+            .root_listing = &root_listing,
+        };
+        inst.coros_locals      = &res_info;
+        inst.coros_locals_size = sizeof(res_info);
+        if (!httpsrvdev_serve(&inst, serve_req, &serve_ctx) &&
+            inst.err == httpsrvdev_HANDED_OFF
+        ) {
+            log_fmt(INFO, "A new server took over; finishing open connections "
+                          "for up to %d ms...", grace_period_ms);
+            httpsrvdev_drain(&inst, grace_period_ms);
+            httpsrvdev_stop(&inst);
+            exit(0);
+        }
+        log_fmt(ERR, "Failed to wait for connections! %s",
+                strerror(inst.err & httpsrvdev_MASK_ERRNO));
     }; httpsrvdev_stop(&inst);
 
     return EXIT_FAILURE;
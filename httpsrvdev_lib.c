@@ -1,31 +1,90 @@
+#define _GNU_SOURCE // For `preadv2`
+
+#include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <time.h>
+#include <ucontext.h>
 #include <unistd.h>
 #include "httpsrvdev_lib.h"
 
+#ifdef HTTPSRVDEV_TLS
+    #include <openssl/err.h>
+    #include <openssl/ssl.h>
+#endif
+
+#if defined(__x86_64__)
+    #include <immintrin.h>
+#endif
+
+// For switching between coroutine stacks
+#ifdef __SANITIZE_ADDRESS__
+    #include <sanitizer/common_interface_defs.h>
+#endif
+
+#if defined(DEV) || defined(HTTPSRVDEV_ARENA_DEBUG)
+    #define ARENA_DEBUG
+    #ifdef __SANITIZE_ADDRESS__
+        #include <sanitizer/asan_interface.h>
+    #endif
+#endif
+
 // Resources:
 //     HTTP Semantics   : https://datatracker.ietf.org/doc/html/rfc9110
 //     HTTP/1.1 RFC 9112: https://datatracker.ietf.org/doc/html/rfc9112
 
+// Format `fmt` and the variadic args into the local array `str_buf`,
+// failing with httpsrvdev_BUF_TOO_SMALL if the result would not fit
 #define SPRINTF_TO_STR_FROM_FMT_AND_VARGS \
     va_list sprintf_args; \
     va_start(sprintf_args, fmt); \
-    vsprintf(str_buf, fmt, sprintf_args); \
-    va_end(sprintf_args)
+    int str_len = vsnprintf(str_buf, sizeof(str_buf), fmt, sprintf_args); \
+    va_end(sprintf_args); \
+    if (str_len < 0 || str_len >= sizeof(str_buf)) { \
+        inst->err = httpsrvdev_BUF_TOO_SMALL; \
+        return false; \
+    }
+
+#define UNLIKELY(cond) __builtin_expect(!!(cond), 0)
+
+// Fire the instrumentation hook `name` if a hook table is registered.
+// The clock is only read inside the (unlikely) branch.
+#define HOOK(inst, name) \
+    if (UNLIKELY((inst)->hooks != NULL)) fire_hook(inst, (inst)->hooks->name)
 
 #ifdef DEV
     // Utilities for use during development
 
     void printf_with_escapes(char* fmt, ...) {
         char str_buf[16*1024];
-        SPRINTF_TO_STR_FROM_FMT_AND_VARGS;
+        va_list sprintf_args;
+        va_start(sprintf_args, fmt);
+        vsnprintf(str_buf, sizeof(str_buf), fmt, sprintf_args);
+        va_end(sprintf_args);
         for (size_t i = 0; i < strlen(str_buf); ++i) {
             char c = str_buf[i];
             switch (c) {
@@ -47,1212 +106,9317 @@
     }
 #endif
 
-struct httpsrvdev_inst httpsrvdev_init_begin() {
-    struct httpsrvdev_inst inst = {
-        .err = httpsrvdev_NO_ERR,
-
-        .ip   = (127<<24) | (0<<16) | (0<<8) | (1<<0),
-        .port = 8080,
+// Set up `conn` for its first connection, e.g. that of a coroutine
+static void conn_init(struct httpsrvdev_conn* conn) {
+    *conn = (struct httpsrvdev_conn) {
         .listen_sock_fd = -1,
         .  conn_sock_fd = -1,
 
         .req_len = 0,
         .req_method = -1,
         .req_target = NULL,
+        .req_path = NULL,
+        .req_query = NULL,
         .req_headers_count = 0,
         .req_body = "",
+        .route_idx = -1,
+        .route_params_count = 0,
+        .route_rest = { .ptr = "", .len = 0 },
 
         .res_status = -1,
+        .res_bytes_sent = 0,
+        .res_recording  = NULL,
 
-        .default_file_mime_type = "\0",
+        .res_upstream_conn_taken  = false,
+        .res_upstream_connect_ns  = 0,
+        .res_upstream_reused      = false,
+        .res_upstream_response_ns = 0,
+
+        .res_listing_buf = NULL,
+        .res_listing_len = 0,
 
         .root_path = ".",
 
-        // TODO: Memory allignment
-        .same_scope_tmp_mem_alloc_offset = 0,
+        .arena = { .blocks = NULL, .used = 0 },
     };
-    inst.same_scope_tmp_mem_size = sizeof(inst.same_scope_tmp_mem);
-
-    return inst;
 }
 
-static void* same_scope_tmp_alloc(struct httpsrvdev_inst* inst, size_t size) {
-    // TODO: Memory allignment
-    size_t alloc_end_offset = inst->same_scope_tmp_mem_alloc_offset + size;
-    void* ptr;
-    // Increment if end of allocation is withing memory region size;
-    if (alloc_end_offset < inst->same_scope_tmp_mem_size) {
-        ptr = inst->same_scope_tmp_mem + inst->same_scope_tmp_mem_alloc_offset;
-        inst->same_scope_tmp_mem_alloc_offset = alloc_end_offset;
-    // otherwise reset/wrap to start of region.
-    } else {
-        ptr = inst->same_scope_tmp_mem;
-        inst->same_scope_tmp_mem_alloc_offset = size;
-    }
+struct httpsrvdev_inst httpsrvdev_init_begin() {
+    struct httpsrvdev_inst inst = {
+        .err = httpsrvdev_NO_ERR,
 
-    return ptr;
-}
+        .hooks = NULL,
 
-bool httpsrvdev_init_end(struct httpsrvdev_inst* inst) {
-    inst->listen_sock_addr = (struct sockaddr_in) {
-        .sin_family = AF_INET,
-        .sin_addr   = { .s_addr = htonl(inst->ip), },
-        .sin_port   = htons(inst->port),
-    };
-    inst->listen_sock_addr_size = sizeof(inst->listen_sock_addr);
+        .ip   = (127<<24) | (0<<16) | (0<<8) | (1<<0),
+        .port = 8080,
+        .listen_addrs_count  = 0,
+        .listen_sock_fds     = { [0 ... httpsrvdev_LISTEN_ADDRS_MAX - 1] = -1 },
+        .listen_socks_polled = false,
+        .listen_addr_failed  = -1,
+        .listen_backlog      = SOMAXCONN,
+        .tcp_nodelay         = false,
+        .tcp_fastopen_qlen   = 0,
+        .tcp_defer_accept_s  = 0,
+        .sock_sndbuf_size    = 0,
+        .sock_rcvbuf_size    = 0,
+
+        .handoff_path            = NULL,
+        .handoff_sock_fd         = -1,
+        .listen_socks_taken_over = 0,
+
+        .admission_max_conns     = 0,
+        .admission_max_queued    = 0,
+        .admission_ip_rate       = 0,
+        .admission_ip_burst      = 0,
+        .admission_retry_after_s = 1,
+        .admission               = NULL,
+        .admission_shed_count    = 0,
+        .admission_queued_count  = 0,
+
+        .conn_header_timeout_ms = 10000,
+        .conn_idle_timeout_ms   = 5000,
+        .conn_min_send_rate     = 0,
+        .timers                 = NULL,
+
+        .h2c = false,
+        .h2  = NULL,
+
+        .tls_cert_path = NULL,
+        .tls_key_path  = NULL,
+        .tls           = NULL,
+
+        .record_path = NULL,
+        .record_fd   = -1,
+
+        .router = NULL,
+
+        .coros_max         = 64,
+        .coro_stack_size   = 256*1024,
+        .coros_locals      = NULL,
+        .coros_locals_size = 0,
+        .coros             = NULL,
+
+        .epoll_fd = -1,
+
+        .conn = NULL,
 
-    return true;
-}
+        .default_file_mime_type = "\0",
 
-bool httpsrvdev_start(struct httpsrvdev_inst* inst) {
-    // Create TCP socket to listen for connections
-    inst->listen_sock_fd = socket(PF_INET, SOCK_STREAM, 0);
-    // Bind socket to address
-    bind(inst->listen_sock_fd,
-         (struct sockaddr*) &inst->listen_sock_addr,
-         inst->listen_sock_addr_size);
-    // Set timeout that the listening socket will be keep around after
-    // being closed to 0
-    struct linger no_linger = { .l_onoff  = 1, .l_linger = 0 };
-    setsockopt(inst->listen_sock_fd,
-               SOL_SOCKET, SO_LINGER,
-               &no_linger, sizeof(no_linger));
-    // Start listening on the socket
-    listen(inst->listen_sock_fd, 1);
+        .live_reload             = NULL,
+        .live_reload_debounce_ms = 100,
 
-    return true;
-}
+        .fs_workers_count = 0,
+        .fs_pool          = NULL,
 
-bool httpsrvdev_stop(struct httpsrvdev_inst* inst) {
-    if (inst->conn_sock_fd != -1) {
-        close(inst->conn_sock_fd);
-    }
-    close(inst->listen_sock_fd);
+        .snapshot = NULL,
+    };
+    conn_init(&inst.conn_default);
 
-    return true;
+    return inst;
 }
 
-static bool parse_req(struct httpsrvdev_inst* inst) {
-    size_t i = 0;
-
-    // --------------------------------------------------------
-    // Parse request's start line
-    // --------------------------------------------------------
+// --------------------------------------------------------
+// Arena allocator
+// --------------------------------------------------------
+
+// Size of the blocks kept in the shared page pool, including the header.
+// Allocations that don't fit in a pool block get a dedicated mapping which
+// is unmapped when it is released.
+#define ARENA_POOL_BLOCK_SIZE  (64*1024)
+#define ARENA_POOL_MAX_FREE    64
+
+struct httpsrvdev_arena_block {
+    struct httpsrvdev_arena_block* next;
+    size_t map_size;
+    size_t size;
+    _Alignas(httpsrvdev_ARENA_ALIGN) char mem[];
+};
 
-    // Prase the request method
-    inst->req_method_str = inst->req_buf + i;
-    if (inst->req_buf[i + 0] == 'G' &&
-        inst->req_buf[i + 1] == 'E' &&
-        inst->req_buf[i + 2] == 'T'
-    ) {
-        inst->req_method = httpsrvdev_GET;
-        i += 3;
-    } else if (
-        inst->req_buf[i + 0] == 'P' &&
-        inst->req_buf[i + 1] == 'O' &&
-        inst->req_buf[i + 2] == 'S' &&
-        inst->req_buf[i + 3] == 'T'
-    ) {
-        inst->req_method = httpsrvdev_POST;
-        i += 4;
-    } else if (
-        inst->req_buf[i + 0] == 'P' &&
-        inst->req_buf[i + 1] == 'U' &&
-        inst->req_buf[i + 2] == 'T'
-    ) {
-        inst->req_method = httpsrvdev_PUT;
-        i += 3;
-    } else if (
-        inst->req_buf[i + 0] == 'D' &&
-        inst->req_buf[i + 1] == 'E' &&
-        inst->req_buf[i + 2] == 'L' &&
-        inst->req_buf[i + 3] == 'E' &&
-        inst->req_buf[i + 4] == 'T' &&
-        inst->req_buf[i + 5] == 'E'
-    ) {
-        inst->req_method = httpsrvdev_DELETE;
-        i += 6;
-    } else if (
-        inst->req_buf[i + 0] == 'O' &&
-        inst->req_buf[i + 1] == 'P' &&
-        inst->req_buf[i + 2] == 'T' &&
-        inst->req_buf[i + 3] == 'I' &&
-        inst->req_buf[i + 4] == 'O' &&
-        inst->req_buf[i + 5] == 'N' &&
-        inst->req_buf[i + 6] == 'S'
-    ) {
-        inst->req_method = httpsrvdev_OPTIONS;
-        i += 7;
-    } else if (
-        inst->req_buf[i + 0] == 'H' &&
-        inst->req_buf[i + 1] == 'E' &&
-        inst->req_buf[i + 2] == 'A' &&
-        inst->req_buf[i + 3] == 'D'
-    ) {
-        inst->req_method = httpsrvdev_HEAD;
-        i += 4;
-    } else if (
-        inst->req_buf[i + 0] == 'C' &&
-        inst->req_buf[i + 1] == 'O' &&
-        inst->req_buf[i + 2] == 'N' &&
-        inst->req_buf[i + 3] == 'N' &&
-        inst->req_buf[i + 4] == 'E' &&
-        inst->req_buf[i + 5] == 'C' &&
-        inst->req_buf[i + 6] == 'T'
-    ) {
-        inst->req_method = httpsrvdev_CONNECT;
-        i += 7;
-    } else if (
-        inst->req_buf[i + 0] == 'P' &&
-        inst->req_buf[i + 1] == 'A' &&
-        inst->req_buf[i + 2] == 'T' &&
-        inst->req_buf[i + 3] == 'C' &&
-        inst->req_buf[i + 4] == 'H'
-    ) {
-        inst->req_method = httpsrvdev_PATCH;
-        i += 5;
-    } else if (
-        inst->req_buf[i + 0] == 'T' &&
-        inst->req_buf[i + 1] == 'R' &&
-        inst->req_buf[i + 2] == 'A' &&
-        inst->req_buf[i + 3] == 'C' &&
-        inst->req_buf[i + 4] == 'E'
-    ) {
-        inst->req_method = httpsrvdev_TRACE;
-        i += 5;
-    } else {
-        goto parse_err;
-    }
-    if (inst->req_buf[i] != ' ') {
-        goto parse_err;
-    }
-    inst->req_buf[i++] = '\0';
+// Blocks released by any arena, ready for reuse
+static struct {
+    struct httpsrvdev_arena_block* free_blocks;
+    size_t                         free_blocks_count;
+} arena_pool = { .free_blocks = NULL, .free_blocks_count = 0 };
 
-    // Parse the request target, e.g. the URL to the dev server
-    inst->req_target = inst->req_buf + i;
-    while (inst->req_buf[i++] != ' ') {}
-    inst->req_buf[i - 1] = '\0';
+static void arena_unpoison(void* ptr, size_t size) {
+#if defined(ARENA_DEBUG) && defined(__SANITIZE_ADDRESS__)
+    ASAN_UNPOISON_MEMORY_REGION(ptr, size);
+#endif
+}
 
-    // As seen above we store `char*` pointers to substrings of `inst->req_buf`
-    // in `inst` and manually insert '\0' null terminators to end the substrings.
-    // This means that you can directly access a requests target -- normally the
-    // page route -- via the `inst->req_target` pointer, e.g.:
-    //
-    //     char* page_route = inst->req_target;
-    //
-    // This pattern is repeated for other important request substrings such as
-    // header names and values; see below.
+static void arena_poison(void* ptr, size_t size) {
+#ifdef ARENA_DEBUG
+    // The region may already be (partly) poisoned
+    arena_unpoison(ptr, size);
+    memset(ptr, 0xDD, size);
+    #ifdef __SANITIZE_ADDRESS__
+        ASAN_POISON_MEMORY_REGION(ptr, size);
+    #endif
+#endif
+}
 
-    // Parse 'HTTP1.(1|0) '
-    if (inst->req_buf[i++] != 'H' ||
-        inst->req_buf[i++] != 'T' ||
-        inst->req_buf[i++] != 'T' ||
-        inst->req_buf[i++] != 'P' ||
-        inst->req_buf[i++] != '/' ||
-        inst->req_buf[i++] != '1' ||
-        inst->req_buf[i++] != '.'
-    ) {
-        goto parse_err;
+static struct httpsrvdev_arena_block* arena_pool_take(size_t min_size) {
+    size_t header_size = sizeof(struct httpsrvdev_arena_block);
+    if (min_size <= ARENA_POOL_BLOCK_SIZE - header_size && arena_pool.free_blocks != NULL) {
+        struct httpsrvdev_arena_block* block = arena_pool.free_blocks;
+        arena_pool.free_blocks = block->next;
+        --arena_pool.free_blocks_count;
+        return block;
     }
-    if (inst->req_buf[i] == '1' || inst->req_buf[i] == '0') {
-        ++i;
-    } else {
-        goto parse_err;
+
+    size_t map_size = ARENA_POOL_BLOCK_SIZE;
+    if (min_size > ARENA_POOL_BLOCK_SIZE - header_size) {
+        size_t page_size = sysconf(_SC_PAGESIZE);
+        map_size = (header_size + min_size + page_size - 1)/page_size*page_size;
     }
+    struct httpsrvdev_arena_block* block = mmap(NULL, map_size,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (block == MAP_FAILED) return NULL;
+    block->map_size = map_size;
+    block->size     = map_size - header_size;
+    return block;
+}
 
-    // Parse end of start line
-    if (inst->req_buf[i++] != '\r' ||
-        inst->req_buf[i++] != '\n'
+static void arena_pool_give(struct httpsrvdev_arena_block* block) {
+    arena_poison(block->mem, block->size);
+    if (block->map_size != ARENA_POOL_BLOCK_SIZE ||
+        arena_pool.free_blocks_count >= ARENA_POOL_MAX_FREE
     ) {
-        goto parse_err;
+        arena_unpoison(block->mem, block->size);
+        munmap(block, block->map_size);
+        return;
     }
+    block->next = arena_pool.free_blocks;
+    arena_pool.free_blocks = block;
+    ++arena_pool.free_blocks_count;
+}
 
-    // --------------------------------------------------------
-    // Parse request headers
-    // --------------------------------------------------------
-
-    inst->req_headers_count = 0;
-    while (inst->req_buf[i] != '\r' && inst->req_buf[i + 1] != '\n') {
+// Returns NULL only if a new block could not be mapped
+void* httpsrvdev_arena_alloc(struct httpsrvdev_arena* arena, size_t size) {
+    size = (size + httpsrvdev_ARENA_ALIGN - 1) & ~(size_t) (httpsrvdev_ARENA_ALIGN - 1);
+
+    char*  mem      = arena->blocks == NULL ? arena->mem         : arena->blocks->mem;
+    size_t mem_size = arena->blocks == NULL ? sizeof(arena->mem) : arena->blocks->size;
+    if (size > mem_size - arena->used) {
+        struct httpsrvdev_arena_block* block = arena_pool_take(size);
+        if (block == NULL) return NULL;
+        block->next   = arena->blocks;
+        arena->blocks = block;
+        arena->used   = 0;
+        mem           = block->mem;
+    }
 
-        // Parse header name
-        inst->req_headers[inst->req_headers_count][0] = inst->req_buf + i;
-        while (true) {
-            ++i;
-            if (inst->req_buf[i] == ':') {
-                inst->req_buf[i] = '\0';
-                break;
-            } else if (inst->req_buf[i] == ' ') {
-                inst->req_buf[i] = '\0';
-                if (inst->req_buf[++i] != ':') {
-                    goto parse_err;
-                }
-            }
-        }
-        ++i;
+    void* ptr = mem + arena->used;
+    arena->used += size;
+    arena_unpoison(ptr, size);
+    return ptr;
+}
 
-        // Parse header value
-        if (inst->req_buf[i++] != ' ') {
-            goto parse_err;
-        }
-        inst->req_headers[inst->req_headers_count][1] = inst->req_buf + i;
-        while (inst->req_buf[i++] != '\r') {}
-        inst->req_buf[i - 1] = '\0';
-        if (inst->req_buf[i++] != '\n') {
-            goto parse_err;
-        }
+struct httpsrvdev_arena_mark httpsrvdev_arena_save(struct httpsrvdev_arena* arena) {
+    return (struct httpsrvdev_arena_mark) { .blocks = arena->blocks, .used = arena->used };
+}
 
-        ++inst->req_headers_count;
+// Free everything allocated since `mark` was saved
+void httpsrvdev_arena_reset(struct httpsrvdev_arena* arena,
+    struct httpsrvdev_arena_mark mark
+) {
+    while (arena->blocks != mark.blocks) {
+        struct httpsrvdev_arena_block* block = arena->blocks;
+        arena->blocks = block->next;
+        arena_pool_give(block);
+        // The inline region or the previous block becomes current again,
+        // and all of it past the mark is freed
+        arena->used = arena->blocks == NULL ? sizeof(arena->mem) : arena->blocks->size;
     }
-    i += 2;
+    char* mem = arena->blocks == NULL ? arena->mem : arena->blocks->mem;
+    if (arena->used > mark.used) {
+        arena_poison(mem + mark.used, arena->used - mark.used);
+    }
+    arena->used = mark.used;
+}
 
-    // --------------------------------------------------------
-    // Parse request body
-    // --------------------------------------------------------
+void httpsrvdev_arena_clear(struct httpsrvdev_arena* arena) {
+    httpsrvdev_arena_reset(arena, (struct httpsrvdev_arena_mark) { .blocks = NULL, .used = 0 });
+}
 
-    inst->req_body = inst->req_buf + i;
-    if (inst->req_buf[inst->req_len - 2] == '\r' &&
-        inst->req_buf[inst->req_len - 1] == '\n'
-    ) {
-        inst->req_buf[inst->req_len - 2] = '\0';
-    } else {
-        // TODO: Maybe this case should be an error?
-        inst->req_buf[inst->req_len] = '\0';
+// Allocate from the connection's arena, setting `inst->err` on failure
+static void* tmp_alloc(struct httpsrvdev_inst* inst, size_t size) {
+    void* ptr = httpsrvdev_arena_alloc(&inst->conn->arena, size);
+    if (ptr == NULL) {
+        inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
     }
+    return ptr;
+}
 
-    // --------------------------------------------------------
-
-    return true;
+static void fire_hook(struct httpsrvdev_inst* inst, httpsrvdev_hook_fn hook) {
+    if (hook == NULL) return;
 
-parse_err:
-    inst->err = httpsrvdev_CANNOT_PARSE_REQ;
-    return false;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    struct httpsrvdev_hook_event event = {
+        .time_ns   = (uint64_t) now.tv_sec*1000000000 + now.tv_nsec,
+        .req_bytes = inst->conn->req_len,
+        .res_bytes = inst->conn->res_bytes_sent,
+    };
+    hook(inst, &event);
 }
 
-bool httpsrvdev_res_begin(struct httpsrvdev_inst* inst) {
-    inst->conn_sock_fd = accept(
-        inst->listen_sock_fd,
-        (struct sockaddr*) &inst->listen_sock_addr,
-        (socklen_t*)       &inst->listen_sock_addr_size);
-
-    inst->req_len = recv(inst->conn_sock_fd, inst->req_buf, 2048, 0);
-    if (!parse_req(inst)) {
+// --------------------------------------------------------
+// Listening sockets
+// --------------------------------------------------------
+
+static bool handoff_serve(struct httpsrvdev_inst* inst);
+static int  timers_timeout_ms(struct httpsrvdev_inst* inst);
+static void timers_advance(struct httpsrvdev_inst* inst, uint64_t now_ns);
+static uint64_t monotonic_ns(void);
+static bool   h2_on_poll_event(struct httpsrvdev_inst* inst, int fd, uint32_t events);
+static size_t h2_conns_count(struct httpsrvdev_inst* inst);
+static void   h2_goaway_all(struct httpsrvdev_inst* inst);
+static bool   h2_stream_is_current(struct httpsrvdev_inst* inst);
+static bool   h2_has_ready_stream(struct httpsrvdev_inst* inst);
+static int    coros_active_count(struct httpsrvdev_inst* inst);
+static int    coros_ready_count(struct httpsrvdev_inst* inst);
+static bool   coros_on_poll_event(struct httpsrvdev_inst* inst, int fd, uint32_t events);
+
+// Create the epoll instance shared by everything the server waits on
+static bool poll_init(struct httpsrvdev_inst* inst) {
+    if (inst->epoll_fd != -1) return true;
+
+    inst->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (inst->epoll_fd == -1) {
+        inst->err = httpsrvdev_COULD_NOT_POLL | (errno & httpsrvdev_MASK_ERRNO);
         return false;
     }
-
     return true;
 }
 
-bool httpsrvdev_res_send_n(struct httpsrvdev_inst* inst, char* str, size_t n) {
-    if (write(inst->conn_sock_fd, str, n) == -1) {
-        // TODO: inst->err = ...
-        return false;
+static bool is_listen_sock(struct httpsrvdev_inst* inst, int fd) {
+    for (int i = 0; i < inst->listen_addrs_count; ++i) {
+        if (inst->listen_sock_fds[i] == fd) return true;
     }
-    // NOTE: We don't need to do our own buffering becuase TCP sockets are
-    //       buffered by default -- see `man 7 tcp`
-    return true;
+    return false;
 }
 
-bool httpsrvdev_res_send(struct httpsrvdev_inst* inst, char* str) {
-    return httpsrvdev_res_send_n(inst, str, strlen(str));
+// Add the listening sockets to the epoll instance, once
+static bool listen_socks_poll(struct httpsrvdev_inst* inst) {
+    if (inst->listen_socks_polled) return true;
+    if (!poll_init(inst))          return false;
+
+    for (int i = -1; i < inst->listen_addrs_count; ++i) {
+        // The hot restart control socket is waited on alongside
+        int fd = i == -1 ? inst->handoff_sock_fd : inst->listen_sock_fds[i];
+        if (fd == -1) continue;
+        struct epoll_event event = { .events = EPOLLIN, .data = { .fd = fd } };
+        if (epoll_ctl(inst->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            inst->err = httpsrvdev_COULD_NOT_POLL | (errno & httpsrvdev_MASK_ERRNO);
+            return false;
+        }
+    }
+    inst->listen_socks_polled = true;
+    return true;
 }
 
-bool httpsrvdev_res_end(struct httpsrvdev_inst* inst) {
-    if (!httpsrvdev_res_send_n(inst, "\r\n", 2)) return false;
+// Set `listen_sock_fd` to a listening socket with a connection to accept,
+// waiting for one if there are several sockets. Meanwhile, HTTP/2
+// connections are served; if they have a request ready, or coroutines are
+// ready to be resumed, `listen_sock_fd` is set to -1 instead.
+static bool listen_socks_wait(struct httpsrvdev_inst* inst) {
+    if (inst->listen_addrs_count == 1 && inst->handoff_sock_fd == -1 &&
+        h2_conns_count(inst) == 0 && coros_active_count(inst) == 0
+    ) {
+        inst->conn->listen_sock_fd = inst->listen_sock_fds[0];
+        return true;
+    }
 
-    if (inst->conn_sock_fd != -1) {
-        // Flush socket buffer by shutting down write... Not documented in
-        // manpage :(
-        if (shutdown(inst->conn_sock_fd, SHUT_RDWR) == -1) {
+    if (!listen_socks_poll(inst)) return false;
+    while (true) {
+        // epoll rotates between ready sockets, so one busy socket can't starve
+        // the others
+        struct epoll_event events[64];
+        int n_events = epoll_wait(inst->epoll_fd, events, sizeof(events)/sizeof(events[0]),
+                                  timers_timeout_ms(inst));
+        if (n_events == -1) {
+            if (errno == EINTR) continue;
+            inst->err = httpsrvdev_COULD_NOT_POLL | (errno & httpsrvdev_MASK_ERRNO);
             return false;
         }
-        if (close(inst->conn_sock_fd) == -1) {
-            return false;
+        if (inst->timers != NULL) timers_advance(inst, monotonic_ns());
+
+        bool can_accept = false;
+        for (int i = 0; i < n_events; ++i) {
+            int fd = events[i].data.fd;
+            if (is_listen_sock(inst, fd)) {
+                // Others that are ready are picked up by the next wait
+                if (!can_accept) inst->conn->listen_sock_fd = fd;
+                can_accept = true;
+            } else if (fd == inst->handoff_sock_fd) {
+                if (handoff_serve(inst)) return false;
+            } else if (!coros_on_poll_event(inst, fd, events[i].events)) {
+                h2_on_poll_event(inst, fd, events[i].events);
+            }
+        }
+        if (can_accept) return true;
+        if (h2_has_ready_stream(inst) || coros_ready_count(inst) > 0) {
+            inst->conn->listen_sock_fd = -1;
+            return true;
         }
     }
-    inst->conn_sock_fd = -1;
+}
 
-    return true;
+// --------------------------------------------------------
+// Timers
+// --------------------------------------------------------
+
+// A hashed timing wheel: each timer hangs off the slot of the tick it expires
+// at, modulo the number of slots, so arming and cancelling are O(1). Timers
+// further out than one revolution share slots with nearer ones and are
+// skipped until their tick comes. The wheel is advanced by whoever waits on a
+// connection, which wakes up at least once a tick while timers are armed.
+
+#define TIMER_WHEEL_SLOTS 256
+#define TIMER_TICK_NS     (100*1000000ull)
+
+static uint64_t monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec*1000000000 + now.tv_nsec;
 }
 
-bool httpsrvdev_res_status_line(struct httpsrvdev_inst* inst, int status) {
-    inst->res_status = status;
+struct timer {
+    // Circular list of the slot; NULL while not armed
+    struct timer* prev;
+    struct timer* next;
+    uint64_t      expires_tick;
+    void        (*fire)(struct httpsrvdev_inst* inst, struct timer* timer);
+};
 
-    if (!httpsrvdev_res_send(inst, "HTTP/1.1 ")) return false;
-    char* status_buf = same_scope_tmp_alloc(inst, 8);
-    sprintf(status_buf, "%d", status);
-    if (!httpsrvdev_res_send(inst, status_buf))  return false;
-    if (!httpsrvdev_res_send(inst, "\r\n"))      return false;
+struct coro;
+
+// The timers of a connection. Each coroutine has its own -- see
+// `httpsrvdev_serve` -- and connections served outside of them share
+// `timers->conn_default`.
+struct conn_timers {
+    struct timer header_timer;
+    struct timer idle_timer;
+    struct timer send_rate_timer;
+    size_t       progress;             // Bytes received + sent at the last wait
+    size_t       bytes_sent_at_check;  // For the send rate
+    bool         send_rate_check_due;
+    bool         timed_out;
+    struct coro* coro;                 // Woken up when a timer fires, if any
+};
+
+#define CONN_TIMERS_OF(timer, field) \
+    ((struct conn_timers*) ((char*) (timer) - offsetof(struct conn_timers, field)))
+
+struct httpsrvdev_timers {
+    struct timer slots[TIMER_WHEEL_SLOTS];  // List heads
+    uint64_t     tick;                      // Last tick that was processed
+    size_t       armed_count;
+
+    // The timers of the current connection
+    struct conn_timers* conn;
+    struct conn_timers  conn_default;
+};
+
+static void conn_timers_init(struct conn_timers* conn, struct coro* coro);
+
+static bool timers_init(struct httpsrvdev_inst* inst) {
+    struct httpsrvdev_timers* timers = calloc(1, sizeof(*timers));
+    if (timers == NULL) {
+        inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+        return false;
+    }
+    for (size_t i = 0; i < TIMER_WHEEL_SLOTS; ++i) {
+        timers->slots[i].prev = &timers->slots[i];
+        timers->slots[i].next = &timers->slots[i];
+    }
+    timers->tick = monotonic_ns()/TIMER_TICK_NS;
+    conn_timers_init(&timers->conn_default, NULL);
+    timers->conn = &timers->conn_default;
 
+    inst->timers = timers;
     return true;
 }
 
-bool httpsrvdev_res_header(struct httpsrvdev_inst* inst, char* name, char* value) {
-    if (!httpsrvdev_res_send(inst, name  )) return false;
-    if (!httpsrvdev_res_send(inst, ": "  )) return false;
-    if (!httpsrvdev_res_send(inst, value )) return false;
-    if (!httpsrvdev_res_send(inst, "\r\n")) return false;
+static void timer_cancel(struct httpsrvdev_timers* timers, struct timer* timer) {
+    if (timer->prev == NULL) return;
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = NULL;
+    timer->next = NULL;
+    --timers->armed_count;
+}
 
-    return true;
+// (Re-)arm `timer` to fire in `delay_ms`, rounded up to whole ticks
+static void timer_arm(struct httpsrvdev_timers* timers, struct timer* timer, int delay_ms) {
+    timer_cancel(timers, timer);
+
+    uint64_t expires_tick =
+        (monotonic_ns() + (uint64_t) delay_ms*1000000 + TIMER_TICK_NS - 1)/TIMER_TICK_NS;
+    if (expires_tick <= timers->tick) expires_tick = timers->tick + 1;
+    timer->expires_tick = expires_tick;
+
+    struct timer* head = &timers->slots[expires_tick & (TIMER_WHEEL_SLOTS - 1)];
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev       = timer;
+    ++timers->armed_count;
 }
 
-bool httpsrvdev_res_headerf(struct httpsrvdev_inst* inst, char* name, char* fmt, ...) {
-    char str_buf[1024];
-    SPRINTF_TO_STR_FROM_FMT_AND_VARGS;
-    return httpsrvdev_res_header(inst, name, str_buf);
+// Fire the timers that have expired by `now_ns`
+static void timers_advance(struct httpsrvdev_inst* inst, uint64_t now_ns) {
+    struct httpsrvdev_timers* timers = inst->timers;
+    uint64_t now_tick = now_ns/TIMER_TICK_NS;
+    if (now_tick <= timers->tick) return;
+
+    // After a long gap, visiting each slot once is enough
+    uint64_t ticks_count = now_tick - timers->tick;
+    if (ticks_count > TIMER_WHEEL_SLOTS) ticks_count = TIMER_WHEEL_SLOTS;
+    for (uint64_t i = 1; i <= ticks_count; ++i) {
+        struct timer* head = &timers->slots[(timers->tick + i) & (TIMER_WHEEL_SLOTS - 1)];
+        for (struct timer* timer = head->next; timer != head; ) {
+            struct timer* next = timer->next;
+            if (timer->expires_tick <= now_tick) {
+                timer_cancel(timers, timer);
+                timer->fire(inst, timer);
+            }
+            timer = next;
+        }
+    }
+    timers->tick = now_tick;
 }
 
-bool httpsrvdev_res_body(struct httpsrvdev_inst* inst, char* body) {
-    char* content_len_value_buf = same_scope_tmp_alloc(inst, 24);
-    if (!httpsrvdev_res_header(inst, "Content-Length", content_len_value_buf))
-        return false;
-    if (!httpsrvdev_res_send(inst, "\r\n")) return false;
-    if (!httpsrvdev_res_send(inst, body  )) return false;
-    if (!httpsrvdev_res_end (inst        )) return false;
+// Milliseconds until the next tick, or -1 if no timers are armed
+static int timers_timeout_ms(struct httpsrvdev_inst* inst) {
+    struct httpsrvdev_timers* timers = inst->timers;
+    if (timers == NULL || timers->armed_count == 0) return -1;
 
-    return true;
+    uint64_t now_ns       = monotonic_ns();
+    uint64_t next_tick_ns = (timers->tick + 1)*TIMER_TICK_NS;
+    if (next_tick_ns <= now_ns) return 0;
+    return (next_tick_ns - now_ns + 999999)/1000000;
 }
 
-static bool path_rel_to_root_to_path_with_root(struct httpsrvdev_inst* inst,
-    char* path, char* result_path
-) {
-    if (path[0] == '/') {
-        strcpy(result_path, path);
-        return true;
-    }
+static void coro_wake_on_conn(struct httpsrvdev_inst* inst, struct coro* coro);
 
-    // Join root and path
-    char* full_path = same_scope_tmp_alloc(inst, 1024);
-    char* path_end_ptr = stpcpy(full_path, inst->root_path);
-    *(path_end_ptr++) = '/';
-    path_end_ptr = stpcpy(path_end_ptr, path);
+static void conn_on_header_timeout(struct httpsrvdev_inst* inst, struct timer* timer) {
+    struct conn_timers* conn = CONN_TIMERS_OF(timer, header_timer);
+    conn->timed_out = true;
+    coro_wake_on_conn(inst, conn->coro);
+}
 
-    // Remove trailing '/'
-    if (*(path_end_ptr - 1) == '/') {
-        *(path_end_ptr - 1) = '\0';
-    }
+static void conn_on_idle_timeout(struct httpsrvdev_inst* inst, struct timer* timer) {
+    struct conn_timers* conn = CONN_TIMERS_OF(timer, idle_timer);
+    conn->timed_out = true;
+    coro_wake_on_conn(inst, conn->coro);
+}
 
-    realpath(full_path, result_path);
+// The send rate is checked by `conn_wait`, where the connection's byte count
+// is at hand even if it is served by a coroutine that isn't running
+static void conn_on_send_rate_check(struct httpsrvdev_inst* inst, struct timer* timer) {
+    struct conn_timers* conn = CONN_TIMERS_OF(timer, send_rate_timer);
+    conn->send_rate_check_due = true;
+    coro_wake_on_conn(inst, conn->coro);
+}
 
-    return true;
+static void conn_timers_init(struct conn_timers* conn, struct coro* coro) {
+    *conn = (struct conn_timers) { .coro = coro };
+    conn->header_timer.fire    = conn_on_header_timeout;
+    conn->idle_timer.fire      = conn_on_idle_timeout;
+    conn->send_rate_timer.fire = conn_on_send_rate_check;
 }
 
-static bool path_with_root_to_path_rel_to_root(struct httpsrvdev_inst* inst,
-    char* path, char* result_path
-) {
-    char* path_resolved = same_scope_tmp_alloc(inst, 1024);
-    path_resolved[0] = '\0';
-    realpath(path, path_resolved);
+// Whether the current connection has run into one of its timeouts
+static bool conn_timers_expired(struct httpsrvdev_inst* inst) {
+    struct httpsrvdev_timers* timers = inst->timers;
+    struct conn_timers*       conn   = timers->conn;
+    if (conn->send_rate_check_due) {
+        conn->send_rate_check_due = false;
+        size_t bytes_sent = inst->conn->res_bytes_sent - conn->bytes_sent_at_check;
+        if (bytes_sent < (size_t) inst->conn_min_send_rate) {
+            conn->timed_out = true;
+        } else {
+            conn->bytes_sent_at_check = inst->conn->res_bytes_sent;
+            timer_arm(timers, &conn->send_rate_timer, 1000);
+        }
+    }
+    return conn->timed_out;
+}
 
-    if (*inst->root_path == '\0') {
-        strcpy(result_path, path_resolved);
-        return true;
+static void conn_timers_cancel(struct httpsrvdev_inst* inst) {
+    struct httpsrvdev_timers* timers = inst->timers;
+    if (timers == NULL) return;
+    timer_cancel(timers, &timers->conn->header_timer);
+    timer_cancel(timers, &timers->conn->idle_timer);
+    timer_cancel(timers, &timers->conn->send_rate_timer);
+    timers->conn->send_rate_check_due = false;
+}
+
+static short conn_tls_wait_events(struct httpsrvdev_inst* inst, short events);
+static void  conn_tls_end(struct httpsrvdev_inst* inst, bool notify);
+static bool  coro_can_wait(struct httpsrvdev_inst* inst);
+static int   coro_wait(struct httpsrvdev_inst* inst, int fd, short events, int timeout_ms);
+static int   coro_fs_event_fd(struct httpsrvdev_inst* inst);
+static int   coro_park(struct httpsrvdev_inst* inst, int fd, int timeout_ms);
+
+// Wait until the connection is ready for `events` (POLLIN/POLLOUT), while
+// enforcing its timeouts. On timeout the connection is closed. On a
+// coroutine, other connections are served meanwhile.
+static bool conn_wait(struct httpsrvdev_inst* inst, short events) {
+    struct httpsrvdev_timers* timers = inst->timers;
+    events = conn_tls_wait_events(inst, events);
+
+    if (timers != NULL && inst->conn_idle_timeout_ms > 0) {
+        // Only waiting without any progress counts as idle
+        struct conn_timers* conn = timers->conn;
+        size_t progress = inst->conn->req_len + inst->conn->res_bytes_sent;
+        if (progress != conn->progress || conn->idle_timer.prev == NULL) {
+            conn->progress = progress;
+            timer_arm(timers, &conn->idle_timer, inst->conn_idle_timeout_ms);
+        }
     }
 
-    char* root_path = same_scope_tmp_alloc(inst, 1024);
-    realpath(inst->root_path, root_path);
+    struct pollfd pfd = { .fd = inst->conn->conn_sock_fd, .events = events };
+    while (true) {
+        int n_ready = coro_can_wait(inst) ? coro_wait(inst, pfd.fd, events, -1)
+                                          : poll(&pfd, 1, timers_timeout_ms(inst));
+        if (n_ready == -1 && errno != EINTR) {
+            inst->err = httpsrvdev_COULD_NOT_POLL | (errno & httpsrvdev_MASK_ERRNO);
+            return false;
+        }
+        if (timers != NULL) {
+            timers_advance(inst, monotonic_ns());
+            if (conn_timers_expired(inst)) break;
+        }
+        if (n_ready > 0) return true;
+    }
 
-    size_t root_path_len = strlen(root_path);
+    conn_timers_cancel(inst);
+    timers->conn->timed_out = false;
+    conn_tls_end(inst, false);
+    close(inst->conn->conn_sock_fd);
+    inst->conn->conn_sock_fd = -1;
+    inst->err = httpsrvdev_TIMED_OUT;
+    return false;
+}
 
-    if (root_path_len > 0 &&
-        strncmp(root_path, path_resolved, root_path_len) != 0
-    ) return false;
+// --------------------------------------------------------
+// TLS
+// --------------------------------------------------------
+
+// The handshake is done by OpenSSL, which then installs the session keys in
+// the kernel (kTLS: the "tls" TCP upper layer protocol) where the kernel and
+// the cipher suite support it. From there on the kernel encrypts what is
+// written to the socket, so responses are sent with plain `send`, and file
+// bodies with `sendfile`, like on unencrypted connections. Otherwise OpenSSL
+// encrypts in user space and file bodies are read and sent through it in
+// chunks.
+//
+// Only built with HTTPSRVDEV_TLS, which needs OpenSSL (libssl, libcrypto).
+
+#ifdef HTTPSRVDEV_TLS
+struct httpsrvdev_tls {
+    SSL_CTX* ctx;
+
+    // Of the current connection
+    SSL*  conn_ssl;
+    bool  conn_ktls_send;    // Whether the kernel encrypts what is sent
+    short conn_wait_events;  // What the last blocked TLS operation waits for
+};
+#endif
 
-    strcpy(result_path, path_resolved + root_path_len);
+static bool tls_init(struct httpsrvdev_inst* inst) {
+    if (inst->tls_cert_path == NULL) return true;
 
-    return true;
-}
+#ifdef HTTPSRVDEV_TLS
+    struct httpsrvdev_tls* tls = calloc(1, sizeof(*tls));
+    if (tls == NULL) {
+        inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+        return false;
+    }
+    inst->tls = tls;
 
-// TODO: Write a unit test to test that this and the next array match
-// MIME Type sources:
-//     https://developer.mozilla.org/en-US/docs/Web/HTTP/Basics_of_HTTP/MIME_types/Common_types
-typedef struct file_type_info {
-    uint64_t ext_encoding;
-    char*    mime_type;
-    bool     charset_utf8;
-} FileTypeInfo;
-static FileTypeInfo file_type_infos[] = {
-    {
-        .ext_encoding = ('h'<<24) | ('t'<<16) | ('m'<< 8) | ('l'<< 0),
-        .mime_type    = "text/html",
-        .charset_utf8 = true,
-    },
-    {
-        .ext_encoding = ('j'<< 8) | ('s'<< 0),
-        .mime_type    = "text/javascript",
-        .charset_utf8 = true,
-    },
-    {
-        .ext_encoding = ('c'<<16) | ('s'<< 8) | ('s'<< 0),
-        .mime_type    = "text/css",
-        .charset_utf8 = true,
-    },
-    {
-        .ext_encoding = ('m'<<16) | ('j'<< 8) | ('s'<< 0),
-        .mime_type    = "text/javascript",
-        .charset_utf8 = true,
-    },
-    {
-        .ext_encoding = ('h'<<16) | ('t'<< 8) | ('m'<< 0),
-        .mime_type    = "text/html",
-        .charset_utf8 = true,
-    },
-    {
-        .ext_encoding = (((uint64_t)'x')<<32) |
-            ('h'<<24) | ('t'<<16) | ('m'<< 8) | ('l'<< 0),
-        .mime_type    = "application/xhtml+xml",
-        .charset_utf8 = true,
-    },
+    char* key_path = inst->tls_key_path != NULL ? inst->tls_key_path : inst->tls_cert_path;
+    // Report missing and unreadable files with their errno
+    if (access(inst->tls_cert_path, R_OK) == -1 || access(key_path, R_OK) == -1) {
+        inst->err = httpsrvdev_COULD_NOT_LOAD_TLS_CERT | (errno & httpsrvdev_MASK_ERRNO);
+        return false;
+    }
 
-    // Other common text formats ----------------------------------------
-    {
-        .ext_encoding = ('j'<<24) | ('s'<<16) | ('o'<< 8) | ('n'<< 0),
-        .mime_type    = "application/json",
-        .charset_utf8 = true,
-    },
-    {
-        .ext_encoding = (((uint64_t) 'j')<<40) | (((uint64_t)'s')<<32) |
-            ('o'<<24) | ('n'<<16) | ('l'<< 8) | ('d'<< 0),
-        .mime_type    = "application/ld+json",
-        .charset_utf8 = true,
-    },
-    {
-        .ext_encoding = ('t'<<16) | ('x'<< 8) | ('t'<< 0),
-        .mime_type    = "text/plain",
-        .charset_utf8 = true,
-    },
-    {
-        .ext_encoding = ('c'<<16) | ('s'<< 8) | ('v'<< 0),
-        .mime_type    = "text/csv",
-        .charset_utf8 = true,
-    },
-    {
-        .ext_encoding = ('x'<<16) | ('m'<< 8) | ('l'<< 0),
-        .mime_type    = "application/xml",
-        .charset_utf8 = true,
-    },
-    {
-        .ext_encoding = ('i'<<16) | ('c'<< 8) | ('s'<< 0),
-        .mime_type    = "text/calendar",
-        .charset_utf8 = true,
-    },
+    tls->ctx = SSL_CTX_new(TLS_server_method());
+    if (tls->ctx == NULL) {
+        inst->err = httpsrvdev_MEM_ERR;
+        return false;
+    }
+    // kTLS supports the AES-GCM and ChaCha20-Poly1305 suites of TLS 1.2 and
+    // 1.3, which are what clients negotiate anyway
+    SSL_CTX_set_min_proto_version(tls->ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(tls->ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION);
+    // Partial writes, like `send`, and retries from a different buffer
+    // holding the same bytes -- e.g. a file chunk read again
+    SSL_CTX_set_mode(tls->ctx,
+        SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    if (SSL_CTX_use_certificate_chain_file(tls->ctx, inst->tls_cert_path) != 1 ||
+        SSL_CTX_use_PrivateKey_file(tls->ctx, key_path, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(tls->ctx) != 1
+    ) {
+        inst->err = httpsrvdev_COULD_NOT_LOAD_TLS_CERT;
+        return false;
+    }
+    return true;
+#else
+    inst->err = httpsrvdev_TLS_NOT_BUILT_IN;
+    return false;
+#endif
+}
 
-    // Unspecified Binary -----------------------------------------------
-    {
-        .ext_encoding = ('b'<<16) | ('i'<< 8) | ('n'<< 0),
-        .mime_type    = "application/octet-stream",
-        .charset_utf8 = true,
-    },
+static void tls_free(struct httpsrvdev_inst* inst) {
+#ifdef HTTPSRVDEV_TLS
+    if (inst->tls == NULL) return;
+    conn_tls_end(inst, false);
+    SSL_CTX_free(inst->tls->ctx);
+    free(inst->tls);
+    inst->tls = NULL;
+#endif
+}
 
-    // Images -----------------------------------------------------------
-    {
-        .ext_encoding = ('j'<<16) | ('p'<< 8) | ('g'<< 0),
-        .mime_type    = "image/jpeg",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('j'<<24) | ('p'<<16) | ('e'<< 8) | ('g'<< 0),
-        .mime_type    = "image/jpeg",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('p'<<16) | ('n'<< 8) | ('g'<< 0),
-        .mime_type    = "image/png",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('w'<<24) | ('e'<<16) | ('b'<< 8) | ('p'<< 0),
-        .mime_type    = "image/webp",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('s'<<16) | ('v'<< 8) | ('g'<< 0),
-        .mime_type    = "image/svg+xml",
-        .charset_utf8 = true,
-    },
-    {
-        .ext_encoding = ('g'<<16) | ('i'<< 8) | ('f'<< 0),
-        .mime_type    = "image/gif",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('t'<<16) | ('i'<< 8) | ('f'<< 0),
-        .mime_type    = "image/tiff",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('t'<<24) | ('i'<<16) | ('f'<< 8) | ('f'<< 0),
-        .mime_type    = "image/tiff",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('b'<<16) | ('m'<< 8) | ('p'<< 0),
-        .mime_type    = "image/bmp",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('a'<<24) | ('p'<<16) | ('n'<< 8) | ('g'<< 0),
-        .mime_type    = "image/apng",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('i'<<16) | ('c'<< 8) | ('o'<< 0),
-        .mime_type    = "image/vnd.microsoft.icon",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('a'<<24) | ('v'<<16) | ('i'<< 8) | ('f'<< 0),
-        .mime_type    = "image/avif",
-        .charset_utf8 = false,
-    },
+#ifdef HTTPSRVDEV_TLS
+// Map the result `ret` of an SSL I/O function to that of `recv`/`send`:
+// -1 with errno EAGAIN if it must wait for the socket, 0 at the end of the
+// stream
+static ssize_t conn_tls_io_result(struct httpsrvdev_inst* inst, int ret) {
+    if (ret > 0) return ret;
+    switch (SSL_get_error(inst->tls->conn_ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+            inst->tls->conn_wait_events = POLLIN;
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_WANT_WRITE:
+            inst->tls->conn_wait_events = POLLOUT;
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_SYSCALL:
+            // The peer closed without close_notify if errno isn't set
+            if (errno != 0) return -1;
+            return 0;
+        default:
+            errno = EPROTO;
+            return -1;
+    }
+}
+#endif
 
-    // Fonts ------------------------------------------------------------
-    {
-        .ext_encoding = ('o'<<16) | ('f'<< 8) | ('t'<< 0),
-        .mime_type    = "font/oft",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('t'<<16) | ('t'<< 8) | ('f'<< 0),
-        .mime_type    = "font/ttf",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('w'<<24) | ('o'<<16) | ('f'<< 8) | ('f'<< 0),
-        .mime_type    = "font/woff",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = (((uint64_t) 'w')<<32) |
-            ('o'<<24) | ('f'<<16) | ('f'<< 8) | ('2'<< 0),
-        .mime_type    = "font/woff2",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('e'<<16) | ('o'<< 8) | ('t'<< 0),
-        .mime_type    = "application/vnd.ms-fontobject",
-        .charset_utf8 = false,
-    },
+// Do the handshake on the accepted connection, if the server does TLS
+static bool conn_tls_begin(struct httpsrvdev_inst* inst) {
+#ifdef HTTPSRVDEV_TLS
+    struct httpsrvdev_tls* tls = inst->tls;
+    if (tls == NULL) return true;
 
-    // Video ------------------------------------------------------------
-    {
-        .ext_encoding = ('m'<<16) | ('p'<< 8) | ('4'<< 0),
-        .mime_type    = "video/mp4",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('m'<<24) | ('p'<<16) | ('e'<< 8) | ('g'<< 0),
-        .mime_type    = "video/mpeg",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('a'<<16) | ('v'<< 8) | ('i'<< 0),
-        .mime_type    = "video/x-msvideo",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('w'<<24) | ('e'<<16) | ('b'<< 8) | ('m'<< 0),
-        .mime_type    = "video/webm",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('o'<<16) | ('g'<< 8) | ('v'<< 0),
-        .mime_type    = "video/ogg",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('o'<<16) | ('g'<< 8) | ('v'<< 0),
-        .mime_type    = "video/mp2t",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('t'<< 8) | ('s'<< 0),
-        .mime_type    = "video/mp2t",
-        .charset_utf8 = false,
-    },
+    tls->conn_ssl = SSL_new(tls->ctx);
+    if (tls->conn_ssl == NULL || SSL_set_fd(tls->conn_ssl, inst->conn->conn_sock_fd) != 1) {
+        inst->err = httpsrvdev_MEM_ERR;
+        return false;
+    }
+    while (true) {
+        ERR_clear_error();
+        errno = 0;
+        ssize_t result = conn_tls_io_result(inst, SSL_accept(tls->conn_ssl));
+        if (result > 0) break;
+        if (result == -1 && errno == EAGAIN) {
+            if (!conn_wait(inst, POLLIN)) return false;
+            continue;
+        }
+        inst->err = httpsrvdev_TLS_HANDSHAKE_FAILED;
+        return false;
+    }
+    tls->conn_ktls_send = BIO_get_ktls_send(SSL_get_wbio(tls->conn_ssl));
+#endif
+    return true;
+}
 
-    // Audio ------------------------------------------------------------
-    {
-        .ext_encoding = ('m'<<16) | ('p'<< 8) | ('3'<< 0),
-        .mime_type    = "audio/mpeg",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('w'<<16) | ('a'<< 8) | ('v'<< 0),
-        .mime_type    = "audio/wav",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('o'<<24) | ('p'<<16) | ('u'<< 8) | ('s'<< 0),
-        .mime_type    = "audio/opus",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('o'<<16) | ('g'<< 8) | ('a'<< 0),
-        .mime_type    = "audio/ogg",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('a'<<16) | ('a'<< 8) | ('c'<< 0),
-        .mime_type    = "audio/aac",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('w'<<24) | ('e'<<16) | ('b'<< 8) | ('a'<< 0),
-        .mime_type    = "audio/weba",
-        .charset_utf8 = false,
+// Free the TLS state of the connection, first telling the client that the
+// connection is about to be closed if `notify`
+static void conn_tls_end(struct httpsrvdev_inst* inst, bool notify) {
+#ifdef HTTPSRVDEV_TLS
+    if (inst->tls == NULL || inst->tls->conn_ssl == NULL) return;
+    // Best effort: the socket is non-blocking and the connection is closed
+    // regardless
+    if (notify) SSL_shutdown(inst->tls->conn_ssl);
+    SSL_free(inst->tls->conn_ssl);
+    inst->tls->conn_ssl         = NULL;
+    inst->tls->conn_ktls_send   = false;
+    inst->tls->conn_wait_events = 0;
+#endif
+}
+
+// The events to wait for before retrying an operation that would have
+// blocked. TLS may have to receive while sending and vice versa.
+static short conn_tls_wait_events(struct httpsrvdev_inst* inst, short events) {
+#ifdef HTTPSRVDEV_TLS
+    if (inst->tls != NULL && inst->tls->conn_wait_events != 0) {
+        events = inst->tls->conn_wait_events;
+        inst->tls->conn_wait_events = 0;
+    }
+#endif
+    return events;
+}
+
+// Whether what is written to the socket is sent as is -- it isn't if OpenSSL
+// encrypts in user space
+static bool conn_sock_is_plain(struct httpsrvdev_inst* inst) {
+#ifdef HTTPSRVDEV_TLS
+    if (inst->tls != NULL && !inst->tls->conn_ktls_send) return false;
+#endif
+    return true;
+}
+
+static ssize_t conn_recv(struct httpsrvdev_inst* inst, void* buf, size_t n) {
+#ifdef HTTPSRVDEV_TLS
+    if (inst->tls != NULL) {
+        ERR_clear_error();
+        errno = 0;
+        return conn_tls_io_result(inst, SSL_read(inst->tls->conn_ssl, buf, n));
+    }
+#endif
+    return recv(inst->conn->conn_sock_fd, buf, n, 0);
+}
+
+static ssize_t conn_send(struct httpsrvdev_inst* inst, void* buf, size_t n) {
+#ifdef HTTPSRVDEV_TLS
+    if (!conn_sock_is_plain(inst)) {
+        ERR_clear_error();
+        errno = 0;
+        return conn_tls_io_result(inst, SSL_write(inst->tls->conn_ssl, buf, n));
+    }
+#endif
+    // MSG_NOSIGNAL: A client that went away must not kill the server
+    // with SIGPIPE
+    return send(inst->conn->conn_sock_fd, buf, n, MSG_NOSIGNAL);
+}
+
+// `sendfile` to the connection, through user space if it must be encrypted
+// there
+static ssize_t conn_sendfile(struct httpsrvdev_inst* inst, int fd, off_t* offset, size_t n) {
+    if (conn_sock_is_plain(inst)) return sendfile(inst->conn->conn_sock_fd, fd, offset, n);
+
+    // One TLS record's worth. A write that would block is retried with the
+    // same bytes, read again from the same offset.
+    char chunk[16*1024];
+    if (n > sizeof(chunk)) n = sizeof(chunk);
+    ssize_t n_read = pread(fd, chunk, n, *offset);
+    if (n_read <= 0) return n_read;
+    ssize_t n_sent = conn_send(inst, chunk, n_read);
+    if (n_sent > 0) *offset += n_sent;
+    return n_sent;
+}
+
+// --------------------------------------------------------
+// Live reload
+// --------------------------------------------------------
+
+// Injected at the end of HTML responses while live reload is enabled.
+// Stylesheets are swapped in place by re-requesting them with a cache-busting
+// query; any other change reloads the page.
+static char live_reload_script[] =
+    "<script>(function(){"
+        "var es=new EventSource(\"" httpsrvdev_LIVE_RELOAD_EVENTS_PATH "\");"
+        "es.addEventListener(\"css\",function(){"
+            "document.querySelectorAll('link[rel=\"stylesheet\"]').forEach(function(l){"
+                "var u=new URL(l.href);"
+                "u.searchParams.set(\"httpsrvdev-v\",Date.now());"
+                "l.href=u.href;"
+            "});"
+        "});"
+        "es.addEventListener(\"reload\",function(){location.reload();});"
+    "})();</script>\n";
+
+#define LIVE_RELOAD_WATCH_MASK \
+    (IN_CLOSE_WRITE | IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+struct live_reload_watch {
+    char* dir_path;
+    // When watching a single file we watch its directory -- editors often
+    // replace files by renaming -- and only report events for this name.
+    // NULL to report every entry in the directory.
+    char* only_name;
+};
+
+struct httpsrvdev_live_reload {
+    int inotify_fd;
+
+    // Indexed by inotify watch descriptor
+    struct live_reload_watch* watches;
+    size_t                    watches_cap;
+
+    // Connected event stream clients
+    int*   clients;
+    size_t clients_count;
+    size_t clients_cap;
+
+    // The current burst of changes, sent once `pending_deadline_ns` passes
+    bool     pending;
+    bool     pending_css_only;
+    uint64_t pending_deadline_ns;
+    char     pending_name[NAME_MAX + 1];
+};
+
+// FNV-1a, for the hash tables below
+static uint64_t hash_fnv1a(char* str, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (unsigned char) str[i];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+static bool live_reload_init(struct httpsrvdev_inst* inst) {
+    struct httpsrvdev_live_reload* lr = calloc(1, sizeof(*lr));
+    if (lr == NULL) {
+        inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+        return false;
+    }
+    lr->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (lr->inotify_fd == -1) {
+        inst->err = httpsrvdev_COULD_NOT_WATCH | (errno & httpsrvdev_MASK_ERRNO);
+        goto err_free;
+    }
+    if (!poll_init(inst)) goto err_close_inotify;
+    struct epoll_event event = { .events = EPOLLIN, .data = { .fd = lr->inotify_fd } };
+    if (epoll_ctl(inst->epoll_fd, EPOLL_CTL_ADD, lr->inotify_fd, &event) == -1) {
+        inst->err = httpsrvdev_COULD_NOT_POLL | (errno & httpsrvdev_MASK_ERRNO);
+        goto err_close_inotify;
+    }
+
+    inst->live_reload = lr;
+    return true;
+
+err_close_inotify:
+    close(lr->inotify_fd);
+err_free:
+    free(lr);
+    return false;
+}
+
+static bool live_reload_add_watch(struct httpsrvdev_inst* inst,
+    char* dir_path, char* only_name
+) {
+    struct httpsrvdev_live_reload* lr = inst->live_reload;
+
+    int wd = inotify_add_watch(lr->inotify_fd, dir_path, LIVE_RELOAD_WATCH_MASK);
+    if (wd == -1) {
+        inst->err = httpsrvdev_COULD_NOT_WATCH | (errno & httpsrvdev_MASK_ERRNO);
+        return false;
+    }
+
+    if (wd >= lr->watches_cap) {
+        size_t new_cap = lr->watches_cap == 0 ? 64 : lr->watches_cap;
+        while (new_cap <= wd) new_cap *= 2;
+        struct live_reload_watch* new_watches =
+            realloc(lr->watches, new_cap*sizeof(lr->watches[0]));
+        if (new_watches == NULL) {
+            inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+            return false;
+        }
+        memset(new_watches + lr->watches_cap, 0,
+               (new_cap - lr->watches_cap)*sizeof(lr->watches[0]));
+        lr->watches     = new_watches;
+        lr->watches_cap = new_cap;
+    }
+
+    // The same directory may be added more than once, e.g. for two file
+    // sources in one directory. A watch can only filter by a single name so
+    // fall back to reporting all entries.
+    struct live_reload_watch* watch = &lr->watches[wd];
+    bool is_new = watch->dir_path == NULL;
+    if (is_new) {
+        watch->dir_path = strdup(dir_path);
+        if (watch->dir_path == NULL) {
+            inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+            return false;
+        }
+    }
+    if (is_new && only_name != NULL) {
+        watch->only_name = strdup(only_name);
+        if (watch->only_name == NULL) {
+            inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+            return false;
+        }
+    } else if (watch->only_name != NULL &&
+               (only_name == NULL || strcmp(watch->only_name, only_name) != 0)
+    ) {
+        free(watch->only_name);
+        watch->only_name = NULL;
+    }
+
+    return true;
+}
+
+// Watch `dir_path` and, recursively, its subdirectories. Hidden directories,
+// e.g. ".git", are skipped.
+static bool live_reload_add_watch_recursive(struct httpsrvdev_inst* inst, char* dir_path) {
+    if (!live_reload_add_watch(inst, dir_path, NULL)) return false;
+
+    DIR* dir = opendir(dir_path);
+    if (dir == NULL) {
+        inst->err = httpsrvdev_COULD_NOT_OPEN_DIR | (errno & httpsrvdev_MASK_ERRNO);
+        return false;
+    }
+
+    bool result = true;
+    struct httpsrvdev_arena_mark arena_mark = httpsrvdev_arena_save(&inst->conn->arena);
+    char* sub_dir_path = tmp_alloc(inst, PATH_MAX);
+    if (sub_dir_path == NULL) {
+        result = false;
+        goto cleanup;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+
+        int sub_dir_path_len = snprintf(sub_dir_path, PATH_MAX,
+                                        "%s/%s", dir_path, entry->d_name);
+        if (sub_dir_path_len < 0 || sub_dir_path_len >= PATH_MAX) continue;
+
+        bool is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN) {
+            struct stat sub_dir_path_stat;
+            is_dir = lstat(sub_dir_path, &sub_dir_path_stat) != -1 &&
+                     (sub_dir_path_stat.st_mode & S_IFMT) == S_IFDIR;
+        }
+        if (!is_dir) continue;
+
+        if (!live_reload_add_watch_recursive(inst, sub_dir_path)) {
+            result = false;
+            break;
+        }
+    }
+
+cleanup:
+    httpsrvdev_arena_reset(&inst->conn->arena, arena_mark);
+    closedir(dir);
+    return result;
+}
+
+bool httpsrvdev_live_reload_watch(struct httpsrvdev_inst* inst, char* path) {
+    if (inst->live_reload == NULL && !live_reload_init(inst)) return false;
+
+    struct stat path_stat;
+    if (stat(path, &path_stat) == -1) {
+        inst->err = httpsrvdev_COULD_NOT_STAT | (errno & httpsrvdev_MASK_ERRNO);
+        return false;
+    }
+    if ((path_stat.st_mode & S_IFMT) == S_IFDIR) {
+        return live_reload_add_watch_recursive(inst, path);
+    }
+
+    // Split file path into directory and name
+    bool result = false;
+    struct httpsrvdev_arena_mark arena_mark = httpsrvdev_arena_save(&inst->conn->arena);
+    char* dir_path = tmp_alloc(inst, PATH_MAX);
+    if (dir_path == NULL) goto cleanup;
+    if (strlen(path) >= PATH_MAX) {
+        inst->err = httpsrvdev_BUF_TOO_SMALL;
+        goto cleanup;
+    }
+    strcpy(dir_path, path);
+    char* last_slash = strrchr(dir_path, '/');
+    char* name = path;
+    if (last_slash == NULL) {
+        strcpy(dir_path, ".");
+    } else {
+        name = path + (last_slash - dir_path) + 1;
+        if (last_slash == dir_path) {
+            last_slash[1] = '\0';
+        } else {
+            last_slash[0] = '\0';
+        }
+    }
+    result = live_reload_add_watch(inst, dir_path, name);
+
+cleanup:
+    httpsrvdev_arena_reset(&inst->conn->arena, arena_mark);
+    return result;
+}
+
+static void live_reload_drop_client(struct httpsrvdev_inst* inst, size_t i) {
+    struct httpsrvdev_live_reload* lr = inst->live_reload;
+    // Closing the fd also removes it from the epoll set
+    close(lr->clients[i]);
+    lr->clients[i] = lr->clients[--lr->clients_count];
+}
+
+static void live_reload_on_client_event(struct httpsrvdev_inst* inst, int fd) {
+    struct httpsrvdev_live_reload* lr = inst->live_reload;
+
+    // Clients don't send anything after the request; drain whatever arrives
+    // and drop the client once it hangs up.
+    char discard[256];
+    ssize_t n_recvd;
+    while ((n_recvd = recv(fd, discard, sizeof(discard), MSG_DONTWAIT)) > 0);
+    if (n_recvd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+
+    for (size_t i = 0; i < lr->clients_count; ++i) {
+        if (lr->clients[i] == fd) {
+            live_reload_drop_client(inst, i);
+            return;
+        }
+    }
+}
+
+static bool live_reload_name_is_ignored(char* name) {
+    // Hidden files and editor swap/backup files
+    size_t name_len = strlen(name);
+    return name[0] == '.' || (name_len > 0 && name[name_len - 1] == '~');
+}
+
+static bool snapshot_update(struct httpsrvdev_inst* inst,
+    struct httpsrvdev_snapshot* snapshot, char* path);
+static void snapshot_rebuild(struct httpsrvdev_inst* inst);
+
+static void live_reload_on_inotify_event(struct httpsrvdev_inst* inst) {
+    struct httpsrvdev_live_reload* lr = inst->live_reload;
+
+    _Alignas(struct inotify_event) char buf[4096];
+    while (true) {
+        ssize_t len = read(lr->inotify_fd, buf, sizeof(buf));
+        if (len <= 0) break;
+
+        for (char* ptr = buf; ptr < buf + len; ) {
+            struct inotify_event* event = (struct inotify_event*) ptr;
+            ptr += sizeof(struct inotify_event) + event->len;
+
+            bool is_overflow = event->mask & IN_Q_OVERFLOW;
+            char* name = event->len > 0 ? event->name : "";
+            // Events were lost so we don't know what changed
+            if (is_overflow && inst->snapshot != NULL) snapshot_rebuild(inst);
+            if (!is_overflow) {
+                if (event->wd < 0 || event->wd >= lr->watches_cap) continue;
+                struct live_reload_watch* watch = &lr->watches[event->wd];
+                if (event->mask & IN_IGNORED) {
+                    free(watch->dir_path);
+                    free(watch->only_name);
+                    *watch = (struct live_reload_watch) { NULL, NULL };
+                    continue;
+                }
+                if (watch->dir_path == NULL) continue;
+                if (watch->only_name != NULL && strcmp(watch->only_name, name) != 0)
+                    continue;
+
+                // Keep the snapshot, if any, up to date before clients reload.
+                // Not arena allocated: recording responses clears the arena.
+                if (inst->snapshot != NULL) {
+                    char path[PATH_MAX];
+                    if (snprintf(path, PATH_MAX, "%s/%s", watch->dir_path, name) < PATH_MAX)
+                        snapshot_update(inst, inst->snapshot, path);
+                }
+
+                if (live_reload_name_is_ignored(name)) continue;
+
+                // Watch new directories so that their files are picked up too
+                if ((event->mask & IN_ISDIR) &&
+                    (event->mask & (IN_CREATE | IN_MOVED_TO)) &&
+                    watch->only_name == NULL
+                ) {
+                    struct httpsrvdev_arena_mark arena_mark =
+                        httpsrvdev_arena_save(&inst->conn->arena);
+                    char* sub_dir_path = tmp_alloc(inst, PATH_MAX);
+                    if (sub_dir_path != NULL) {
+                        int sub_dir_path_len = snprintf(sub_dir_path, PATH_MAX,
+                                                        "%s/%s", watch->dir_path, name);
+                        if (sub_dir_path_len > 0 && sub_dir_path_len < PATH_MAX) {
+                            // Best effort; the directory may already be gone
+                            live_reload_add_watch_recursive(inst, sub_dir_path);
+                        }
+                    }
+                    httpsrvdev_arena_reset(&inst->conn->arena, arena_mark);
+                }
+            }
+
+            // Only CSS changes in the whole burst can be swapped without a reload
+            size_t name_len = strlen(name);
+            bool is_css = !is_overflow && !(event->mask & IN_ISDIR) &&
+                          name_len > 4 && strcmp(name + name_len - 4, ".css") == 0;
+            if (!lr->pending) {
+                lr->pending             = true;
+                lr->pending_css_only    = is_css;
+                lr->pending_deadline_ns = monotonic_ns() +
+                                          (uint64_t) inst->live_reload_debounce_ms*1000000;
+            } else {
+                lr->pending_css_only = lr->pending_css_only && is_css;
+            }
+            // Keep the name on one line so it can't break the event framing
+            size_t n = strcspn(name, "\r\n");
+            if (n >= sizeof(lr->pending_name)) n = sizeof(lr->pending_name) - 1;
+            memcpy(lr->pending_name, name, n);
+            lr->pending_name[n] = '\0';
+        }
+    }
+}
+
+static void live_reload_broadcast(struct httpsrvdev_inst* inst) {
+    struct httpsrvdev_live_reload* lr = inst->live_reload;
+    lr->pending = false;
+
+    char msg[sizeof(lr->pending_name) + 64];
+    int  msg_len = snprintf(msg, sizeof(msg), "event: %s\ndata: %s\n\n",
+                            lr->pending_css_only ? "css" : "reload", lr->pending_name);
+    if (msg_len < 0 || msg_len >= sizeof(msg)) return;
+
+    // The message is tiny, so a client that can't take it whole right away
+    // has stopped reading and is dropped rather than blocking the server
+    for (size_t i = 0; i < lr->clients_count; ) {
+        ssize_t n_sent = send(lr->clients[i], msg, msg_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n_sent != msg_len) {
+            live_reload_drop_client(inst, i);
+        } else {
+            ++i;
+        }
+    }
+}
+
+// Wait until a connection can be accepted, meanwhile handling file system
+// events and event stream clients. Like `listen_socks_wait` otherwise.
+static bool live_reload_wait_for_conn(struct httpsrvdev_inst* inst) {
+    struct httpsrvdev_live_reload* lr = inst->live_reload;
+
+    if (!listen_socks_poll(inst)) return false;
+
+    while (true) {
+        int timeout_ms = timers_timeout_ms(inst);
+        if (lr->pending) {
+            uint64_t now_ns = monotonic_ns();
+            if (now_ns >= lr->pending_deadline_ns) {
+                live_reload_broadcast(inst);
+                continue;
+            }
+            int pending_timeout_ms = (lr->pending_deadline_ns - now_ns + 999999)/1000000;
+            if (timeout_ms == -1 || pending_timeout_ms < timeout_ms) {
+                timeout_ms = pending_timeout_ms;
+            }
+        }
+
+        struct epoll_event events[64];
+        int n_events = epoll_wait(inst->epoll_fd, events,
+                                  sizeof(events)/sizeof(events[0]), timeout_ms);
+        if (n_events == -1) {
+            if (errno == EINTR) continue;
+            inst->err = httpsrvdev_COULD_NOT_POLL | (errno & httpsrvdev_MASK_ERRNO);
+            return false;
+        }
+        if (inst->timers != NULL) timers_advance(inst, monotonic_ns());
+
+        bool can_accept = false;
+        for (int i = 0; i < n_events; ++i) {
+            int fd = events[i].data.fd;
+            if (is_listen_sock(inst, fd)) {
+                // Others that are ready are picked up by the next wait
+                if (!can_accept) inst->conn->listen_sock_fd = fd;
+                can_accept = true;
+            } else if (fd == inst->handoff_sock_fd) {
+                if (handoff_serve(inst)) return false;
+            } else if (fd == lr->inotify_fd) {
+                live_reload_on_inotify_event(inst);
+            } else if (!coros_on_poll_event(inst, fd, events[i].events) &&
+                       !h2_on_poll_event(inst, fd, events[i].events)
+            ) {
+                live_reload_on_client_event(inst, fd);
+            }
+        }
+        if (can_accept) return true;
+        if (h2_has_ready_stream(inst) || coros_ready_count(inst) > 0) {
+            inst->conn->listen_sock_fd = -1;
+            return true;
+        }
+    }
+}
+
+bool httpsrvdev_res_live_reload_events(struct httpsrvdev_inst* inst) {
+    struct httpsrvdev_live_reload* lr = inst->live_reload;
+    // Event streams take over the connection, which HTTP/2 streams can't.
+    // Nor can TLS connections that OpenSSL encrypts.
+    if (lr == NULL || h2_stream_is_current(inst) || !conn_sock_is_plain(inst)) {
+        inst->err = httpsrvdev_LIB_IMPL_ERR;
+        return false;
+    }
+
+    if (lr->clients_count == lr->clients_cap) {
+        size_t new_cap = lr->clients_cap == 0 ? 64 : 2*lr->clients_cap;
+        int* new_clients = realloc(lr->clients, new_cap*sizeof(lr->clients[0]));
+        if (new_clients == NULL) {
+            inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+            return false;
+        }
+        lr->clients     = new_clients;
+        lr->clients_cap = new_cap;
+    }
+
+    if (!httpsrvdev_res_status_line(inst, 200))                             return false;
+    if (!httpsrvdev_res_header(inst, "Content-Type", "text/event-stream"))  return false;
+    if (!httpsrvdev_res_header(inst, "Cache-Control", "no-cache"))          return false;
+    // Ask the browser to reconnect quickly, e.g. after a server restart
+    if (!httpsrvdev_res_send(inst, "\r\nretry: 500\n\n"))                   return false;
+
+    // Hand the connection over to the poll loop instead of closing it. From
+    // here on, the client only costs a file descriptor.
+    int fd = inst->conn->conn_sock_fd;
+    int flags = fcntl(fd, F_GETFL);
+    struct epoll_event event = {
+        .events = EPOLLIN | EPOLLRDHUP,
+        .data   = { .fd = fd },
+    };
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1 ||
+        epoll_ctl(inst->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1
+    ) {
+        inst->err = httpsrvdev_COULD_NOT_POLL | (errno & httpsrvdev_MASK_ERRNO);
+        return false;
+    }
+    lr->clients[lr->clients_count++] = fd;
+
+    conn_timers_cancel(inst);
+    // The kernel keeps encrypting, if it does
+    conn_tls_end(inst, false);
+    inst->conn->conn_sock_fd = -1;
+    httpsrvdev_arena_clear(&inst->conn->arena);
+    HOOK(inst, res_end);
+
+    return true;
+}
+
+static void live_reload_free(struct httpsrvdev_inst* inst) {
+    struct httpsrvdev_live_reload* lr = inst->live_reload;
+    if (lr == NULL) return;
+
+    for (size_t i = 0; i < lr->clients_count; ++i) {
+        close(lr->clients[i]);
+    }
+    for (size_t i = 0; i < lr->watches_cap; ++i) {
+        free(lr->watches[i].dir_path);
+        free(lr->watches[i].only_name);
+    }
+    close(lr->inotify_fd);
+    free(lr->clients);
+    free(lr->watches);
+    free(lr);
+    inst->live_reload = NULL;
+}
+
+// --------------------------------------------------------
+// Hot restart
+// --------------------------------------------------------
+
+// A process started with the same `handoff_path` as a running one connects
+// to the running one's control socket there and is sent its listening
+// sockets with SCM_RIGHTS. Connections keep queuing on the shared sockets
+// while the processes swap, so none are refused. The old process then
+// drains its remaining connections and exits.
+
+static bool handoff_addr(struct httpsrvdev_inst* inst, struct sockaddr_un* addr_un) {
+    size_t path_len = strlen(inst->handoff_path);
+    if (path_len == 0 || path_len >= sizeof(addr_un->sun_path)) {
+        inst->err = httpsrvdev_INVALID_ADDR;
+        return false;
+    }
+    *addr_un = (struct sockaddr_un) { .sun_family = AF_UNIX };
+    memcpy(addr_un->sun_path, inst->handoff_path, path_len + 1);
+    return true;
+}
+
+union handoff_control {
+    struct cmsghdr hdr;
+    char           buf[CMSG_SPACE(sizeof(int)*httpsrvdev_LISTEN_ADDRS_MAX)];
+};
+
+// Send the listening sockets to the process connecting to the control socket
+// and stop accepting connections. Returns true once handed off, with
+// `inst->err` set to `httpsrvdev_HANDED_OFF`.
+static bool handoff_serve(struct httpsrvdev_inst* inst) {
+    int conn_fd = accept4(inst->handoff_sock_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (conn_fd == -1) {
+        inst->err = httpsrvdev_COULD_NOT_ACCEPT | (errno & httpsrvdev_MASK_ERRNO);
+        return false;
+    }
+
+    uint32_t fds_count = inst->listen_addrs_count;
+    union handoff_control control = { .buf = {0} };
+    struct iovec  iov = { .iov_base = &fds_count, .iov_len = sizeof(fds_count) };
+    struct msghdr msg = {
+        .msg_iov        = &iov,
+        .msg_iovlen     = 1,
+        .msg_control    = control.buf,
+        .msg_controllen = CMSG_SPACE(sizeof(int)*fds_count),
+    };
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(int)*fds_count);
+    memcpy(CMSG_DATA(cmsg), inst->listen_sock_fds, sizeof(int)*fds_count);
+    ssize_t n_sent = sendmsg(conn_fd, &msg, MSG_NOSIGNAL);
+    int sendmsg_errno = errno;
+    close(conn_fd);
+    if (n_sent != sizeof(fds_count)) {
+        // The new process has gone away, so keep serving
+        inst->err = httpsrvdev_COULD_NOT_HAND_OFF | (sendmsg_errno & httpsrvdev_MASK_ERRNO);
+        return false;
+    }
+
+    // The sockets are shared with the new process now, so they have to be
+    // taken out of the epoll set explicitly; closing them here isn't enough.
+    // Paths of Unix domain sockets and of the control socket belong to the
+    // new process too, so aren't unlinked.
+    for (int i = -1; i < inst->listen_addrs_count; ++i) {
+        int* fd = i == -1 ? &inst->handoff_sock_fd : &inst->listen_sock_fds[i];
+        if (inst->listen_socks_polled) epoll_ctl(inst->epoll_fd, EPOLL_CTL_DEL, *fd, NULL);
+        close(*fd);
+        *fd = -1;
+    }
+
+    inst->err = httpsrvdev_HANDED_OFF;
+    return true;
+}
+
+static bool addr_eq(struct httpsrvdev_addr* a, struct httpsrvdev_addr* b) {
+    return a->sock_addr_size == b->sock_addr_size &&
+           memcmp(&a->sock_addr, &b->sock_addr, a->sock_addr_size) == 0;
+}
+
+// Take over the listening sockets of the server serving the control socket,
+// if there is one. Sockets for addresses that aren't listened on anymore are
+// closed.
+static bool handoff_recv(struct httpsrvdev_inst* inst) {
+    struct sockaddr_un addr_un;
+    if (!handoff_addr(inst, &addr_un)) return false;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        inst->err = httpsrvdev_COULD_NOT_HAND_OFF | (errno & httpsrvdev_MASK_ERRNO);
+        return false;
+    }
+    if (connect(fd, (struct sockaddr*) &addr_un, sizeof(addr_un)) == -1) {
+        // No server to take over from
+        close(fd);
+        return true;
+    }
+    // The old server answers between requests; don't wait forever on one
+    // that is stuck
+    struct timeval timeout = { .tv_sec = 10, .tv_usec = 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    uint32_t fds_count;
+    union handoff_control control;
+    struct iovec  iov = { .iov_base = &fds_count, .iov_len = sizeof(fds_count) };
+    struct msghdr msg = {
+        .msg_iov        = &iov,
+        .msg_iovlen     = 1,
+        .msg_control    = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    ssize_t n_recvd = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    int recvmsg_errno = n_recvd == -1 ? errno : EPROTO;
+    close(fd);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (n_recvd != sizeof(fds_count) || cmsg == NULL ||
+        cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+    ) {
+        inst->err = httpsrvdev_COULD_NOT_HAND_OFF | (recvmsg_errno & httpsrvdev_MASK_ERRNO);
+        return false;
+    }
+
+    int    fds[httpsrvdev_LISTEN_ADDRS_MAX];
+    size_t recvd_fds_count = (cmsg->cmsg_len - CMSG_LEN(0))/sizeof(int);
+    memcpy(fds, CMSG_DATA(cmsg), recvd_fds_count*sizeof(int));
+    for (size_t j = 0; j < recvd_fds_count; ++j) {
+        struct httpsrvdev_addr addr = { .sock_addr_size = sizeof(addr.sock_addr) };
+        bool taken_over = false;
+        if (getsockname(fds[j], (struct sockaddr*) &addr.sock_addr, &addr.sock_addr_size) == 0) {
+            for (int i = 0; i < inst->listen_addrs_count && !taken_over; ++i) {
+                if (inst->listen_sock_fds[i] == -1 && addr_eq(&inst->listen_addrs[i], &addr)) {
+                    inst->listen_sock_fds[i] = fds[j];
+                    ++inst->listen_socks_taken_over;
+                    taken_over = true;
+                }
+            }
+        }
+        if (!taken_over) {
+            if (addr.sock_addr.ss_family == AF_UNIX) {
+                unlink(((struct sockaddr_un*) &addr.sock_addr)->sun_path);
+            }
+            close(fds[j]);
+        }
+    }
+
+    return true;
+}
+
+// Serve the control socket for the next restart, replacing the old server's
+static bool handoff_listen(struct httpsrvdev_inst* inst) {
+    struct sockaddr_un addr_un;
+    if (!handoff_addr(inst, &addr_un)) return false;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) goto err;
+    unlink(addr_un.sun_path);
+    if (bind(fd, (struct sockaddr*) &addr_un, sizeof(addr_un)) == -1 ||
+        listen(fd, 1) == -1
+    ) goto err_close;
+
+    inst->handoff_sock_fd = fd;
+    return true;
+
+err_close:
+    close(fd);
+err:
+    inst->err = httpsrvdev_COULD_NOT_HAND_OFF | (errno & httpsrvdev_MASK_ERRNO);
+    return false;
+}
+
+static void coros_run_ready(struct httpsrvdev_inst* inst);
+
+bool httpsrvdev_drain(struct httpsrvdev_inst* inst, int grace_ms) {
+    struct httpsrvdev_live_reload* lr = inst->live_reload;
+
+    if (lr != NULL) {
+        // The new process watches the files from here on. Ending the event
+        // streams has browsers reconnect to it.
+        epoll_ctl(inst->epoll_fd, EPOLL_CTL_DEL, lr->inotify_fd, NULL);
+        for (size_t i = 0; i < lr->clients_count; ++i) {
+            shutdown(lr->clients[i], SHUT_WR);
+        }
+    }
+    // HTTP/2 clients open new connections, to the new process, for the
+    // streams that weren't served
+    h2_goaway_all(inst);
+    // Connections suspended on coroutines are served to the end
+    coros_run_ready(inst);
+
+    uint64_t deadline_ns = monotonic_ns() + (uint64_t) grace_ms*1000000;
+    while ((lr != NULL && lr->clients_count > 0) || h2_conns_count(inst) > 0 ||
+           coros_active_count(inst) > 0
+    ) {
+        uint64_t now_ns = monotonic_ns();
+        if (now_ns >= deadline_ns) break;
+
+        // Timers keep the coroutines' connections within their timeouts
+        int timeout_ms = (deadline_ns - now_ns + 999999)/1000000;
+        int timers_ms  = timers_timeout_ms(inst);
+        if (timers_ms != -1 && timers_ms < timeout_ms) timeout_ms = timers_ms;
+        struct epoll_event events[64];
+        int n_events = epoll_wait(inst->epoll_fd, events, sizeof(events)/sizeof(events[0]),
+                                  timeout_ms);
+        if (n_events == -1) {
+            if (errno == EINTR) continue;
+            inst->err = httpsrvdev_COULD_NOT_POLL | (errno & httpsrvdev_MASK_ERRNO);
+            return false;
+        }
+        if (inst->timers != NULL) timers_advance(inst, monotonic_ns());
+        for (int i = 0; i < n_events; ++i) {
+            int fd = events[i].data.fd;
+            if (!coros_on_poll_event(inst, fd, events[i].events) &&
+                !h2_on_poll_event(inst, fd, events[i].events)
+            ) {
+                live_reload_on_client_event(inst, fd);
+            }
+        }
+        coros_run_ready(inst);
+    }
+
+    // Clients still connected are closed by `httpsrvdev_stop`
+    return true;
+}
+
+// --------------------------------------------------------
+// Traffic recording
+// --------------------------------------------------------
+
+// Each request is appended to the recording with a single `writev` as soon
+// as it has arrived, so that a server that crashes still leaves the requests
+// that led up to it. HTTP/2 requests are recorded as the HTTP/1.1 they are
+// rebuilt as.
+
+static bool record_open(struct httpsrvdev_inst* inst) {
+    int fd = open(inst->record_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) goto err;
+
+    // Start a new recording or append to one -- but not to anything else
+    char magic[httpsrvdev_RECORD_MAGIC_LEN];
+    ssize_t n_read = pread(fd, magic, sizeof(magic), 0);
+    if (n_read == 0) {
+        if (write(fd, httpsrvdev_RECORD_MAGIC, sizeof(magic)) != sizeof(magic)) goto err;
+    } else if (n_read != sizeof(magic) || memcmp(magic, httpsrvdev_RECORD_MAGIC, sizeof(magic))) {
+        if (n_read != -1) errno = EINVAL;
+        goto err;
+    }
+    inst->record_fd = fd;
+    return true;
+
+err:
+    inst->err = httpsrvdev_COULD_NOT_OPEN_RECORDING | (errno & httpsrvdev_MASK_ERRNO);
+    if (fd != -1) close(fd);
+    return false;
+}
+
+// Append the request in `req_buf`. Best effort: requests are served all the
+// same if recording fails, e.g. on a full disk, but recording stops so that
+// a partly written record is the last one.
+static void record_req(struct httpsrvdev_inst* inst) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t time_ns = (uint64_t) now.tv_sec*1000000000 + now.tv_nsec;
+
+    uint8_t head[httpsrvdev_RECORD_HEAD_LEN];
+    for (int i = 0; i < 8; ++i) head[i]     = time_ns >> 8*i;
+    for (int i = 0; i < 4; ++i) head[8 + i] = (uint64_t) inst->conn->req_len >> 8*i;
+    struct iovec iov[2] = {
+        { .iov_base = head,          .iov_len = sizeof(head)  },
+        { .iov_base = inst->conn->req_buf, .iov_len = inst->conn->req_len },
+    };
+    if (writev(inst->record_fd, iov, 2) != (ssize_t) (sizeof(head) + inst->conn->req_len)) {
+        close(inst->record_fd);
+        inst->record_fd = -1;
+    }
+}
+
+// --------------------------------------------------------
+// Admission control
+// --------------------------------------------------------
+
+// Token bucket of a client IP. IPv4 addresses are stored IPv4-mapped.
+struct admission_bucket {
+    uint8_t  ip[16];
+    bool     used;
+    double   tokens;
+    uint64_t last_ns;
+};
+
+struct httpsrvdev_admission {
+    // Sent to refused clients, without parsing their request
+    struct httpsrvdev_prebuilt_res res_503;
+
+    // Open addressing, kept at most half full
+    struct admission_bucket* buckets;
+    size_t                   buckets_count;
+    size_t                   buckets_cap;
+};
+
+static bool admission_init(struct httpsrvdev_inst* inst) {
+    struct httpsrvdev_admission* adm = calloc(1, sizeof(*adm));
+    if (adm == NULL) {
+        inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+        return false;
+    }
+
+    httpsrvdev_prebuilt_begin(inst, &adm->res_503);
+    if (!httpsrvdev_res_status_line(inst, 503)                                   ||
+        !httpsrvdev_res_header(inst, "Content-Type", "text/plain; charset=utf-8") ||
+        !httpsrvdev_res_headerf(inst, "Retry-After", "%d", inst->admission_retry_after_s) ||
+        !httpsrvdev_res_body(inst, "Server is busy, please retry shortly!")
+    ) {
+        inst->conn->res_recording = NULL;
+        httpsrvdev_prebuilt_free(&adm->res_503);
+        free(adm);
+        return false;
+    }
+
+    inst->admission = adm;
+    return true;
+}
+
+static void admission_free(struct httpsrvdev_inst* inst) {
+    struct httpsrvdev_admission* adm = inst->admission;
+    if (adm == NULL) return;
+
+    httpsrvdev_prebuilt_free(&adm->res_503);
+    free(adm->buckets);
+    free(adm);
+    inst->admission = NULL;
+}
+
+static double admission_burst(struct httpsrvdev_inst* inst) {
+    return inst->admission_ip_burst > 0 ? inst->admission_ip_burst
+                                        : inst->admission_ip_rate;
+}
+
+static struct admission_bucket* admission_find_bucket(
+    struct admission_bucket* buckets, size_t cap, uint8_t ip[16]
+) {
+    size_t i = hash_fnv1a((char*) ip, 16) & (cap - 1);
+    while (buckets[i].used && memcmp(buckets[i].ip, ip, 16) != 0) {
+        i = (i + 1) & (cap - 1);
+    }
+    return &buckets[i];
+}
+
+// Double the table, dropping buckets that have refilled completely since
+// they are the same as new ones
+static bool admission_grow_buckets(struct httpsrvdev_inst* inst, uint64_t now_ns) {
+    struct httpsrvdev_admission* adm = inst->admission;
+    size_t new_cap = adm->buckets_cap == 0 ? 64 : 2*adm->buckets_cap;
+    struct admission_bucket* new_buckets = calloc(new_cap, sizeof(new_buckets[0]));
+    if (new_buckets == NULL) {
+        inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+        return false;
+    }
+
+    double burst = admission_burst(inst);
+    size_t new_count = 0;
+    for (size_t i = 0; i < adm->buckets_cap; ++i) {
+        struct admission_bucket* bucket = &adm->buckets[i];
+        if (!bucket->used) continue;
+        double tokens = bucket->tokens +
+                        (now_ns - bucket->last_ns)*1e-9*inst->admission_ip_rate;
+        if (tokens >= burst) continue;
+        *admission_find_bucket(new_buckets, new_cap, bucket->ip) = *bucket;
+        ++new_count;
+    }
+    free(adm->buckets);
+    adm->buckets       = new_buckets;
+    adm->buckets_count = new_count;
+    adm->buckets_cap   = new_cap;
+    return true;
+}
+
+// Take a token from the bucket of the connected client's IP
+static bool admission_take_token(struct httpsrvdev_inst* inst) {
+    struct httpsrvdev_admission* adm = inst->admission;
+
+    uint8_t ip[16] = {0};
+    struct sockaddr_storage* addr = &inst->conn->conn_addr.sock_addr;
+    if (addr->ss_family == AF_INET6) {
+        memcpy(ip, &((struct sockaddr_in6*) addr)->sin6_addr, 16);
+    } else if (addr->ss_family == AF_INET) {
+        ip[10] = 0xFF;
+        ip[11] = 0xFF;
+        memcpy(ip + 12, &((struct sockaddr_in*) addr)->sin_addr, 4);
+    } else {
+        // Local clients of Unix domain sockets aren't limited
+        return true;
+    }
+
+    uint64_t now_ns = monotonic_ns();
+    if (2*(adm->buckets_count + 1) > adm->buckets_cap &&
+        !admission_grow_buckets(inst, now_ns)
+    ) {
+        // Rather admit than refuse everyone when out of memory
+        return true;
+    }
+
+    double burst = admission_burst(inst);
+    struct admission_bucket* bucket =
+        admission_find_bucket(adm->buckets, adm->buckets_cap, ip);
+    if (!bucket->used) {
+        *bucket = (struct admission_bucket) { .used = true, .tokens = burst, .last_ns = now_ns };
+        memcpy(bucket->ip, ip, 16);
+        ++adm->buckets_count;
+    }
+
+    bucket->tokens += (now_ns - bucket->last_ns)*1e-9*inst->admission_ip_rate;
+    if (bucket->tokens > burst) bucket->tokens = burst;
+    bucket->last_ns = now_ns;
+    if (bucket->tokens < 1) return false;
+    bucket->tokens -= 1;
+    return true;
+}
+
+// Number of connections waiting to be accepted on the current listening
+// socket, or -1 if unknown
+static int admission_queued_count(struct httpsrvdev_inst* inst) {
+    struct tcp_info info;
+    socklen_t info_size = sizeof(info);
+    if (getsockopt(inst->conn->listen_sock_fd, IPPROTO_TCP, TCP_INFO, &info, &info_size) == -1) {
+        return -1;
+    }
+    // For listening sockets, the kernel reports the accept queue length here
+    return info.tcpi_unacked;
+}
+
+// Decide whether to serve the accepted connection. If not, the prebuilt 503
+// is sent and the connection closed.
+static bool admission_admit(struct httpsrvdev_inst* inst) {
+    struct httpsrvdev_admission* adm = inst->admission;
+
+    int queued_count = admission_queued_count(inst);
+    if (queued_count != -1) inst->admission_queued_count = queued_count;
+
+    // The connections being served, any event streams and HTTP/2 connections
+    int conns_count = coros_active_count(inst);
+    if (conns_count == 0) conns_count = 1;
+    conns_count += h2_conns_count(inst);
+    if (inst->live_reload != NULL) conns_count += inst->live_reload->clients_count;
+
+    bool admit =
+        (inst->admission_max_conns  <= 0 || conns_count  <= inst->admission_max_conns ) &&
+        (inst->admission_max_queued <= 0 || queued_count <= inst->admission_max_queued) &&
+        (inst->admission_ip_rate    <= 0 || admission_take_token(inst));
+    if (admit) return true;
+
+    ++inst->admission_shed_count;
+    httpsrvdev_res_prebuilt(inst, &adm->res_503);
+    HOOK(inst, conn_shed);
+    return false;
+}
+
+// --------------------------------------------------------
+// File system access
+// --------------------------------------------------------
+
+// With `inst->fs_workers_count` > 0, `stat` and `scandir` run on a pool of
+// worker threads and file data is read inline only if it is already in the
+// page cache (`preadv2` with RWF_NOWAIT); otherwise, the read is offloaded
+// too. Workers signal completion through an eventfd: that of the coroutine
+// that submitted the job, which is parked meanwhile, or else the pool's.
+
+#define FS_JOB_STAT    1
+#define FS_JOB_SCANDIR 2
+#define FS_JOB_PREAD   3
+
+struct fs_job {
+    int kind;
+
+    char*            path;     // STAT, SCANDIR
+    struct stat*     stat_buf; // STAT
+    struct dirent*** entries;  // SCANDIR
+    int              fd;       // PREAD
+    void*            buf;      // PREAD
+    size_t           n;        // PREAD
+    off_t            offset;   // PREAD
+
+    ssize_t result;
+    int     err;
+
+    int            event_fd;  // Of the coroutine, else of the pool
+    atomic_bool    done;
+    struct fs_job* next;
+};
+
+struct httpsrvdev_fs_pool {
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    struct fs_job*  queue_head;
+    struct fs_job*  queue_tail;
+    bool            stopping;
+
+    int event_fd;
+
+    size_t    threads_count;
+    pthread_t threads[];
+};
+
+static void fs_job_run(struct fs_job* job) {
+    switch (job->kind) {
+        case FS_JOB_STAT:
+            job->result = stat(job->path, job->stat_buf);
+            break;
+        case FS_JOB_SCANDIR:
+            job->result = scandir(job->path, job->entries, NULL, alphasort);
+            break;
+        case FS_JOB_PREAD:
+            job->result = pread(job->fd, job->buf, job->n, job->offset);
+            break;
+    }
+    job->err = job->result == -1 ? errno : 0;
+}
+
+static void* fs_worker_main(void* arg) {
+    struct httpsrvdev_fs_pool* pool = arg;
+
+    while (true) {
+        pthread_mutex_lock(&pool->mutex);
+        while (pool->queue_head == NULL && !pool->stopping) {
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+        }
+        if (pool->stopping) {
+            pthread_mutex_unlock(&pool->mutex);
+            return NULL;
+        }
+        struct fs_job* job = pool->queue_head;
+        pool->queue_head = job->next;
+        if (pool->queue_head == NULL) pool->queue_tail = NULL;
+        pthread_mutex_unlock(&pool->mutex);
+
+        // The job may be gone as soon as it is done
+        int event_fd = job->event_fd;
+        fs_job_run(job);
+
+        atomic_store_explicit(&job->done, true, memory_order_release);
+        uint64_t one = 1;
+        while (write(event_fd, &one, sizeof(one)) == -1 && errno == EINTR);
+    }
+}
+
+static bool fs_pool_start(struct httpsrvdev_inst* inst) {
+    size_t threads_count = inst->fs_workers_count;
+    struct httpsrvdev_fs_pool* pool =
+        calloc(1, sizeof(*pool) + threads_count*sizeof(pool->threads[0]));
+    if (pool == NULL) {
+        inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+        return false;
+    }
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pool->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (pool->event_fd == -1) {
+        inst->err = httpsrvdev_COULD_NOT_POLL | (errno & httpsrvdev_MASK_ERRNO);
+        free(pool);
+        return false;
+    }
+    inst->fs_pool = pool;
+
+    for (size_t i = 0; i < threads_count; ++i) {
+        int err = pthread_create(&pool->threads[i], NULL, fs_worker_main, pool);
+        if (err != 0) {
+            inst->err = httpsrvdev_MEM_ERR | (err & httpsrvdev_MASK_ERRNO);
+            return false;
+        }
+        ++pool->threads_count;
+    }
+
+    return true;
+}
+
+static void fs_pool_stop(struct httpsrvdev_inst* inst) {
+    struct httpsrvdev_fs_pool* pool = inst->fs_pool;
+    if (pool == NULL) return;
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+    for (size_t i = 0; i < pool->threads_count; ++i) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    close(pool->event_fd);
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->cond);
+    free(pool);
+    inst->fs_pool = NULL;
+}
+
+// Whether `n` bytes at `p` lie in the coroutine locals, which other
+// coroutines take over while the current one is suspended. Its `conn` stays
+// put.
+static bool fs_in_coro_state(struct httpsrvdev_inst* inst, void* p, size_t n) {
+    uintptr_t begin  = (uintptr_t) p;
+    uintptr_t end    = begin + n;
+    uintptr_t locals = (uintptr_t) inst->coros_locals;
+    return begin < locals + inst->coros_locals_size && end > locals;
+}
+
+// Run `job` on the worker pool and wait for it to complete. On a coroutine,
+// other connections are served meanwhile. Sets `errno` to the job's error if
+// it failed.
+static ssize_t fs_job_submit_and_wait(struct httpsrvdev_inst* inst, struct fs_job* job) {
+    struct httpsrvdev_fs_pool* pool = inst->fs_pool;
+
+    // A path in the coroutine locals is copied to the stack, which stays put
+    // while the coroutine is suspended. A read into them blocks instead.
+    char path_copy[PATH_MAX];
+    if (job->path != NULL && fs_in_coro_state(inst, job->path, 1)) {
+        size_t path_len = strlen(job->path);
+        if (path_len < sizeof(path_copy)) {
+            memcpy(path_copy, job->path, path_len + 1);
+            job->path = path_copy;
+        }
+    }
+    bool park = coro_can_wait(inst) &&
+        (job->path == NULL || !fs_in_coro_state(inst, job->path, 1)) &&
+        (job->buf  == NULL || !fs_in_coro_state(inst, job->buf, job->n));
+    job->event_fd = park ? coro_fs_event_fd(inst) : -1;
+    park = job->event_fd != -1;
+    if (!park) job->event_fd = pool->event_fd;
+
+    job->next = NULL;
+    atomic_init(&job->done, false);
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->queue_tail == NULL) {
+        pool->queue_head = job;
+    } else {
+        pool->queue_tail->next = job;
+    }
+    pool->queue_tail = job;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    // The worker signals after the job is done, so reading the count leaves
+    // the coroutine's eventfd at zero for its next job. The pool's may hold
+    // the count of an earlier job that was done before it was waited for.
+    struct pollfd pfd = { .fd = job->event_fd, .events = POLLIN };
+    while (true) {
+        uint64_t count;
+        if (read(job->event_fd, &count, sizeof(count)) == sizeof(count) &&
+            atomic_load_explicit(&job->done, memory_order_acquire)
+        ) break;
+        if (!park || coro_park(inst, job->event_fd, -1) == -1) {
+            if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+                // Can't wait on the eventfd; spin instead of losing the job
+                sched_yield();
+            }
+        }
+    }
+
+    errno = job->err;
+    return job->result;
+}
+
+static int fs_stat(struct httpsrvdev_inst* inst, char* path, struct stat* stat_buf) {
+    if (inst->fs_pool == NULL) return stat(path, stat_buf);
+
+    struct fs_job job = { .kind = FS_JOB_STAT, .path = path, .stat_buf = stat_buf };
+    return fs_job_submit_and_wait(inst, &job);
+}
+
+static int fs_scandir(struct httpsrvdev_inst* inst, char* path, struct dirent*** entries) {
+    if (inst->fs_pool == NULL) return scandir(path, entries, NULL, alphasort);
+
+    struct fs_job job = { .kind = FS_JOB_SCANDIR, .path = path, .entries = entries };
+    return fs_job_submit_and_wait(inst, &job);
+}
+
+static ssize_t fs_pread(struct httpsrvdev_inst* inst,
+    int fd, void* buf, size_t n, off_t offset
+) {
+    if (inst->fs_pool == NULL) return pread(fd, buf, n, offset);
+
+    // Fast path: page cache hits are served inline
+    struct iovec iov = { .iov_base = buf, .iov_len = n };
+    ssize_t n_read = preadv2(fd, &iov, 1, offset, RWF_NOWAIT);
+    if (n_read != -1 || (errno != EAGAIN && errno != EOPNOTSUPP)) return n_read;
+
+    struct fs_job job = {
+        .kind = FS_JOB_PREAD, .fd = fd, .buf = buf, .n = n, .offset = offset,
+    };
+    return fs_job_submit_and_wait(inst, &job);
+}
+
+// --------------------------------------------------------
+// HTTP/2
+// --------------------------------------------------------
+
+// Resources:
+//     HTTP/2 RFC 9113: https://datatracker.ietf.org/doc/html/rfc9113
+//     HPACK RFC 7541 : https://datatracker.ietf.org/doc/html/rfc7541
+
+// HTTP/2 connections stay in the epoll set between requests. Requests that
+// arrive on their streams are rebuilt as HTTP/1.1 text in `inst->conn->req_buf`,
+// parsed by `parse_req` and served one at a time like any other. Responses
+// are translated back as the `httpsrvdev_res_*` functions write them: the
+// head becomes a HEADERS frame and the body is queued on the stream -- files
+// as ranges of a file descriptor that are only read once their DATA frames
+// are due. Whenever a connection is writable its streams take turns to send
+// one DATA frame each, within the flow control windows, so that a large file
+// doesn't hold up the small ones requested alongside it.
+
+#define H2_PREFACE                "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN            24
+#define H2_FRAME_HEADER_LEN       9
+// Frames are sent at the default SETTINGS_MAX_FRAME_SIZE, which every peer
+// accepts, and we don't accept larger ones either
+#define H2_MAX_FRAME_SIZE         16384
+#define H2_INITIAL_WINDOW_SIZE    65535
+#define H2_MAX_WINDOW_SIZE        0x7fffffff
+#define H2_MAX_CONCURRENT_STREAMS 100
+// The default SETTINGS_HEADER_TABLE_SIZE, which we keep for decoding
+#define H2_HEADER_TABLE_SIZE      4096
+// Header blocks continued beyond this are refused
+#define H2_MAX_HEADER_BLOCK_SIZE  (64*1024)
+// DATA frames are only scheduled while less output than this is unsent
+#define H2_OUT_HIGH_WATER         (128*1024)
+
+#define H2_DATA          0x0
+#define H2_HEADERS       0x1
+#define H2_PRIORITY      0x2
+#define H2_RST_STREAM    0x3
+#define H2_SETTINGS      0x4
+#define H2_PUSH_PROMISE  0x5
+#define H2_PING          0x6
+#define H2_GOAWAY        0x7
+#define H2_WINDOW_UPDATE 0x8
+#define H2_CONTINUATION  0x9
+
+#define H2_FLAG_END_STREAM  0x1
+#define H2_FLAG_ACK         0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED      0x8
+#define H2_FLAG_PRIORITY    0x20
+
+#define H2_NO_ERROR           0x0
+#define H2_PROTOCOL_ERROR     0x1
+#define H2_INTERNAL_ERROR     0x2
+#define H2_FLOW_CONTROL_ERROR 0x3
+#define H2_FRAME_SIZE_ERROR   0x6
+#define H2_REFUSED_STREAM     0x7
+#define H2_COMPRESSION_ERROR  0x9
+#define H2_ENHANCE_YOUR_CALM  0xb
+
+#define H2_SETTINGS_ENABLE_PUSH            0x2
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE    0x4
+#define H2_SETTINGS_MAX_FRAME_SIZE         0x5
+
+// States of the decoder that strips the chunked transfer coding, which
+// HTTP/2 doesn't have, from response bodies
+#define H2_CHUNK_NONE     0
+#define H2_CHUNK_SIZE     1
+#define H2_CHUNK_EXT      2
+#define H2_CHUNK_DATA     3
+#define H2_CHUNK_DATA_END 4
+#define H2_CHUNK_TRAILER  5
+
+struct h2_buf {
+    char*  data;
+    size_t len;
+    size_t cap;
+};
+
+static bool h2_buf_reserve(struct h2_buf* buf, size_t n) {
+    if (buf->len + n <= buf->cap) return true;
+    size_t new_cap = buf->cap == 0 ? 1024 : buf->cap;
+    while (new_cap < buf->len + n) new_cap *= 2;
+    char* new_data = realloc(buf->data, new_cap);
+    if (new_data == NULL) return false;
+    buf->data = new_data;
+    buf->cap  = new_cap;
+    return true;
+}
+
+static bool h2_buf_append(struct h2_buf* buf, void* data, size_t n) {
+    if (n == 0) return true;
+    if (!h2_buf_reserve(buf, n)) return false;
+    memcpy(buf->data + buf->len, data, n);
+    buf->len += n;
+    return true;
+}
+
+static uint32_t h2_read_u32(uint8_t* ptr) {
+    return (uint32_t) ptr[0] << 24 | (uint32_t) ptr[1] << 16 | (uint32_t) ptr[2] << 8 | ptr[3];
+}
+
+static void h2_write_u32(uint8_t* ptr, uint32_t value) {
+    ptr[0] = value >> 24;
+    ptr[1] = value >> 16;
+    ptr[2] = value >> 8;
+    ptr[3] = value;
+}
+
+static bool h2_str_eq(char* str, size_t len, char* lit) {
+    return strlen(lit) == len && memcmp(str, lit, len) == 0;
+}
+
+// --------------------------------------------------------
+// HPACK
+
+struct hpack_field {
+    char* name;
+    char* value;
+};
+
+#define HPACK_STATIC_TABLE_LEN 61
+
+// Index 0 is unused
+static struct hpack_field hpack_static_table[HPACK_STATIC_TABLE_LEN + 1] = {
+    {NULL, NULL},
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+// The Huffman code of each octet, followed by EOS, right-aligned
+static const uint32_t hpack_huffman_codes[257] = {
+    0x00001ff8, 0x007fffd8, 0x0fffffe2, 0x0fffffe3, 0x0fffffe4, 0x0fffffe5, 0x0fffffe6, 0x0fffffe7,
+    0x0fffffe8, 0x00ffffea, 0x3ffffffc, 0x0fffffe9, 0x0fffffea, 0x3ffffffd, 0x0fffffeb, 0x0fffffec,
+    0x0fffffed, 0x0fffffee, 0x0fffffef, 0x0ffffff0, 0x0ffffff1, 0x0ffffff2, 0x3ffffffe, 0x0ffffff3,
+    0x0ffffff4, 0x0ffffff5, 0x0ffffff6, 0x0ffffff7, 0x0ffffff8, 0x0ffffff9, 0x0ffffffa, 0x0ffffffb,
+    0x00000014, 0x000003f8, 0x000003f9, 0x00000ffa, 0x00001ff9, 0x00000015, 0x000000f8, 0x000007fa,
+    0x000003fa, 0x000003fb, 0x000000f9, 0x000007fb, 0x000000fa, 0x00000016, 0x00000017, 0x00000018,
+    0x00000000, 0x00000001, 0x00000002, 0x00000019, 0x0000001a, 0x0000001b, 0x0000001c, 0x0000001d,
+    0x0000001e, 0x0000001f, 0x0000005c, 0x000000fb, 0x00007ffc, 0x00000020, 0x00000ffb, 0x000003fc,
+    0x00001ffa, 0x00000021, 0x0000005d, 0x0000005e, 0x0000005f, 0x00000060, 0x00000061, 0x00000062,
+    0x00000063, 0x00000064, 0x00000065, 0x00000066, 0x00000067, 0x00000068, 0x00000069, 0x0000006a,
+    0x0000006b, 0x0000006c, 0x0000006d, 0x0000006e, 0x0000006f, 0x00000070, 0x00000071, 0x00000072,
+    0x000000fc, 0x00000073, 0x000000fd, 0x00001ffb, 0x0007fff0, 0x00001ffc, 0x00003ffc, 0x00000022,
+    0x00007ffd, 0x00000003, 0x00000023, 0x00000004, 0x00000024, 0x00000005, 0x00000025, 0x00000026,
+    0x00000027, 0x00000006, 0x00000074, 0x00000075, 0x00000028, 0x00000029, 0x0000002a, 0x00000007,
+    0x0000002b, 0x00000076, 0x0000002c, 0x00000008, 0x00000009, 0x0000002d, 0x00000077, 0x00000078,
+    0x00000079, 0x0000007a, 0x0000007b, 0x00007ffe, 0x000007fc, 0x00003ffd, 0x00001ffd, 0x0ffffffc,
+    0x000fffe6, 0x003fffd2, 0x000fffe7, 0x000fffe8, 0x003fffd3, 0x003fffd4, 0x003fffd5, 0x007fffd9,
+    0x003fffd6, 0x007fffda, 0x007fffdb, 0x007fffdc, 0x007fffdd, 0x007fffde, 0x00ffffeb, 0x007fffdf,
+    0x00ffffec, 0x00ffffed, 0x003fffd7, 0x007fffe0, 0x00ffffee, 0x007fffe1, 0x007fffe2, 0x007fffe3,
+    0x007fffe4, 0x001fffdc, 0x003fffd8, 0x007fffe5, 0x003fffd9, 0x007fffe6, 0x007fffe7, 0x00ffffef,
+    0x003fffda, 0x001fffdd, 0x000fffe9, 0x003fffdb, 0x003fffdc, 0x007fffe8, 0x007fffe9, 0x001fffde,
+    0x007fffea, 0x003fffdd, 0x003fffde, 0x00fffff0, 0x001fffdf, 0x003fffdf, 0x007fffeb, 0x007fffec,
+    0x001fffe0, 0x001fffe1, 0x003fffe0, 0x001fffe2, 0x007fffed, 0x003fffe1, 0x007fffee, 0x007fffef,
+    0x000fffea, 0x003fffe2, 0x003fffe3, 0x003fffe4, 0x007ffff0, 0x003fffe5, 0x003fffe6, 0x007ffff1,
+    0x03ffffe0, 0x03ffffe1, 0x000fffeb, 0x0007fff1, 0x003fffe7, 0x007ffff2, 0x003fffe8, 0x01ffffec,
+    0x03ffffe2, 0x03ffffe3, 0x03ffffe4, 0x07ffffde, 0x07ffffdf, 0x03ffffe5, 0x00fffff1, 0x01ffffed,
+    0x0007fff2, 0x001fffe3, 0x03ffffe6, 0x07ffffe0, 0x07ffffe1, 0x03ffffe7, 0x07ffffe2, 0x00fffff2,
+    0x001fffe4, 0x001fffe5, 0x03ffffe8, 0x03ffffe9, 0x0ffffffd, 0x07ffffe3, 0x07ffffe4, 0x07ffffe5,
+    0x000fffec, 0x00fffff3, 0x000fffed, 0x001fffe6, 0x003fffe9, 0x001fffe7, 0x001fffe8, 0x007ffff3,
+    0x003fffea, 0x003fffeb, 0x01ffffee, 0x01ffffef, 0x00fffff4, 0x00fffff5, 0x03ffffea, 0x007ffff4,
+    0x03ffffeb, 0x07ffffe6, 0x03ffffec, 0x03ffffed, 0x07ffffe7, 0x07ffffe8, 0x07ffffe9, 0x07ffffea,
+    0x07ffffeb, 0x0ffffffe, 0x07ffffec, 0x07ffffed, 0x07ffffee, 0x07ffffef, 0x07fffff0, 0x03ffffee,
+    0x3fffffff,
+};
+
+// ...and its length in bits
+static const uint8_t hpack_huffman_code_lens[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+     6, 10, 10, 12, 13,  6,  8, 11, 10, 10,  8, 11,  8,  6,  6,  6,
+     5,  5,  5,  6,  6,  6,  6,  6,  6,  6,  7,  8, 15,  6, 12, 10,
+    13,  6,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,
+     7,  7,  7,  7,  7,  7,  7,  7,  8,  7,  8, 13, 19, 13, 14,  6,
+    15,  5,  6,  5,  6,  5,  6,  6,  6,  5,  7,  7,  6,  6,  6,  5,
+     6,  7,  6,  5,  5,  6,  7,  7,  7,  7,  7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+// Decoding tree, built from the codes on first use. Children >= 0 are nodes
+// and children < 0 symbols, stored as -1 - symbol. The code is complete, so
+// every node has both children.
+static int16_t hpack_huffman_tree[256][2];
+static bool    hpack_huffman_tree_built;
+
+static void hpack_huffman_tree_build(void) {
+    int nodes_count = 1;
+    for (int sym = 0; sym < 257; ++sym) {
+        uint32_t code = hpack_huffman_codes[sym];
+        int      node = 0;
+        for (int bit_i = hpack_huffman_code_lens[sym] - 1; bit_i > 0; --bit_i) {
+            int bit = (code >> bit_i) & 1;
+            if (hpack_huffman_tree[node][bit] == 0) {
+                hpack_huffman_tree[node][bit] = nodes_count++;
+            }
+            node = hpack_huffman_tree[node][bit];
+        }
+        hpack_huffman_tree[node][code & 1] = -1 - sym;
+    }
+    hpack_huffman_tree_built = true;
+}
+
+// Decode the Huffman coded `in` to `out`, which must have space for
+// `in_len*8/5` bytes -- the shortest code is 5 bits long
+static bool hpack_huffman_decode(uint8_t* in, size_t in_len, char* out, size_t* out_len) {
+    if (!hpack_huffman_tree_built) hpack_huffman_tree_build();
+
+    size_t n        = 0;
+    int    node     = 0;
+    int    depth    = 0;     // Bits since the last symbol...
+    bool   all_ones = true;  // ...which may only be padding: a prefix of EOS
+    for (size_t i = 0; i < in_len; ++i) {
+        for (int bit_i = 7; bit_i >= 0; --bit_i) {
+            int bit   = (in[i] >> bit_i) & 1;
+            int child = hpack_huffman_tree[node][bit];
+            ++depth;
+            all_ones = all_ones && bit;
+            if (child >= 0) {
+                node = child;
+                continue;
+            }
+            int sym = -1 - child;
+            if (sym == 256) return false;
+            out[n++] = sym;
+            node     = 0;
+            depth    = 0;
+            all_ones = true;
+        }
+    }
+    if (depth > 7 || !all_ones) return false;
+
+    *out_len = n;
+    return true;
+}
+
+// Dynamic table entry: the name followed by the value
+struct hpack_entry {
+    size_t name_len;
+    size_t value_len;
+    char   data[];
+};
+
+struct hpack_table {
+    struct hpack_entry** entries;  // Ring buffer, newest at `first`
+    size_t first;
+    size_t count;
+    size_t cap;
+    size_t size;      // Lengths of the names and values + 32 per entry
+    size_t max_size;
+};
+
+static size_t hpack_entry_size(struct hpack_entry* entry) {
+    return entry->name_len + entry->value_len + 32;
+}
+
+static void hpack_table_evict(struct hpack_table* table, size_t max_size) {
+    while (table->size > max_size) {
+        size_t last = (table->first + table->count - 1) % table->cap;
+        table->size -= hpack_entry_size(table->entries[last]);
+        free(table->entries[last]);
+        --table->count;
+    }
+}
+
+static bool hpack_table_add(struct hpack_table* table,
+    char* name, size_t name_len, char* value, size_t value_len
+) {
+    // Copied before evicting, which may free what `name` points to
+    struct hpack_entry* entry = malloc(sizeof(*entry) + name_len + value_len);
+    if (entry == NULL) return false;
+    entry->name_len  = name_len;
+    entry->value_len = value_len;
+    memcpy(entry->data, name, name_len);
+    memcpy(entry->data + name_len, value, value_len);
+
+    // An entry larger than the table empties it and isn't added
+    size_t entry_size = hpack_entry_size(entry);
+    if (entry_size > table->max_size) {
+        hpack_table_evict(table, 0);
+        free(entry);
+        return true;
+    }
+    hpack_table_evict(table, table->max_size - entry_size);
+
+    if (table->count == table->cap) {
+        size_t new_cap = table->cap == 0 ? 16 : 2*table->cap;
+        struct hpack_entry** new_entries = malloc(new_cap*sizeof(new_entries[0]));
+        if (new_entries == NULL) {
+            free(entry);
+            return false;
+        }
+        for (size_t i = 0; i < table->count; ++i) {
+            new_entries[i] = table->entries[(table->first + i) % table->cap];
+        }
+        free(table->entries);
+        table->entries = new_entries;
+        table->first   = 0;
+        table->cap     = new_cap;
+    }
+    table->first = (table->first + table->cap - 1) % table->cap;
+    table->entries[table->first] = entry;
+    ++table->count;
+    table->size += entry_size;
+    return true;
+}
+
+static void hpack_table_free(struct hpack_table* table) {
+    hpack_table_evict(table, 0);
+    free(table->entries);
+}
+
+// Look up `index` in the static table, followed by the dynamic table
+static bool hpack_table_get(struct hpack_table* table, uint64_t index,
+    char** name, size_t* name_len, char** value, size_t* value_len
+) {
+    if (index == 0) return false;
+    if (index <= HPACK_STATIC_TABLE_LEN) {
+        *name      = hpack_static_table[index].name;
+        *name_len  = strlen(*name);
+        *value     = hpack_static_table[index].value;
+        *value_len = strlen(*value);
+        return true;
+    }
+    index -= HPACK_STATIC_TABLE_LEN + 1;
+    if (index >= table->count) return false;
+    struct hpack_entry* entry = table->entries[(table->first + index) % table->cap];
+    *name      = entry->data;
+    *name_len  = entry->name_len;
+    *value     = entry->data + entry->name_len;
+    *value_len = entry->value_len;
+    return true;
+}
+
+static bool hpack_decode_int(uint8_t** pos, uint8_t* end, int prefix_bits, uint64_t* value) {
+    if (*pos >= end) return false;
+    uint64_t max_prefix = (1 << prefix_bits) - 1;
+    *value = *(*pos)++ & max_prefix;
+    if (*value < max_prefix) return true;
+
+    // Anything beyond 2^28 or so can only be an attack
+    for (int shift = 0; shift <= 21; shift += 7) {
+        if (*pos >= end) return false;
+        uint8_t byte = *(*pos)++;
+        *value += (uint64_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+// Decode a string literal to the end of `scratch`, returning its offset there
+// rather than a pointer, which `scratch` growing would invalidate
+static bool hpack_decode_str(uint8_t** pos, uint8_t* end,
+    struct h2_buf* scratch, size_t* str_offset, size_t* str_len
+) {
+    if (*pos >= end) return false;
+    bool is_huffman = **pos & 0x80;
+    uint64_t len;
+    if (!hpack_decode_int(pos, end, 7, &len) || len > (uint64_t) (end - *pos)) return false;
+
+    if (!h2_buf_reserve(scratch, is_huffman ? len*8/5 : len)) return false;
+    *str_offset = scratch->len;
+    if (is_huffman) {
+        if (!hpack_huffman_decode(*pos, len, scratch->data + scratch->len, str_len))
+            return false;
+    } else {
+        memcpy(scratch->data + scratch->len, *pos, len);
+        *str_len = len;
+    }
+    scratch->len += *str_len;
+    *pos += len;
+    return true;
+}
+
+static bool hpack_encode_int(struct h2_buf* buf, uint8_t first_byte, int prefix_bits,
+    uint64_t value
+) {
+    uint64_t max_prefix = (1 << prefix_bits) - 1;
+    uint8_t  bytes[16];
+    size_t   n = 0;
+    if (value < max_prefix) {
+        bytes[n++] = first_byte | value;
+    } else {
+        bytes[n++] = first_byte | max_prefix;
+        for (value -= max_prefix; value >= 0x80; value >>= 7) {
+            bytes[n++] = 0x80 | (value & 0x7f);
+        }
+        bytes[n++] = value;
+    }
+    return h2_buf_append(buf, bytes, n);
+}
+
+// Encode a string literal without Huffman coding: our header values are short
+// and mostly not worth it
+static bool hpack_encode_str(struct h2_buf* buf, char* str, size_t len) {
+    return hpack_encode_int(buf, 0x00, 7, len) && h2_buf_append(buf, str, len);
+}
+
+// Encode a field as a literal without indexing, referring to the static
+// table for the name if it's there. The dynamic table isn't used: nearly all
+// the names are in the static table and values vary between responses.
+static bool hpack_encode_field(struct h2_buf* buf,
+    char* name, size_t name_len, char* value, size_t value_len
+) {
+    for (int i = 1; i <= HPACK_STATIC_TABLE_LEN; ++i) {
+        if (h2_str_eq(name, name_len, hpack_static_table[i].name)) {
+            return hpack_encode_int(buf, 0x00, 4, i) && hpack_encode_str(buf, value, value_len);
+        }
+    }
+    return hpack_encode_int(buf, 0x00, 4, 0) &&
+           hpack_encode_str(buf, name, name_len) &&
+           hpack_encode_str(buf, value, value_len);
+}
+
+// Encode the ":status" field with the three digit status code `value`
+static bool hpack_encode_status(struct h2_buf* buf, char* value) {
+    // Indices of ":status" with common values
+    for (int i = 8; i <= 14; ++i) {
+        if (memcmp(hpack_static_table[i].value, value, 3) == 0) {
+            return hpack_encode_int(buf, 0x80, 7, i);
+        }
+    }
+    return hpack_encode_int(buf, 0x00, 4, 8) && hpack_encode_str(buf, value, 3);
+}
+
+// --------------------------------------------------------
+// Connections and streams
+
+// A piece of a response body: bytes in `data` or a range of the file `fd`
+struct h2_segment {
+    struct h2_segment* next;
+    int    fd;      // -1 for bytes in `data`
+    off_t  offset;  // Of the next byte to send, in the file or in `data`
+    off_t  end;
+    char*  data;
+    size_t cap;
+};
+
+struct h2_conn;
+
+struct h2_stream {
+    uint32_t          id;
+    struct h2_conn*   conn;
+    int64_t           send_window;
+
+    // The request, decoded from the header block
+    struct h2_buf     req_method;
+    struct h2_buf     req_path;
+    struct h2_buf     req_authority;
+    struct h2_buf     req_headers;  // As HTTP/1.1 header lines
+    bool              req_malformed;
+    bool              req_ended;  // END_STREAM received
+    // Waiting to be served, in `httpsrvdev_h2.ready_first`
+    bool              is_ready;
+    struct h2_stream* next_ready;
+
+    // The response, as written by the `httpsrvdev_res_*` functions
+    struct h2_buf      res_head;            // HTTP/1.1 head until it is complete
+    bool               res_head_sent;
+    bool               res_body_discarded;  // For HEAD requests, 204 and 304
+    int64_t            res_body_remaining;  // Per Content-Length; -1 if unknown
+    int                res_chunk_state;
+    uint64_t           res_chunk_remaining;
+    struct h2_segment* res_body_first;
+    struct h2_segment* res_body_last;
+    bool               res_ended;
+};
+
+struct h2_conn {
+    int                    fd;
+    struct httpsrvdev_addr addr;
+    struct timer           idle_timer;
+
+    // Received bytes, until they make up complete frames
+    char     in[H2_FRAME_HEADER_LEN + H2_MAX_FRAME_SIZE];
+    size_t   in_len;
+    bool     preface_received;
+    // Frames to send
+    struct h2_buf out;
+    size_t        out_sent;
+    bool          out_polled;  // Whether EPOLLOUT is waited for
+
+    int64_t  send_window;
+    int64_t  peer_initial_window_size;
+    uint32_t last_stream_id;        // Highest stream opened by the client
+    uint32_t last_served_stream_id; // Highest stream handed out by `res_begin`
+    bool     goaway_sent;
+    bool     goaway_received;
+
+    // Header block being continued with CONTINUATION frames
+    struct h2_buf      header_block;
+    uint32_t           header_block_stream_id;  // 0 if none
+    bool               header_block_end_stream;
+    struct hpack_table hpack_table;
+    struct h2_buf      hpack_scratch;
+
+    // Streams that are waiting to be served or sending their response
+    struct h2_stream* streams[H2_MAX_CONCURRENT_STREAMS];
+    size_t            streams_count;
+    size_t            sched_next;  // Index of the stream to send next
+};
+
+struct httpsrvdev_h2 {
+    struct h2_conn**  conns;
+    size_t            conns_count;
+    size_t            conns_cap;
+    // Streams waiting to be served, in order of arrival
+    struct h2_stream* ready_first;
+    struct h2_stream* ready_last;
+    // The stream being served, if any
+    struct h2_stream* stream;
+};
+
+static bool h2_has_ready_stream(struct httpsrvdev_inst* inst) {
+    return inst->h2 != NULL && inst->h2->ready_first != NULL;
+}
+
+static bool h2_stream_is_current(struct httpsrvdev_inst* inst) {
+    return inst->h2 != NULL && inst->h2->stream != NULL;
+}
+
+static size_t h2_conns_count(struct httpsrvdev_inst* inst) {
+    return inst->h2 == NULL ? 0 : inst->h2->conns_count;
+}
+
+static bool h2_out_frame(struct h2_conn* conn,
+    int type, int flags, uint32_t stream_id, void* payload, size_t len
+) {
+    uint8_t header[H2_FRAME_HEADER_LEN] = {
+        len >> 16, len >> 8, len, type, flags,
+        (stream_id >> 24) & 0x7f, stream_id >> 16, stream_id >> 8, stream_id,
+    };
+    return h2_buf_append(&conn->out, header, sizeof(header)) &&
+           h2_buf_append(&conn->out, payload, len);
+}
+
+static struct h2_stream* h2_conn_find_stream(struct h2_conn* conn, uint32_t stream_id) {
+    for (size_t i = 0; i < conn->streams_count; ++i) {
+        if (conn->streams[i]->id == stream_id) return conn->streams[i];
+    }
+    return NULL;
+}
+
+static void h2_segment_free(struct h2_segment* segment) {
+    if (segment->fd != -1) close(segment->fd);
+    free(segment->data);
+    free(segment);
+}
+
+static void h2_stream_free(struct httpsrvdev_inst* inst, struct h2_stream* stream) {
+    struct httpsrvdev_h2* h2   = inst->h2;
+    struct h2_conn*       conn = stream->conn;
+
+    if (stream->is_ready) {
+        struct h2_stream*  prev = NULL;
+        struct h2_stream** link = &h2->ready_first;
+        while (*link != stream) {
+            prev = *link;
+            link = &(*link)->next_ready;
+        }
+        *link = stream->next_ready;
+        if (h2->ready_last == stream) h2->ready_last = prev;
+    }
+    for (size_t i = 0; i < conn->streams_count; ++i) {
+        if (conn->streams[i] == stream) {
+            conn->streams[i] = conn->streams[--conn->streams_count];
+            break;
+        }
+    }
+
+    while (stream->res_body_first != NULL) {
+        struct h2_segment* next = stream->res_body_first->next;
+        h2_segment_free(stream->res_body_first);
+        stream->res_body_first = next;
+    }
+    free(stream->req_method.data);
+    free(stream->req_path.data);
+    free(stream->req_authority.data);
+    free(stream->req_headers.data);
+    free(stream->res_head.data);
+    free(stream);
+}
+
+static void h2_stream_reset(struct httpsrvdev_inst* inst,
+    struct h2_stream* stream, uint32_t error_code
+) {
+    uint8_t payload[4];
+    h2_write_u32(payload, error_code);
+    // If this fails for lack of memory, so will everything else on the
+    // connection
+    h2_out_frame(stream->conn, H2_RST_STREAM, 0, stream->id, payload, sizeof(payload));
+    h2_stream_free(inst, stream);
+}
+
+// Forget the stream once its response is sent in full. A client that is
+// still sending the request is asked to stop (RFC 9113, section 8.1), since
+// DATA on a forgotten stream no longer gets the stream's window credited.
+static void h2_stream_done(struct httpsrvdev_inst* inst, struct h2_stream* stream) {
+    if (stream->req_ended) {
+        h2_stream_free(inst, stream);
+    } else {
+        h2_stream_reset(inst, stream, H2_NO_ERROR);
+    }
+}
+
+static void h2_conn_free(struct httpsrvdev_inst* inst, struct h2_conn* conn) {
+    struct httpsrvdev_h2* h2 = inst->h2;
+
+    while (conn->streams_count > 0) {
+        h2_stream_free(inst, conn->streams[conn->streams_count - 1]);
+    }
+    if (inst->timers != NULL) timer_cancel(inst->timers, &conn->idle_timer);
+    // Closing the fd also removes it from the epoll set
+    close(conn->fd);
+    free(conn->out.data);
+    free(conn->header_block.data);
+    free(conn->hpack_scratch.data);
+    hpack_table_free(&conn->hpack_table);
+
+    for (size_t i = 0; i < h2->conns_count; ++i) {
+        if (h2->conns[i] == conn) {
+            h2->conns[i] = h2->conns[--h2->conns_count];
+            break;
+        }
+    }
+    free(conn);
+}
+
+static void h2_free(struct httpsrvdev_inst* inst) {
+    struct httpsrvdev_h2* h2 = inst->h2;
+    if (h2 == NULL) return;
+
+    while (h2->conns_count > 0) {
+        h2_conn_free(inst, h2->conns[h2->conns_count - 1]);
+    }
+    free(h2->conns);
+    free(h2);
+    inst->h2 = NULL;
+}
+
+// Tell the client that streams after the last one served won't be, and drop
+// those that were waiting. The connection is closed once the served ones are
+// done.
+static void h2_conn_goaway(struct httpsrvdev_inst* inst,
+    struct h2_conn* conn, uint32_t error_code
+) {
+    if (conn->goaway_sent) return;
+    conn->goaway_sent = true;
+
+    uint8_t payload[8];
+    h2_write_u32(payload, conn->last_served_stream_id);
+    h2_write_u32(payload + 4, error_code);
+    h2_out_frame(conn, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+
+    for (size_t i = conn->streams_count; i > 0; --i) {
+        if (conn->streams[i - 1]->is_ready) h2_stream_free(inst, conn->streams[i - 1]);
+    }
+}
+
+// Write as much of the pending output as the socket takes without blocking
+static bool h2_conn_write(struct h2_conn* conn) {
+    while (conn->out_sent < conn->out.len) {
+        ssize_t n_sent = send(conn->fd, conn->out.data + conn->out_sent,
+                              conn->out.len - conn->out_sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n_sent == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return false;
+        }
+        conn->out_sent += n_sent;
+    }
+    if (conn->out_sent == conn->out.len) {
+        conn->out.len  = 0;
+        conn->out_sent = 0;
+    } else if (conn->out_sent >= conn->out.len/2) {
+        memmove(conn->out.data, conn->out.data + conn->out_sent, conn->out.len - conn->out_sent);
+        conn->out.len -= conn->out_sent;
+        conn->out_sent = 0;
+    }
+    return true;
+}
+
+// Queue the next DATA frame of `stream`. Returns 1 if one was queued, 2 if
+// the stream is done -- and freed -- 0 if the stream has nothing to send or
+// no window to send it in, and -1 on errors.
+static int h2_stream_send_data(struct httpsrvdev_inst* inst, struct h2_stream* stream) {
+    struct h2_conn* conn = stream->conn;
+    if (!stream->res_head_sent) return 0;
+
+    struct h2_segment* segment = stream->res_body_first;
+    if (segment == NULL) {
+        if (!stream->res_ended) return 0;
+        if (!h2_out_frame(conn, H2_DATA, H2_FLAG_END_STREAM, stream->id, NULL, 0)) return -1;
+        h2_stream_done(inst, stream);
+        return 2;
+    }
+
+    int64_t len = segment->end - segment->offset;
+    if (len > H2_MAX_FRAME_SIZE)   len = H2_MAX_FRAME_SIZE;
+    if (len > conn->send_window)   len = conn->send_window;
+    if (len > stream->send_window) len = stream->send_window;
+    if (len <= 0) return 0;
+
+    // Read straight into the output, after the frame header
+    size_t header_pos = conn->out.len;
+    if (!h2_buf_reserve(&conn->out, H2_FRAME_HEADER_LEN + len)) return -1;
+    char* payload = conn->out.data + header_pos + H2_FRAME_HEADER_LEN;
+    if (segment->fd == -1) {
+        memcpy(payload, segment->data + segment->offset, len);
+    } else {
+        ssize_t n_read = fs_pread(inst, segment->fd, payload, len, segment->offset);
+        if (n_read <= 0) {
+            // The file shrank or can't be read; the response can't be completed
+            h2_stream_reset(inst, stream, H2_INTERNAL_ERROR);
+            return 2;
+        }
+        len = n_read;
+    }
+    segment->offset += len;
+    if (segment->offset == segment->end) {
+        stream->res_body_first = segment->next;
+        if (stream->res_body_first == NULL) stream->res_body_last = NULL;
+        h2_segment_free(segment);
+    }
+    conn->send_window   -= len;
+    stream->send_window -= len;
+
+    bool is_last = stream->res_body_first == NULL && stream->res_ended;
+    // Has the capacity reserved above, so it can't fail
+    h2_out_frame(conn, H2_DATA, is_last ? H2_FLAG_END_STREAM : 0, stream->id, NULL, 0);
+    conn->out.data[header_pos + 2] = len;
+    conn->out.data[header_pos + 1] = len >> 8;
+    conn->out.len += len;
+
+    if (is_last) {
+        h2_stream_done(inst, stream);
+        return 2;
+    }
+    return 1;
+}
+
+// Queue DATA frames, one per stream in turn, until enough output is pending.
+// Returns 1 if stopped for that, 0 if no stream can send and -1 on errors.
+static int h2_conn_schedule(struct httpsrvdev_inst* inst, struct h2_conn* conn) {
+    while (true) {
+        bool sent_any = false;
+        for (size_t n = conn->streams_count; n > 0 && conn->streams_count > 0; --n) {
+            if (conn->out.len - conn->out_sent >= H2_OUT_HIGH_WATER) return 1;
+            if (conn->sched_next >= conn->streams_count) conn->sched_next = 0;
+
+            int result = h2_stream_send_data(inst, conn->streams[conn->sched_next++]);
+            if (result == -1) return -1;
+            // The last stream has taken the place of the one that's done
+            if (result == 2) --conn->sched_next;
+            if (result != 0) sent_any = true;
+        }
+        if (!sent_any) return 0;
+    }
+}
+
+// Send what can be sent without blocking. Returns false if the connection
+// was closed.
+static bool h2_conn_flush(struct httpsrvdev_inst* inst, struct h2_conn* conn) {
+    while (true) {
+        int scheduled = h2_conn_schedule(inst, conn);
+        if (scheduled == -1)      goto close;
+        if (!h2_conn_write(conn)) goto close;
+        // Stop once the socket is full or there is nothing more to send
+        if (conn->out_sent < conn->out.len || scheduled == 0) break;
+    }
+
+    bool want_out = conn->out_sent < conn->out.len;
+    if (want_out != conn->out_polled) {
+        struct epoll_event event = {
+            .events = EPOLLIN | (want_out ? EPOLLOUT : 0),
+            .data   = { .fd = conn->fd },
+        };
+        if (epoll_ctl(inst->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) == -1) goto close;
+        conn->out_polled = want_out;
+    }
+    if ((conn->goaway_sent || conn->goaway_received) &&
+        conn->streams_count == 0 && !want_out
+    ) goto close;
+
+    return true;
+
+close:
+    h2_conn_free(inst, conn);
+    return false;
+}
+
+static void h2_flush_all(struct httpsrvdev_inst* inst) {
+    // Backwards, since closed connections are replaced by the last one
+    for (size_t i = inst->h2->conns_count; i > 0; --i) {
+        h2_conn_flush(inst, inst->h2->conns[i - 1]);
+    }
+}
+
+// Ask the clients of all connections to go away, e.g. before a hot restart.
+// The connections close once their streams are done.
+static void h2_goaway_all(struct httpsrvdev_inst* inst) {
+    if (inst->h2 == NULL) return;
+    for (size_t i = inst->h2->conns_count; i > 0; --i) {
+        h2_conn_goaway(inst, inst->h2->conns[i - 1], H2_NO_ERROR);
+    }
+    h2_flush_all(inst);
+}
+
+static void h2_conn_on_idle_timeout(struct httpsrvdev_inst* inst, struct timer* timer) {
+    struct h2_conn* conn =
+        (struct h2_conn*) ((char*) timer - offsetof(struct h2_conn, idle_timer));
+    // Only connections without streams are idle
+    if (conn->streams_count > 0) {
+        timer_arm(inst->timers, timer, inst->conn_idle_timeout_ms);
+        return;
+    }
+    h2_conn_goaway(inst, conn, H2_NO_ERROR);
+    h2_conn_flush(inst, conn);
+}
+
+static void h2_stream_add_field(struct h2_stream* stream,
+    char* name, size_t name_len, char* value, size_t value_len
+) {
+    if (stream == NULL || stream->req_malformed) return;
+
+    // Nothing may break the HTTP/1.1 text the request is rebuilt as
+    if (name_len == 0 ||
+        memchr(name, '\r', name_len) != NULL || memchr(value, '\r', value_len) != NULL ||
+        memchr(name, '\n', name_len) != NULL || memchr(value, '\n', value_len) != NULL ||
+        memchr(name, '\0', name_len) != NULL || memchr(value, '\0', value_len) != NULL ||
+        memchr(name + 1, ':', name_len - 1) != NULL
+    ) goto malformed;
+
+    if (name[0] == ':') {
+        // Pseudo-header fields come first
+        if (stream->req_headers.len > 0) goto malformed;
+        struct h2_buf* buf;
+        if (h2_str_eq(name, name_len, ":method")) {
+            buf = &stream->req_method;
+        } else if (h2_str_eq(name, name_len, ":path")) {
+            buf = &stream->req_path;
+        } else if (h2_str_eq(name, name_len, ":authority")) {
+            buf = &stream->req_authority;
+        } else if (h2_str_eq(name, name_len, ":scheme")) {
+            return;
+        } else {
+            goto malformed;
+        }
+        if (buf->len > 0 || !h2_buf_append(buf, value, value_len)) goto malformed;
+        return;
+    }
+
+    if (!h2_buf_append(&stream->req_headers, name, name_len) ||
+        !h2_buf_append(&stream->req_headers, ": ", 2) ||
+        !h2_buf_append(&stream->req_headers, value, value_len) ||
+        !h2_buf_append(&stream->req_headers, "\r\n", 2)
+    ) goto malformed;
+    return;
+
+malformed:
+    stream->req_malformed = true;
+}
+
+// Decode the header block `block`, adding the fields to `stream` if it isn't
+// NULL. Blocks that aren't wanted are decoded too, to keep the dynamic table
+// in sync with the client's.
+static bool h2_conn_decode_header_block(struct h2_conn* conn,
+    uint8_t* block, size_t len, struct h2_stream* stream
+) {
+    struct hpack_table* table   = &conn->hpack_table;
+    struct h2_buf*      scratch = &conn->hpack_scratch;
+
+    uint8_t* pos = block;
+    uint8_t* end = block + len;
+    while (pos < end) {
+        scratch->len = 0;
+        uint8_t byte = *pos;
+        char*   name;
+        char*   value;
+        size_t  name_len;
+        size_t  value_len;
+        if (byte & 0x80) {
+            // Indexed field
+            uint64_t index;
+            if (!hpack_decode_int(&pos, end, 7, &index) ||
+                !hpack_table_get(table, index, &name, &name_len, &value, &value_len)
+            ) return false;
+            h2_stream_add_field(stream, name, name_len, value, value_len);
+        } else if ((byte & 0xe0) == 0x20) {
+            // Dynamic table size update
+            uint64_t max_size;
+            if (!hpack_decode_int(&pos, end, 5, &max_size) || max_size > H2_HEADER_TABLE_SIZE)
+                return false;
+            table->max_size = max_size;
+            hpack_table_evict(table, max_size);
+        } else {
+            // Literal field, with incremental indexing or not
+            bool     is_indexed = (byte & 0xc0) == 0x40;
+            uint64_t index;
+            size_t   name_offset;
+            size_t   value_offset;
+            if (!hpack_decode_int(&pos, end, is_indexed ? 6 : 4, &index)) return false;
+            if (index == 0) {
+                if (!hpack_decode_str(&pos, end, scratch, &name_offset, &name_len)) return false;
+            } else {
+                char*  unused_value;
+                size_t unused_value_len;
+                if (!hpack_table_get(table, index, &name, &name_len,
+                                     &unused_value, &unused_value_len)
+                ) return false;
+            }
+            if (!hpack_decode_str(&pos, end, scratch, &value_offset, &value_len)) return false;
+            if (index == 0) name = scratch->data + name_offset;
+            value = scratch->data + value_offset;
+
+            h2_stream_add_field(stream, name, name_len, value, value_len);
+            if (is_indexed && !hpack_table_add(table, name, name_len, value, value_len))
+                return false;
+        }
+    }
+    return true;
+}
+
+// Open the stream that the complete header block `block` starts, and queue
+// it to be served
+static bool h2_conn_on_header_block(struct httpsrvdev_inst* inst, struct h2_conn* conn,
+    uint32_t stream_id, bool end_stream, uint8_t* block, size_t len
+) {
+    struct httpsrvdev_h2* h2 = inst->h2;
+
+    // Otherwise these are trailers, of a request body that's ignored anyway
+    bool is_new = stream_id > conn->last_stream_id;
+    struct h2_stream* stream = NULL;
+    if (!is_new && end_stream) {
+        struct h2_stream* ended = h2_conn_find_stream(conn, stream_id);
+        if (ended != NULL) ended->req_ended = true;
+    }
+    if (is_new) {
+        conn->last_stream_id = stream_id;
+        if (!conn->goaway_sent && conn->streams_count < H2_MAX_CONCURRENT_STREAMS) {
+            stream = calloc(1, sizeof(*stream));
+            if (stream == NULL) {
+                h2_conn_goaway(inst, conn, H2_INTERNAL_ERROR);
+                return false;
+            }
+            stream->id                 = stream_id;
+            stream->conn               = conn;
+            stream->send_window        = conn->peer_initial_window_size;
+            stream->req_ended          = end_stream;
+            stream->res_body_remaining = -1;
+            conn->streams[conn->streams_count++] = stream;
+        }
+    }
+
+    if (!h2_conn_decode_header_block(conn, block, len, stream)) {
+        h2_conn_goaway(inst, conn, H2_COMPRESSION_ERROR);
+        return false;
+    }
+    if (!is_new || conn->goaway_sent) return true;
+
+    if (stream == NULL) {
+        uint8_t payload[4];
+        h2_write_u32(payload, H2_REFUSED_STREAM);
+        return h2_out_frame(conn, H2_RST_STREAM, 0, stream_id, payload, sizeof(payload));
+    }
+    if (stream->req_malformed || stream->req_method.len == 0 || stream->req_path.len == 0) {
+        h2_stream_reset(inst, stream, H2_PROTOCOL_ERROR);
+        return true;
+    }
+
+    stream->is_ready = true;
+    if (h2->ready_last != NULL) {
+        h2->ready_last->next_ready = stream;
+    } else {
+        h2->ready_first = stream;
+    }
+    h2->ready_last = stream;
+    return true;
+}
+
+static bool h2_conn_apply_settings(struct h2_conn* conn,
+    uint8_t* payload, size_t len, uint32_t* error_code
+) {
+    for (size_t i = 0; i + 6 <= len; i += 6) {
+        int      id    = payload[i] << 8 | payload[i + 1];
+        uint32_t value = h2_read_u32(payload + i + 2);
+        switch (id) {
+            case H2_SETTINGS_ENABLE_PUSH:
+                if (value > 1) {
+                    *error_code = H2_PROTOCOL_ERROR;
+                    return false;
+                }
+                break;
+            case H2_SETTINGS_INITIAL_WINDOW_SIZE: {
+                if (value > H2_MAX_WINDOW_SIZE) {
+                    *error_code = H2_FLOW_CONTROL_ERROR;
+                    return false;
+                }
+                // Applies to the windows of open streams too
+                int64_t delta = (int64_t) value - conn->peer_initial_window_size;
+                for (size_t j = 0; j < conn->streams_count; ++j) {
+                    conn->streams[j]->send_window += delta;
+                    if (conn->streams[j]->send_window > H2_MAX_WINDOW_SIZE) {
+                        *error_code = H2_FLOW_CONTROL_ERROR;
+                        return false;
+                    }
+                }
+                conn->peer_initial_window_size = value;
+                break;
+            }
+            case H2_SETTINGS_MAX_FRAME_SIZE:
+                // We stick to the minimum either way
+                if (value < 16384 || value > 16777215) {
+                    *error_code = H2_PROTOCOL_ERROR;
+                    return false;
+                }
+                break;
+            default:
+                // The encoder doesn't use the dynamic table, so the size the
+                // client allows for it doesn't matter. Unknown settings are
+                // ignored.
+                break;
+        }
+    }
+    return true;
+}
+
+// Returns false on connection errors, after queuing GOAWAY
+static bool h2_conn_on_frame(struct httpsrvdev_inst* inst, struct h2_conn* conn,
+    int type, int flags, uint32_t stream_id, uint8_t* payload, size_t len
+) {
+    uint32_t error_code = H2_PROTOCOL_ERROR;
+
+    // A header block must be continued right away
+    if (conn->header_block_stream_id != 0 &&
+        (type != H2_CONTINUATION || stream_id != conn->header_block_stream_id)
+    ) goto conn_err;
+
+    switch (type) {
+        case H2_DATA: {
+            if (stream_id == 0) goto conn_err;
+            struct h2_stream* stream = h2_conn_find_stream(conn, stream_id);
+            if (stream != NULL && (flags & H2_FLAG_END_STREAM)) stream->req_ended = true;
+            // Request bodies aren't used; give the window back right away
+            if (len == 0) return true;
+            uint8_t increment[4];
+            h2_write_u32(increment, len);
+            if (!h2_out_frame(conn, H2_WINDOW_UPDATE, 0, 0, increment, sizeof(increment)))
+                goto internal_err;
+            if (stream != NULL && !stream->req_ended &&
+                !h2_out_frame(conn, H2_WINDOW_UPDATE, 0, stream_id, increment, sizeof(increment))
+            ) goto internal_err;
+            return true;
+        }
+        case H2_HEADERS: {
+            if (stream_id == 0 || stream_id % 2 == 0) goto conn_err;
+            size_t pos = 0;
+            size_t end = len;
+            if (flags & H2_FLAG_PADDED) {
+                if (len < 1 || payload[0] >= len) goto conn_err;
+                pos = 1;
+                end = len - payload[0];
+            }
+            if (flags & H2_FLAG_PRIORITY) pos += 5;
+            if (pos > end) goto conn_err;
+
+            bool end_stream = flags & H2_FLAG_END_STREAM;
+            if (flags & H2_FLAG_END_HEADERS) {
+                return h2_conn_on_header_block(inst, conn, stream_id, end_stream,
+                                               payload + pos, end - pos);
+            }
+            conn->header_block.len = 0;
+            if (!h2_buf_append(&conn->header_block, payload + pos, end - pos)) goto internal_err;
+            conn->header_block_stream_id  = stream_id;
+            conn->header_block_end_stream = end_stream;
+            return true;
+        }
+        case H2_CONTINUATION: {
+            if (conn->header_block_stream_id == 0) goto conn_err;
+            if (conn->header_block.len + len > H2_MAX_HEADER_BLOCK_SIZE) {
+                error_code = H2_ENHANCE_YOUR_CALM;
+                goto conn_err;
+            }
+            if (!h2_buf_append(&conn->header_block, payload, len)) goto internal_err;
+            if (!(flags & H2_FLAG_END_HEADERS)) return true;
+            conn->header_block_stream_id = 0;
+            return h2_conn_on_header_block(inst, conn, stream_id, conn->header_block_end_stream,
+                (uint8_t*) conn->header_block.data, conn->header_block.len);
+        }
+        case H2_PRIORITY:
+            // Streams are served in order of arrival regardless
+            if (len != 5) goto frame_size_err;
+            return true;
+        case H2_RST_STREAM: {
+            if (stream_id == 0) goto conn_err;
+            if (len != 4)       goto frame_size_err;
+            struct h2_stream* stream = h2_conn_find_stream(conn, stream_id);
+            // The stream being served is left alone until it ends
+            if (stream != NULL && stream != inst->h2->stream) h2_stream_free(inst, stream);
+            return true;
+        }
+        case H2_SETTINGS:
+            if (stream_id != 0) goto conn_err;
+            if (flags & H2_FLAG_ACK) {
+                if (len != 0) goto frame_size_err;
+                return true;
+            }
+            if (len % 6 != 0) goto frame_size_err;
+            if (!h2_conn_apply_settings(conn, payload, len, &error_code)) goto conn_err;
+            if (!h2_out_frame(conn, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0)) goto internal_err;
+            return true;
+        case H2_PUSH_PROMISE:
+            // Only servers push
+            goto conn_err;
+        case H2_PING:
+            if (stream_id != 0) goto conn_err;
+            if (len != 8)       goto frame_size_err;
+            if (flags & H2_FLAG_ACK) return true;
+            if (!h2_out_frame(conn, H2_PING, H2_FLAG_ACK, 0, payload, len)) goto internal_err;
+            return true;
+        case H2_GOAWAY:
+            if (stream_id != 0) goto conn_err;
+            // The streams that are open are still served
+            conn->goaway_received = true;
+            return true;
+        case H2_WINDOW_UPDATE: {
+            if (len != 4) goto frame_size_err;
+            uint32_t increment = h2_read_u32(payload) & 0x7fffffff;
+            if (increment == 0) goto conn_err;
+            if (stream_id == 0) {
+                conn->send_window += increment;
+                if (conn->send_window > H2_MAX_WINDOW_SIZE) {
+                    error_code = H2_FLOW_CONTROL_ERROR;
+                    goto conn_err;
+                }
+                return true;
+            }
+            struct h2_stream* stream = h2_conn_find_stream(conn, stream_id);
+            if (stream == NULL) return true;
+            stream->send_window += increment;
+            if (stream->send_window > H2_MAX_WINDOW_SIZE && stream != inst->h2->stream) {
+                h2_stream_reset(inst, stream, H2_FLOW_CONTROL_ERROR);
+            }
+            return true;
+        }
+        default:
+            // Unknown frame types are ignored
+            return true;
+    }
+
+frame_size_err:
+    error_code = H2_FRAME_SIZE_ERROR;
+    goto conn_err;
+internal_err:
+    error_code = H2_INTERNAL_ERROR;
+conn_err:
+    h2_conn_goaway(inst, conn, error_code);
+    return false;
+}
+
+// Handle the complete frames received so far. Returns false if the
+// connection was closed.
+static bool h2_conn_on_input(struct httpsrvdev_inst* inst, struct h2_conn* conn) {
+    size_t pos = 0;
+    if (!conn->preface_received) {
+        size_t n = conn->in_len < H2_PREFACE_LEN ? conn->in_len : H2_PREFACE_LEN;
+        if (memcmp(conn->in, H2_PREFACE, n) != 0) {
+            h2_conn_goaway(inst, conn, H2_PROTOCOL_ERROR);
+            goto close;
+        }
+        if (n < H2_PREFACE_LEN) return true;
+        conn->preface_received = true;
+        pos = H2_PREFACE_LEN;
+    }
+
+    while (conn->in_len - pos >= H2_FRAME_HEADER_LEN) {
+        uint8_t* header = (uint8_t*) conn->in + pos;
+        size_t   len    = header[0] << 16 | header[1] << 8 | header[2];
+        if (len > H2_MAX_FRAME_SIZE) {
+            h2_conn_goaway(inst, conn, H2_FRAME_SIZE_ERROR);
+            goto close;
+        }
+        if (conn->in_len - pos < H2_FRAME_HEADER_LEN + len) break;
+
+        uint32_t stream_id = h2_read_u32(header + 5) & 0x7fffffff;
+        if (!h2_conn_on_frame(inst, conn, header[3], header[4], stream_id,
+                              header + H2_FRAME_HEADER_LEN, len)
+        ) goto close;
+        pos += H2_FRAME_HEADER_LEN + len;
+    }
+    memmove(conn->in, conn->in + pos, conn->in_len - pos);
+    conn->in_len -= pos;
+
+    return h2_conn_flush(inst, conn);
+
+close:
+    // Best effort, for the GOAWAY
+    h2_conn_write(conn);
+    h2_conn_free(inst, conn);
+    return false;
+}
+
+static void h2_conn_touch(struct httpsrvdev_inst* inst, struct h2_conn* conn) {
+    if (inst->timers != NULL && inst->conn_idle_timeout_ms > 0) {
+        timer_arm(inst->timers, &conn->idle_timer, inst->conn_idle_timeout_ms);
+    }
+}
+
+static void h2_conn_on_readable(struct httpsrvdev_inst* inst, struct h2_conn* conn) {
+    while (true) {
+        // There's always space: complete frames are handled right away
+        ssize_t n_recvd = recv(conn->fd, conn->in + conn->in_len,
+                               sizeof(conn->in) - conn->in_len, MSG_DONTWAIT);
+        if (n_recvd == -1 && errno == EINTR) continue;
+        if (n_recvd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n_recvd <= 0) {
+            h2_conn_free(inst, conn);
+            return;
+        }
+        conn->in_len += n_recvd;
+        if (!h2_conn_on_input(inst, conn)) return;
+    }
+    h2_conn_touch(inst, conn);
+}
+
+// Handle an epoll event if it is for an HTTP/2 connection
+static bool h2_on_poll_event(struct httpsrvdev_inst* inst, int fd, uint32_t events) {
+    struct httpsrvdev_h2* h2 = inst->h2;
+    if (h2 == NULL) return false;
+
+    for (size_t i = 0; i < h2->conns_count; ++i) {
+        struct h2_conn* conn = h2->conns[i];
+        if (conn->fd != fd) continue;
+        if (events & EPOLLOUT) {
+            if (!h2_conn_flush(inst, conn)) return true;
+        }
+        if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) h2_conn_on_readable(inst, conn);
+        return true;
+    }
+    return false;
+}
+
+// Take over the accepted connection as an HTTP/2 connection, with `in_len`
+// bytes of it already received in `in`. On failure, the connection is closed
+// and NULL returned.
+static struct h2_conn* h2_conn_open(struct httpsrvdev_inst* inst, char* in, size_t in_len) {
+    struct h2_conn* conn = NULL;
+
+    if (!listen_socks_poll(inst)) goto err;
+    if (inst->h2 == NULL) {
+        inst->h2 = calloc(1, sizeof(*inst->h2));
+        if (inst->h2 == NULL) goto mem_err;
+    }
+    struct httpsrvdev_h2* h2 = inst->h2;
+    if (h2->conns_count == h2->conns_cap) {
+        size_t new_cap = h2->conns_cap == 0 ? 16 : 2*h2->conns_cap;
+        struct h2_conn** new_conns = realloc(h2->conns, new_cap*sizeof(h2->conns[0]));
+        if (new_conns == NULL) goto mem_err;
+        h2->conns     = new_conns;
+        h2->conns_cap = new_cap;
+    }
+    conn = calloc(1, sizeof(*conn));
+    if (conn == NULL) goto mem_err;
+
+    conn->fd                       = inst->conn->conn_sock_fd;
+    conn->addr                     = inst->conn->conn_addr;
+    conn->idle_timer.fire          = h2_conn_on_idle_timeout;
+    conn->send_window              = H2_INITIAL_WINDOW_SIZE;
+    conn->peer_initial_window_size = H2_INITIAL_WINDOW_SIZE;
+    conn->hpack_table.max_size     = H2_HEADER_TABLE_SIZE;
+    if (in_len > 0) memcpy(conn->in, in, in_len);
+    conn->in_len = in_len;
+
+    // Our connection preface
+    uint8_t settings[6] = { 0, H2_SETTINGS_MAX_CONCURRENT_STREAMS };
+    h2_write_u32(settings + 2, H2_MAX_CONCURRENT_STREAMS);
+    if (!h2_out_frame(conn, H2_SETTINGS, 0, 0, settings, sizeof(settings))) goto mem_err;
+
+    struct epoll_event event = { .events = EPOLLIN, .data = { .fd = conn->fd } };
+    if (epoll_ctl(inst->epoll_fd, EPOLL_CTL_ADD, conn->fd, &event) == -1) {
+        inst->err = httpsrvdev_COULD_NOT_POLL | (errno & httpsrvdev_MASK_ERRNO);
+        goto err;
+    }
+    h2->conns[h2->conns_count++] = conn;
+
+    conn_timers_cancel(inst);
+    inst->conn->conn_sock_fd = -1;
+    h2_conn_touch(inst, conn);
+    return conn;
+
+mem_err:
+    inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+err:
+    if (conn != NULL) free(conn->out.data);
+    free(conn);
+    conn_timers_cancel(inst);
+    close(inst->conn->conn_sock_fd);
+    inst->conn->conn_sock_fd = -1;
+    return NULL;
+}
+
+// Decode unpadded base64url, as in the HTTP2-Settings header
+static bool h2_base64url_decode(char* str, uint8_t* out, size_t out_size, size_t* out_len) {
+    uint32_t bits       = 0;
+    int      bits_count = 0;
+    size_t   n          = 0;
+    for (; *str != '\0' && *str != '='; ++str) {
+        char c = *str;
+        int  value;
+        if      (c >= 'A' && c <= 'Z') value = c - 'A';
+        else if (c >= 'a' && c <= 'z') value = c - 'a' + 26;
+        else if (c >= '0' && c <= '9') value = c - '0' + 52;
+        else if (c == '-' || c == '+') value = 62;
+        else if (c == '_' || c == '/') value = 63;
+        else return false;
+
+        bits = (bits << 6 | value) & 0xffffff;
+        bits_count += 6;
+        if (bits_count >= 8) {
+            bits_count -= 8;
+            if (n == out_size) return false;
+            out[n++] = bits >> bits_count;
+        }
+    }
+    *out_len = n;
+    return true;
+}
+
+// Switch the connection to HTTP/2 if the request asks for it with
+// "Upgrade: h2c". The request itself is then served on stream 1. Returns
+// false only if the connection was lost in the process.
+static bool h2_upgrade(struct httpsrvdev_inst* inst) {
+    char* upgrade = inst->conn->req_known_headers[httpsrvdev_HDR_UPGRADE];
+    if (upgrade == NULL || strstr(upgrade, "h2c") == NULL) return true;
+    // The body would have to be received before switching; such requests
+    // are served with HTTP/1.1 instead
+    char* content_length = inst->conn->req_known_headers[httpsrvdev_HDR_CONTENT_LENGTH];
+    if (inst->conn->req_known_headers[httpsrvdev_HDR_TRANSFER_ENCODING] != NULL ||
+        (content_length != NULL && strcmp(content_length, "0") != 0)
+    ) return true;
+
+    char* settings_str = NULL;
+    for (int i = 0; i < inst->conn->req_headers_count; ++i) {
+        if (strcasecmp(inst->conn->req_headers[i][0], "HTTP2-Settings") == 0) {
+            settings_str = inst->conn->req_headers[i][1];
+        }
+    }
+    uint8_t settings[256];
+    size_t  settings_len;
+    if (settings_str == NULL ||
+        !h2_base64url_decode(settings_str, settings, sizeof(settings), &settings_len) ||
+        settings_len % 6 != 0
+    ) return true;
+
+    if (!httpsrvdev_res_send(inst, "HTTP/1.1 101\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n"))
+        return false;
+    inst->conn->res_bytes_sent = 0;
+
+    // The client only sends its preface once it has the 101
+    struct h2_conn* conn = h2_conn_open(inst, NULL, 0);
+    if (conn == NULL) return false;
+    uint32_t error_code;
+    struct h2_stream* stream = calloc(1, sizeof(*stream));
+    if (stream == NULL || !h2_conn_apply_settings(conn, settings, settings_len, &error_code)) {
+        free(stream);
+        h2_conn_free(inst, conn);
+        inst->err = httpsrvdev_CANNOT_PARSE_REQ;
+        return false;
+    }
+    stream->id                 = 1;
+    stream->conn               = conn;
+    stream->send_window        = conn->peer_initial_window_size;
+    // The request came in full over HTTP/1.1
+    stream->req_ended          = true;
+    stream->res_body_remaining = -1;
+    conn->streams[conn->streams_count++] = stream;
+    conn->last_stream_id        = 1;
+    conn->last_served_stream_id = 1;
+    inst->h2->stream = stream;
+
+    return true;
+}
+
+static bool parse_req(struct httpsrvdev_inst* inst);
+
+// Serve the request that has waited longest on an HTTP/2 stream
+static bool h2_req_begin(struct httpsrvdev_inst* inst) {
+    struct httpsrvdev_h2* h2     = inst->h2;
+    struct h2_stream*     stream = h2->ready_first;
+
+    h2->ready_first = stream->next_ready;
+    if (h2->ready_first == NULL) h2->ready_last = NULL;
+    stream->is_ready   = false;
+    stream->next_ready = NULL;
+    stream->conn->last_served_stream_id = stream->id;
+
+    inst->conn->req_len        = 0;
+    inst->conn->res_bytes_sent = 0;
+    inst->conn->conn_addr      = stream->conn->addr;
+    httpsrvdev_arena_clear(&inst->conn->arena);
+    HOOK(inst, conn_accept);
+
+    // Rebuild the request as HTTP/1.1
+    struct h2_buf* method    = &stream->req_method;
+    struct h2_buf* path      = &stream->req_path;
+    struct h2_buf* authority = &stream->req_authority;
+    struct h2_buf* headers   = &stream->req_headers;
+    bool has_host = authority->len > 0;
+    int len = snprintf(inst->conn->req_buf, sizeof(inst->conn->req_buf),
+                       "%.*s %.*s HTTP/1.1\r\n%s%.*s%s%.*s\r\n",
+                       (int) method->len, method->data, (int) path->len, path->data,
+                       has_host ? "Host: " : "",
+                       (int) authority->len, has_host ? authority->data : "",
+                       has_host ? "\r\n" : "",
+                       (int) headers->len, headers->len > 0 ? headers->data : "");
+    if (len < 0 || len >= sizeof(inst->conn->req_buf)) {
+        h2_stream_reset(inst, stream, H2_INTERNAL_ERROR);
+        inst->err = httpsrvdev_CANNOT_PARSE_REQ;
+        return false;
+    }
+    inst->conn->req_len = len;
+    if (inst->record_fd != -1) record_req(inst);
+
+    if (!parse_req(inst)) {
+        h2_stream_reset(inst, stream, H2_PROTOCOL_ERROR);
+        return false;
+    }
+    h2->stream = stream;
+    HOOK(inst, parse_complete);
+
+    return true;
+}
+
+// Queue `n` bytes of the body, leaving out those beyond Content-Length
+static bool h2_stream_queue_bytes(struct httpsrvdev_inst* inst,
+    struct h2_stream* stream, char* str, size_t n
+) {
+    if (stream->res_body_discarded) return true;
+    if (stream->res_body_remaining >= 0) {
+        if (n > (uint64_t) stream->res_body_remaining) n = stream->res_body_remaining;
+        stream->res_body_remaining -= n;
+    }
+    if (n == 0) return true;
+
+    struct h2_segment* segment = stream->res_body_last;
+    if (segment == NULL || segment->fd != -1) {
+        segment = calloc(1, sizeof(*segment));
+        if (segment == NULL) goto mem_err;
+        segment->fd = -1;
+        if (stream->res_body_last != NULL) {
+            stream->res_body_last->next = segment;
+        } else {
+            stream->res_body_first = segment;
+        }
+        stream->res_body_last = segment;
+    }
+    if (segment->end + n > segment->cap) {
+        size_t new_cap = segment->cap == 0 ? 4096 : 2*segment->cap;
+        while (new_cap < segment->end + n) new_cap *= 2;
+        char* new_data = realloc(segment->data, new_cap);
+        if (new_data == NULL) goto mem_err;
+        segment->data = new_data;
+        segment->cap  = new_cap;
+    }
+    memcpy(segment->data + segment->end, str, n);
+    segment->end += n;
+    return true;
+
+mem_err:
+    inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+    return false;
+}
+
+// Queue `len` bytes of the file `fd` from `offset` as part of the body of the
+// stream being served. Takes ownership of `fd`.
+static bool h2_stream_queue_file(struct httpsrvdev_inst* inst, int fd, off_t offset, off_t len) {
+    struct h2_stream* stream = inst->h2->stream;
+    inst->conn->res_bytes_sent += len;
+
+    if (stream->res_body_discarded) len = 0;
+    if (stream->res_body_remaining >= 0) {
+        if (len > stream->res_body_remaining) len = stream->res_body_remaining;
+        stream->res_body_remaining -= len;
+    }
+    if (len == 0) {
+        close(fd);
+        return true;
+    }
+
+    struct h2_segment* segment = calloc(1, sizeof(*segment));
+    if (segment == NULL) {
+        inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+        close(fd);
+        return false;
+    }
+    segment->fd     = fd;
+    segment->offset = offset;
+    segment->end    = offset + len;
+    if (stream->res_body_last != NULL) {
+        stream->res_body_last->next = segment;
+    } else {
+        stream->res_body_first = segment;
+    }
+    stream->res_body_last = segment;
+    return true;
+}
+
+static bool h2_stream_write_body(struct httpsrvdev_inst* inst,
+    struct h2_stream* stream, char* str, size_t n
+) {
+    if (stream->res_chunk_state == H2_CHUNK_NONE) {
+        return h2_stream_queue_bytes(inst, stream, str, n);
+    }
+
+    // Strip the chunked transfer coding
+    for (size_t i = 0; i < n; ) {
+        switch (stream->res_chunk_state) {
+            case H2_CHUNK_SIZE:
+            case H2_CHUNK_EXT: {
+                char c = str[i++];
+                int  digit = c >= '0' && c <= '9' ? c - '0'      :
+                             c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+                             c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+                if (stream->res_chunk_state == H2_CHUNK_SIZE && digit != -1) {
+                    stream->res_chunk_remaining = 16*stream->res_chunk_remaining + digit;
+                } else if (c == ';') {
+                    stream->res_chunk_state = H2_CHUNK_EXT;
+                } else if (c == '\n') {
+                    stream->res_chunk_state = stream->res_chunk_remaining == 0 ?
+                                              H2_CHUNK_TRAILER : H2_CHUNK_DATA;
+                }
+                break;
+            }
+            case H2_CHUNK_DATA: {
+                size_t len = n - i;
+                if (len > stream->res_chunk_remaining) len = stream->res_chunk_remaining;
+                if (!h2_stream_queue_bytes(inst, stream, str + i, len)) return false;
+                i += len;
+                stream->res_chunk_remaining -= len;
+                if (stream->res_chunk_remaining == 0) stream->res_chunk_state = H2_CHUNK_DATA_END;
+                break;
+            }
+            case H2_CHUNK_DATA_END:
+                if (str[i++] == '\n') stream->res_chunk_state = H2_CHUNK_SIZE;
+                break;
+            default:
+                // Trailers are dropped
+                i = n;
+                break;
+        }
+    }
+    return true;
+}
+
+// Translate the complete HTTP/1.1 response head `head` to a HEADERS frame
+static bool h2_stream_send_head(struct httpsrvdev_inst* inst,
+    struct h2_stream* stream, char* head, size_t head_len
+) {
+    struct h2_conn* conn  = stream->conn;
+    struct h2_buf   block = {0};
+
+    // "HTTP/1.1 200\r\n"
+    if (head_len < 14 || memcmp(head, "HTTP/1.", 7) != 0 ||
+        !isdigit(head[9]) || !isdigit(head[10]) || !isdigit(head[11])
+    ) {
+        inst->err = httpsrvdev_LIB_IMPL_ERR;
+        return false;
+    }
+    int status = (head[9] - '0')*100 + (head[10] - '0')*10 + (head[11] - '0');
+    stream->res_body_discarded = inst->conn->req_method == httpsrvdev_HEAD ||
+                                 status == 204 || status == 304;
+    if (!hpack_encode_status(&block, head + 9)) goto mem_err;
+
+    char* line = memchr(head, '\n', head_len) + 1;
+    char* end  = head + head_len;
+    while (line < end) {
+        char*  line_end = memchr(line, '\n', end - line);
+        size_t line_len = line_end - line;
+        char*  colon    = memchr(line, ':', line_len);
+        if (colon != NULL) {
+            // Field names are lowercase in HTTP/2
+            char   name[64];
+            size_t name_len = colon - line;
+            if (name_len >= sizeof(name)) name_len = 0;
+            for (size_t i = 0; i < name_len; ++i) name[i] = tolower(line[i]);
+
+            char* value     = colon + 1;
+            char* value_end = line_end;
+            while (value < value_end && (*value == ' ' || *value == '\t')) ++value;
+            while (value_end > value && isspace(value_end[-1])) --value_end;
+            size_t value_len = value_end - value;
+
+            // Connection-specific fields don't exist in HTTP/2
+            if (h2_str_eq(name, name_len, "transfer-encoding")) {
+                if (memmem(value, value_len, "chunked", 7) != NULL) {
+                    stream->res_chunk_state = H2_CHUNK_SIZE;
+                }
+            } else if (name_len > 0 &&
+                !h2_str_eq(name, name_len, "connection") &&
+                !h2_str_eq(name, name_len, "keep-alive") &&
+                !h2_str_eq(name, name_len, "proxy-connection") &&
+                !h2_str_eq(name, name_len, "upgrade")
+            ) {
+                if (h2_str_eq(name, name_len, "content-length")) {
+                    stream->res_body_remaining = strtoll(value, NULL, 10);
+                }
+                if (!hpack_encode_field(&block, name, name_len, value, value_len))
+                    goto mem_err;
+            }
+        }
+        line = line_end + 1;
+    }
+
+    // Split into a HEADERS frame and CONTINUATION frames as needed
+    size_t pos = 0;
+    do {
+        size_t frame_len = block.len - pos;
+        if (frame_len > H2_MAX_FRAME_SIZE) frame_len = H2_MAX_FRAME_SIZE;
+        if (!h2_out_frame(conn, pos == 0 ? H2_HEADERS : H2_CONTINUATION,
+                          pos + frame_len == block.len ? H2_FLAG_END_HEADERS : 0,
+                          stream->id, block.data + pos, frame_len)
+        ) goto mem_err;
+        pos += frame_len;
+    } while (pos < block.len);
+    free(block.data);
+
+    stream->res_head_sent = true;
+    return true;
+
+mem_err:
+    free(block.data);
+    inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+    return false;
+}
+
+// `httpsrvdev_res_send_n` on the stream being served
+static bool h2_stream_write(struct httpsrvdev_inst* inst, char* str, size_t n) {
+    struct h2_stream* stream = inst->h2->stream;
+    if (UNLIKELY(inst->hooks != NULL) && inst->conn->res_bytes_sent == 0 && n > 0) {
+        fire_hook(inst, inst->hooks->first_byte_sent);
+    }
+    inst->conn->res_bytes_sent += n;
+    if (stream->res_head_sent) return h2_stream_write_body(inst, stream, str, n);
+
+    // Collect the head until it is complete
+    size_t search_from = stream->res_head.len < 3 ? 0 : stream->res_head.len - 3;
+    if (!h2_buf_append(&stream->res_head, str, n)) {
+        inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+        return false;
+    }
+    char* head_end = memmem(stream->res_head.data + search_from,
+                            stream->res_head.len - search_from, "\r\n\r\n", 4);
+    if (head_end == NULL) return true;
+
+    size_t head_len = head_end + 4 - stream->res_head.data;
+    bool ok = h2_stream_send_head(inst, stream, stream->res_head.data, head_len) &&
+              h2_stream_write_body(inst, stream, stream->res_head.data + head_len,
+                                   stream->res_head.len - head_len);
+    free(stream->res_head.data);
+    stream->res_head = (struct h2_buf) {0};
+    return ok;
+}
+
+// End the stream being served, as `conn_close` closes connections
+static bool h2_stream_end(struct httpsrvdev_inst* inst) {
+    struct httpsrvdev_h2* h2     = inst->h2;
+    struct h2_stream*     stream = h2->stream;
+    h2->stream = NULL;
+
+    if (stream->res_head_sent) {
+        stream->res_ended = true;
+    } else {
+        // There's no response to speak of
+        h2_stream_reset(inst, stream, H2_INTERNAL_ERROR);
+    }
+    httpsrvdev_arena_clear(&inst->conn->arena);
+    HOOK(inst, res_end);
+
+    // Requests that arrived together are answered together
+    if (h2->ready_first == NULL) h2_flush_all(inst);
+
+    return true;
+}
+
+bool httpsrvdev_init_end(struct httpsrvdev_inst* inst) {
+    // Only now that `inst` is where it stays
+    inst->conn = &inst->conn_default;
+
+    if (inst->listen_addrs_count == 0) {
+        struct httpsrvdev_addr addr = { .sock_addr_size = sizeof(struct sockaddr_in) };
+        struct sockaddr_in* addr_in = (struct sockaddr_in*) &addr.sock_addr;
+        *addr_in = (struct sockaddr_in) {
+            .sin_family = AF_INET,
+            .sin_addr   = { .s_addr = htonl(inst->ip), },
+            .sin_port   = htons(inst->port),
+        };
+        if (!httpsrvdev_listen_addr_add(inst, &addr)) return false;
+    }
+
+    return true;
+}
+
+static bool sock_opt_set(struct httpsrvdev_inst* inst,
+    int fd, int level, int name, int value
+) {
+    if (setsockopt(fd, level, name, &value, sizeof(value)) == -1) {
+        inst->err = httpsrvdev_COULD_NOT_SET_SOCK_OPT | (errno & httpsrvdev_MASK_ERRNO);
+        return false;
+    }
+    return true;
+}
+
+// Create, configure, bind and listen on the socket for `listen_addrs[i]`
+static bool listen_sock_open(struct httpsrvdev_inst* inst, int i) {
+    struct httpsrvdev_addr* addr = &inst->listen_addrs[i];
+    int  family = addr->sock_addr.ss_family;
+    bool is_tcp = family == AF_INET || family == AF_INET6;
+
+    // Create socket to listen for connections
+    int fd = socket(family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        inst->err = httpsrvdev_COULD_NOT_CREATE_SOCK | (errno & httpsrvdev_MASK_ERRNO);
+        return false;
+    }
+    inst->listen_sock_fds[i] = fd;
+
+    if (family == AF_UNIX) {
+        // Remove the socket file left behind by a previous run
+        struct sockaddr_un* addr_un = (struct sockaddr_un*) &addr->sock_addr;
+        struct stat sock_stat;
+        if (stat(addr_un->sun_path, &sock_stat) == 0 && S_ISSOCK(sock_stat.st_mode)) {
+            unlink(addr_un->sun_path);
+        }
+    }
+    // Allow restarting straight away while connections of the previous run
+    // are still in TIME_WAIT
+    if (is_tcp && !sock_opt_set(inst, fd, SOL_SOCKET, SO_REUSEADDR, 1)) return false;
+    // Leave the IPv4 side of the port free for its own listen address
+    if (family == AF_INET6 && !sock_opt_set(inst, fd, IPPROTO_IPV6, IPV6_V6ONLY, 1))
+        return false;
+    // Accepted sockets inherit the buffer sizes. They must be set before
+    // connecting for the TCP window scale to be chosen to match.
+    if (inst->sock_sndbuf_size > 0 &&
+        !sock_opt_set(inst, fd, SOL_SOCKET, SO_SNDBUF, inst->sock_sndbuf_size)
+    ) return false;
+    if (inst->sock_rcvbuf_size > 0 &&
+        !sock_opt_set(inst, fd, SOL_SOCKET, SO_RCVBUF, inst->sock_rcvbuf_size)
+    ) return false;
+    // Only wake up for connections once their request has arrived
+    if (is_tcp && inst->tcp_defer_accept_s > 0 &&
+        !sock_opt_set(inst, fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, inst->tcp_defer_accept_s)
+    ) return false;
+
+    // Bind socket to address
+    if (bind(fd, (struct sockaddr*) &addr->sock_addr, addr->sock_addr_size) == -1) {
+        inst->err = httpsrvdev_COULD_NOT_BIND | (errno & httpsrvdev_MASK_ERRNO);
+        return false;
+    }
+    // Let repeat clients send their request with the SYN
+    if (is_tcp && inst->tcp_fastopen_qlen > 0 &&
+        !sock_opt_set(inst, fd, IPPROTO_TCP, TCP_FASTOPEN, inst->tcp_fastopen_qlen)
+    ) return false;
+    // Start listening on the socket
+    if (listen(fd, inst->listen_backlog) == -1) {
+        inst->err = httpsrvdev_COULD_NOT_LISTEN | (errno & httpsrvdev_MASK_ERRNO);
+        return false;
+    }
+
+    return true;
+}
+
+static void listen_socks_close(struct httpsrvdev_inst* inst) {
+    for (int i = 0; i < inst->listen_addrs_count; ++i) {
+        if (inst->listen_sock_fds[i] == -1) continue;
+        close(inst->listen_sock_fds[i]);
+        inst->listen_sock_fds[i] = -1;
+        struct httpsrvdev_addr* addr = &inst->listen_addrs[i];
+        if (addr->sock_addr.ss_family == AF_UNIX) {
+            unlink(((struct sockaddr_un*) &addr->sock_addr)->sun_path);
+        }
+    }
+}
+
+static bool router_freeze(struct httpsrvdev_inst* inst);
+static void router_free(struct httpsrvdev_inst* inst);
+
+bool httpsrvdev_start(struct httpsrvdev_inst* inst) {
+    // Writes to a connection the client closed fail with EPIPE, but those of
+    // `splice`, `sendfile` and OpenSSL also raise SIGPIPE, which would kill
+    // the server. It is ignored once for the process -- a signal mask would
+    // be per thread, and coroutines share the thread -- unless the program
+    // handles it itself.
+    struct sigaction sigpipe_action;
+    if (sigaction(SIGPIPE, NULL, &sigpipe_action) == 0 &&
+        sigpipe_action.sa_handler == SIG_DFL
+    ) {
+        signal(SIGPIPE, SIG_IGN);
+    }
+
+    if (!router_freeze(inst)) return false;
+    // Before taking over, so that a bad certificate doesn't stop the server
+    // that's running
+    if (!tls_init(inst)) {
+        tls_free(inst);
+        return false;
+    }
+    if (inst->record_path != NULL && !record_open(inst)) {
+        tls_free(inst);
+        return false;
+    }
+    if (inst->handoff_path != NULL && !handoff_recv(inst)) return false;
+
+    for (int i = 0; i < inst->listen_addrs_count; ++i) {
+        if (inst->listen_sock_fds[i] != -1) {
+            // Taken over; only the backlog can still be changed
+            listen(inst->listen_sock_fds[i], inst->listen_backlog);
+            continue;
+        }
+        if (!listen_sock_open(inst, i)) {
+            inst->listen_addr_failed = i;
+            listen_socks_close(inst);
+            return false;
+        }
+    }
+    inst->conn->listen_sock_fd = inst->listen_sock_fds[0];
+
+    if (inst->handoff_path != NULL && !handoff_listen(inst)) {
+        listen_socks_close(inst);
+        return false;
+    }
+
+    if ((inst->conn_header_timeout_ms > 0 || inst->conn_idle_timeout_ms > 0 ||
+         inst->conn_min_send_rate > 0) &&
+        !timers_init(inst)
+    ) {
+        listen_socks_close(inst);
+        return false;
+    }
+
+    if ((inst->admission_max_conns > 0 || inst->admission_max_queued > 0 ||
+         inst->admission_ip_rate > 0) &&
+        !admission_init(inst)
+    ) {
+        listen_socks_close(inst);
+        return false;
+    }
+
+    if (inst->fs_workers_count > 0 && !fs_pool_start(inst)) {
+        fs_pool_stop(inst);
+        listen_socks_close(inst);
+        return false;
+    }
+
+    return true;
+}
+
+static void coros_free(struct httpsrvdev_inst* inst);
+
+bool httpsrvdev_stop(struct httpsrvdev_inst* inst) {
+    // Jobs in flight point into the stacks of coroutines
+    fs_pool_stop(inst);
+    // While their TLS sessions and timers can still be freed
+    coros_free(inst);
+    tls_free(inst);
+    if (inst->conn->conn_sock_fd != -1) {
+        close(inst->conn->conn_sock_fd);
+    }
+    listen_socks_close(inst);
+    if (inst->handoff_sock_fd != -1) {
+        close(inst->handoff_sock_fd);
+        inst->handoff_sock_fd = -1;
+        unlink(inst->handoff_path);
+    }
+    h2_free(inst);
+    live_reload_free(inst);
+    admission_free(inst);
+    if (inst->record_fd != -1) {
+        close(inst->record_fd);
+        inst->record_fd = -1;
+    }
+    router_free(inst);
+    free(inst->timers);
+    inst->timers = NULL;
+    if (inst->epoll_fd != -1) {
+        close(inst->epoll_fd);
+        inst->epoll_fd = -1;
+    }
+
+    return true;
+}
+
+// Compare the header name `name` of length `len` against the lowercase
+// `lower`. Only 'A'-'Z' are folded; ORing every byte with 0x20 would also
+// turn e.g. '\r' into '-'.
+static bool header_name_eq(char* name, char* lower, size_t len) {
+    for (size_t i = 0; i < len; ++i) {
+        char c = name[i];
+        if (c >= 'A' && c <= 'Z') c |= 0x20;
+        if (c != lower[i]) return false;
+    }
+    return true;
+}
+
+// Map a header name to its `httpsrvdev_HDR_*` index, or -1 if it is not one
+// of the well-known headers. Switching on the length first means that at most
+// a couple of names have to be compared.
+static int classify_header_name(char* name, size_t len) {
+    switch (len) {
+    case 4:
+        if (header_name_eq(name, "host", 4))              return httpsrvdev_HDR_HOST;
+        break;
+    case 5:
+        if (header_name_eq(name, "range", 5))             return httpsrvdev_HDR_RANGE;
+        break;
+    case 6:
+        if (header_name_eq(name, "accept", 6))            return httpsrvdev_HDR_ACCEPT;
+        break;
+    case 7:
+        if (header_name_eq(name, "upgrade", 7))           return httpsrvdev_HDR_UPGRADE;
+        break;
+    case 8:
+        if (header_name_eq(name, "if-range", 8))          return httpsrvdev_HDR_IF_RANGE;
+        break;
+    case 10:
+        if (header_name_eq(name, "connection", 10))       return httpsrvdev_HDR_CONNECTION;
+        if (header_name_eq(name, "user-agent", 10))       return httpsrvdev_HDR_USER_AGENT;
+        break;
+    case 12:
+        if (header_name_eq(name, "content-type", 12))     return httpsrvdev_HDR_CONTENT_TYPE;
+        break;
+    case 13:
+        if (header_name_eq(name, "if-none-match", 13))    return httpsrvdev_HDR_IF_NONE_MATCH;
+        break;
+    case 14:
+        if (header_name_eq(name, "content-length", 14))   return httpsrvdev_HDR_CONTENT_LENGTH;
+        break;
+    case 15:
+        if (header_name_eq(name, "accept-encoding", 15))  return httpsrvdev_HDR_ACCEPT_ENCODING;
+        break;
+    case 17:
+        if (header_name_eq(name, "if-modified-since", 17)) return httpsrvdev_HDR_IF_MODIFIED_SINCE;
+        if (header_name_eq(name, "transfer-encoding", 17)) return httpsrvdev_HDR_TRANSFER_ENCODING;
+        break;
+    }
+    return -1;
+}
+
+// Request targets are mapped to `inst->conn->req_path`: the path without the query,
+// percent-decoded, with "." and ".." segments resolved and runs of '/'
+// collapsed, so that it can't lead outside of the served directories and
+// equal paths are spelled alike. Most targets are already in that form; a
+// vector scan finds those and `req_path` then points into the target itself.
+
+// Whether `target` is a path that normalizing would leave as it is: no query,
+// '%', "//" or segment starting with '.'. Such segments include "." and ".."
+// but also e.g. ".hidden", for which normalizing is merely a copy.
+static bool target_is_normal(char* target, size_t len) {
+    if (len == 0 || target[0] != '/') return false;
+#if defined(__x86_64__)
+    // Targets are short, so 16 bytes at a time it is. Whether the last byte
+    // of the previous block was a '/' is carried over in `prev_slash`.
+    uint32_t prev_slash = 0;
+    for (size_t i = 0; i < len; i += 16) {
+        uint8_t tail[16] = {0};
+        char*   block    = target + i;
+        if (len - i < 16) {
+            memcpy(tail, block, len - i);
+            block = (char*) tail;
+        }
+        __m128i  bytes  = _mm_loadu_si128((__m128i*) block);
+        uint32_t slash  = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('/')));
+        uint32_t dot    = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('.')));
+        uint32_t other  = _mm_movemask_epi8(_mm_or_si128(
+            _mm_cmpeq_epi8(bytes, _mm_set1_epi8('%')),
+            _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('?')),
+                         _mm_cmpeq_epi8(bytes, _mm_set1_epi8('#')))));
+        uint32_t after_slash = (slash << 1 | prev_slash) & 0xFFFF;
+        if ((after_slash & (slash | dot)) != 0 || other != 0) return false;
+        prev_slash = slash >> 15;
+    }
+    return true;
+#else
+    for (size_t i = 0; i < len; ++i) {
+        char c = target[i];
+        if (c == '%' || c == '?' || c == '#') return false;
+        if (i > 0 && target[i - 1] == '/' && (c == '/' || c == '.')) return false;
+    }
+    return true;
+#endif
+}
+
+static int hex_digit_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Set `inst->conn->req_path` and `inst->conn->req_query` from `inst->conn->req_target`.
+// Fails on malformed percent-encoding and on encoded NUL bytes.
+static bool target_normalize(struct httpsrvdev_inst* inst) {
+    char*  target     = inst->conn->req_target;
+    size_t target_len = strlen(target);
+    inst->conn->req_query   = NULL;
+    if (target_is_normal(target, target_len)) {
+        inst->conn->req_path = target;
+        return true;
+    }
+
+    // Absolute form, as sent to proxies: skip the scheme and authority
+    if (strncasecmp(target, "http://", 7) == 0 || strncasecmp(target, "https://", 8) == 0) {
+        target = strstr(target, "//") + 2;
+        target += strcspn(target, "/?#");
+    }
+    size_t path_len = strcspn(target, "?#");
+    if (target[path_len] == '?') inst->conn->req_query = target + path_len + 1;
+
+    // Decode into `req_path_buf`, after a leading '/' in case the target
+    // doesn't have one. Decoding only shortens the path.
+    char*  path        = inst->conn->req_path_buf;
+    size_t decoded_len = 0;
+    path[decoded_len++] = '/';
+    for (size_t i = 0; i < path_len; ++i) {
+        char c = target[i];
+        if (c == '%') {
+            int high = i + 2 < path_len ? hex_digit_value(target[i + 1]) : -1;
+            int low  = high != -1 ? hex_digit_value(target[i + 2]) : -1;
+            if (low == -1 || (high == 0 && low == 0)) return false;
+            c  = high << 4 | low;
+            i += 2;
+        }
+        path[decoded_len++] = c;
+    }
+
+    // Resolve segments in place; the output never overtakes the input
+    size_t out_len = 0;
+    bool   ends_in_dir = false;
+    for (size_t i = 0; i < decoded_len; ) {
+        while (i < decoded_len && path[i] == '/') ++i;
+        size_t seg_start = i;
+        while (i < decoded_len && path[i] != '/') ++i;
+        size_t seg_len = i - seg_start;
+        ends_in_dir = true;
+        if (seg_len == 0 || (seg_len == 1 && path[seg_start] == '.')) continue;
+        if (seg_len == 2 && path[seg_start] == '.' && path[seg_start + 1] == '.') {
+            // Never above the root
+            while (out_len > 0 && path[out_len - 1] != '/') --out_len;
+            if (out_len > 0) --out_len;
+            continue;
+        }
+        path[out_len++] = '/';
+        memmove(path + out_len, path + seg_start, seg_len);
+        out_len += seg_len;
+        ends_in_dir = i < decoded_len;
+    }
+    if (out_len == 0 || ends_in_dir) path[out_len++] = '/';
+    path[out_len] = '\0';
+
+    inst->conn->req_path = path;
+    return true;
+}
+
+// Control characters per RFC 5234 (CTL), which may not appear in a token
+static bool is_ctl_char(char c) {
+    return (unsigned char) c < 0x20 || c == 0x7f;
+}
+
+static bool parse_req(struct httpsrvdev_inst* inst) {
+    size_t i = 0;
+
+    // --------------------------------------------------------
+    // Parse request's start line
+    // --------------------------------------------------------
+
+    // Prase the request method
+    inst->conn->req_method_str = inst->conn->req_buf + i;
+    if (inst->conn->req_buf[i + 0] == 'G' &&
+        inst->conn->req_buf[i + 1] == 'E' &&
+        inst->conn->req_buf[i + 2] == 'T'
+    ) {
+        inst->conn->req_method = httpsrvdev_GET;
+        i += 3;
+    } else if (
+        inst->conn->req_buf[i + 0] == 'P' &&
+        inst->conn->req_buf[i + 1] == 'O' &&
+        inst->conn->req_buf[i + 2] == 'S' &&
+        inst->conn->req_buf[i + 3] == 'T'
+    ) {
+        inst->conn->req_method = httpsrvdev_POST;
+        i += 4;
+    } else if (
+        inst->conn->req_buf[i + 0] == 'P' &&
+        inst->conn->req_buf[i + 1] == 'U' &&
+        inst->conn->req_buf[i + 2] == 'T'
+    ) {
+        inst->conn->req_method = httpsrvdev_PUT;
+        i += 3;
+    } else if (
+        inst->conn->req_buf[i + 0] == 'D' &&
+        inst->conn->req_buf[i + 1] == 'E' &&
+        inst->conn->req_buf[i + 2] == 'L' &&
+        inst->conn->req_buf[i + 3] == 'E' &&
+        inst->conn->req_buf[i + 4] == 'T' &&
+        inst->conn->req_buf[i + 5] == 'E'
+    ) {
+        inst->conn->req_method = httpsrvdev_DELETE;
+        i += 6;
+    } else if (
+        inst->conn->req_buf[i + 0] == 'O' &&
+        inst->conn->req_buf[i + 1] == 'P' &&
+        inst->conn->req_buf[i + 2] == 'T' &&
+        inst->conn->req_buf[i + 3] == 'I' &&
+        inst->conn->req_buf[i + 4] == 'O' &&
+        inst->conn->req_buf[i + 5] == 'N' &&
+        inst->conn->req_buf[i + 6] == 'S'
+    ) {
+        inst->conn->req_method = httpsrvdev_OPTIONS;
+        i += 7;
+    } else if (
+        inst->conn->req_buf[i + 0] == 'H' &&
+        inst->conn->req_buf[i + 1] == 'E' &&
+        inst->conn->req_buf[i + 2] == 'A' &&
+        inst->conn->req_buf[i + 3] == 'D'
+    ) {
+        inst->conn->req_method = httpsrvdev_HEAD;
+        i += 4;
+    } else if (
+        inst->conn->req_buf[i + 0] == 'C' &&
+        inst->conn->req_buf[i + 1] == 'O' &&
+        inst->conn->req_buf[i + 2] == 'N' &&
+        inst->conn->req_buf[i + 3] == 'N' &&
+        inst->conn->req_buf[i + 4] == 'E' &&
+        inst->conn->req_buf[i + 5] == 'C' &&
+        inst->conn->req_buf[i + 6] == 'T'
+    ) {
+        inst->conn->req_method = httpsrvdev_CONNECT;
+        i += 7;
+    } else if (
+        inst->conn->req_buf[i + 0] == 'P' &&
+        inst->conn->req_buf[i + 1] == 'A' &&
+        inst->conn->req_buf[i + 2] == 'T' &&
+        inst->conn->req_buf[i + 3] == 'C' &&
+        inst->conn->req_buf[i + 4] == 'H'
+    ) {
+        inst->conn->req_method = httpsrvdev_PATCH;
+        i += 5;
+    } else if (
+        inst->conn->req_buf[i + 0] == 'T' &&
+        inst->conn->req_buf[i + 1] == 'R' &&
+        inst->conn->req_buf[i + 2] == 'A' &&
+        inst->conn->req_buf[i + 3] == 'C' &&
+        inst->conn->req_buf[i + 4] == 'E'
+    ) {
+        inst->conn->req_method = httpsrvdev_TRACE;
+        i += 5;
+    } else {
+        goto parse_err;
+    }
+    if (inst->conn->req_buf[i] != ' ') {
+        goto parse_err;
+    }
+    inst->conn->req_buf[i++] = '\0';
+
+    // Parse the request target, e.g. the URL to the dev server
+    inst->conn->req_target = inst->conn->req_buf + i;
+    while (inst->conn->req_buf[i] != ' ') {
+        if (inst->conn->req_buf[i++] == '\0') goto parse_err;
+    }
+    inst->conn->req_buf[i++] = '\0';
+    if (!target_normalize(inst)) goto parse_err;
+
+    // As seen above we store `char*` pointers to substrings of `inst->conn->req_buf`
+    // in `inst` and manually insert '\0' null terminators to end the substrings.
+    // This means that you can directly access a requests target -- normally the
+    // page route -- via the `inst->conn->req_target` pointer, e.g.:
+    //
+    //     char* page_route = inst->conn->req_target;
+    //
+    // This pattern is repeated for other important request substrings such as
+    // header names and values; see below.
+
+    // Parse 'HTTP1.(1|0) '
+    if (inst->conn->req_buf[i++] != 'H' ||
+        inst->conn->req_buf[i++] != 'T' ||
+        inst->conn->req_buf[i++] != 'T' ||
+        inst->conn->req_buf[i++] != 'P' ||
+        inst->conn->req_buf[i++] != '/' ||
+        inst->conn->req_buf[i++] != '1' ||
+        inst->conn->req_buf[i++] != '.'
+    ) {
+        goto parse_err;
+    }
+    if (inst->conn->req_buf[i] == '1' || inst->conn->req_buf[i] == '0') {
+        ++i;
+    } else {
+        goto parse_err;
+    }
+
+    // Parse end of start line
+    if (inst->conn->req_buf[i++] != '\r' ||
+        inst->conn->req_buf[i++] != '\n'
+    ) {
+        goto parse_err;
+    }
+
+    // --------------------------------------------------------
+    // Parse request headers
+    // --------------------------------------------------------
+
+    // NOTE: `inst->conn->req_buf` is null terminated after the received bytes
+    //       (see `httpsrvdev_res_begin`) so scanning stops at '\0' at the latest.
+    inst->conn->req_headers_count = 0;
+    memset(inst->conn->req_known_headers, 0, sizeof(inst->conn->req_known_headers));
+    while (inst->conn->req_buf[i] != '\r' && inst->conn->req_buf[i + 1] != '\n') {
+        if (inst->conn->req_buf[i] == '\0') goto parse_err;
+        if (inst->conn->req_headers_count ==
+            sizeof(inst->conn->req_headers)/sizeof(inst->conn->req_headers[0])
+        ) goto parse_err;
+
+        // Parse header name. Control characters (including the terminating
+        // '\0') are never part of one.
+        size_t name_start = i;
+        size_t name_len;
+        inst->conn->req_headers[inst->conn->req_headers_count][0] = inst->conn->req_buf + i;
+        if (is_ctl_char(inst->conn->req_buf[i])) goto parse_err;
+        while (true) {
+            ++i;
+            if (is_ctl_char(inst->conn->req_buf[i])) {
+                goto parse_err;
+            } else if (inst->conn->req_buf[i] == ':') {
+                name_len = i - name_start;
+                inst->conn->req_buf[i] = '\0';
+                break;
+            } else if (inst->conn->req_buf[i] == ' ') {
+                name_len = i - name_start;
+                inst->conn->req_buf[i] = '\0';
+                if (inst->conn->req_buf[++i] != ':') {
+                    goto parse_err;
+                }
+                break;
+            }
+        }
+        ++i;
+
+        // Parse header value
+        if (inst->conn->req_buf[i++] != ' ') {
+            goto parse_err;
+        }
+        inst->conn->req_headers[inst->conn->req_headers_count][1] = inst->conn->req_buf + i;
+        while (inst->conn->req_buf[i] != '\r') {
+            if (inst->conn->req_buf[i++] == '\0') goto parse_err;
+        }
+        inst->conn->req_buf[i++] = '\0';
+        if (inst->conn->req_buf[i++] != '\n') {
+            goto parse_err;
+        }
+
+        int hdr = classify_header_name(inst->conn->req_buf + name_start, name_len);
+        if (hdr != -1 && inst->conn->req_known_headers[hdr] == NULL) {
+            inst->conn->req_known_headers[hdr] =
+                inst->conn->req_headers[inst->conn->req_headers_count][1];
+        }
+
+        ++inst->conn->req_headers_count;
+    }
+    i += 2;
+
+    // --------------------------------------------------------
+    // Parse request body
+    // --------------------------------------------------------
+
+    if (i > inst->conn->req_len) goto parse_err;
+    inst->conn->req_body = inst->conn->req_buf + i;
+    // A body with a Content-Length is left byte for byte, e.g. for
+    // `httpsrvdev_res_proxy`
+    if (inst->conn->req_known_headers[httpsrvdev_HDR_CONTENT_LENGTH] == NULL &&
+        inst->conn->req_len >= 2 &&
+        inst->conn->req_buf[inst->conn->req_len - 2] == '\r' &&
+        inst->conn->req_buf[inst->conn->req_len - 1] == '\n'
+    ) {
+        inst->conn->req_buf[inst->conn->req_len - 2] = '\0';
+    }
+
+    // --------------------------------------------------------
+
+    return true;
+
+parse_err:
+    inst->err = httpsrvdev_CANNOT_PARSE_REQ;
+    return false;
+}
+
+// Accept a connection and receive its request
+static bool conn_begin(struct httpsrvdev_inst* inst) {
+    inst->conn->conn_addr.sock_addr_size = sizeof(inst->conn->conn_addr.sock_addr);
+    // Non-blocking so that waiting on the connection is bounded by its
+    // timeouts -- see `conn_wait`
+    inst->conn->conn_sock_fd = accept4(
+        inst->conn->listen_sock_fd,
+        (struct sockaddr*) &inst->conn->conn_addr.sock_addr,
+        &inst->conn->conn_addr.sock_addr_size,
+        SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (inst->conn->conn_sock_fd == -1) {
+        inst->err = httpsrvdev_COULD_NOT_ACCEPT | (errno & httpsrvdev_MASK_ERRNO);
+        return false;
+    }
+    // Per connection options
+    if (inst->tcp_nodelay && inst->conn->conn_addr.sock_addr.ss_family != AF_UNIX &&
+        !sock_opt_set(inst, inst->conn->conn_sock_fd, IPPROTO_TCP, TCP_NODELAY, 1)
+    ) goto err_close_conn;
+    inst->conn->req_len        = 0;
+    inst->conn->res_bytes_sent = 0;
+    httpsrvdev_arena_clear(&inst->conn->arena);
+    HOOK(inst, conn_accept);
+
+    if (inst->timers != NULL && inst->conn_header_timeout_ms > 0) {
+        timer_arm(inst->timers, &inst->timers->conn->header_timer,
+                  inst->conn_header_timeout_ms);
+    }
+    if (!conn_tls_begin(inst)) goto err_close_conn;
+
+    // Receive until the end of the headers. Leave space for a null terminator
+    // so the parser can't run past the end.
+    while (inst->conn->req_len < sizeof(inst->conn->req_buf) - 1) {
+        ssize_t n_recvd = conn_recv(inst, inst->conn->req_buf + inst->conn->req_len,
+                                    sizeof(inst->conn->req_buf) - 1 - inst->conn->req_len);
+        if (n_recvd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!conn_wait(inst, POLLIN)) return false;
+            continue;
+        }
+        if (n_recvd == -1 && errno == EINTR) continue;
+        if (n_recvd <= 0) {
+            inst->err = httpsrvdev_CANNOT_PARSE_REQ;
+            goto err_close_conn;
+        }
+        inst->conn->req_len += n_recvd;
+        inst->conn->req_buf[inst->conn->req_len] = '\0';
+        if (strstr(inst->conn->req_buf, "\r\n\r\n") != NULL) break;
+    }
+    if (inst->timers != NULL) {
+        timer_cancel(inst->timers, &inst->timers->conn->header_timer);
+        if (inst->conn_min_send_rate > 0) {
+            inst->timers->conn->bytes_sent_at_check = 0;
+            timer_arm(inst->timers, &inst->timers->conn->send_rate_timer, 1000);
+        }
+    }
+    // HTTP/2 with prior knowledge: the requests follow on streams. h2c is
+    // cleartext only; the HTTP/2 connections bypass TLS.
+    bool is_h2c = inst->h2c && inst->tls == NULL;
+    size_t preface_len =
+        inst->conn->req_len < H2_PREFACE_LEN ? inst->conn->req_len : H2_PREFACE_LEN;
+    bool is_h2_preface = is_h2c && memcmp(inst->conn->req_buf, H2_PREFACE, preface_len) == 0;
+    // The requests on the streams are recorded by `h2_req_begin`
+    if (inst->record_fd != -1 && !is_h2_preface) record_req(inst);
+    // Refuse before parsing or touching the file system
+    if (inst->admission != NULL && !admission_admit(inst)) {
+        inst->err = httpsrvdev_SHED;
+        return false;
+    }
+    if (is_h2_preface) {
+        struct h2_conn* conn = h2_conn_open(inst, inst->conn->req_buf, inst->conn->req_len);
+        if (conn == NULL) return false;
+        h2_conn_on_input(inst, conn);
+        return true;
+    }
+    if (!parse_req(inst)) {
+        goto err_close_conn;
+    }
+    if (is_h2c && !h2_upgrade(inst)) {
+        goto err_close_conn;
+    }
+    HOOK(inst, parse_complete);
+
+    return true;
+
+err_close_conn:
+    conn_timers_cancel(inst);
+    conn_tls_end(inst, false);
+    if (inst->conn->conn_sock_fd != -1) close(inst->conn->conn_sock_fd);
+    inst->conn->conn_sock_fd = -1;
+    return false;
+}
+
+bool httpsrvdev_res_begin(struct httpsrvdev_inst* inst) {
+    // Requests waiting on HTTP/2 connections are served before accepting
+    // more connections
+    while (!h2_has_ready_stream(inst)) {
+        if (inst->live_reload != NULL) {
+            if (!live_reload_wait_for_conn(inst)) return false;
+        } else {
+            if (!listen_socks_wait(inst))         return false;
+        }
+        if (inst->conn->listen_sock_fd == -1) continue;
+
+        if (!conn_begin(inst)) return false;
+        // Unless the connection turned out to be HTTP/2 without a request yet
+        if (inst->conn->conn_sock_fd != -1 || h2_stream_is_current(inst)) return true;
+    }
+    return h2_req_begin(inst);
+}
+
+char* httpsrvdev_req_header(struct httpsrvdev_inst* inst, int hdr) {
+    if (hdr < 0 || hdr >= httpsrvdev_HDR_COUNT) return NULL;
+    return inst->conn->req_known_headers[hdr];
+}
+
+// Append to the response being recorded by `httpsrvdev_prebuilt_begin`
+static bool prebuilt_append(struct httpsrvdev_inst* inst, char* str, size_t n) {
+    struct httpsrvdev_prebuilt_res* res = inst->conn->res_recording;
+    if (res->len + n > res->cap) {
+        size_t new_cap = res->cap == 0 ? 4096 : res->cap;
+        while (new_cap < res->len + n) new_cap *= 2;
+        char* new_data = realloc(res->data, new_cap);
+        if (new_data == NULL) {
+            inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+            return false;
+        }
+        res->data = new_data;
+        res->cap  = new_cap;
+    }
+    memcpy(res->data + res->len, str, n);
+    res->len += n;
+    return true;
+}
+
+bool httpsrvdev_res_send_n(struct httpsrvdev_inst* inst, char* str, size_t n) {
+    if (inst->conn->res_recording != NULL) return prebuilt_append(inst, str, n);
+    if (h2_stream_is_current(inst))  return h2_stream_write(inst, str, n);
+
+    bool is_first_write = inst->conn->res_bytes_sent == 0 && n > 0;
+    size_t n_written = 0;
+    while (n_written < n) {
+        ssize_t n_written_now = conn_send(inst, str + n_written, n - n_written);
+        if (n_written_now == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (!conn_wait(inst, POLLOUT)) return false;
+                continue;
+            }
+            // TODO: inst->err = ...
+            return false;
+        }
+        n_written            += n_written_now;
+        inst->conn->res_bytes_sent += n_written_now;
+    }
+    if (UNLIKELY(inst->hooks != NULL) && is_first_write) {
+        fire_hook(inst, inst->hooks->first_byte_sent);
+    }
+    // NOTE: We don't need to do our own buffering becuase TCP sockets are
+    //       buffered by default -- see `man 7 tcp`
+    return true;
+}
+
+bool httpsrvdev_res_send(struct httpsrvdev_inst* inst, char* str) {
+    return httpsrvdev_res_send_n(inst, str, strlen(str));
+}
+
+// Close the connection once the response has been sent
+static bool conn_close(struct httpsrvdev_inst* inst) {
+    if (h2_stream_is_current(inst)) return h2_stream_end(inst);
+
+    conn_timers_cancel(inst);
+    conn_tls_end(inst, true);
+    if (inst->conn->conn_sock_fd != -1) {
+        // Flush socket buffer by shutting down write... Not documented in
+        // manpage :( A client that already went away has nothing to flush.
+        if (shutdown(inst->conn->conn_sock_fd, SHUT_RDWR) == -1 && errno != ENOTCONN) {
+            return false;
+        }
+        if (close(inst->conn->conn_sock_fd) == -1) {
+            return false;
+        }
+    }
+    inst->conn->conn_sock_fd = -1;
+    httpsrvdev_arena_clear(&inst->conn->arena);
+    HOOK(inst, res_end);
+
+    return true;
+}
+
+bool httpsrvdev_res_end(struct httpsrvdev_inst* inst) {
+    // HTTP/2 streams end with their last DATA frame
+    if (!h2_stream_is_current(inst) && !httpsrvdev_res_send_n(inst, "\r\n", 2)) return false;
+
+    // Finish recording, leaving the connection -- if any -- untouched
+    if (inst->conn->res_recording != NULL) {
+        inst->conn->res_recording->status = inst->conn->res_status;
+        inst->conn->res_recording = NULL;
+        httpsrvdev_arena_clear(&inst->conn->arena);
+        return true;
+    }
+
+    return conn_close(inst);
+}
+
+bool httpsrvdev_prebuilt_begin(struct httpsrvdev_inst* inst,
+    struct httpsrvdev_prebuilt_res* res
+) {
+    *res = (struct httpsrvdev_prebuilt_res) { .data = NULL, .len = 0, .cap = 0, .status = -1 };
+    inst->conn->res_recording = res;
+    return true;
+}
+
+bool httpsrvdev_res_prebuilt(struct httpsrvdev_inst* inst,
+    struct httpsrvdev_prebuilt_res* res
+) {
+    inst->conn->res_status = res->status;
+    if (!httpsrvdev_res_send_n(inst, res->data, res->len)) return false;
+    return conn_close(inst);
+}
+
+void httpsrvdev_prebuilt_free(struct httpsrvdev_prebuilt_res* res) {
+    free(res->data);
+    *res = (struct httpsrvdev_prebuilt_res) { .data = NULL, .len = 0, .cap = 0, .status = -1 };
+}
+
+bool httpsrvdev_res_status_line(struct httpsrvdev_inst* inst, int status) {
+    inst->conn->res_status = status;
+
+    if (!httpsrvdev_res_send(inst, "HTTP/1.1 ")) return false;
+    char status_buf[16];
+    snprintf(status_buf, sizeof(status_buf), "%d", status);
+    if (!httpsrvdev_res_send(inst, status_buf))  return false;
+    if (!httpsrvdev_res_send(inst, "\r\n"))      return false;
+
+    return true;
+}
+
+bool httpsrvdev_res_header(struct httpsrvdev_inst* inst, char* name, char* value) {
+    if (!httpsrvdev_res_send(inst, name  )) return false;
+    if (!httpsrvdev_res_send(inst, ": "  )) return false;
+    if (!httpsrvdev_res_send(inst, value )) return false;
+    if (!httpsrvdev_res_send(inst, "\r\n")) return false;
+
+    return true;
+}
+
+bool httpsrvdev_res_headerf(struct httpsrvdev_inst* inst, char* name, char* fmt, ...) {
+    char str_buf[1024];
+    SPRINTF_TO_STR_FROM_FMT_AND_VARGS;
+    return httpsrvdev_res_header(inst, name, str_buf);
+}
+
+bool httpsrvdev_res_body(struct httpsrvdev_inst* inst, char* body) {
+    size_t body_len = strlen(body);
+    if (!httpsrvdev_res_headerf(inst, "Content-Length", "%zu", body_len))
+        return false;
+    if (!httpsrvdev_res_send  (inst, "\r\n"        )) return false;
+    if (!httpsrvdev_res_send_n(inst, body, body_len)) return false;
+    if (!httpsrvdev_res_end (inst        )) return false;
+
+    return true;
+}
+
+// NOTE: Both path helpers below write to `result_path`, which must point to a
+//       buffer of at least PATH_MAX bytes -- as required by `realpath`.
+
+static bool path_rel_to_root_to_path_with_root(struct httpsrvdev_inst* inst,
+    char* path, char* result_path
+) {
+    if (path[0] == '/') {
+        if (strlen(path) >= PATH_MAX) {
+            inst->err = httpsrvdev_BUF_TOO_SMALL;
+            return false;
+        }
+        strcpy(result_path, path);
+        return true;
+    }
+
+    bool result = false;
+    struct httpsrvdev_arena_mark arena_mark = httpsrvdev_arena_save(&inst->conn->arena);
+
+    // Join root and path
+    char* full_path = tmp_alloc(inst, PATH_MAX);
+    if (full_path == NULL) goto cleanup;
+    int   full_path_len = snprintf(full_path, PATH_MAX, "%s/%s", inst->conn->root_path, path);
+    if (full_path_len < 0 || full_path_len >= PATH_MAX) {
+        inst->err = httpsrvdev_BUF_TOO_SMALL;
+        goto cleanup;
+    }
+
+    // Remove trailing '/'
+    if (full_path[full_path_len - 1] == '/') {
+        full_path[full_path_len - 1] = '\0';
+    }
+
+    if (realpath(full_path, result_path) == NULL) {
+        inst->err = httpsrvdev_COULD_NOT_STAT | (errno & httpsrvdev_MASK_ERRNO);
+        goto cleanup;
+    }
+    result = true;
+
+cleanup:
+    httpsrvdev_arena_reset(&inst->conn->arena, arena_mark);
+    return result;
+}
+
+static bool path_with_root_to_path_rel_to_root(struct httpsrvdev_inst* inst,
+    char* path, char* result_path
+) {
+    bool result = false;
+    struct httpsrvdev_arena_mark arena_mark = httpsrvdev_arena_save(&inst->conn->arena);
+
+    char* path_resolved = tmp_alloc(inst, PATH_MAX);
+    char* root_path     = tmp_alloc(inst, PATH_MAX);
+    if (path_resolved == NULL || root_path == NULL) goto cleanup;
+
+    if (realpath(path, path_resolved) == NULL) {
+        inst->err = httpsrvdev_COULD_NOT_STAT | (errno & httpsrvdev_MASK_ERRNO);
+        goto cleanup;
+    }
+
+    if (*inst->conn->root_path == '\0') {
+        strcpy(result_path, path_resolved);
+        result = true;
+        goto cleanup;
+    }
+
+    if (realpath(inst->conn->root_path, root_path) == NULL) {
+        inst->err = httpsrvdev_COULD_NOT_STAT | (errno & httpsrvdev_MASK_ERRNO);
+        goto cleanup;
+    }
+
+    size_t root_path_len = strlen(root_path);
+
+    if (root_path_len > 0 &&
+        strncmp(root_path, path_resolved, root_path_len) != 0
+    ) goto cleanup;
+
+    strcpy(result_path, path_resolved + root_path_len);
+    result = true;
+
+cleanup:
+    httpsrvdev_arena_reset(&inst->conn->arena, arena_mark);
+    return result;
+}
+
+// TODO: Write a unit test to test that this and the next array match
+// MIME Type sources:
+//     https://developer.mozilla.org/en-US/docs/Web/HTTP/Basics_of_HTTP/MIME_types/Common_types
+typedef struct file_type_info {
+    uint64_t ext_encoding;
+    char*    mime_type;
+    bool     charset_utf8;
+} FileTypeInfo;
+static FileTypeInfo file_type_infos[] = {
+    {
+        .ext_encoding = ('h'<<24) | ('t'<<16) | ('m'<< 8) | ('l'<< 0),
+        .mime_type    = "text/html",
+        .charset_utf8 = true,
+    },
+    {
+        .ext_encoding = ('j'<< 8) | ('s'<< 0),
+        .mime_type    = "text/javascript",
+        .charset_utf8 = true,
+    },
+    {
+        .ext_encoding = ('c'<<16) | ('s'<< 8) | ('s'<< 0),
+        .mime_type    = "text/css",
+        .charset_utf8 = true,
+    },
+    {
+        .ext_encoding = ('m'<<16) | ('j'<< 8) | ('s'<< 0),
+        .mime_type    = "text/javascript",
+        .charset_utf8 = true,
+    },
+    {
+        .ext_encoding = ('h'<<16) | ('t'<< 8) | ('m'<< 0),
+        .mime_type    = "text/html",
+        .charset_utf8 = true,
+    },
+    {
+        .ext_encoding = (((uint64_t)'x')<<32) |
+            ('h'<<24) | ('t'<<16) | ('m'<< 8) | ('l'<< 0),
+        .mime_type    = "application/xhtml+xml",
+        .charset_utf8 = true,
+    },
+
+    // Other common text formats ----------------------------------------
+    {
+        .ext_encoding = ('j'<<24) | ('s'<<16) | ('o'<< 8) | ('n'<< 0),
+        .mime_type    = "application/json",
+        .charset_utf8 = true,
+    },
+    {
+        .ext_encoding = (((uint64_t) 'j')<<40) | (((uint64_t)'s')<<32) |
+            ('o'<<24) | ('n'<<16) | ('l'<< 8) | ('d'<< 0),
+        .mime_type    = "application/ld+json",
+        .charset_utf8 = true,
+    },
+    {
+        .ext_encoding = ('t'<<16) | ('x'<< 8) | ('t'<< 0),
+        .mime_type    = "text/plain",
+        .charset_utf8 = true,
+    },
+    {
+        .ext_encoding = ('c'<<16) | ('s'<< 8) | ('v'<< 0),
+        .mime_type    = "text/csv",
+        .charset_utf8 = true,
+    },
+    {
+        .ext_encoding = ('x'<<16) | ('m'<< 8) | ('l'<< 0),
+        .mime_type    = "application/xml",
+        .charset_utf8 = true,
+    },
+    {
+        .ext_encoding = ('i'<<16) | ('c'<< 8) | ('s'<< 0),
+        .mime_type    = "text/calendar",
+        .charset_utf8 = true,
+    },
+
+    // Unspecified Binary -----------------------------------------------
+    {
+        .ext_encoding = ('b'<<16) | ('i'<< 8) | ('n'<< 0),
+        .mime_type    = "application/octet-stream",
+        .charset_utf8 = true,
+    },
+
+    // Images -----------------------------------------------------------
+    {
+        .ext_encoding = ('j'<<16) | ('p'<< 8) | ('g'<< 0),
+        .mime_type    = "image/jpeg",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('j'<<24) | ('p'<<16) | ('e'<< 8) | ('g'<< 0),
+        .mime_type    = "image/jpeg",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('p'<<16) | ('n'<< 8) | ('g'<< 0),
+        .mime_type    = "image/png",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('w'<<24) | ('e'<<16) | ('b'<< 8) | ('p'<< 0),
+        .mime_type    = "image/webp",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('s'<<16) | ('v'<< 8) | ('g'<< 0),
+        .mime_type    = "image/svg+xml",
+        .charset_utf8 = true,
+    },
+    {
+        .ext_encoding = ('g'<<16) | ('i'<< 8) | ('f'<< 0),
+        .mime_type    = "image/gif",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('t'<<16) | ('i'<< 8) | ('f'<< 0),
+        .mime_type    = "image/tiff",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('t'<<24) | ('i'<<16) | ('f'<< 8) | ('f'<< 0),
+        .mime_type    = "image/tiff",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('b'<<16) | ('m'<< 8) | ('p'<< 0),
+        .mime_type    = "image/bmp",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('a'<<24) | ('p'<<16) | ('n'<< 8) | ('g'<< 0),
+        .mime_type    = "image/apng",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('i'<<16) | ('c'<< 8) | ('o'<< 0),
+        .mime_type    = "image/vnd.microsoft.icon",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('a'<<24) | ('v'<<16) | ('i'<< 8) | ('f'<< 0),
+        .mime_type    = "image/avif",
+        .charset_utf8 = false,
+    },
+
+    // Fonts ------------------------------------------------------------
+    {
+        .ext_encoding = ('o'<<16) | ('f'<< 8) | ('t'<< 0),
+        .mime_type    = "font/oft",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('t'<<16) | ('t'<< 8) | ('f'<< 0),
+        .mime_type    = "font/ttf",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('w'<<24) | ('o'<<16) | ('f'<< 8) | ('f'<< 0),
+        .mime_type    = "font/woff",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = (((uint64_t) 'w')<<32) |
+            ('o'<<24) | ('f'<<16) | ('f'<< 8) | ('2'<< 0),
+        .mime_type    = "font/woff2",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('e'<<16) | ('o'<< 8) | ('t'<< 0),
+        .mime_type    = "application/vnd.ms-fontobject",
+        .charset_utf8 = false,
+    },
+
+    // Video ------------------------------------------------------------
+    {
+        .ext_encoding = ('m'<<16) | ('p'<< 8) | ('4'<< 0),
+        .mime_type    = "video/mp4",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('m'<<24) | ('p'<<16) | ('e'<< 8) | ('g'<< 0),
+        .mime_type    = "video/mpeg",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('a'<<16) | ('v'<< 8) | ('i'<< 0),
+        .mime_type    = "video/x-msvideo",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('w'<<24) | ('e'<<16) | ('b'<< 8) | ('m'<< 0),
+        .mime_type    = "video/webm",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('o'<<16) | ('g'<< 8) | ('v'<< 0),
+        .mime_type    = "video/ogg",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('o'<<16) | ('g'<< 8) | ('v'<< 0),
+        .mime_type    = "video/mp2t",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('t'<< 8) | ('s'<< 0),
+        .mime_type    = "video/mp2t",
+        .charset_utf8 = false,
+    },
+
+    // Audio ------------------------------------------------------------
+    {
+        .ext_encoding = ('m'<<16) | ('p'<< 8) | ('3'<< 0),
+        .mime_type    = "audio/mpeg",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('w'<<16) | ('a'<< 8) | ('v'<< 0),
+        .mime_type    = "audio/wav",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('o'<<24) | ('p'<<16) | ('u'<< 8) | ('s'<< 0),
+        .mime_type    = "audio/opus",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('o'<<16) | ('g'<< 8) | ('a'<< 0),
+        .mime_type    = "audio/ogg",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('a'<<16) | ('a'<< 8) | ('c'<< 0),
+        .mime_type    = "audio/aac",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('w'<<24) | ('e'<<16) | ('b'<< 8) | ('a'<< 0),
+        .mime_type    = "audio/weba",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('m'<<16) | ('i'<< 8) | ('d'<< 0),
+        .mime_type    = "audio/midi",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('m'<<24) | ('i'<<16) | ('d'<< 8) | ('i'<< 0),
+        .mime_type    = "audio/midi",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('c'<<16) | ('d'<< 8) | ('a'<< 0),
+        .mime_type    = "application/x-cdf",
+        .charset_utf8 = false,
+    },
+
+    // Document / Book formats ------------------------------------------
+    {
+        .ext_encoding = ('p'<<16) | ('d'<< 8) | ('f'<< 0),
+        .mime_type    = "application/pdf",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('d'<<24) | ('o'<<16) | ('c'<< 8) | ('x'<< 0),
+        .mime_type    =
+            "application/vnd.openxmlformats-officedocument.wordprocessingml.document",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('d'<<16) | ('o'<< 8) | ('c'<< 0),
+        .mime_type    = "application/msword",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('x'<<24) | ('l'<<16) | ('s'<< 8) | ('x'<< 0),
+        .mime_type    =
+            "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('x'<<16) | ('l'<< 8) | ('s'<< 0),
+        .mime_type    = "application/vnd.ms-excel",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('p'<<24) | ('p'<<16) | ('t'<< 8) | ('x'<< 0),
+        .mime_type    =
+            "application/vnd.openxmlformats-officedocument.presentationml.presentation",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('p'<<16) | ('p'<< 8) | ('t'<< 0),
+        .mime_type    = "application/vnd.ms-powerpoint",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('o'<<16) | ('d'<< 8) | ('t'<< 0),
+        .mime_type    = "application/vnd.oasis.opendocument.text",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('o'<<16) | ('d'<< 8) | ('p'<< 0),
+        .mime_type    = "application/vnd.oasis.opendocument.presentation",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('o'<<16) | ('d'<< 8) | ('s'<< 0),
+        .mime_type    = "application/vnd.oasis.opendocument.spreadsheet",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('e'<<24) | ('p'<<16) | ('u'<< 8) | ('b'<< 0),
+        .mime_type    = "application/epub+zip",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('a'<<16) | ('z'<< 8) | ('w'<< 0),
+        .mime_type    = "application/vnd.amazon.ebook",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('a'<<16) | ('b'<< 8) | ('w'<< 0),
+        .mime_type    = "application/x-abiword",
+        .charset_utf8 = false,
+    },
+
+    // Archive / compression formats ------------------------------------
+    {
+        .ext_encoding = ('z'<<16) | ('i'<< 8) | ('p'<< 0),
+        .mime_type    = "application/zip",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('g'<< 8) | ('z'<< 0),
+        .mime_type    = "application/gzip",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('t'<<16) | ('a'<< 8) | ('r'<< 0),
+        .mime_type    = "application/x-tar",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('7'<< 8) | ('z'<< 0),
+        .mime_type    = "application/x-7z-compressed",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('b'<< 8) | ('z'<< 0),
+        .mime_type    = "application/x-bzip",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('b'<<16) | ('z'<< 8) | ('2'<< 0),
+        .mime_type    = "application/x-bzip2",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('a'<<16) | ('r'<< 8) | ('c'<< 0),
+        .mime_type    = "application/x-freearc",
+        .charset_utf8 = false,
+    },
+
+    // Programmer BS ----------------------------------------------------
+    {
+        .ext_encoding = ('j'<<16) | ('a'<< 8) | ('r'<< 0),
+        .mime_type    = "application/java-archive",
+        .charset_utf8 = false,
+    },
+    {
+        .ext_encoding = ('p'<<16) | ('h'<< 8) | ('p'<< 0),
+        .mime_type    = "application/x-httpd-php",
+        .charset_utf8 = true,
+    },
+    {
+        .ext_encoding = ('s'<< 8) | ('h'<< 0),
+        .mime_type    = "text/plain",
+        .charset_utf8 = true,
+    },
+    {
+        .ext_encoding = ('r'<<16) | ('t'<< 8) | ('f'<< 0),
+        .mime_type    = "text/plain",
+        .charset_utf8 = true,
+    },
+    {
+        .ext_encoding = ('c'<<16) | ('s'<< 8) | ('h'<< 0),
+        .mime_type    = "text/plain",
+        .charset_utf8 = true,
+    },
+    {
+        .ext_encoding = ('m'<< 8) | ('d'<< 0),
+        .mime_type    = "text/plain",
+        .charset_utf8 = true,
+    },
+    {
+        .ext_encoding = ('o'<<16) | ('r'<< 8) | ('g'<< 0),
+        .mime_type    = "text/plain",
+        .charset_utf8 = true,
+    },
+    {
+        .ext_encoding = ('a'<<16) | ('d'<<16) | ('o'<< 8) | ('c'<< 0),
+        .mime_type    = "text/plain",
+        .charset_utf8 = true,
+    },
+    {
+        .ext_encoding = ('c'<< 0),
+        .mime_type    = "text/plain",
+        .charset_utf8 = true,
+    },
+    {
+        .ext_encoding = ('h'<< 0),
+        .mime_type    = "text/plain",
+        .charset_utf8 = true,
+    },
+    {
+        .ext_encoding = ('p'<< 8) | ('y'<< 0),
+        .mime_type    = "text/plain",
+        .charset_utf8 = true,
+    },
+    {
+        .ext_encoding = ('c'<<16) | ('p'<< 8) | ('p'<< 0),
+        .mime_type    = "text/plain",
+        .charset_utf8 = true,
+    },
+    {
+        .ext_encoding = ('c'<<16) | ('+'<< 8) | ('+'<< 0),
+        .mime_type    = "text/plain",
+        .charset_utf8 = true,
+    },
+    {
+        .ext_encoding = ('h'<<16) | ('p'<< 8) | ('p'<< 0),
+        .mime_type    = "text/plain",
+        .charset_utf8 = true,
+    },
+    {
+        .ext_encoding = ('h'<<16) | ('+'<< 8) | ('+'<< 0),
+        .mime_type    = "text/plain",
+        .charset_utf8 = true,
+    },
+    {
+        .ext_encoding = ('g'<< 8) | ('o'<< 0),
+        .mime_type    = "text/plain",
+        .charset_utf8 = true,
+    },
+    {
+        .ext_encoding = ('j'<<16) | ('a'<<16) | ('v'<< 8) | ('a'<< 0),
+        .mime_type    = "text/plain",
+        .charset_utf8 = true,
+    },
+    {
+        .ext_encoding = ('z'<<16) | ('i'<< 8) | ('g'<< 0),
+        .mime_type    = "text/plain",
+        .charset_utf8 = true,
+    },
+    {
+        .ext_encoding = ('o'<<16) | ('d'<<16) | ('i'<< 8) | ('n'<< 0),
+        .mime_type    = "text/plain",
+        .charset_utf8 = true,
     },
     {
-        .ext_encoding = ('m'<<16) | ('i'<< 8) | ('d'<< 0),
-        .mime_type    = "audio/midi",
-        .charset_utf8 = false,
+        .ext_encoding = ('h'<< 8) | ('a'<< 0),
+        .mime_type    = "text/plain",
+        .charset_utf8 = true,
     },
     {
-        .ext_encoding = ('m'<<24) | ('i'<<16) | ('d'<< 8) | ('i'<< 0),
-        .mime_type    = "audio/midi",
+        .ext_encoding = ('j'<<16) | ('a'<< 8) | ('i'<< 0),
+        .mime_type    = "text/plain",
+        .charset_utf8 = true,
+    },
+    {
+        .ext_encoding = ('r'<< 8) | ('s'<< 0),
+        .mime_type    = "text/plain",
+        .charset_utf8 = true,
+    },
+    {
+        .ext_encoding = ('c'<<16) | ('j'<< 8) | ('s'<< 0),
+        .mime_type    = "text/plain",
+        .charset_utf8 = true,
+    },
+    {
+        .ext_encoding = ('m'<<16) | ('o'<<16) | ('j'<< 8) | ('o'<< 0),
+        .mime_type    = "text/plain",
+        .charset_utf8 = true,
+    },
+    {
+        .ext_encoding = ('r'<< 8) | ('b'<< 0),
+        .mime_type    = "text/plain",
+        .charset_utf8 = true,
+    },
+
+    // Misc -------------------------------------------------------------
+    {
+        .ext_encoding = ('o'<<16) | ('g'<< 8) | ('x'<< 0),
+        .mime_type    = "application/ogg",
         .charset_utf8 = false,
     },
     {
-        .ext_encoding = ('c'<<16) | ('d'<< 8) | ('a'<< 0),
-        .mime_type    = "application/x-cdf",
+        .ext_encoding = ('v'<<16) | ('s'<< 8) | ('d'<< 0),
+        .mime_type    = "application/vnd.visio",
         .charset_utf8 = false,
     },
+};
+
+
+static FileTypeInfo default_faile_type_info = {
+    .ext_encoding = 0,
+    .mime_type    = "",
+    .charset_utf8 = true,
+};
+
+static FileTypeInfo* get_file_type_info_(struct httpsrvdev_inst* inst, char* file_path) {
+    uint64_t ext_encoding = httpsrvdev_file_encode_ext(inst, file_path);
+    if (ext_encoding == 0) {
+        if (inst->default_file_mime_type[0] == '\0') {
+            inst->err = httpsrvdev_FILE_HAS_NO_EXT;
+        }
+        default_faile_type_info.ext_encoding = ext_encoding;
+        default_faile_type_info.mime_type    = inst->default_file_mime_type;
+        default_faile_type_info.charset_utf8 = true;
+        return &default_faile_type_info;
+    }
+
+    // TODO: Do something faster than a linear search
+    for (size_t i = 0; i < sizeof(file_type_infos)/sizeof(file_type_infos[0]); ++i) {
+        if (file_type_infos[i].ext_encoding == ext_encoding) {
+            return &file_type_infos[i];
+        }
+    }
+
+    inst->err = httpsrvdev_LIB_IMPL_ERR;
+    default_faile_type_info.ext_encoding = ext_encoding;
+    default_faile_type_info.mime_type    = inst->default_file_mime_type;
+    default_faile_type_info.charset_utf8 = true;
+    return &default_faile_type_info;
+}
+
+// Send the status line and the headers describing a file's contents
+static bool res_file_headers(struct httpsrvdev_inst* inst,
+    FileTypeInfo* file_type_info, off_t content_length
+) {
+    if (!httpsrvdev_res_status_line(inst, 200)) return false;
+    if (!httpsrvdev_res_headerf(inst, "Content-Length", "%lld", (long long) content_length))
+        return false;
+    if (file_type_info->charset_utf8) {
+        if (!httpsrvdev_res_headerf(inst,
+            "Content-Type", "%s; charset=utf-8", file_type_info->mime_type)
+        ) return false;
+    } else {
+        if (!httpsrvdev_res_header(inst, "Content-Type", file_type_info->mime_type))
+            return false;
+    }
+
+    return true;
+}
+
+// Send the `size` bytes of the file `fd`, and close it
+static bool res_file_body(struct httpsrvdev_inst* inst, int fd, off_t size) {
+    // Straight from the page cache to the socket, unless the body is to be
+    // recorded, encrypted in user space, or read by the file system workers,
+    // which `sendfile` would block on page cache misses
+    if (inst->conn->res_recording == NULL && inst->fs_pool == NULL && conn_sock_is_plain(inst)) {
+        off_t offset = 0;
+        while (offset < size) {
+            ssize_t n_sent = sendfile(inst->conn->conn_sock_fd, fd, &offset, size - offset);
+            if (n_sent == -1) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN && conn_wait(inst, POLLOUT)) continue;
+                close(fd);
+                return false;
+            }
+            // The file was truncated meanwhile
+            if (n_sent == 0) {
+                inst->err = httpsrvdev_COULD_NOT_READ_FILE;
+                close(fd);
+                return false;
+            }
+            inst->conn->res_bytes_sent += n_sent;
+        }
+        if (close(fd) == -1) {
+            inst->err = httpsrvdev_COULD_NOT_CLOSE_FILE | (errno & httpsrvdev_MASK_ERRNO);
+            return false;
+        }
+        return true;
+    }
+
+    // Read in large chunks so that a page cache miss is offloaded once per
+    // chunk rather than once per few KiB
+    size_t chunk_size = 32*1024;
+    char*  chunk = tmp_alloc(inst, chunk_size);
+    if (chunk == NULL) {
+        close(fd);
+        return false;
+    }
+    off_t offset = 0;
+    while (true) {
+        ssize_t n_bytes_read = fs_pread(inst, fd, chunk, chunk_size, offset);
+        if (n_bytes_read == -1) {
+            inst->err = httpsrvdev_COULD_NOT_READ_FILE | (errno & httpsrvdev_MASK_ERRNO);
+            close(fd);
+            return false;
+        }
+        if (n_bytes_read == 0) break;
+        offset += n_bytes_read;
+        if (!httpsrvdev_res_send_n(inst, chunk, n_bytes_read)) {
+            close(fd);
+            return false;
+        }
+    }
+
+    if (close(fd) == -1) {
+        inst->err = httpsrvdev_COULD_NOT_CLOSE_FILE | (errno & httpsrvdev_MASK_ERRNO);
+        return false;
+    }
+    return true;
+}
+
+bool httpsrvdev_res_file(struct httpsrvdev_inst* inst, char* path) {
+    FileTypeInfo* file_type_info = get_file_type_info_(inst, path);
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        inst->err = httpsrvdev_COULD_NOT_OPEN_FILE | (errno & httpsrvdev_MASK_ERRNO);
+        // Goto ensures that file descriptor is closed
+        close(fd);
+        return false;
+    }
+
+    if (lseek(fd, 0, SEEK_SET) == -1) {
+        inst->err = httpsrvdev_FILE_SYS_ERR | (errno & httpsrvdev_MASK_ERRNO);
+        close(fd);
+        return false;
+    }
+    off_t content_length = lseek(fd, 0, SEEK_END);
+    if (content_length == -1) {
+        inst->err = httpsrvdev_COULD_NOT_GET_FILE_CONTENT_LENGTH |
+                    (errno & httpsrvdev_MASK_ERRNO);
+        close(fd);
+        return false;
+    }
+    if (lseek(fd, 0, SEEK_SET) == -1) {
+        inst->err = httpsrvdev_FILE_SYS_ERR | (errno & httpsrvdev_MASK_ERRNO);
+        close(fd);
+        return false;
+    }
+
+    // Appending the script after "</html>" is fine for browsers and saves
+    // scanning the file for a place to insert it
+    bool inject_live_reload_script = inst->live_reload != NULL &&
+                                     strcmp(file_type_info->mime_type, "text/html") == 0;
+    if (inject_live_reload_script) {
+        content_length += sizeof(live_reload_script) - 1;
+    }
+
+    if (!res_file_headers(inst, file_type_info, content_length)) {
+        close(fd);
+        return false;
+    }
+    if (!httpsrvdev_res_header (inst, "Connection", "Keep-Alive")) {
+        close(fd);
+        return false;
+    }
+
+    if (!httpsrvdev_res_send_n(inst, "\r\n", 2)) {
+        close(fd);
+        return false;
+    }
+
+    off_t file_size = content_length;
+    if (inject_live_reload_script) file_size -= sizeof(live_reload_script) - 1;
+    if (h2_stream_is_current(inst)) {
+        // Read only once the stream's DATA frames are due
+        if (!h2_stream_queue_file(inst, fd, 0, file_size)) return false;
+    } else if (!res_file_body(inst, fd, file_size)) {
+        return false;
+    }
+
+    if (inject_live_reload_script &&
+        !httpsrvdev_res_send_n(inst, live_reload_script, sizeof(live_reload_script) - 1)
+    ) return false;
+
+    if (!httpsrvdev_res_end(inst)) return false;
+
+    return true;
+}
+
+static char* index_files[] = {"/index.html", "/index.htm"};
+
+bool httpsrvdev_res_dir(struct httpsrvdev_inst* inst, char* dir_path) {
+    // Respond with the index.htm(l) file of existent in the directory
+    struct httpsrvdev_arena_mark arena_mark = httpsrvdev_arena_save(&inst->conn->arena);
+    for (size_t i = 0; i < sizeof(index_files)/sizeof(index_files[0]); ++i) {
+        httpsrvdev_arena_reset(&inst->conn->arena, arena_mark);
+        char* index_file_path = tmp_alloc(inst, PATH_MAX);
+        if (index_file_path == NULL) return false;
+        int   index_file_path_len = snprintf(index_file_path, PATH_MAX,
+                                             "%s%s", dir_path, index_files[i]);
+        if (index_file_path_len < 0 || index_file_path_len >= PATH_MAX) continue;
+        struct stat index_file_path_stat;
+
+        if (fs_stat(inst, index_file_path, &index_file_path_stat) == -1 ||
+            (index_file_path_stat.st_mode & S_IFMT) != S_IFREG
+        ) continue;
+
+        return httpsrvdev_res_file(inst, index_file_path);
+    }
+    httpsrvdev_arena_reset(&inst->conn->arena, arena_mark);
+
+    // Construct buffer containing "<dir_path>/" that will act as the prefix
+    // for the path to each directory entry
+    char* entry_path_buf = tmp_alloc(inst, PATH_MAX);
+    if (entry_path_buf == NULL) return false;
+    if (!path_with_root_to_path_rel_to_root(inst, dir_path, entry_path_buf))
+        return false;
+    char* entry_name_in_path_start = entry_path_buf + strlen(entry_path_buf);
+    if (entry_name_in_path_start == entry_path_buf ||
+        *(entry_name_in_path_start - 1) != '/'
+    ) {
+        if (entry_name_in_path_start + 1 >= entry_path_buf + PATH_MAX) {
+            inst->err = httpsrvdev_BUF_TOO_SMALL;
+            return false;
+        }
+        *entry_name_in_path_start = '/';
+        ++entry_name_in_path_start;
+    }
+    size_t entry_name_max_len = entry_path_buf + PATH_MAX - entry_name_in_path_start;
+
+    // Create the directory listing
+    struct dirent** entries;
+    int n_entries = fs_scandir(inst, dir_path, &entries);
+    if (n_entries == -1) {
+        inst->err = httpsrvdev_COULD_NOT_OPEN_DIR | (errno & httpsrvdev_MASK_ERRNO);
+        return false;
+    }
+    bool ok = httpsrvdev_res_listing_begin(inst);
+    for (size_t i = 0; i < n_entries; ++i) {
+        struct dirent* entry = entries[i];
+        char* entry_name = entry->d_name;
+        size_t entry_name_len = strlen(entry_name);
+        // Skip entries whose path wouldn't fit, leaving space for '/' and '\0'
+        if (ok && entry_name_len + 2 <= entry_name_max_len) {
+            char* path_end = stpcpy(entry_name_in_path_start, entry_name);
+            // Add trailing '/' to entry path if it's a directory.
+            // This ensures that the directory is kept in URL.
+            if (entry->d_type == DT_DIR) {
+                *(path_end++) = '/';
+                *path_end = '\0';
+            }
+            ok = httpsrvdev_res_listing_entry(inst, entry_path_buf, entry_name);
+        }
+        free(entry);
+    }
+    free(entries);
+    if (!ok) return false;
+
+    return httpsrvdev_res_listing_end(inst);
+}
+
+bool httpsrvdev_res_file_sys_entry(struct httpsrvdev_inst* inst, char* path) {
+    struct stat path_stat;
+    if (fs_stat(inst, path, &path_stat) == -1) {
+        inst->err = httpsrvdev_COULD_NOT_STAT | (errno & httpsrvdev_MASK_ERRNO);
+        return false;
+    }
+
+    int file_type = path_stat.st_mode & S_IFMT;
+    switch (file_type) {
+        case S_IFREG:
+            return httpsrvdev_res_file(inst, path);
+        case S_IFDIR:
+            return httpsrvdev_res_dir(inst, path);
+    }
+
+    inst->err = httpsrvdev_UNHANDLED_FILE_TYPE | (file_type & httpsrvdev_MASK_FILE_TYPE);
+    return false;
+}
+
+bool httpsrvdev_res_filef(struct httpsrvdev_inst* inst, char* fmt, ...) {
+    char str_buf[PATH_MAX];
+    SPRINTF_TO_STR_FROM_FMT_AND_VARGS;
+    return httpsrvdev_res_file(inst, str_buf);
+}
+
+bool httpsrvdev_res_dirf(struct httpsrvdev_inst* inst, char* fmt, ...) {
+    char str_buf[PATH_MAX];
+    SPRINTF_TO_STR_FROM_FMT_AND_VARGS;
+    return httpsrvdev_res_dir(inst, str_buf);
+}
+
+bool httpsrvdev_res_file_sys_entryf(struct httpsrvdev_inst* inst, char* fmt, ...) {
+    char str_buf[PATH_MAX];
+    SPRINTF_TO_STR_FROM_FMT_AND_VARGS;
+    return httpsrvdev_res_file_sys_entry(inst, str_buf);
+}
+
+bool httpsrvdev_res_rel_file(struct httpsrvdev_inst* inst, char* path) {
+    char resolved_path[PATH_MAX];
+    if (!path_rel_to_root_to_path_with_root(inst, path, resolved_path)) return false;
+    return httpsrvdev_res_file(inst, resolved_path);
+}
+
+bool httpsrvdev_res_rel_dir(struct httpsrvdev_inst* inst, char* path) {
+    char resolved_path[PATH_MAX];
+    if (!path_rel_to_root_to_path_with_root(inst, path, resolved_path)) return false;
+    return httpsrvdev_res_dir(inst, resolved_path);
+}
+
+bool httpsrvdev_res_rel_file_sys_entry(struct httpsrvdev_inst* inst, char* path) {
+    char resolved_path[PATH_MAX];
+    if (!path_rel_to_root_to_path_with_root(inst, path, resolved_path)) return false;
+    return httpsrvdev_res_file_sys_entry(inst, resolved_path);
+}
+
+bool httpsrvdev_res_rel_filef(struct httpsrvdev_inst* inst, char* fmt, ...) {
+    char str_buf[PATH_MAX];
+    SPRINTF_TO_STR_FROM_FMT_AND_VARGS;
+    char resolved_path[PATH_MAX];
+    if (!path_rel_to_root_to_path_with_root(inst, str_buf, resolved_path)) return false;
+    return httpsrvdev_res_file(inst, resolved_path);
+}
+
+bool httpsrvdev_res_rel_dirf(struct httpsrvdev_inst* inst, char* fmt, ...) {
+    char str_buf[PATH_MAX];
+    SPRINTF_TO_STR_FROM_FMT_AND_VARGS;
+    char resolved_path[PATH_MAX];
+    if (!path_rel_to_root_to_path_with_root(inst, str_buf, resolved_path)) return false;
+    return httpsrvdev_res_dir(inst, resolved_path);
+}
+
+bool httpsrvdev_res_rel_file_sys_entryf(struct httpsrvdev_inst* inst, char* fmt, ...) {
+    char str_buf[PATH_MAX];
+    SPRINTF_TO_STR_FROM_FMT_AND_VARGS;
+    char resolved_path[PATH_MAX];
+    if (!path_rel_to_root_to_path_with_root(inst, str_buf, resolved_path)) return false;
+    return httpsrvdev_res_file_sys_entry(inst, resolved_path);
+}
+
+// Escaping of names for listings: as HTML text, as HTML attribute values and
+// as URL path segments. Most names need no escaping at all, so the bytes are
+// first scanned 32 (AVX2) or 16 (SSE2) at a time for those that might, and
+// the runs in between are copied as they are. The vector checks only rule
+// bytes out; a byte they flag is looked at again by `escape_byte`.
+
+#define ESCAPE_HTML_TEXT 0  // & < >
+#define ESCAPE_HTML_ATTR 1  // & < > " '
+#define ESCAPE_URL_PATH  2  // All but unreserved bytes, sub-delimiters, ':', '@' and '/'
+// How much longer than its input an escaped string may be: '"' becomes
+// "&quot;", bytes in URLs "%XX"
+#define ESCAPE_MAX_GROWTH 6
+
+// Write the escaped form of `c` to `dest`, returning its length. Bytes that
+// need no escaping are written as they are.
+static size_t escape_byte(int kind, uint8_t c, char* dest) {
+    char* html = NULL;
+    switch (c) {
+        case '&':  html = "&amp;";  break;
+        case '<':  html = "&lt;";   break;
+        case '>':  html = "&gt;";   break;
+        case '"':  html = kind == ESCAPE_HTML_ATTR ? "&quot;" : NULL; break;
+        case '\'': html = kind == ESCAPE_HTML_ATTR ? "&#39;"  : NULL; break;
+    }
+    if (kind != ESCAPE_URL_PATH) {
+        if (html == NULL) {
+            *dest = c;
+            return 1;
+        }
+        size_t html_len = strlen(html);
+        memcpy(dest, html, html_len);
+        return html_len;
+    }
+    // '&' and '\'' are allowed in paths but are escaped anyway, so that the
+    // result can be put into HTML attributes as is
+    bool is_safe = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+                   (c != '\0' && strchr("-._~!$()*+,;=:@/", c) != NULL);
+    if (is_safe) {
+        *dest = c;
+        return 1;
+    }
+    static char hex_digits[] = "0123456789ABCDEF";
+    dest[0] = '%';
+    dest[1] = hex_digits[c >> 4];
+    dest[2] = hex_digits[c & 0xF];
+    return 3;
+}
+
+#if defined(__x86_64__)
+// The vector scans return the offset of the first byte that might need
+// escaping, or `len`. The last, partial vector's worth is copied out first so
+// that nothing is read past the end.
+
+__attribute__((target("avx2")))
+static size_t escape_scan_avx2(int kind, uint8_t* src, size_t len) {
+    for (size_t i = 0; i < len; i += 32) {
+        uint8_t tail[32];
+        uint8_t* block = src + i;
+        if (len - i < 32) {
+            memcpy(tail, block, len - i);
+            block = tail;
+        }
+        __m256i bytes = _mm256_loadu_si256((__m256i*) block);
+        __m256i flagged;
+        if (kind == ESCAPE_URL_PATH) {
+            // Letters, digits and the most common punctuation are safe
+            __m256i lower   = _mm256_or_si256(bytes, _mm256_set1_epi8(0x20));
+            __m256i letter  = _mm256_sub_epi8(lower, _mm256_set1_epi8('a'));
+            __m256i digit   = _mm256_sub_epi8(bytes, _mm256_set1_epi8('0'));
+            __m256i is_safe = _mm256_or_si256(
+                _mm256_cmpeq_epi8(_mm256_min_epu8(letter, _mm256_set1_epi8(25)), letter),
+                _mm256_cmpeq_epi8(_mm256_min_epu8(digit,  _mm256_set1_epi8(9)),  digit));
+            is_safe = _mm256_or_si256(is_safe, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('-')));
+            is_safe = _mm256_or_si256(is_safe, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('.')));
+            is_safe = _mm256_or_si256(is_safe, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('_')));
+            is_safe = _mm256_or_si256(is_safe, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('/')));
+            flagged = _mm256_xor_si256(is_safe, _mm256_set1_epi8(-1));
+        } else {
+            flagged = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('&')),
+                                _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('<'))),
+                _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('>')));
+            if (kind == ESCAPE_HTML_ATTR) {
+                flagged = _mm256_or_si256(flagged,
+                    _mm256_or_si256(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('"')),
+                                    _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\''))));
+            }
+        }
+        uint32_t mask = _mm256_movemask_epi8(flagged);
+        if (len - i < 32) mask &= ((uint32_t) 1 << (len - i)) - 1;
+        if (mask != 0) return i + __builtin_ctz(mask);
+    }
+    return len;
+}
+
+static size_t escape_scan_sse2(int kind, uint8_t* src, size_t len) {
+    for (size_t i = 0; i < len; i += 16) {
+        uint8_t tail[16];
+        uint8_t* block = src + i;
+        if (len - i < 16) {
+            memcpy(tail, block, len - i);
+            block = tail;
+        }
+        __m128i bytes = _mm_loadu_si128((__m128i*) block);
+        __m128i flagged;
+        if (kind == ESCAPE_URL_PATH) {
+            __m128i lower   = _mm_or_si128(bytes, _mm_set1_epi8(0x20));
+            __m128i letter  = _mm_sub_epi8(lower, _mm_set1_epi8('a'));
+            __m128i digit   = _mm_sub_epi8(bytes, _mm_set1_epi8('0'));
+            __m128i is_safe = _mm_or_si128(
+                _mm_cmpeq_epi8(_mm_min_epu8(letter, _mm_set1_epi8(25)), letter),
+                _mm_cmpeq_epi8(_mm_min_epu8(digit,  _mm_set1_epi8(9)),  digit));
+            is_safe = _mm_or_si128(is_safe, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('-')));
+            is_safe = _mm_or_si128(is_safe, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('.')));
+            is_safe = _mm_or_si128(is_safe, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('_')));
+            is_safe = _mm_or_si128(is_safe, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('/')));
+            flagged = _mm_xor_si128(is_safe, _mm_set1_epi8(-1));
+        } else {
+            flagged = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('&')),
+                             _mm_cmpeq_epi8(bytes, _mm_set1_epi8('<'))),
+                _mm_cmpeq_epi8(bytes, _mm_set1_epi8('>')));
+            if (kind == ESCAPE_HTML_ATTR) {
+                flagged = _mm_or_si128(flagged,
+                    _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('"')),
+                                 _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\''))));
+            }
+        }
+        uint32_t mask = _mm_movemask_epi8(flagged);
+        if (len - i < 16) mask &= ((uint32_t) 1 << (len - i)) - 1;
+        if (mask != 0) return i + __builtin_ctz(mask);
+    }
+    return len;
+}
+#endif
+
+// The offset of the first byte of `src` that needs escaping, or `len`
+static size_t escape_scan(int kind, uint8_t* src, size_t len) {
+    char   escaped[ESCAPE_MAX_GROWTH];
+    size_t i = 0;
+    while (i < len) {
+#if defined(__x86_64__)
+        if (__builtin_cpu_supports("avx2")) {
+            i += escape_scan_avx2(kind, src + i, len - i);
+        } else {
+            i += escape_scan_sse2(kind, src + i, len - i);
+        }
+        if (i == len) break;
+#endif
+        if (escape_byte(kind, src[i], escaped) > 1 || escaped[0] != src[i]) return i;
+        ++i;
+    }
+    return len;
+}
+
+// Write `src` escaped as `kind` to `dest`, which must have space for
+// ESCAPE_MAX_GROWTH times `len` bytes, returning the escaped length
+static size_t escape(int kind, char* dest, char* src, size_t len) {
+    size_t dest_len = 0;
+    size_t i        = 0;
+    while (true) {
+        size_t run_len = escape_scan(kind, (uint8_t*) src + i, len - i);
+        memcpy(dest + dest_len, src + i, run_len);
+        dest_len += run_len;
+        i        += run_len;
+        if (i == len) return dest_len;
+        dest_len += escape_byte(kind, src[i], dest + dest_len);
+        ++i;
+    }
+}
+
+// Send `n` bytes of `data` as a single chunk of a chunked response body
+static bool res_send_chunk(struct httpsrvdev_inst* inst, char* data, size_t n) {
+    char size_line[24];
+    int  size_line_len = snprintf(size_line, sizeof(size_line), "%zX\r\n", n);
+    if (!httpsrvdev_res_send_n(inst, size_line, size_line_len)) return false;
+    if (!httpsrvdev_res_send_n(inst, data, n))                  return false;
+    if (!httpsrvdev_res_send_n(inst, "\r\n", 2))                return false;
+
+    return true;
+}
+
+// Listings are sent in chunks of at least LISTING_CHUNK_MIN bytes, except
+// for the last one. The buffer has space for that plus an entry with the
+// longest path and link text, escaped.
+#define LISTING_CHUNK_MIN (16*1024)
+#define LISTING_BUF_SIZE  (64*1024)
+
+static bool listing_flush(struct httpsrvdev_inst* inst) {
+    if (inst->conn->res_listing_len == 0) return true;
+    size_t len = inst->conn->res_listing_len;
+    inst->conn->res_listing_len = 0;
+    return res_send_chunk(inst, inst->conn->res_listing_buf, len);
+}
+
+static bool listing_append(struct httpsrvdev_inst* inst, char* data, size_t n) {
+    if (inst->conn->res_listing_len + n > LISTING_BUF_SIZE && !listing_flush(inst)) return false;
+    if (n > LISTING_BUF_SIZE) return res_send_chunk(inst, data, n);
+    memcpy(inst->conn->res_listing_buf + inst->conn->res_listing_len, data, n);
+    inst->conn->res_listing_len += n;
+    return true;
+}
+
+bool httpsrvdev_res_listing_begin(struct httpsrvdev_inst* inst) {
+    inst->conn->res_listing_buf = tmp_alloc(inst, LISTING_BUF_SIZE);
+    inst->conn->res_listing_len = 0;
+    if (inst->conn->res_listing_buf == NULL) return false;
+
+    if (!httpsrvdev_res_status_line(inst, 200))                         return false;
+    if (!httpsrvdev_res_header(inst, "Content-Type", "text/html"))      return false;
+    if (!httpsrvdev_res_header(inst, "Transfer-Encoding", "chunked"))   return false;
+    if (!httpsrvdev_res_send_n(inst, "\r\n", 2))                        return false;
+    char html[] =
+        "<!DOCTYPE html>\n"
+        "<html><body style=\"font-family:sans-serif;\n"
+        "background-color:#000;margin:2em\">\n";
+    return listing_append(inst, html, sizeof(html) - 1);
+}
+
+// `path` is a path, not a URL: it is percent-encoded for the link, and
+// `link_text` is escaped
+bool httpsrvdev_res_listing_entry(struct httpsrvdev_inst* inst,
+    char* path, char* link_text
+) {
+    bool path_is_abs = path[0] == '/';
+    char* anchor_target;
+    if (path_is_abs) {
+        anchor_target = "_top";
+    } else {
+        anchor_target = "_self";
+    }
+    char html_begin[] =
+        "<a style=\"color:#FFF;text-decoration:underline;"
+                   "display:block;margin-bottom:0.5em\" "
+            "href=\"";
+    char html_middle_fmt[] = "\" target=\"%s\">";
+    char html_end[] = "</a>";
+
+    size_t path_len      = strlen(path);
+    size_t link_text_len = strlen(link_text);
+    if (path_len >= PATH_MAX || link_text_len >= PATH_MAX) {
+        inst->err = httpsrvdev_BUF_TOO_SMALL;
+        return false;
+    }
+    size_t max_len = sizeof(html_begin) + sizeof(html_middle_fmt) + 8 + sizeof(html_end) +
+                     ESCAPE_MAX_GROWTH*(path_len + link_text_len);
+    if (inst->conn->res_listing_len + max_len > LISTING_BUF_SIZE && !listing_flush(inst)) {
+        return false;
+    }
+
+    char*  buf = inst->conn->res_listing_buf;
+    size_t len = inst->conn->res_listing_len;
+    memcpy(buf + len, html_begin, sizeof(html_begin) - 1);
+    len += sizeof(html_begin) - 1;
+    len += escape(ESCAPE_URL_PATH, buf + len, path, path_len);
+    len += sprintf(buf + len, html_middle_fmt, anchor_target);
+    len += escape(ESCAPE_HTML_TEXT, buf + len, link_text, link_text_len);
+    memcpy(buf + len, html_end, sizeof(html_end) - 1);
+    len += sizeof(html_end) - 1;
+    inst->conn->res_listing_len = len;
+
+    if (inst->conn->res_listing_len >= LISTING_CHUNK_MIN) return listing_flush(inst);
+    return true;
+}
+
+bool httpsrvdev_res_listing_end(struct httpsrvdev_inst* inst) {
+    char html[] = "</body></html>";
+    bool ok = listing_append(inst, html, sizeof(html) - 1);
+    if (ok && inst->live_reload != NULL) {
+        ok = listing_append(inst, live_reload_script, sizeof(live_reload_script) - 1);
+    }
+    ok = ok && listing_flush(inst);
+    inst->conn->res_listing_buf = NULL;
+    inst->conn->res_listing_len = 0;
+    if (!ok) return false;
+    // Last, empty chunk. The final CRLF is sent by `httpsrvdev_res_end`.
+    if (!httpsrvdev_res_send_n(inst, "0\r\n", 3))        return false;
+    return httpsrvdev_res_end(inst);
+}
+
+// --------------------------------------------------------
+// Archives
+// --------------------------------------------------------
+
+// Resources:
+//     ustar/pax: https://pubs.opengroup.org/onlinepubs/9699919799/utilities/pax.html
+//     ZIP      : https://pkware.cachefly.net/webdocs/casestudies/APPNOTE.TXT
+
+#define ARCHIVE_STORED  0
+#define ARCHIVE_DEFLATE 8
+
+struct archive_member {
+    uint64_t hash;
+    char*    name;     // Relative path without leading "./" or '/'
+    size_t   name_len;
+    off_t    offset;   // Of the member's (possibly compressed) data
+    off_t    size;     // Of the member's (possibly compressed) data
+    int      method;   // ARCHIVE_STORED or ARCHIVE_DEFLATE
+};
+
+struct httpsrvdev_archive {
+    int    fd;
+    char*  map;
+    size_t map_size;
+
+    // Open-addressing hash table keyed on `name`
+    struct archive_member* members;
+    size_t                 members_cap; // Power of 2
+    size_t                 members_count;
+
+    // The members ordered by name, for finding the contents of directories
+    struct archive_member** sorted;
+};
+
+static struct archive_member* archive_find_slot(struct httpsrvdev_archive* archive,
+    char* name, size_t name_len, uint64_t hash
+) {
+    size_t mask = archive->members_cap - 1;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        struct archive_member* member = &archive->members[i];
+        if (member->name == NULL ||
+            (member->hash == hash && member->name_len == name_len &&
+             memcmp(member->name, name, name_len) == 0)
+        ) {
+            return member;
+        }
+    }
+}
+
+static struct archive_member* archive_find(struct httpsrvdev_archive* archive,
+    char* name, size_t name_len
+) {
+    if (archive->members_cap == 0) return NULL;
+    struct archive_member* member =
+        archive_find_slot(archive, name, name_len, hash_fnv1a(name, name_len));
+    return member->name == NULL ? NULL : member;
+}
+
+static bool archive_add(struct httpsrvdev_inst* inst, struct httpsrvdev_archive* archive,
+    char* name, size_t name_len, off_t offset, off_t size, int method
+) {
+    // Normalize the name
+    while (name_len >= 2 && name[0] == '.' && name[1] == '/') {
+        name += 2;
+        name_len -= 2;
+    }
+    while (name_len > 0 && name[0] == '/') {
+        ++name;
+        --name_len;
+    }
+    if (name_len == 0 || name[name_len - 1] == '/') return true;
+    if (offset < 0 || size < 0 || offset + size > archive->map_size) {
+        inst->err = httpsrvdev_COULD_NOT_READ_ARCHIVE;
+        return false;
+    }
+
+    // Keep the load factor at or below 1/2
+    if (2*(archive->members_count + 1) > archive->members_cap) {
+        size_t old_cap = archive->members_cap;
+        struct archive_member* old_members = archive->members;
+        archive->members_cap = old_cap == 0 ? 64 : 2*old_cap;
+        archive->members = calloc(archive->members_cap, sizeof(archive->members[0]));
+        if (archive->members == NULL) {
+            inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+            archive->members     = old_members;
+            archive->members_cap = old_cap;
+            return false;
+        }
+        for (size_t i = 0; i < old_cap; ++i) {
+            if (old_members[i].name == NULL) continue;
+            *archive_find_slot(archive, old_members[i].name, old_members[i].name_len,
+                               old_members[i].hash) = old_members[i];
+        }
+        free(old_members);
+    }
+
+    // Later members replace earlier ones with the same name, as when
+    // extracting
+    uint64_t hash = hash_fnv1a(name, name_len);
+    struct archive_member* member = archive_find_slot(archive, name, name_len, hash);
+    if (member->name == NULL) {
+        char* name_copy = strndup(name, name_len);
+        if (name_copy == NULL) {
+            inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+            return false;
+        }
+        member->name     = name_copy;
+        member->name_len = name_len;
+        member->hash     = hash;
+        ++archive->members_count;
+    }
+    member->offset = offset;
+    member->size   = size;
+    member->method = method;
+
+    return true;
+}
+
+// Parse a NUL or space terminated octal tar header field
+static bool tar_parse_octal(char* field, size_t field_size, off_t* result) {
+    off_t value = 0;
+    size_t i = 0;
+    while (i < field_size && field[i] == ' ') ++i;
+    for (; i < field_size && field[i] != '\0' && field[i] != ' '; ++i) {
+        if (field[i] < '0' || field[i] > '7') return false;
+        if (value > (INT64_MAX >> 3)) return false;
+        value = (value << 3) | (field[i] - '0');
+    }
+    *result = value;
+    return true;
+}
+
+static bool archive_index_tar(struct httpsrvdev_inst* inst, struct httpsrvdev_archive* archive) {
+    char* map = archive->map;
+    size_t map_size = archive->map_size;
+
+    // Name of the next member from a GNU long name or pax header, if any
+    char*  next_name     = NULL;
+    size_t next_name_len = 0;
+
+    for (size_t offset = 0; offset + 512 <= map_size; ) {
+        char* header = map + offset;
+        // The archive ends with (at least) one zero block
+        if (header[0] == '\0') break;
+
+        off_t size;
+        if (!tar_parse_octal(header + 124, 12, &size) ||
+            size > map_size - offset - 512
+        ) {
+            inst->err = httpsrvdev_COULD_NOT_READ_ARCHIVE;
+            return false;
+        }
+        off_t data_offset = offset + 512;
+        char  type        = header[156];
+
+        if (type == 'L') {
+            // GNU long name: the data is the NUL-terminated name of the next member
+            next_name     = map + data_offset;
+            next_name_len = strnlen(next_name, size);
+        } else if (type == 'x') {
+            // pax extended header: records of "<len> <key>=<value>\n"
+            char* record     = map + data_offset;
+            char* record_end = record + size;
+            while (record < record_end) {
+                char* len_end;
+                long  record_len = strtol(record, &len_end, 10);
+                if (record_len <= 0 || record_len > record_end - record) break;
+                char* key = len_end + 1;
+                if (key + 5 <= record + record_len && memcmp(key, "path=", 5) == 0) {
+                    next_name     = key + 5;
+                    next_name_len = record + record_len - 1 - next_name;
+                }
+                record += record_len;
+            }
+        } else {
+            if (type == '0' || type == '\0' || type == '7') {
+                char*  name;
+                size_t name_len;
+                char   ustar_name[256];
+                if (next_name != NULL) {
+                    name     = next_name;
+                    name_len = next_name_len;
+                } else if (memcmp(header + 257, "ustar\0", 6) == 0 && header[345] != '\0') {
+                    // ustar splits long names into a prefix and a name
+                    int ustar_name_len = snprintf(ustar_name, sizeof(ustar_name), "%.155s/%.100s",
+                                                  header + 345, header);
+                    name     = ustar_name;
+                    name_len = ustar_name_len;
+                } else {
+                    name     = header;
+                    name_len = strnlen(header, 100);
+                }
+                if (!archive_add(inst, archive, name, name_len,
+                                 data_offset, size, ARCHIVE_STORED)
+                ) return false;
+            }
+            next_name = NULL;
+        }
+
+        offset = data_offset + ((size + 511) & ~(off_t) 511);
+    }
+
+    return true;
+}
+
+static uint16_t read_le16(char* ptr) {
+    unsigned char* p = (unsigned char*) ptr;
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t read_le32(char* ptr) {
+    unsigned char* p = (unsigned char*) ptr;
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static bool archive_index_zip(struct httpsrvdev_inst* inst, struct httpsrvdev_archive* archive) {
+    char* map = archive->map;
+    size_t map_size = archive->map_size;
+
+    // Find the end of central directory record, which is followed by a
+    // comment of up to 64 KiB
+    if (map_size < 22) goto err_corrupt;
+    char* eocd = NULL;
+    for (size_t i = map_size - 22; ; --i) {
+        if (read_le32(map + i) == 0x06054b50) {
+            eocd = map + i;
+            break;
+        }
+        if (i == 0 || map_size - i > 22 + 0xFFFF) break;
+    }
+    if (eocd == NULL) goto err_corrupt;
+
+    size_t entries_count = read_le16(eocd + 10);
+    size_t cd_size       = read_le32(eocd + 12);
+    size_t cd_offset     = read_le32(eocd + 16);
+    if (cd_offset > map_size || cd_size > map_size - cd_offset) goto err_corrupt;
+
+    char* entry     = map + cd_offset;
+    char* entry_end = map + cd_offset + cd_size;
+    for (size_t i = 0; i < entries_count; ++i) {
+        if (entry + 46 > entry_end || read_le32(entry) != 0x02014b50) goto err_corrupt;
+        bool     is_encrypted      = read_le16(entry + 8) & 1;
+        int      method            = read_le16(entry + 10);
+        uint32_t compressed_size   = read_le32(entry + 20);
+        uint32_t uncompressed_size = read_le32(entry + 24);
+        size_t   name_len          = read_le16(entry + 28);
+        size_t   extra_len         = read_le16(entry + 30);
+        size_t   comment_len       = read_le16(entry + 32);
+        size_t   local_offset      = read_le32(entry + 42);
+        char*    name              = entry + 46;
+        if (name + name_len > entry_end) goto err_corrupt;
+
+        // ZIP64 and encrypted members, and other compression methods, are skipped
+        bool is_zip64 = compressed_size == 0xFFFFFFFF || uncompressed_size == 0xFFFFFFFF ||
+                        local_offset == 0xFFFFFFFF;
+        if (!is_zip64 && !is_encrypted && (method == ARCHIVE_STORED || method == ARCHIVE_DEFLATE)) {
+            // The local header's name and extra field may differ in length
+            // from the central directory's
+            if (local_offset + 30 > map_size ||
+                read_le32(map + local_offset) != 0x04034b50
+            ) goto err_corrupt;
+            off_t data_offset = local_offset + 30 +
+                                read_le16(map + local_offset + 26) +
+                                read_le16(map + local_offset + 28);
+            if (!archive_add(inst, archive, name, name_len,
+                             data_offset, compressed_size, method)
+            ) return false;
+        }
+
+        entry = name + name_len + extra_len + comment_len;
+    }
+
+    return true;
+
+err_corrupt:
+    inst->err = httpsrvdev_COULD_NOT_READ_ARCHIVE;
+    return false;
+}
+
+static int archive_member_cmp(const void* a, const void* b) {
+    struct archive_member* member_a = *(struct archive_member**) a;
+    struct archive_member* member_b = *(struct archive_member**) b;
+    return strcmp(member_a->name, member_b->name);
+}
+
+struct httpsrvdev_archive* httpsrvdev_archive_open(struct httpsrvdev_inst* inst, char* path) {
+    uint64_t ext_encoding = httpsrvdev_file_encode_ext(inst, path);
+    bool is_tar = ext_encoding == (('t'<<16) | ('a'<< 8) | ('r'<< 0));
+    bool is_zip = ext_encoding == (('z'<<16) | ('i'<< 8) | ('p'<< 0));
+    if (!is_tar && !is_zip) {
+        inst->err = httpsrvdev_COULD_NOT_READ_ARCHIVE;
+        return NULL;
+    }
+
+    struct httpsrvdev_archive* archive = calloc(1, sizeof(*archive));
+    if (archive == NULL) {
+        inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+        return NULL;
+    }
+    archive->map = MAP_FAILED;
+
+    archive->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (archive->fd == -1) {
+        inst->err = httpsrvdev_COULD_NOT_OPEN_FILE | (errno & httpsrvdev_MASK_ERRNO);
+        goto err;
+    }
+    struct stat archive_stat;
+    if (fstat(archive->fd, &archive_stat) == -1) {
+        inst->err = httpsrvdev_COULD_NOT_STAT | (errno & httpsrvdev_MASK_ERRNO);
+        goto err;
+    }
+    archive->map_size = archive_stat.st_size;
+    if (archive->map_size > 0) {
+        archive->map = mmap(NULL, archive->map_size, PROT_READ, MAP_PRIVATE, archive->fd, 0);
+        if (archive->map == MAP_FAILED) {
+            inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+            goto err;
+        }
+    }
+
+    if (archive->map_size > 0 &&
+        !(is_tar ? archive_index_tar(inst, archive) : archive_index_zip(inst, archive))
+    ) goto err;
+
+    archive->sorted = malloc((archive->members_count + 1)*sizeof(archive->sorted[0]));
+    if (archive->sorted == NULL) {
+        inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+        goto err;
+    }
+    size_t sorted_count = 0;
+    for (size_t i = 0; i < archive->members_cap; ++i) {
+        if (archive->members[i].name != NULL) {
+            archive->sorted[sorted_count++] = &archive->members[i];
+        }
+    }
+    qsort(archive->sorted, sorted_count, sizeof(archive->sorted[0]), archive_member_cmp);
+
+    return archive;
+
+err:
+    httpsrvdev_archive_close(archive);
+    return NULL;
+}
+
+void httpsrvdev_archive_close(struct httpsrvdev_archive* archive) {
+    if (archive == NULL) return;
+
+    for (size_t i = 0; i < archive->members_cap; ++i) {
+        free(archive->members[i].name);
+    }
+    free(archive->members);
+    free(archive->sorted);
+    if (archive->map != MAP_FAILED) munmap(archive->map, archive->map_size);
+    if (archive->fd != -1) close(archive->fd);
+    free(archive);
+}
+
+// Whether the Accept-Encoding header value `accept_encoding` allows `coding`
+static bool accepts_encoding(char* accept_encoding, char* coding) {
+    if (accept_encoding == NULL) return false;
+
+    size_t coding_len = strlen(coding);
+    for (char* item = accept_encoding; *item != '\0'; ) {
+        size_t item_len = strcspn(item, ",");
+        while (item_len > 0 && (*item == ' ' || *item == '\t')) {
+            ++item;
+            --item_len;
+        }
+        size_t name_len = strcspn(item, ";, \t");
+        if (name_len > item_len) name_len = item_len;
+
+        bool name_matches = (name_len == coding_len && strncasecmp(item, coding, name_len) == 0) ||
+                            (name_len == 1 && item[0] == '*');
+        if (name_matches) {
+            // "q=0", "q=0.0", ... disallow the coding
+            char* q = strstr(item, "q=");
+            bool q_is_zero = q != NULL && q < item + item_len &&
+                             q[2] == '0' && strspn(q + 3, ".0") == strcspn(q + 3, ", \t");
+            return !q_is_zero;
+        }
+
+        item += item_len;
+        if (*item == ',') ++item;
+    }
+    return false;
+}
+
+static bool archive_res_member(struct httpsrvdev_inst* inst,
+    struct httpsrvdev_archive* archive, struct archive_member* member
+) {
+    FileTypeInfo* file_type_info = get_file_type_info_(inst, member->name);
+
+    // Deflated members are passed through as is. ZIP stores raw deflate data,
+    // without the zlib wrapper that "deflate" nominally implies; browsers and
+    // curl accept it either way.
+    bool is_deflated = member->method == ARCHIVE_DEFLATE;
+    if (is_deflated &&
+        !accepts_encoding(httpsrvdev_req_header(inst, httpsrvdev_HDR_ACCEPT_ENCODING), "deflate")
+    ) {
+        inst->err = httpsrvdev_UNACCEPTABLE_ENCODING;
+        return false;
+    }
+
+    bool inject_live_reload_script = inst->live_reload != NULL && !is_deflated &&
+                                     strcmp(file_type_info->mime_type, "text/html") == 0;
+    off_t content_length = member->size;
+    if (inject_live_reload_script) {
+        content_length += sizeof(live_reload_script) - 1;
+    }
+
+    if (!res_file_headers(inst, file_type_info, content_length)) return false;
+    if (is_deflated) {
+        if (!httpsrvdev_res_header(inst, "Content-Encoding", "deflate")) return false;
+        if (!httpsrvdev_res_header(inst, "Vary", "Accept-Encoding"))     return false;
+    }
+    if (!httpsrvdev_res_send_n(inst, "\r\n", 2)) return false;
+
+    // Send the member straight from the archive's file descriptor
+    off_t offset = member->offset;
+    off_t end    = member->offset + member->size;
+    if (h2_stream_is_current(inst)) {
+        // The stream reads it once its DATA frames are due, from its own
+        // descriptor since the archive may be closed by then
+        int fd = fcntl(archive->fd, F_DUPFD_CLOEXEC, 0);
+        if (fd == -1) {
+            inst->err = httpsrvdev_COULD_NOT_READ_ARCHIVE | (errno & httpsrvdev_MASK_ERRNO);
+            return false;
+        }
+        if (!h2_stream_queue_file(inst, fd, offset, end - offset)) return false;
+        offset = end;
+    }
+    while (offset < end) {
+        ssize_t n_sent = conn_sendfile(inst, archive->fd, &offset, end - offset);
+        if (n_sent == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN && conn_wait(inst, POLLOUT)) continue;
+            return false;
+        }
+        if (n_sent == 0) {
+            inst->err = httpsrvdev_COULD_NOT_READ_ARCHIVE;
+            return false;
+        }
+        inst->conn->res_bytes_sent += n_sent;
+    }
+
+    if (inject_live_reload_script &&
+        !httpsrvdev_res_send_n(inst, live_reload_script, sizeof(live_reload_script) - 1)
+    ) return false;
+
+    return httpsrvdev_res_end(inst);
+}
+
+bool httpsrvdev_res_archive_member(struct httpsrvdev_inst* inst,
+    struct httpsrvdev_archive* archive, char* path
+) {
+    while (*path == '/') ++path;
+    size_t path_len = strlen(path);
+    while (path_len > 0 && path[path_len - 1] == '/') --path_len;
+
+    struct archive_member* member = archive_find(archive, path, path_len);
+    if (member != NULL) return archive_res_member(inst, archive, member);
+
+    // Otherwise treat the path as a directory: serve its index file if it
+    // has one or else a listing of its contents
+    bool result = false;
+    struct httpsrvdev_arena_mark arena_mark = httpsrvdev_arena_save(&inst->conn->arena);
+    char* dir_prefix = tmp_alloc(inst, path_len + 2);
+    if (dir_prefix == NULL) goto cleanup;
+    memcpy(dir_prefix, path, path_len);
+    size_t dir_prefix_len = path_len;
+    if (path_len > 0) dir_prefix[dir_prefix_len++] = '/';
+    dir_prefix[dir_prefix_len] = '\0';
+
+    for (size_t i = 0; i < sizeof(index_files)/sizeof(index_files[0]); ++i) {
+        size_t index_path_len = dir_prefix_len + strlen(index_files[i]) - 1;
+        char*  index_path = tmp_alloc(inst, index_path_len + 1);
+        if (index_path == NULL) goto cleanup;
+        snprintf(index_path, index_path_len + 1, "%s%s", dir_prefix, index_files[i] + 1);
+        member = archive_find(archive, index_path, index_path_len);
+        if (member != NULL) {
+            result = archive_res_member(inst, archive, member);
+            goto cleanup;
+        }
+    }
+
+    // Binary search for the first member in the directory
+    size_t lo = 0;
+    size_t hi = archive->members_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo)/2;
+        if (strcmp(archive->sorted[mid]->name, dir_prefix) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == archive->members_count ||
+        strncmp(archive->sorted[lo]->name, dir_prefix, dir_prefix_len) != 0
+    ) {
+        inst->err = httpsrvdev_COULD_NOT_STAT | ENOENT;
+        goto cleanup;
+    }
+
+    // Members with the same prefix are contiguous, and so are those in the
+    // same subdirectory, so each child is listed once
+    char*  entry_buf = tmp_alloc(inst, PATH_MAX);
+    char*  link_text = tmp_alloc(inst, PATH_MAX);
+    if (entry_buf == NULL || link_text == NULL) goto cleanup;
+    char*  last_child = NULL;
+    size_t last_child_len = 0;
+    if (!httpsrvdev_res_listing_begin(inst)) goto cleanup;
+    for (size_t i = lo; i < archive->members_count; ++i) {
+        char* name = archive->sorted[i]->name;
+        if (strncmp(name, dir_prefix, dir_prefix_len) != 0) break;
+
+        char*  child     = name + dir_prefix_len;
+        size_t child_len = strcspn(child, "/");
+        bool   is_dir    = child[child_len] == '/';
+        if (last_child != NULL && child_len == last_child_len &&
+            memcmp(child, last_child, child_len) == 0
+        ) continue;
+        last_child     = child;
+        last_child_len = child_len;
+
+        if (child_len + 2 > PATH_MAX) continue;
+        memcpy(entry_buf, child, child_len);
+        entry_buf[child_len] = '\0';
+        memcpy(link_text, entry_buf, child_len + 1);
+        if (is_dir) {
+            entry_buf[child_len]     = '/';
+            entry_buf[child_len + 1] = '\0';
+        }
+        if (!httpsrvdev_res_listing_entry(inst, entry_buf, link_text)) goto cleanup;
+    }
+    result = httpsrvdev_res_listing_end(inst);
+
+cleanup:
+    httpsrvdev_arena_reset(&inst->conn->arena, arena_mark);
+    return result;
+}
+
+// --------------------------------------------------------
+// Reverse proxy
+// --------------------------------------------------------
+
+// Requests are forwarded to the upstream as HTTP/1.1 over keep-alive
+// connections, which are pooled per upstream and reused by later requests.
+// Bodies are moved between the client's connection and the upstream's with
+// `splice` through a pipe, so they aren't copied to user space, let alone
+// buffered in full. Where the client's side can't be spliced -- connections
+// encrypted in user space and HTTP/2 streams -- they are relayed in chunks.
+// Chunked response bodies are spliced chunk by chunk, reading only their
+// framing, so that the end of the response is known and the connection can be
+// reused.
+
+#define PROXY_IDLE_CONNS_MAX 16
+// How long to wait on the upstream for each step of connecting, sending and
+// receiving
+#define PROXY_TIMEOUT_MS     30000
+#define PROXY_RES_HEAD_MAX   8192
+#define PROXY_SPLICE_MAX     (64*1024)
+
+// States of the scanner that finds the end of chunked response bodies
+#define PROXY_CHUNK_SIZE         0
+#define PROXY_CHUNK_EXT          1
+#define PROXY_CHUNK_DATA         2
+#define PROXY_CHUNK_DATA_END     3
+#define PROXY_CHUNK_TRAILER      4  // At the start of a trailer line
+#define PROXY_CHUNK_TRAILER_LINE 5
+#define PROXY_CHUNK_DONE         6
+#define PROXY_CHUNK_INVALID      7
+
+struct httpsrvdev_upstream {
+    struct httpsrvdev_addr addr;
+    // Replaces the matched prefix of request targets. NULL if the URL has no
+    // path, in which case targets are forwarded as they are.
+    char* path;
+    int   idle_fds[PROXY_IDLE_CONNS_MAX];
+    int   idle_fds_count;
+    // For `splice`, which needs a pipe on one end. Empty between transfers.
+    int   pipe_fds[2];
+};
+
+struct proxy_chunked {
+    int    state;
+    size_t remaining;  // Of the chunk's size or data
+};
+
+// Request headers that apply to the client's connection only, and Expect,
+// which is answered here
+static char* proxy_hop_by_hop_headers[] = {
+    "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer",
+    "Transfer-Encoding", "Upgrade", "HTTP2-Settings", "Expect",
+};
+
+// Parse `url`, e.g. "http://127.0.0.1:9000" or "http://localhost:9000/api"
+struct httpsrvdev_upstream* httpsrvdev_upstream_open(struct httpsrvdev_inst* inst, char* url) {
+    if (strncmp(url, "http://", 7) != 0) goto invalid;
+    char*  host_port     = url + 7;
+    size_t host_port_len = strcspn(host_port, "/");
+    char*  path          = host_port + host_port_len;
+    if (host_port_len == 0 || strlen(path) >= 512) goto invalid;
+
+    // The port defaults to 80, and "localhost" to IPv4
+    char addr_str[INET6_ADDRSTRLEN + 16];
+    if (strncmp(host_port, "localhost", 9) == 0 &&
+        (host_port_len == 9 || host_port[9] == ':')
+    ) {
+        host_port     += 9;
+        host_port_len -= 9;
+        memcpy(addr_str, "127.0.0.1", 10);
+    } else {
+        addr_str[0] = '\0';
+    }
+    size_t addr_str_len = strlen(addr_str);
+    if (addr_str_len + host_port_len + 4 > sizeof(addr_str)) goto invalid;
+    memcpy(addr_str + addr_str_len, host_port, host_port_len);
+    addr_str_len += host_port_len;
+    addr_str[addr_str_len] = '\0';
+    char* port_sep = addr_str[0] == '[' ? strstr(addr_str, "]:") : strchr(addr_str, ':');
+    if (port_sep == NULL) memcpy(addr_str + addr_str_len, ":80", 4);
+
+    struct httpsrvdev_upstream* upstream = calloc(1, sizeof(*upstream));
+    if (upstream == NULL) {
+        inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+        return NULL;
+    }
+    upstream->pipe_fds[0] = -1;
+    upstream->pipe_fds[1] = -1;
+    if (!httpsrvdev_addr_parse(inst, addr_str, &upstream->addr) ||
+        upstream->addr.sock_addr.ss_family == AF_UNIX
+    ) {
+        free(upstream);
+        goto invalid;
+    }
+    if (*path != '\0') {
+        upstream->path = strdup(path);
+        if (upstream->path == NULL) {
+            inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+            free(upstream);
+            return NULL;
+        }
+    }
+    return upstream;
+
+invalid:
+    inst->err = httpsrvdev_INVALID_UPSTREAM_URL;
+    return NULL;
+}
+
+static void proxy_pipe_close(struct httpsrvdev_upstream* upstream) {
+    if (upstream->pipe_fds[0] == -1) return;
+    close(upstream->pipe_fds[0]);
+    close(upstream->pipe_fds[1]);
+    upstream->pipe_fds[0] = -1;
+    upstream->pipe_fds[1] = -1;
+}
+
+// Close the pooled connections and the pipe
+static void upstream_conns_close(struct httpsrvdev_upstream* upstream) {
+    for (int i = 0; i < upstream->idle_fds_count; ++i) close(upstream->idle_fds[i]);
+    upstream->idle_fds_count = 0;
+    proxy_pipe_close(upstream);
+}
+
+void httpsrvdev_upstream_close(struct httpsrvdev_upstream* upstream) {
+    if (upstream == NULL) return;
+    upstream_conns_close(upstream);
+    free(upstream->path);
+    free(upstream);
+}
+
+// Wait until `fd` -- an upstream connection or the client's -- is ready for
+// `events`
+static bool proxy_wait(struct httpsrvdev_inst* inst, int fd, short events) {
+    if (fd == inst->conn->conn_sock_fd) return conn_wait(inst, events);
+
+    struct pollfd pfd = { .fd = fd, .events = events };
+    while (true) {
+        int n_ready = coro_can_wait(inst) ? coro_wait(inst, fd, events, PROXY_TIMEOUT_MS)
+                                          : poll(&pfd, 1, PROXY_TIMEOUT_MS);
+        if (n_ready == -1 && errno == EINTR) continue;
+        if (n_ready == -1) {
+            inst->err = httpsrvdev_COULD_NOT_POLL | (errno & httpsrvdev_MASK_ERRNO);
+            return false;
+        }
+        if (n_ready == 0) {
+            inst->err = httpsrvdev_UPSTREAM_TIMED_OUT;
+            return false;
+        }
+        return true;
+    }
+}
+
+static int upstream_connect(struct httpsrvdev_inst* inst, struct httpsrvdev_upstream* upstream) {
+    int fd = socket(upstream->addr.sock_addr.ss_family,
+                    SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        inst->err = httpsrvdev_COULD_NOT_CREATE_SOCK | (errno & httpsrvdev_MASK_ERRNO);
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr*) &upstream->addr.sock_addr,
+                upstream->addr.sock_addr_size) == -1
+    ) {
+        if (errno != EINPROGRESS) goto conn_err;
+        if (!proxy_wait(inst, fd, POLLOUT)) goto err;
+        int       sock_err     = 0;
+        socklen_t sock_err_len = sizeof(sock_err);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &sock_err, &sock_err_len) == -1) goto conn_err;
+        if (sock_err != 0) {
+            errno = sock_err;
+            goto conn_err;
+        }
+    }
+    // The head and the rest of the body are written separately; don't let
+    // the second write wait for the ACK of the first
+    if (upstream->addr.sock_addr.ss_family != AF_UNIX &&
+        !sock_opt_set(inst, fd, IPPROTO_TCP, TCP_NODELAY, 1)
+    ) goto err;
+    return fd;
+
+conn_err:
+    inst->err = httpsrvdev_UPSTREAM_CONN_FAILED | (errno & httpsrvdev_MASK_ERRNO);
+err:
+    close(fd);
+    return -1;
+}
+
+// Take an idle connection to the upstream from the pool, or else connect
+static int upstream_conn_take(struct httpsrvdev_inst* inst,
+    struct httpsrvdev_upstream* upstream, bool* reused
+) {
+    *reused = false;
+    while (upstream->idle_fds_count > 0) {
+        int fd = upstream->idle_fds[--upstream->idle_fds_count];
+        // Connections that the upstream closed while they were idle read as
+        // the end of the stream
+        char byte;
+        ssize_t n_peeked = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (n_peeked == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            *reused = true;
+            return fd;
+        }
+        close(fd);
+    }
+    return upstream_connect(inst, upstream);
+}
+
+static void upstream_conn_give(struct httpsrvdev_upstream* upstream, int fd) {
+    if (upstream->idle_fds_count == PROXY_IDLE_CONNS_MAX) {
+        close(fd);
+        return;
+    }
+    upstream->idle_fds[upstream->idle_fds_count++] = fd;
+}
+
+static bool upstream_send(struct httpsrvdev_inst* inst, int fd, char* buf, size_t n) {
+    while (n > 0) {
+        ssize_t n_sent = send(fd, buf, n, MSG_NOSIGNAL);
+        if (n_sent == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (!proxy_wait(inst, fd, POLLOUT)) return false;
+                continue;
+            }
+            inst->err = httpsrvdev_UPSTREAM_CONN_FAILED | (errno & httpsrvdev_MASK_ERRNO);
+            return false;
+        }
+        buf += n_sent;
+        n   -= n_sent;
+    }
+    return true;
+}
+
+// Move up to `n` bytes from `in_fd` to `out_fd`, one of which is the
+// client's, through the pipe. Stops early at the end of the stream. Returns
+// the number of bytes moved or -1.
+static ssize_t proxy_splice(struct httpsrvdev_inst* inst,
+    int pipe_fds[2], int in_fd, int out_fd, size_t n
+) {
+    bool   is_to_client = out_fd == inst->conn->conn_sock_fd;
+    size_t n_moved      = 0;
+    while (n_moved < n) {
+        size_t n_want = n - n_moved < PROXY_SPLICE_MAX ? n - n_moved : PROXY_SPLICE_MAX;
+        ssize_t n_in = splice(in_fd, NULL, pipe_fds[1], NULL, n_want,
+                              SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n_in == -1) {
+            if (errno == EINTR) continue;
+            // The pipe is empty, so it's the socket that has nothing yet
+            if (errno == EAGAIN) {
+                if (!proxy_wait(inst, in_fd, POLLIN)) return -1;
+                continue;
+            }
+            if (is_to_client) {
+                inst->err = httpsrvdev_UPSTREAM_CONN_FAILED | (errno & httpsrvdev_MASK_ERRNO);
+            }
+            return -1;
+        }
+        if (n_in == 0) break;
+        if (!is_to_client) inst->conn->req_len += n_in;  // Counts as progress for `conn_wait`
+
+        for (ssize_t n_out_total = 0; n_out_total < n_in; ) {
+            ssize_t n_out = splice(pipe_fds[0], NULL, out_fd, NULL,
+                                   n_in - n_out_total,
+                                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+            if (n_out == -1) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN) {
+                    if (!proxy_wait(inst, out_fd, POLLOUT)) return -1;
+                    continue;
+                }
+                if (!is_to_client) {
+                    inst->err = httpsrvdev_UPSTREAM_CONN_FAILED | (errno & httpsrvdev_MASK_ERRNO);
+                }
+                return -1;
+            }
+            n_out_total += n_out;
+            if (is_to_client) inst->conn->res_bytes_sent += n_out;
+        }
+        n_moved += n_in;
+    }
+    return n_moved;
+}
+
+// `proxy_splice` through user space, for when the client's side can't be
+// spliced
+static ssize_t proxy_copy(struct httpsrvdev_inst* inst,
+    int upstream_fd, size_t n, bool is_to_client
+) {
+    char   buf[16*1024];
+    size_t n_moved = 0;
+    while (n_moved < n) {
+        size_t  n_want = n - n_moved < sizeof(buf) ? n - n_moved : sizeof(buf);
+        ssize_t n_in   = is_to_client ? recv(upstream_fd, buf, n_want, 0)
+                                      : conn_recv(inst, buf, n_want);
+        if (n_in == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (!(is_to_client ? proxy_wait(inst, upstream_fd, POLLIN)
+                                   : conn_wait(inst, POLLIN))
+                ) return -1;
+                continue;
+            }
+            if (is_to_client) {
+                inst->err = httpsrvdev_UPSTREAM_CONN_FAILED | (errno & httpsrvdev_MASK_ERRNO);
+            }
+            return -1;
+        }
+        if (n_in == 0) break;
+        if (is_to_client) {
+            if (!httpsrvdev_res_send_n(inst, buf, n_in)) return -1;
+        } else {
+            if (!upstream_send(inst, upstream_fd, buf, n_in)) return -1;
+            inst->conn->req_len += n_in;
+        }
+        n_moved += n_in;
+    }
+    return n_moved;
+}
+
+// Move up to `n` body bytes between the client and the upstream
+static ssize_t proxy_relay(struct httpsrvdev_inst* inst,
+    struct httpsrvdev_upstream* upstream, int upstream_fd, size_t n, bool is_to_client
+) {
+    bool can_splice = is_to_client ? inst->conn->res_recording == NULL &&
+                                     !h2_stream_is_current(inst) && conn_sock_is_plain(inst)
+                                   : inst->tls == NULL;
+    // The pipe is taken from the upstream for the transfer, so that
+    // transfers on other coroutines meanwhile get their own. Without a pipe,
+    // e.g. out of file descriptors, the bytes are copied.
+    int pipe_fds[2] = { upstream->pipe_fds[0], upstream->pipe_fds[1] };
+    if (can_splice && pipe_fds[0] == -1 && pipe2(pipe_fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+        can_splice = false;
+    }
+    if (!can_splice) return proxy_copy(inst, upstream_fd, n, is_to_client);
+    upstream->pipe_fds[0] = -1;
+    upstream->pipe_fds[1] = -1;
+
+    int     in_fd   = is_to_client ? upstream_fd : inst->conn->conn_sock_fd;
+    int     out_fd  = is_to_client ? inst->conn->conn_sock_fd : upstream_fd;
+    ssize_t n_moved = proxy_splice(inst, pipe_fds, in_fd, out_fd, n);
+    // A failed transfer may have left bytes in it
+    if (n_moved == -1 || upstream->pipe_fds[0] != -1) {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+    } else {
+        upstream->pipe_fds[0] = pipe_fds[0];
+        upstream->pipe_fds[1] = pipe_fds[1];
+    }
+    return n_moved;
+}
+
+// Advance `chunked` over `n` bytes of a chunked body. Returns how many of
+// them belong to the body, which is fewer than `n` only once it has ended.
+static size_t proxy_chunked_scan(struct proxy_chunked* chunked, char* buf, size_t n) {
+    size_t i = 0;
+    while (i < n && chunked->state != PROXY_CHUNK_DONE && chunked->state != PROXY_CHUNK_INVALID) {
+        switch (chunked->state) {
+            case PROXY_CHUNK_SIZE:
+            case PROXY_CHUNK_EXT: {
+                char c = buf[i++];
+                int  digit = c >= '0' && c <= '9' ? c - '0'      :
+                             c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+                             c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+                if (chunked->state == PROXY_CHUNK_SIZE && digit != -1) {
+                    if (chunked->remaining > SIZE_MAX/16) {
+                        chunked->state = PROXY_CHUNK_INVALID;
+                        break;
+                    }
+                    chunked->remaining = 16*chunked->remaining + digit;
+                } else if (c == ';') {
+                    chunked->state = PROXY_CHUNK_EXT;
+                } else if (c == '\n') {
+                    chunked->state = chunked->remaining == 0 ? PROXY_CHUNK_TRAILER
+                                                             : PROXY_CHUNK_DATA;
+                }
+            } break;
+            case PROXY_CHUNK_DATA: {
+                size_t len = n - i < chunked->remaining ? n - i : chunked->remaining;
+                i                  += len;
+                chunked->remaining -= len;
+                if (chunked->remaining == 0) chunked->state = PROXY_CHUNK_DATA_END;
+            } break;
+            case PROXY_CHUNK_DATA_END:
+                if (buf[i++] == '\n') chunked->state = PROXY_CHUNK_SIZE;
+                break;
+            case PROXY_CHUNK_TRAILER: {
+                char c = buf[i++];
+                if (c == '\n') {
+                    chunked->state = PROXY_CHUNK_DONE;
+                } else if (c != '\r') {
+                    chunked->state = PROXY_CHUNK_TRAILER_LINE;
+                }
+            } break;
+            case PROXY_CHUNK_TRAILER_LINE:
+                if (buf[i++] == '\n') chunked->state = PROXY_CHUNK_TRAILER;
+                break;
+        }
+    }
+    return i;
+}
+
+// Relay the rest of a chunked response body: the framing is received and
+// sent line by line, which leaves the data of each chunk in the socket for
+// `proxy_relay`
+static bool proxy_relay_chunked(struct httpsrvdev_inst* inst,
+    struct httpsrvdev_upstream* upstream, int upstream_fd, struct proxy_chunked* chunked
+) {
+    while (chunked->state != PROXY_CHUNK_DONE) {
+        if (chunked->state == PROXY_CHUNK_INVALID) {
+            inst->err = httpsrvdev_BAD_UPSTREAM_RES;
+            return false;
+        }
+        if (chunked->state == PROXY_CHUNK_DATA) {
+            ssize_t n_relayed = proxy_relay(inst, upstream, upstream_fd,
+                                            chunked->remaining, true);
+            if (n_relayed == -1) return false;
+            if ((size_t) n_relayed < chunked->remaining) {
+                inst->err = httpsrvdev_BAD_UPSTREAM_RES;
+                return false;
+            }
+            chunked->remaining = 0;
+            chunked->state     = PROXY_CHUNK_DATA_END;
+            continue;
+        }
+
+        char    line[256];
+        ssize_t n_peeked = recv(upstream_fd, line, sizeof(line), MSG_PEEK);
+        if (n_peeked == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (!proxy_wait(inst, upstream_fd, POLLIN)) return false;
+                continue;
+            }
+            inst->err = httpsrvdev_UPSTREAM_CONN_FAILED | (errno & httpsrvdev_MASK_ERRNO);
+            return false;
+        }
+        if (n_peeked == 0) {
+            inst->err = httpsrvdev_BAD_UPSTREAM_RES;
+            return false;
+        }
+        char*   line_end = memchr(line, '\n', n_peeked);
+        size_t  line_len = line_end != NULL ? (size_t) (line_end + 1 - line) : (size_t) n_peeked;
+        ssize_t n_recvd  = recv(upstream_fd, line, line_len, 0);
+        if (n_recvd <= 0) {
+            inst->err = httpsrvdev_UPSTREAM_CONN_FAILED | (errno & httpsrvdev_MASK_ERRNO);
+            return false;
+        }
+        size_t n_used = proxy_chunked_scan(chunked, line, n_recvd);
+        if (!httpsrvdev_res_send_n(inst, line, n_used)) return false;
+    }
+    return true;
+}
+
+// Receive the upstream's response head into `buf`, skipping interim (1xx)
+// responses. `*len` bytes are received, of which the first `*head_len` are
+// the head; any after it are the start of the body.
+static bool proxy_recv_res_head(struct httpsrvdev_inst* inst, int upstream_fd,
+    char* buf, size_t size, size_t* len, size_t* head_len
+) {
+    *len = 0;
+    while (true) {
+        char* head_end = memmem(buf, *len, "\r\n\r\n", 4);
+        if (head_end != NULL) {
+            size_t n = head_end + 4 - buf;
+            if (n > 9 && buf[9] == '1') {
+                memmove(buf, buf + n, *len - n);
+                *len -= n;
+                continue;
+            }
+            *head_len = n;
+            return true;
+        }
+        if (*len == size) {
+            inst->err = httpsrvdev_BAD_UPSTREAM_RES;
+            return false;
+        }
+        ssize_t n_recvd = recv(upstream_fd, buf + *len, size - *len, 0);
+        if (n_recvd == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (!proxy_wait(inst, upstream_fd, POLLIN)) return false;
+                continue;
+            }
+            inst->err = httpsrvdev_UPSTREAM_CONN_FAILED | (errno & httpsrvdev_MASK_ERRNO);
+            return false;
+        }
+        if (n_recvd == 0) {
+            inst->err = httpsrvdev_BAD_UPSTREAM_RES;
+            return false;
+        }
+        *len += n_recvd;
+    }
+}
+
+static bool proxy_appendf(struct httpsrvdev_inst* inst,
+    char* buf, size_t size, size_t* len, char* fmt, ...
+) {
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(buf + *len, size - *len, fmt, args);
+    va_end(args);
+    if (n < 0 || (size_t) n >= size - *len) {
+        inst->err = httpsrvdev_BUF_TOO_SMALL;
+        return false;
+    }
+    *len += n;
+    return true;
+}
+
+// The length of the request body, and how much of it arrived along with the
+// head. Request bodies are streamed, so their length must be known up front.
+// HTTP/2 request bodies aren't kept -- see `h2_conn_on_frame`.
+static bool proxy_req_body(struct httpsrvdev_inst* inst, size_t* body_len, size_t* body_buffered) {
+    char* content_length = inst->conn->req_known_headers[httpsrvdev_HDR_CONTENT_LENGTH];
+    if (inst->conn->req_known_headers[httpsrvdev_HDR_TRANSFER_ENCODING] != NULL) {
+        inst->err = httpsrvdev_UNSUPPORTED_REQ_BODY;
+        return false;
+    }
+    *body_len = 0;
+    if (content_length != NULL) {
+        char* content_length_end;
+        errno = 0;
+        unsigned long long len = strtoull(content_length, &content_length_end, 10);
+        if (!isdigit(*content_length) || *content_length_end != '\0' || errno != 0) {
+            inst->err = httpsrvdev_CANNOT_PARSE_REQ;
+            return false;
+        }
+        *body_len = len;
+    }
+    if (*body_len > 0 && h2_stream_is_current(inst)) {
+        inst->err = httpsrvdev_UNSUPPORTED_REQ_BODY;
+        return false;
+    }
+    size_t body_offset = inst->conn->req_body - inst->conn->req_buf;
+    *body_buffered = inst->conn->req_len > body_offset ? inst->conn->req_len - body_offset : 0;
+    if (*body_buffered > *body_len) *body_buffered = *body_len;
+    return true;
+}
+
+static bool proxy_res(struct httpsrvdev_inst* inst,
+    struct httpsrvdev_upstream* upstream, size_t prefix_len
+) {
+    int  upstream_fd = -1;
+    bool res_begun   = false;
+
+    size_t body_len;
+    size_t body_buffered;
+    if (!proxy_req_body(inst, &body_len, &body_buffered)) return false;
+
+    // Build the request head, followed by what there is of the body
+    char   head[ESCAPE_MAX_GROWTH*sizeof(inst->conn->req_buf) + 1024];
+    size_t head_len = 0;
+    char*  target   = inst->conn->req_target;
+    if (upstream->path != NULL) {
+        // The rest of the normalized path, encoded again
+        char*  path_rest     = inst->conn->req_path;
+        size_t path_rest_len = strlen(path_rest);
+        path_rest     += prefix_len < path_rest_len ? prefix_len : path_rest_len;
+        path_rest_len  = strlen(path_rest);
+        char target_buf[ESCAPE_MAX_GROWTH*sizeof(inst->conn->req_buf)];
+        size_t target_len = escape(ESCAPE_URL_PATH, target_buf, path_rest, path_rest_len);
+        target_buf[target_len] = '\0';
+        if (!proxy_appendf(inst, head, sizeof(head), &head_len, "%s %s%s%s%s HTTP/1.1\r\n",
+                           inst->conn->req_method_str, upstream->path, target_buf,
+                           inst->conn->req_query != NULL ? "?" : "",
+                           inst->conn->req_query != NULL ? inst->conn->req_query : "")
+        ) return false;
+    } else if (!proxy_appendf(inst, head, sizeof(head), &head_len, "%s %s HTTP/1.1\r\n",
+                              inst->conn->req_method_str, target)
+    ) return false;
+    for (int i = 0; i < inst->conn->req_headers_count; ++i) {
+        char* name = inst->conn->req_headers[i][0];
+        bool  is_hop_by_hop = false;
+        for (size_t j = 0; j < sizeof(proxy_hop_by_hop_headers)/sizeof(char*); ++j) {
+            if (strcasecmp(name, proxy_hop_by_hop_headers[j]) == 0) is_hop_by_hop = true;
+        }
+        if (is_hop_by_hop) continue;
+        if (!proxy_appendf(inst, head, sizeof(head), &head_len, "%s: %s\r\n",
+                           name, inst->conn->req_headers[i][1])
+        ) return false;
+    }
+    if (!proxy_appendf(inst, head, sizeof(head), &head_len,
+                       "X-Forwarded-Proto: %s\r\nConnection: keep-alive\r\n\r\n",
+                       inst->tls != NULL ? "https" : "http")
+    ) return false;
+    if (body_buffered > sizeof(head) - head_len) {
+        inst->err = httpsrvdev_BUF_TOO_SMALL;
+        return false;
+    }
+    memcpy(head + head_len, inst->conn->req_body, body_buffered);
+    head_len += body_buffered;
+
+    // Send the request and receive the response head
+    char*  expect = NULL;
+    for (int i = 0; i < inst->conn->req_headers_count; ++i) {
+        if (strcasecmp(inst->conn->req_headers[i][0], "Expect") == 0) {
+            expect = inst->conn->req_headers[i][1];
+        }
+    }
+    char   res_head[PROXY_RES_HEAD_MAX];
+    size_t res_len = 0;
+    size_t res_head_len;
+    while (true) {
+        uint64_t connect_start_ns = monotonic_ns();
+        upstream_fd = upstream_conn_take(inst, upstream, &inst->conn->res_upstream_reused);
+        if (upstream_fd == -1) goto err;
+        inst->conn->res_upstream_conn_taken = true;
+        inst->conn->res_upstream_connect_ns = monotonic_ns() - connect_start_ns;
+
+        // From the start of sending: the upstream may well have responded by
+        // the time `send` returns
+        uint64_t send_start_ns = monotonic_ns();
+        bool ok = upstream_send(inst, upstream_fd, head, head_len);
+        if (ok && body_len > body_buffered) {
+            // Clients that asked wait for this before sending the rest of the
+            // body. It's an interim response; the response proper is yet to
+            // begin.
+            if (expect != NULL && strcasecmp(expect, "100-continue") == 0) {
+                if (!httpsrvdev_res_send(inst, "HTTP/1.1 100 Continue\r\n\r\n")) goto err;
+                inst->conn->res_bytes_sent = 0;
+            }
+            size_t  body_rest = body_len - body_buffered;
+            ssize_t n_relayed = proxy_relay(inst, upstream, upstream_fd, body_rest, false);
+            if (n_relayed == -1) goto err;
+            if ((size_t) n_relayed < body_rest) {
+                inst->err = httpsrvdev_CANNOT_PARSE_REQ;
+                goto err;
+            }
+        }
+        // Acknowledge the head right away, or upstreams that write the body
+        // separately without TCP_NODELAY wait for the delayed ACK before
+        // sending it
+        int quickack = 1;
+        if (ok) setsockopt(upstream_fd, IPPROTO_TCP, TCP_QUICKACK, &quickack, sizeof(quickack));
+        if (ok) ok = proxy_recv_res_head(inst, upstream_fd, res_head, sizeof(res_head),
+                                         &res_len, &res_head_len);
+        if (ok) {
+            inst->conn->res_upstream_response_ns = monotonic_ns() - send_start_ns;
+            break;
+        }
+        // An idle connection may have been closed by the upstream just as it
+        // was taken. Try another if the request can be sent again.
+        if (!inst->conn->res_upstream_reused || res_len > 0 || body_len > body_buffered) goto err;
+        close(upstream_fd);
+        upstream_fd = -1;
+    }
+
+    // "HTTP/1.1 200 OK\r\n"
+    if (res_head_len < 14 || memcmp(res_head, "HTTP/1.", 7) != 0 || res_head[8] != ' ' ||
+        !isdigit(res_head[9]) || !isdigit(res_head[10]) || !isdigit(res_head[11])
+    ) {
+        inst->err = httpsrvdev_BAD_UPSTREAM_RES;
+        goto err;
+    }
+    int  status     = (res_head[9] - '0')*100 + (res_head[10] - '0')*10 + (res_head[11] - '0');
+    bool keep_alive = res_head[7] == '1';
+    bool is_chunked = false;
+    bool has_length = false;
+    unsigned long long res_body_len = 0;
+
+    // Forward the head without the headers about the upstream connection.
+    // Ours is closed after the response. The status line is ours, whatever
+    // the upstream's version.
+    char   fwd_head[PROXY_RES_HEAD_MAX + 32];
+    char*  line     = memchr(res_head, '\n', res_head_len) + 1;
+    char*  head_end = res_head + res_head_len - 2;
+    size_t fwd_head_len = snprintf(fwd_head, sizeof(fwd_head), "HTTP/1.1 %d\r\n", status);
+
+    // Redirects into the upstream's path lead back under the prefix that was
+    // matched, e.g. "/api/x" to "/v2/x" for /v2=http://127.0.0.1:9000/api
+    char*  upstream_path     = upstream->path;
+    size_t upstream_path_len = upstream_path != NULL ? strlen(upstream_path) : 0;
+    char*  prefix            = inst->conn->req_path;
+    size_t prefix_path_len   = strlen(prefix);
+    if (prefix_path_len > prefix_len) prefix_path_len = prefix_len;
+    if (upstream_path_len > 0 && upstream_path[upstream_path_len - 1] == '/') --upstream_path_len;
+    if (prefix_path_len   > 0 && prefix[prefix_path_len - 1]          == '/') --prefix_path_len;
+
+    while (line < head_end) {
+        char*  line_end  = memchr(line, '\n', head_end - line) + 1;
+        size_t line_len  = line_end - line;
+        char*  colon     = memchr(line, ':', line_len);
+        size_t name_len  = colon != NULL ? (size_t) (colon - line) : 0;
+        char*  value     = colon != NULL ? colon + 1 : line_end;
+        while (value < line_end && (*value == ' ' || *value == '\t')) ++value;
+        size_t value_len = line_end - value;
+
+        bool is_conn_header      = false;
+        bool is_location_in_path = false;
+        if (name_len == 14 && strncasecmp(line, "Content-Length", 14) == 0) {
+            char* value_end;
+            res_body_len = strtoull(value, &value_end, 10);
+            has_length   = value_end != value;
+        } else if (name_len == 17 && strncasecmp(line, "Transfer-Encoding", 17) == 0) {
+            for (size_t i = 0; i + 7 <= value_len; ++i) {
+                if (strncasecmp(value + i, "chunked", 7) == 0) is_chunked = true;
+            }
+        } else if (name_len == 10 && strncasecmp(line, "Connection", 10) == 0) {
+            if (value_len >= 5 && strncasecmp(value, "close", 5) == 0) keep_alive = false;
+            if (value_len >= 10 && strncasecmp(value, "keep-alive", 10) == 0) keep_alive = true;
+            is_conn_header = true;
+        } else if ((name_len == 10 && strncasecmp(line, "Keep-Alive", 10) == 0) ||
+                   (name_len == 16 && strncasecmp(line, "Proxy-Connection", 16) == 0)
+        ) {
+            is_conn_header = true;
+        } else if (name_len == 8 && strncasecmp(line, "Location", 8) == 0 &&
+                   upstream_path != NULL && value_len > upstream_path_len &&
+                   memcmp(value, upstream_path, upstream_path_len) == 0 &&
+                   strchr("/?#\r\n", value[upstream_path_len]) != NULL && value[0] == '/'
+        ) {
+            is_location_in_path = true;
+        }
+        if (is_conn_header) {
+            line = line_end;
+            continue;
+        }
+        // With room for the "Connection" header that ends the head
+        size_t name_part_len = is_location_in_path ? (size_t) (value - line) : line_len;
+        size_t new_path_len  = is_location_in_path ? prefix_path_len : 0;
+        size_t rest_len      = is_location_in_path ? value_len - upstream_path_len : 0;
+        size_t fwd_line_len  = name_part_len + new_path_len + rest_len;
+        if (fwd_head_len + fwd_line_len + 21 > sizeof(fwd_head)) {
+            inst->err = httpsrvdev_BAD_UPSTREAM_RES;
+            goto err;
+        }
+        memcpy(fwd_head + fwd_head_len, line, name_part_len);
+        fwd_head_len += name_part_len;
+        if (is_location_in_path) {
+            memcpy(fwd_head + fwd_head_len, prefix, prefix_path_len);
+            fwd_head_len += prefix_path_len;
+            memcpy(fwd_head + fwd_head_len, value + upstream_path_len, rest_len);
+            fwd_head_len += rest_len;
+        }
+        line = line_end;
+    }
+    memcpy(fwd_head + fwd_head_len, "Connection: close\r\n\r\n", 21);
+    fwd_head_len += 21;
+
+    inst->conn->res_status = status;
+    res_begun = true;
+    if (!httpsrvdev_res_send_n(inst, fwd_head, fwd_head_len)) goto err;
+
+    // Relay the body, starting with what was received along with the head
+    char*  extra     = res_head + res_head_len;
+    size_t extra_len = res_len - res_head_len;
+    bool   has_body  = inst->conn->req_method != httpsrvdev_HEAD && status != 204 && status != 304;
+    if (!has_body) {
+        keep_alive = keep_alive && extra_len == 0;
+    } else if (is_chunked) {
+        struct proxy_chunked chunked = { .state = PROXY_CHUNK_SIZE, .remaining = 0 };
+        size_t n_used = proxy_chunked_scan(&chunked, extra, extra_len);
+        if (!httpsrvdev_res_send_n(inst, extra, n_used)) goto err;
+        keep_alive = keep_alive && n_used == extra_len;
+        if (!proxy_relay_chunked(inst, upstream, upstream_fd, &chunked)) goto err;
+    } else if (has_length) {
+        size_t n_used = extra_len < res_body_len ? extra_len : res_body_len;
+        if (!httpsrvdev_res_send_n(inst, extra, n_used)) goto err;
+        keep_alive = keep_alive && n_used == extra_len;
+        size_t  body_rest = res_body_len - n_used;
+        ssize_t n_relayed = proxy_relay(inst, upstream, upstream_fd, body_rest, true);
+        if (n_relayed == -1) goto err;
+        if ((size_t) n_relayed < body_rest) {
+            inst->err = httpsrvdev_BAD_UPSTREAM_RES;
+            goto err;
+        }
+    } else {
+        // The body ends when the upstream closes the connection
+        keep_alive = false;
+        if (!httpsrvdev_res_send_n(inst, extra, extra_len)) goto err;
+        if (proxy_relay(inst, upstream, upstream_fd, SIZE_MAX, true) == -1) goto err;
+    }
+
+    if (keep_alive) {
+        upstream_conn_give(upstream, upstream_fd);
+    } else {
+        close(upstream_fd);
+    }
+    return conn_close(inst);
+
+err:
+    if (upstream_fd != -1) close(upstream_fd);
+    // Once the response has begun, the client can only be told by closing
+    // the connection
+    if (res_begun) conn_close(inst);
+    return false;
+}
+
+// Forward the request to the upstream and its response to the client. If
+// the upstream's URL has a path, it replaces the first `prefix_len` bytes of
+// the normalized path `inst->conn->req_path`, e.g. the prefix the request was
+// routed by, and it's replaced by that prefix again at the start of Location
+// headers; otherwise the target is forwarded as it is. The Host header is
+// forwarded as well.
+//
+// On failure nothing has been sent unless `inst->conn->res_bytes_sent` says so, in
+// which case the connection has been closed.
+bool httpsrvdev_res_proxy(struct httpsrvdev_inst* inst,
+    struct httpsrvdev_upstream* upstream, size_t prefix_len
+) {
+    inst->err                      = httpsrvdev_NO_ERR;
+    inst->conn->res_upstream_conn_taken  = false;
+    inst->conn->res_upstream_connect_ns  = 0;
+    inst->conn->res_upstream_reused      = false;
+    inst->conn->res_upstream_response_ns = 0;
+
+    return proxy_res(inst, upstream, prefix_len);
+}
+
+// --------------------------------------------------------
+// FastCGI
+// --------------------------------------------------------
+
+// Resources:
+//     FastCGI Specification: https://fastcgi-archives.github.io/FastCGI_Specification.html
+
+// Requests for scripts, e.g. PHP pages, are sent to a FastCGI backend such as
+// php-fpm as records on kept-alive connections (FCGI_KEEP_CONN), which are
+// pooled and relayed to like those of the reverse proxy: the payloads of
+// STDIN and STDOUT records are spliced between the sockets, and only the
+// record headers and the CGI response headers pass through user space.
+// Each connection carries one request at a time -- concurrent requests, e.g.
+// on different coroutines, take different connections from the pool rather
+// than being multiplexed -- but every request gets its own request ID so
+// that records left over from an earlier one can't be mistaken for its own.
+
+#define FCGI_VERSION_1        1
+#define FCGI_HEADER_LEN       8
+#define FCGI_MAX_CONTENT_LEN  65535
+#define FCGI_PARAMS_MAX       (16*1024)
+
+#define FCGI_BEGIN_REQUEST    1
+#define FCGI_END_REQUEST      3
+#define FCGI_PARAMS           4
+#define FCGI_STDIN            5
+#define FCGI_STDOUT           6
+#define FCGI_STDERR           7
+
+#define FCGI_RESPONDER        1
+#define FCGI_KEEP_CONN        1
+#define FCGI_REQUEST_COMPLETE 0
+
+struct httpsrvdev_fcgi {
+    struct httpsrvdev_upstream backend;  // Its `path` is unused
+    uint16_t                   next_req_id;
+};
+
+// Open a pool of connections to the backend at `addr`, in the form accepted
+// by `httpsrvdev_addr_parse`, e.g. "127.0.0.1:9000" or
+// "unix:/run/php/php-fpm.sock". Connections are made as requests need them.
+struct httpsrvdev_fcgi* httpsrvdev_fcgi_open(struct httpsrvdev_inst* inst, char* addr) {
+    struct httpsrvdev_fcgi* fcgi = calloc(1, sizeof(*fcgi));
+    if (fcgi == NULL) {
+        inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+        return NULL;
+    }
+    fcgi->backend.pipe_fds[0] = -1;
+    fcgi->backend.pipe_fds[1] = -1;
+    fcgi->next_req_id         = 1;
+    if (!httpsrvdev_addr_parse(inst, addr, &fcgi->backend.addr)) {
+        free(fcgi);
+        return NULL;
+    }
+    return fcgi;
+}
+
+void httpsrvdev_fcgi_close(struct httpsrvdev_fcgi* fcgi) {
+    if (fcgi == NULL) return;
+    upstream_conns_close(&fcgi->backend);
+    free(fcgi);
+}
+
+static void fcgi_record_header(uint8_t* buf, int type, uint16_t req_id, size_t content_len) {
+    buf[0] = FCGI_VERSION_1;
+    buf[1] = type;
+    buf[2] = req_id >> 8;
+    buf[3] = req_id;
+    buf[4] = content_len >> 8;
+    buf[5] = content_len;
+    buf[6] = 0;  // Padding length
+    buf[7] = 0;
+}
+
+static bool fcgi_param(struct httpsrvdev_inst* inst, char* buf, size_t* len,
+    char* name, size_t name_len, char* value, size_t value_len
+) {
+    if (*len + 8 + name_len + value_len > FCGI_PARAMS_MAX) {
+        inst->err = httpsrvdev_BUF_TOO_SMALL;
+        return false;
+    }
+    // Lengths below 128 take one byte, others four with the high bit set
+    size_t lens[2] = {name_len, value_len};
+    for (int i = 0; i < 2; ++i) {
+        if (lens[i] < 128) {
+            buf[(*len)++] = lens[i];
+        } else {
+            buf[(*len)++] = (lens[i] >> 24) | 0x80;
+            buf[(*len)++] = lens[i] >> 16;
+            buf[(*len)++] = lens[i] >> 8;
+            buf[(*len)++] = lens[i];
+        }
+    }
+    memcpy(buf + *len, name, name_len);
+    *len += name_len;
+    memcpy(buf + *len, value, value_len);
+    *len += value_len;
+    return true;
+}
+
+static bool fcgi_param_str(struct httpsrvdev_inst* inst, char* buf, size_t* len,
+    char* name, char* value
+) {
+    return fcgi_param(inst, buf, len, name, strlen(name), value, strlen(value));
+}
+
+// The CGI/1.1 meta-variables (RFC 3875), plus what PHP expects
+static bool fcgi_params(struct httpsrvdev_inst* inst, char* script_path, char* path_info,
+    char* buf, size_t* len
+) {
+    *len = 0;
+
+    char*  path          = inst->conn->req_path;
+    size_t path_len      = strlen(path);
+    size_t path_info_len = strlen(path_info);
+    char*  query         = inst->conn->req_query != NULL ? inst->conn->req_query : "";
+    // The script's name is the request path without the path info after it
+    size_t script_name_len = path_len;
+    if (path_len >= path_info_len &&
+        strcmp(path + path_len - path_info_len, path_info) == 0
+    ) script_name_len = path_len - path_info_len;
+    // The document root is what's left of the script's path without its
+    // name, if the script was found under it
+    size_t script_path_len = strlen(script_path);
+    size_t doc_root_len    = 0;
+    if (script_path_len >= script_name_len &&
+        memcmp(script_path + script_path_len - script_name_len, path, script_name_len) == 0
+    ) doc_root_len = script_path_len - script_name_len;
+
+    if (!fcgi_param_str(inst, buf, len, "GATEWAY_INTERFACE", "CGI/1.1")                  ||
+        !fcgi_param_str(inst, buf, len, "SERVER_SOFTWARE",   "httpsrvdev")               ||
+        !fcgi_param_str(inst, buf, len, "SERVER_PROTOCOL",   "HTTP/1.1")                 ||
+        !fcgi_param_str(inst, buf, len, "REQUEST_METHOD",    inst->conn->req_method_str)       ||
+        !fcgi_param_str(inst, buf, len, "REQUEST_URI",       inst->conn->req_target)           ||
+        !fcgi_param    (inst, buf, len, "SCRIPT_NAME", 11, path, script_name_len)        ||
+        !fcgi_param_str(inst, buf, len, "DOCUMENT_URI",      path)                       ||
+        !fcgi_param_str(inst, buf, len, "QUERY_STRING",      query)                      ||
+        !fcgi_param_str(inst, buf, len, "SCRIPT_FILENAME",   script_path)                ||
+        !fcgi_param    (inst, buf, len, "DOCUMENT_ROOT", 13, script_path, doc_root_len)  ||
+        // PHP refuses to run without it when built with cgi.force_redirect
+        !fcgi_param_str(inst, buf, len, "REDIRECT_STATUS",   "200")
+    ) return false;
+    if (path_info_len > 0 && !fcgi_param_str(inst, buf, len, "PATH_INFO", path_info)) return false;
+    if (inst->tls != NULL && !fcgi_param_str(inst, buf, len, "HTTPS", "on")) return false;
+
+    char* host = inst->conn->req_known_headers[httpsrvdev_HDR_HOST];
+    if (host != NULL) {
+        size_t host_len = host[0] == '[' ? strcspn(host, "]") + 1 : strcspn(host, ":");
+        if (host_len > strlen(host)) host_len = strlen(host);
+        if (!fcgi_param(inst, buf, len, "SERVER_NAME", 11, host, host_len)) return false;
+    }
+
+    char remote_addr[INET6_ADDRSTRLEN];
+    char remote_port[8];
+    struct sockaddr_storage* sock_addr = &inst->conn->conn_addr.sock_addr;
+    if (sock_addr->ss_family == AF_INET || sock_addr->ss_family == AF_INET6) {
+        bool is_ipv4 = sock_addr->ss_family == AF_INET;
+        inet_ntop(sock_addr->ss_family,
+                  is_ipv4 ? (void*) &((struct sockaddr_in*)  sock_addr)->sin_addr
+                          : (void*) &((struct sockaddr_in6*) sock_addr)->sin6_addr,
+                  remote_addr, sizeof(remote_addr));
+        snprintf(remote_port, sizeof(remote_port), "%d",
+                 ntohs(is_ipv4 ? ((struct sockaddr_in*)  sock_addr)->sin_port
+                               : ((struct sockaddr_in6*) sock_addr)->sin6_port));
+        if (!fcgi_param_str(inst, buf, len, "REMOTE_ADDR", remote_addr) ||
+            !fcgi_param_str(inst, buf, len, "REMOTE_PORT", remote_port)
+        ) return false;
+    }
+
+    // Headers become HTTP_* variables, except for the two with their own
+    char* content_length = inst->conn->req_known_headers[httpsrvdev_HDR_CONTENT_LENGTH];
+    char* content_type   = inst->conn->req_known_headers[httpsrvdev_HDR_CONTENT_TYPE];
+    if (content_length != NULL && !fcgi_param_str(inst, buf, len, "CONTENT_LENGTH", content_length))
+        return false;
+    if (content_type   != NULL && !fcgi_param_str(inst, buf, len, "CONTENT_TYPE",   content_type))
+        return false;
+    for (int i = 0; i < inst->conn->req_headers_count; ++i) {
+        char*  name     = inst->conn->req_headers[i][0];
+        size_t name_len = strlen(name);
+        if (strcasecmp(name, "Content-Length") == 0 || strcasecmp(name, "Content-Type") == 0 ||
+            // "httpoxy": scripts take HTTP_PROXY for the proxy to use
+            strcasecmp(name, "Proxy") == 0
+        ) continue;
+
+        char var_name[128];
+        if (5 + name_len >= sizeof(var_name)) continue;
+        memcpy(var_name, "HTTP_", 5);
+        for (size_t j = 0; j < name_len; ++j) {
+            var_name[5 + j] = name[j] == '-' ? '_' : toupper(name[j]);
+        }
+        if (!fcgi_param(inst, buf, len, var_name, 5 + name_len,
+                        inst->conn->req_headers[i][1], strlen(inst->conn->req_headers[i][1]))
+        ) return false;
+    }
+    return true;
+}
+
+// Receive exactly `n` bytes from the backend, into `buf` or, if it is NULL,
+// nowhere
+static bool fcgi_recv(struct httpsrvdev_inst* inst, int backend_fd, void* buf, size_t n) {
+    char discard_buf[4096];
+    while (n > 0) {
+        void*  dest   = buf != NULL ? buf : discard_buf;
+        size_t n_want = buf != NULL || n < sizeof(discard_buf) ? n : sizeof(discard_buf);
+        ssize_t n_recvd = recv(backend_fd, dest, n_want, 0);
+        if (n_recvd == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (!proxy_wait(inst, backend_fd, POLLIN)) return false;
+                continue;
+            }
+            inst->err = httpsrvdev_UPSTREAM_CONN_FAILED | (errno & httpsrvdev_MASK_ERRNO);
+            return false;
+        }
+        if (n_recvd == 0) {
+            inst->err = httpsrvdev_BAD_UPSTREAM_RES;
+            return false;
+        }
+        if (buf != NULL) buf = (char*) buf + n_recvd;
+        n -= n_recvd;
+    }
+    return true;
+}
+
+// Send the CGI response head `cgi_head` as the HTTP response head. Bodies
+// without a Content-Length are sent chunked.
+static bool fcgi_res_head(struct httpsrvdev_inst* inst,
+    char* cgi_head, size_t cgi_head_len, bool* has_body, bool* is_chunked
+) {
+    int  status       = 0;
+    bool has_location = false;
+    bool has_length   = false;
+    for (char* line = cgi_head; line < cgi_head + cgi_head_len; ) {
+        if (strncasecmp(line, "Status:", 7) == 0)          status       = atoi(line + 7);
+        if (strncasecmp(line, "Location:", 9) == 0)        has_location = true;
+        if (strncasecmp(line, "Content-Length:", 15) == 0) has_length   = true;
+        line = (char*) memchr(line, '\n', cgi_head + cgi_head_len - line) + 1;
+    }
+    // A redirect if the script doesn't say otherwise (RFC 3875 6.2.3)
+    if (status == 0) status = has_location ? 302 : 200;
+    if (status < 100 || status > 999) {
+        inst->err = httpsrvdev_BAD_UPSTREAM_RES;
+        return false;
+    }
+    *has_body   = inst->conn->req_method != httpsrvdev_HEAD && status != 204 && status != 304;
+    *is_chunked = *has_body && !has_length;
+
+    if (!httpsrvdev_res_status_line(inst, status)) return false;
+    for (char* line = cgi_head; line < cgi_head + cgi_head_len; ) {
+        char*  line_end = memchr(line, '\n', cgi_head + cgi_head_len - line);
+        size_t line_len = line_end - line;
+        if (line_len > 0 && line[line_len - 1] == '\r') --line_len;
+        if (line_len > 0 && strncasecmp(line, "Status:", 7) != 0) {
+            if (!httpsrvdev_res_send_n(inst, line, line_len) ||
+                !httpsrvdev_res_send_n(inst, "\r\n", 2)
+            ) return false;
+        }
+        line = line_end + 1;
+    }
+    if (*is_chunked && !httpsrvdev_res_header(inst, "Transfer-Encoding", "chunked")) return false;
+    return httpsrvdev_res_send_n(inst, "\r\n", 2);
+}
+
+// Send `n` body bytes, from `buf` or, if it is NULL, relayed from the backend
+static bool fcgi_res_body(struct httpsrvdev_inst* inst, struct httpsrvdev_fcgi* fcgi,
+    int backend_fd, char* buf, size_t n, bool has_body, bool is_chunked
+) {
+    if (n == 0) return true;
+    if (!has_body) return buf != NULL || fcgi_recv(inst, backend_fd, NULL, n);
+
+    if (is_chunked) {
+        char chunk_size[24];
+        int  chunk_size_len = snprintf(chunk_size, sizeof(chunk_size), "%zx\r\n", n);
+        if (!httpsrvdev_res_send_n(inst, chunk_size, chunk_size_len)) return false;
+    }
+    if (buf != NULL) {
+        if (!httpsrvdev_res_send_n(inst, buf, n)) return false;
+    } else {
+        ssize_t n_relayed = proxy_relay(inst, &fcgi->backend, backend_fd, n, true);
+        if (n_relayed == -1) return false;
+        if ((size_t) n_relayed < n) {
+            inst->err = httpsrvdev_BAD_UPSTREAM_RES;
+            return false;
+        }
+    }
+    return !is_chunked || httpsrvdev_res_send_n(inst, "\r\n", 2);
+}
+
+static bool fcgi_res(struct httpsrvdev_inst* inst, struct httpsrvdev_fcgi* fcgi,
+    char* script_path, char* path_info
+) {
+    int  backend_fd = -1;
+    bool res_begun  = false;
+
+    struct stat stat_buf;
+    if (fs_stat(inst, script_path, &stat_buf) == -1) {
+        inst->err = httpsrvdev_COULD_NOT_STAT | (errno & httpsrvdev_MASK_ERRNO);
+        return false;
+    }
+    if (!S_ISREG(stat_buf.st_mode)) {
+        inst->err = httpsrvdev_COULD_NOT_STAT | ENOENT;
+        return false;
+    }
+    size_t body_len;
+    size_t body_buffered;
+    if (!proxy_req_body(inst, &body_len, &body_buffered)) return false;
+
+    uint16_t req_id = fcgi->next_req_id++;
+    if (fcgi->next_req_id == 0) fcgi->next_req_id = 1;
+
+    // The records up to the end of STDIN, or what there is of it so far
+    char    out[5*FCGI_HEADER_LEN + FCGI_HEADER_LEN + FCGI_PARAMS_MAX +
+                sizeof(inst->conn->req_buf)];
+    uint8_t* out_u8  = (uint8_t*) out;
+    size_t   out_len = 0;
+    fcgi_record_header(out_u8, FCGI_BEGIN_REQUEST, req_id, 8);
+    memset(out + FCGI_HEADER_LEN, 0, 8);
+    out[FCGI_HEADER_LEN + 1] = FCGI_RESPONDER;
+    out[FCGI_HEADER_LEN + 2] = FCGI_KEEP_CONN;
+    out_len = 2*FCGI_HEADER_LEN;
+    size_t params_len;
+    if (!fcgi_params(inst, script_path, path_info, out + out_len + FCGI_HEADER_LEN, &params_len))
+        return false;
+    fcgi_record_header(out_u8 + out_len, FCGI_PARAMS, req_id, params_len);
+    out_len += FCGI_HEADER_LEN + params_len;
+    fcgi_record_header(out_u8 + out_len, FCGI_PARAMS, req_id, 0);
+    out_len += FCGI_HEADER_LEN;
+    if (body_buffered > 0) {
+        fcgi_record_header(out_u8 + out_len, FCGI_STDIN, req_id, body_buffered);
+        memcpy(out + out_len + FCGI_HEADER_LEN, inst->conn->req_body, body_buffered);
+        out_len += FCGI_HEADER_LEN + body_buffered;
+    }
+    if (body_buffered == body_len) {
+        fcgi_record_header(out_u8 + out_len, FCGI_STDIN, req_id, 0);
+        out_len += FCGI_HEADER_LEN;
+    }
+
+    // Send the request and receive the first record
+    char* expect = NULL;
+    for (int i = 0; i < inst->conn->req_headers_count; ++i) {
+        if (strcasecmp(inst->conn->req_headers[i][0], "Expect") == 0) {
+            expect = inst->conn->req_headers[i][1];
+        }
+    }
+    uint8_t header[FCGI_HEADER_LEN];
+    while (true) {
+        uint64_t connect_start_ns = monotonic_ns();
+        backend_fd = upstream_conn_take(inst, &fcgi->backend, &inst->conn->res_upstream_reused);
+        if (backend_fd == -1) goto err;
+        inst->conn->res_upstream_conn_taken = true;
+        inst->conn->res_upstream_connect_ns = monotonic_ns() - connect_start_ns;
+
+        uint64_t send_start_ns = monotonic_ns();
+        bool ok = upstream_send(inst, backend_fd, out, out_len);
+        if (ok && body_len > body_buffered) {
+            if (expect != NULL && strcasecmp(expect, "100-continue") == 0) {
+                if (!httpsrvdev_res_send(inst, "HTTP/1.1 100 Continue\r\n\r\n")) goto err;
+                inst->conn->res_bytes_sent = 0;
+            }
+            // Records of the body as it arrives, ended by an empty one
+            for (size_t body_rest = body_len - body_buffered; body_rest > 0 || ok; ) {
+                size_t n = body_rest < FCGI_MAX_CONTENT_LEN ? body_rest : FCGI_MAX_CONTENT_LEN;
+                fcgi_record_header(header, FCGI_STDIN, req_id, n);
+                if (!upstream_send(inst, backend_fd, (char*) header, sizeof(header))) goto err;
+                if (n == 0) break;
+                ssize_t n_relayed = proxy_relay(inst, &fcgi->backend, backend_fd, n, false);
+                if (n_relayed == -1) goto err;
+                if ((size_t) n_relayed < n) {
+                    inst->err = httpsrvdev_CANNOT_PARSE_REQ;
+                    goto err;
+                }
+                body_rest -= n;
+            }
+        }
+        int quickack = 1;
+        if (ok) setsockopt(backend_fd, IPPROTO_TCP, TCP_QUICKACK, &quickack, sizeof(quickack));
+        if (ok) ok = fcgi_recv(inst, backend_fd, header, sizeof(header));
+        if (ok) {
+            inst->conn->res_upstream_response_ns = monotonic_ns() - send_start_ns;
+            break;
+        }
+        // See `proxy_res`
+        if (!inst->conn->res_upstream_reused || body_len > body_buffered) goto err;
+        close(backend_fd);
+        backend_fd = -1;
+    }
+
+    // Relay STDOUT until END_REQUEST: first the CGI head, then the body
+    char   cgi_head[PROXY_RES_HEAD_MAX];
+    size_t cgi_head_len = 0;
+    bool   has_body     = true;
+    bool   is_chunked   = false;
+    bool   keep_conn    = true;
+    while (true) {
+        if (header[0] != FCGI_VERSION_1) {
+            inst->err = httpsrvdev_BAD_UPSTREAM_RES;
+            goto err;
+        }
+        int    type        = header[1];
+        bool   is_ours     = (header[2] << 8 | header[3]) == req_id;
+        size_t content_len = header[4] << 8 | header[5];
+        size_t padding_len = header[6];
+
+        if (is_ours && type == FCGI_END_REQUEST) {
+            uint8_t end_body[8];
+            if (content_len != sizeof(end_body) ||
+                !fcgi_recv(inst, backend_fd, end_body, sizeof(end_body)) ||
+                !fcgi_recv(inst, backend_fd, NULL, padding_len)
+            ) goto err;
+            keep_conn = end_body[4] == FCGI_REQUEST_COMPLETE;
+            break;
+        }
+        if (is_ours && type == FCGI_STDOUT && !res_begun && content_len > 0) {
+            size_t n = content_len;
+            if (n > sizeof(cgi_head) - cgi_head_len) {
+                inst->err = httpsrvdev_BAD_UPSTREAM_RES;
+                goto err;
+            }
+            if (!fcgi_recv(inst, backend_fd, cgi_head + cgi_head_len, n)) goto err;
+            size_t search_from = cgi_head_len >= 3 ? cgi_head_len - 3 : 0;
+            cgi_head_len += n;
+            content_len = 0;
+
+            // The head ends at an empty line, which scripts may end with LF only
+            char*  head_end     = NULL;
+            size_t head_end_len = 0;
+            for (size_t i = search_from; i + 1 < cgi_head_len && head_end == NULL; ++i) {
+                if (cgi_head[i] != '\n') continue;
+                if (cgi_head[i + 1] == '\n') {
+                    head_end     = cgi_head + i + 1;
+                    head_end_len = 1;
+                } else if (cgi_head[i + 1] == '\r' && i + 2 < cgi_head_len &&
+                           cgi_head[i + 2] == '\n'
+                ) {
+                    head_end     = cgi_head + i + 1;
+                    head_end_len = 2;
+                }
+            }
+            if (head_end != NULL) {
+                res_begun = true;
+                char*  body     = head_end + head_end_len;
+                size_t body_len = cgi_head + cgi_head_len - body;
+                if (!fcgi_res_head(inst, cgi_head, head_end - cgi_head, &has_body, &is_chunked) ||
+                    !fcgi_res_body(inst, fcgi, backend_fd, body, body_len, has_body, is_chunked)
+                ) goto err;
+            }
+        }
+        if (is_ours && type == FCGI_STDOUT && res_begun) {
+            if (!fcgi_res_body(inst, fcgi, backend_fd, NULL, content_len, has_body, is_chunked))
+                goto err;
+            content_len = 0;
+        }
+        // Anything else, e.g. STDERR, which the backend logs itself
+        if (!fcgi_recv(inst, backend_fd, NULL, content_len + padding_len) ||
+            !fcgi_recv(inst, backend_fd, header, sizeof(header))
+        ) goto err;
+    }
+    if (!res_begun) {
+        inst->err = httpsrvdev_BAD_UPSTREAM_RES;
+        goto err;
+    }
+    if (is_chunked && !httpsrvdev_res_send_n(inst, "0\r\n\r\n", 5)) goto err;
+
+    if (keep_conn) {
+        upstream_conn_give(&fcgi->backend, backend_fd);
+    } else {
+        close(backend_fd);
+    }
+    return conn_close(inst);
+
+err:
+    if (backend_fd != -1) close(backend_fd);
+    if (res_begun) conn_close(inst);
+    return false;
+}
 
-    // Document / Book formats ------------------------------------------
-    {
-        .ext_encoding = ('p'<<16) | ('d'<< 8) | ('f'<< 0),
-        .mime_type    = "application/pdf",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('d'<<24) | ('o'<<16) | ('c'<< 8) | ('x'<< 0),
-        .mime_type    =
-            "application/vnd.openxmlformats-officedocument.wordprocessingml.document",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('d'<<16) | ('o'<< 8) | ('c'<< 0),
-        .mime_type    = "application/msword",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('x'<<24) | ('l'<<16) | ('s'<< 8) | ('x'<< 0),
-        .mime_type    =
-            "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('x'<<16) | ('l'<< 8) | ('s'<< 0),
-        .mime_type    = "application/vnd.ms-excel",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('p'<<24) | ('p'<<16) | ('t'<< 8) | ('x'<< 0),
-        .mime_type    =
-            "application/vnd.openxmlformats-officedocument.presentationml.presentation",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('p'<<16) | ('p'<< 8) | ('t'<< 0),
-        .mime_type    = "application/vnd.ms-powerpoint",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('o'<<16) | ('d'<< 8) | ('t'<< 0),
-        .mime_type    = "application/vnd.oasis.opendocument.text",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('o'<<16) | ('d'<< 8) | ('p'<< 0),
-        .mime_type    = "application/vnd.oasis.opendocument.presentation",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('o'<<16) | ('d'<< 8) | ('s'<< 0),
-        .mime_type    = "application/vnd.oasis.opendocument.spreadsheet",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('e'<<24) | ('p'<<16) | ('u'<< 8) | ('b'<< 0),
-        .mime_type    = "application/epub+zip",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('a'<<16) | ('z'<< 8) | ('w'<< 0),
-        .mime_type    = "application/vnd.amazon.ebook",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('a'<<16) | ('b'<< 8) | ('w'<< 0),
-        .mime_type    = "application/x-abiword",
-        .charset_utf8 = false,
-    },
+// Run the script at `script_path` -- which must exist -- on the FastCGI
+// backend and send its response. `path_info` is what follows the script in
+// the request path, e.g. "/extra/info" for "/t.php/extra/info", or NULL.
+// Failures are reported as by `httpsrvdev_res_proxy`.
+bool httpsrvdev_res_fcgi(struct httpsrvdev_inst* inst, struct httpsrvdev_fcgi* fcgi,
+    char* script_path, char* path_info
+) {
+    inst->err                      = httpsrvdev_NO_ERR;
+    inst->conn->res_upstream_conn_taken  = false;
+    inst->conn->res_upstream_connect_ns  = 0;
+    inst->conn->res_upstream_reused      = false;
+    inst->conn->res_upstream_response_ns = 0;
 
-    // Archive / compression formats ------------------------------------
-    {
-        .ext_encoding = ('z'<<16) | ('i'<< 8) | ('p'<< 0),
-        .mime_type    = "application/zip",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('g'<< 8) | ('z'<< 0),
-        .mime_type    = "application/gzip",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('t'<<16) | ('a'<< 8) | ('r'<< 0),
-        .mime_type    = "application/x-tar",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('7'<< 8) | ('z'<< 0),
-        .mime_type    = "application/x-7z-compressed",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('b'<< 8) | ('z'<< 0),
-        .mime_type    = "application/x-bzip",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('b'<<16) | ('z'<< 8) | ('2'<< 0),
-        .mime_type    = "application/x-bzip2",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('a'<<16) | ('r'<< 8) | ('c'<< 0),
-        .mime_type    = "application/x-freearc",
-        .charset_utf8 = false,
-    },
+    return fcgi_res(inst, fcgi, script_path, path_info != NULL ? path_info : "");
+}
 
-    // Programmer BS ----------------------------------------------------
-    {
-        .ext_encoding = ('j'<<16) | ('a'<< 8) | ('r'<< 0),
-        .mime_type    = "application/java-archive",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('p'<<16) | ('h'<< 8) | ('p'<< 0),
-        .mime_type    = "application/x-httpd-php",
-        .charset_utf8 = true,
-    },
-    {
-        .ext_encoding = ('s'<< 8) | ('h'<< 0),
-        .mime_type    = "text/plain",
-        .charset_utf8 = true,
-    },
-    {
-        .ext_encoding = ('r'<<16) | ('t'<< 8) | ('f'<< 0),
-        .mime_type    = "text/plain",
-        .charset_utf8 = true,
-    },
-    {
-        .ext_encoding = ('c'<<16) | ('s'<< 8) | ('h'<< 0),
-        .mime_type    = "text/plain",
-        .charset_utf8 = true,
-    },
-    {
-        .ext_encoding = ('m'<< 8) | ('d'<< 0),
-        .mime_type    = "text/plain",
-        .charset_utf8 = true,
-    },
-    {
-        .ext_encoding = ('o'<<16) | ('r'<< 8) | ('g'<< 0),
-        .mime_type    = "text/plain",
-        .charset_utf8 = true,
-    },
-    {
-        .ext_encoding = ('a'<<16) | ('d'<<16) | ('o'<< 8) | ('c'<< 0),
-        .mime_type    = "text/plain",
-        .charset_utf8 = true,
-    },
-    {
-        .ext_encoding = ('c'<< 0),
-        .mime_type    = "text/plain",
-        .charset_utf8 = true,
-    },
-    {
-        .ext_encoding = ('h'<< 0),
-        .mime_type    = "text/plain",
-        .charset_utf8 = true,
-    },
-    {
-        .ext_encoding = ('p'<< 8) | ('y'<< 0),
-        .mime_type    = "text/plain",
-        .charset_utf8 = true,
-    },
-    {
-        .ext_encoding = ('c'<<16) | ('p'<< 8) | ('p'<< 0),
-        .mime_type    = "text/plain",
-        .charset_utf8 = true,
-    },
-    {
-        .ext_encoding = ('c'<<16) | ('+'<< 8) | ('+'<< 0),
-        .mime_type    = "text/plain",
-        .charset_utf8 = true,
-    },
-    {
-        .ext_encoding = ('h'<<16) | ('p'<< 8) | ('p'<< 0),
-        .mime_type    = "text/plain",
-        .charset_utf8 = true,
-    },
-    {
-        .ext_encoding = ('h'<<16) | ('+'<< 8) | ('+'<< 0),
-        .mime_type    = "text/plain",
-        .charset_utf8 = true,
-    },
-    {
-        .ext_encoding = ('g'<< 8) | ('o'<< 0),
-        .mime_type    = "text/plain",
-        .charset_utf8 = true,
-    },
-    {
-        .ext_encoding = ('j'<<16) | ('a'<<16) | ('v'<< 8) | ('a'<< 0),
-        .mime_type    = "text/plain",
-        .charset_utf8 = true,
-    },
-    {
-        .ext_encoding = ('z'<<16) | ('i'<< 8) | ('g'<< 0),
-        .mime_type    = "text/plain",
-        .charset_utf8 = true,
-    },
-    {
-        .ext_encoding = ('o'<<16) | ('d'<<16) | ('i'<< 8) | ('n'<< 0),
-        .mime_type    = "text/plain",
-        .charset_utf8 = true,
-    },
-    {
-        .ext_encoding = ('h'<< 8) | ('a'<< 0),
-        .mime_type    = "text/plain",
-        .charset_utf8 = true,
-    },
-    {
-        .ext_encoding = ('j'<<16) | ('a'<< 8) | ('i'<< 0),
-        .mime_type    = "text/plain",
-        .charset_utf8 = true,
-    },
-    {
-        .ext_encoding = ('r'<< 8) | ('s'<< 0),
-        .mime_type    = "text/plain",
-        .charset_utf8 = true,
-    },
-    {
-        .ext_encoding = ('c'<<16) | ('j'<< 8) | ('s'<< 0),
-        .mime_type    = "text/plain",
-        .charset_utf8 = true,
-    },
-    {
-        .ext_encoding = ('m'<<16) | ('o'<<16) | ('j'<< 8) | ('o'<< 0),
-        .mime_type    = "text/plain",
-        .charset_utf8 = true,
-    },
-    {
-        .ext_encoding = ('r'<< 8) | ('b'<< 0),
-        .mime_type    = "text/plain",
-        .charset_utf8 = true,
-    },
+bool httpsrvdev_res_rel_fcgi(struct httpsrvdev_inst* inst, struct httpsrvdev_fcgi* fcgi,
+    char* path, char* path_info
+) {
+    char resolved_path[PATH_MAX];
+    if (!path_rel_to_root_to_path_with_root(inst, path, resolved_path)) return false;
+    return httpsrvdev_res_fcgi(inst, fcgi, resolved_path, path_info);
+}
+
+// --------------------------------------------------------
+// Router
+// --------------------------------------------------------
+
+// Routes are collected by `httpsrvdev_route_add` and compiled by
+// `httpsrvdev_start` into a radix trie whose nodes live in one array, the
+// static children of each node next to each other and sorted by their first
+// byte. A static node matches its label -- the bytes that all routes below it
+// share -- and a parameter node one non-empty path segment. Dispatching walks
+// down the trie along the path without copying or allocating; at a node with
+// both, the static child is tried before the parameter child, which is only
+// walked into if the static subtree has no route for the path.
+
+#define ROUTER_NONE UINT32_MAX
+
+struct router_route {
+    char*               pattern;  // Owned copy
+    uint32_t            methods;
+    httpsrvdev_route_fn handler;
+    void*               ctx;
+    // Names of the ":param" segments, in order; into `pattern`
+    struct httpsrvdev_slice param_names[httpsrvdev_ROUTE_PARAMS_MAX];
+    int                 params_count;
+    // The next route that ends at the same node, with other methods
+    uint32_t            next;
+};
+
+struct router_node {
+    char*    label;            // Into a route's pattern
+    uint32_t label_len;
+    uint8_t  first_byte;       // Of the label, so that children are picked without
+                               // following `label`
+    bool     is_param;
+    uint32_t children_offset;  // Static children, contiguous
+    uint32_t children_count;
+    uint32_t param_child;
+    uint32_t route;            // Routes that end here
+    uint32_t prefix_route;     // Routes with their '*' here
+};
+
+struct httpsrvdev_router {
+    struct router_route* routes;
+    uint32_t             routes_count;
+    uint32_t             routes_cap;
+
+    // Built by `router_freeze`; node 0 is the root
+    struct router_node*  nodes;
+    uint32_t             nodes_count;
+    uint32_t             nodes_cap;
+    bool                 frozen;
+};
+
+// Whether the patterns `a` and `b` match the same paths, i.e. are equal but
+// for the names of their parameters
+static bool router_patterns_eq(char* a, char* b) {
+    while (*a != '\0' && *a == *b) {
+        if (*a == ':') {
+            a += strcspn(a, "/");
+            b += strcspn(b, "/");
+            continue;
+        }
+        ++a;
+        ++b;
+    }
+    return *a == *b;
+}
+
+// Add a route for requests with one of the `methods` -- a mask of
+// `httpsrvdev_METHOD_BIT`s -- whose normalized path matches `pattern`.
+// Patterns are absolute paths in which
+//     a segment ":name" matches any non-empty segment, see
+//         `httpsrvdev_route_param`, and
+//     a final '*' matches the rest of the path, including nothing, see
+//         `inst->conn->route_rest`.
+// E.g. "/users/:id/posts" or "/static/*". Static segments take precedence over
+// parameters. Routes can only be added before `httpsrvdev_start`.
+bool httpsrvdev_route_add(struct httpsrvdev_inst* inst, uint32_t methods, char* pattern,
+    httpsrvdev_route_fn handler, void* ctx
+) {
+    struct httpsrvdev_router* router = inst->router;
+    if (router == NULL) {
+        router = calloc(1, sizeof(*router));
+        if (router == NULL) {
+            inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+            return false;
+        }
+        inst->router = router;
+    }
+    if (router->frozen || pattern[0] != '/' || handler == NULL || methods == 0) {
+        inst->err = httpsrvdev_INVALID_ROUTE;
+        return false;
+    }
+
+    struct router_route route = {
+        .methods = methods, .handler = handler, .ctx = ctx, .next = ROUTER_NONE,
+    };
+    for (size_t i = 1; pattern[i] != '\0'; ++i) {
+        bool is_segment_start = pattern[i - 1] == '/';
+        if (pattern[i] == '*' && (!is_segment_start || pattern[i + 1] != '\0')) {
+            inst->err = httpsrvdev_INVALID_ROUTE;
+            return false;
+        }
+        if (pattern[i] != ':') continue;
+        char*  name     = pattern + i + 1;
+        size_t name_len = strcspn(name, "/");
+        if (!is_segment_start || name_len == 0 ||
+            route.params_count == httpsrvdev_ROUTE_PARAMS_MAX ||
+            memchr(name, ':', name_len) != NULL || memchr(name, '*', name_len) != NULL
+        ) {
+            inst->err = httpsrvdev_INVALID_ROUTE;
+            return false;
+        }
+        // Pointed into the copy below
+        route.param_names[route.params_count++] =
+            (struct httpsrvdev_slice) { .ptr = name, .len = name_len };
+        i += name_len;
+    }
+    // Routes for the same paths must not share methods
+    for (uint32_t i = 0; i < router->routes_count; ++i) {
+        if ((router->routes[i].methods & methods) != 0 &&
+            router_patterns_eq(router->routes[i].pattern, pattern)
+        ) {
+            inst->err = httpsrvdev_INVALID_ROUTE;
+            return false;
+        }
+    }
 
-    // Misc -------------------------------------------------------------
-    {
-        .ext_encoding = ('o'<<16) | ('g'<< 8) | ('x'<< 0),
-        .mime_type    = "application/ogg",
-        .charset_utf8 = false,
-    },
-    {
-        .ext_encoding = ('v'<<16) | ('s'<< 8) | ('d'<< 0),
-        .mime_type    = "application/vnd.visio",
-        .charset_utf8 = false,
-    },
+    if (router->routes_count == router->routes_cap) {
+        uint32_t new_cap = router->routes_cap == 0 ? 16 : 2*router->routes_cap;
+        struct router_route* new_routes =
+            realloc(router->routes, new_cap*sizeof(router->routes[0]));
+        if (new_routes == NULL) {
+            inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+            return false;
+        }
+        router->routes     = new_routes;
+        router->routes_cap = new_cap;
+    }
+    route.pattern = strdup(pattern);
+    if (route.pattern == NULL) {
+        inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+        return false;
+    }
+    for (int i = 0; i < route.params_count; ++i) {
+        route.param_names[i].ptr = route.pattern + (route.param_names[i].ptr - pattern);
+    }
+    router->routes[router->routes_count++] = route;
+    return true;
+}
+
+// Append `n` contiguous empty nodes, returning the index of the first one
+static uint32_t router_nodes_add(struct httpsrvdev_router* router, uint32_t n) {
+    if (router->nodes_count + n > router->nodes_cap) {
+        uint32_t new_cap = router->nodes_cap == 0 ? 64 : router->nodes_cap;
+        while (new_cap < router->nodes_count + n) new_cap *= 2;
+        struct router_node* new_nodes = realloc(router->nodes, new_cap*sizeof(router->nodes[0]));
+        if (new_nodes == NULL) return ROUTER_NONE;
+        router->nodes     = new_nodes;
+        router->nodes_cap = new_cap;
+    }
+    for (uint32_t i = 0; i < n; ++i) {
+        router->nodes[router->nodes_count + i] = (struct router_node) {
+            .param_child = ROUTER_NONE, .route = ROUTER_NONE, .prefix_route = ROUTER_NONE,
+        };
+    }
+    router->nodes_count += n;
+    return router->nodes_count - n;
+}
+
+// Build the node `node_idx` and its subtree for the `count` routes
+// `route_idxs`, whose patterns continue at `positions[route_idx]` -- all with
+// a ':' if `is_param`, otherwise all with the same byte. `route_idxs` is
+// reordered. Nodes are only referred to by index since building reallocates
+// the array.
+static bool router_build(struct httpsrvdev_router* router, uint32_t node_idx, bool is_param,
+    uint32_t* route_idxs, uint32_t count, size_t* positions
+) {
+    struct router_route* routes = router->routes;
+    router->nodes[node_idx].is_param = is_param;
+    if (is_param) {
+        for (uint32_t i = 0; i < count; ++i) {
+            char* rest = routes[route_idxs[i]].pattern + positions[route_idxs[i]];
+            positions[route_idxs[i]] += strcspn(rest, "/");
+        }
+    } else {
+        // The label runs up to the first difference, parameter or '*'
+        char*  first     = routes[route_idxs[0]].pattern + positions[route_idxs[0]];
+        size_t label_len = 0;
+        for (; first[label_len] != '\0' && first[label_len] != ':' && first[label_len] != '*';
+               ++label_len
+        ) {
+            uint32_t i = 1;
+            while (i < count &&
+                   routes[route_idxs[i]].pattern[positions[route_idxs[i]] + label_len] ==
+                       first[label_len]
+            ) {
+                ++i;
+            }
+            if (i < count) break;
+        }
+        for (uint32_t i = 0; i < count; ++i) positions[route_idxs[i]] += label_len;
+        router->nodes[node_idx].label      = first;
+        router->nodes[node_idx].label_len  = label_len;
+        router->nodes[node_idx].first_byte = first[0];
+    }
+
+    // Chain the routes that end here, then move those that continue with a
+    // parameter to the front and sort the rest by their next byte, so that
+    // each static child's routes are next to each other
+    uint32_t  continuing_count = 0;
+    uint32_t* route_tail       = &router->nodes[node_idx].route;
+    uint32_t* prefix_tail      = &router->nodes[node_idx].prefix_route;
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t idx = route_idxs[i];
+        char     c   = routes[idx].pattern[positions[idx]];
+        if (c == '\0') {
+            *route_tail = idx;
+            route_tail  = &routes[idx].next;
+        } else if (c == '*') {
+            *prefix_tail = idx;
+            prefix_tail  = &routes[idx].next;
+        } else {
+            route_idxs[continuing_count++] = idx;
+        }
+    }
+    // Few routes per node; an insertion sort does
+    for (uint32_t i = 1; i < continuing_count; ++i) {
+        uint32_t idx = route_idxs[i];
+        uint8_t  c   = routes[idx].pattern[positions[idx]] == ':' ?
+            0 : routes[idx].pattern[positions[idx]];
+        uint32_t j = i;
+        for (; j > 0; --j) {
+            uint32_t prev_idx = route_idxs[j - 1];
+            uint8_t  prev_c   = routes[prev_idx].pattern[positions[prev_idx]] == ':' ?
+                0 : routes[prev_idx].pattern[positions[prev_idx]];
+            if (prev_c <= c) break;
+            route_idxs[j] = prev_idx;
+        }
+        route_idxs[j] = idx;
+    }
+
+    uint32_t params_count = 0;
+    while (params_count < continuing_count &&
+           routes[route_idxs[params_count]].pattern[positions[route_idxs[params_count]]] == ':'
+    ) {
+        ++params_count;
+    }
+    if (params_count > 0) {
+        uint32_t child_idx = router_nodes_add(router, 1);
+        if (child_idx == ROUTER_NONE) return false;
+        router->nodes[node_idx].param_child = child_idx;
+        if (!router_build(router, child_idx, true, route_idxs, params_count, positions)) {
+            return false;
+        }
+    }
+
+    uint32_t* static_idxs   = route_idxs + params_count;
+    uint32_t  static_count  = continuing_count - params_count;
+    uint32_t  children_count = 0;
+    for (uint32_t i = 0; i < static_count; ++i) {
+        children_count += i == 0 ||
+            routes[static_idxs[i]].pattern[positions[static_idxs[i]]] !=
+            routes[static_idxs[i - 1]].pattern[positions[static_idxs[i - 1]]];
+    }
+    if (children_count == 0) return true;
+    uint32_t children_offset = router_nodes_add(router, children_count);
+    if (children_offset == ROUTER_NONE) return false;
+    router->nodes[node_idx].children_offset = children_offset;
+    router->nodes[node_idx].children_count  = children_count;
+    uint32_t group_start = 0;
+    for (uint32_t child = 0; child < children_count; ++child) {
+        uint32_t first_idx = static_idxs[group_start];
+        char     c         = routes[first_idx].pattern[positions[first_idx]];
+        uint32_t group_end = group_start + 1;
+        while (group_end < static_count &&
+               routes[static_idxs[group_end]].pattern[positions[static_idxs[group_end]]] == c
+        ) {
+            ++group_end;
+        }
+        if (!router_build(router, children_offset + child, false, static_idxs + group_start,
+                          group_end - group_start, positions)
+        ) {
+            return false;
+        }
+        group_start = group_end;
+    }
+    return true;
+}
+
+// Compile the routes added so far into the trie. No routes can be added
+// afterwards.
+static bool router_freeze(struct httpsrvdev_inst* inst) {
+    struct httpsrvdev_router* router = inst->router;
+    if (router == NULL || router->frozen) return true;
+    router->frozen = true;
+    if (router->routes_count == 0) return true;
+
+    uint32_t* route_idxs = malloc(router->routes_count*sizeof(uint32_t));
+    size_t*   positions  = calloc(router->routes_count, sizeof(size_t));
+    bool      ok         = route_idxs != NULL && positions != NULL &&
+                           router_nodes_add(router, 1) == 0;
+    for (uint32_t i = 0; ok && i < router->routes_count; ++i) route_idxs[i] = i;
+    // Every pattern starts with '/'
+    ok = ok && router_build(router, 0, false, route_idxs, router->routes_count, positions);
+    free(route_idxs);
+    free(positions);
+    if (!ok) inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+    return ok;
+}
+
+static void router_free(struct httpsrvdev_inst* inst) {
+    struct httpsrvdev_router* router = inst->router;
+    if (router == NULL) return;
+    for (uint32_t i = 0; i < router->routes_count; ++i) free(router->routes[i].pattern);
+    free(router->routes);
+    free(router->nodes);
+    free(router);
+    inst->router = NULL;
+}
+
+// The first route of the chain `route_idx` that serves one of the methods
+// `method_bits`, noting in `path_matched` whether there was any route
+static uint32_t router_route_for_methods(struct httpsrvdev_router* router, uint32_t route_idx,
+    uint32_t method_bits, bool* path_matched
+) {
+    for (; route_idx != ROUTER_NONE; route_idx = router->routes[route_idx].next) {
+        *path_matched = true;
+        if ((router->routes[route_idx].methods & method_bits) != 0) return route_idx;
+    }
+    return ROUTER_NONE;
+}
+
+// Match `inst->conn->req_path` from `pos` on against the subtree of the node
+// `node_idx`, with `params_count` parameters captured on the way there
+static uint32_t router_match(struct httpsrvdev_inst* inst, uint32_t node_idx, size_t pos,
+    int params_count, uint32_t method_bits, bool* path_matched
+) {
+    struct httpsrvdev_router* router = inst->router;
+    struct router_node*       node   = &router->nodes[node_idx];
+    char*                     path   = inst->conn->req_path;
+
+    if (node->is_param) {
+        size_t segment_len = strcspn(path + pos, "/");
+        if (segment_len == 0) return ROUTER_NONE;
+        // Deeper nodes only write the slots after this one, so a failed
+        // match below doesn't clobber what the caller captured
+        inst->conn->route_params[params_count++] =
+            (struct httpsrvdev_slice) { .ptr = path + pos, .len = segment_len };
+        pos += segment_len;
+    } else {
+        // The label contains no NUL, so this stops at the end of the path
+        if (strncmp(path + pos, node->label, node->label_len) != 0) return ROUTER_NONE;
+        pos += node->label_len;
+    }
+
+    uint32_t route_idx;
+    if (path[pos] == '\0') {
+        route_idx = router_route_for_methods(router, node->route, method_bits, path_matched);
+        if (route_idx != ROUTER_NONE) {
+            inst->conn->route_params_count = params_count;
+            inst->conn->route_rest = (struct httpsrvdev_slice) { .ptr = path + pos, .len = 0 };
+            return route_idx;
+        }
+    } else {
+        // Binary search of the children by first byte
+        uint8_t  c  = path[pos];
+        uint32_t lo = node->children_offset;
+        uint32_t hi = node->children_offset + node->children_count;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo)/2;
+            if (router->nodes[mid].first_byte < c) lo = mid + 1;
+            else                                   hi = mid;
+        }
+        if (lo < node->children_offset + node->children_count &&
+            router->nodes[lo].first_byte == c
+        ) {
+            route_idx = router_match(inst, lo, pos, params_count, method_bits, path_matched);
+            if (route_idx != ROUTER_NONE) return route_idx;
+        }
+        if (node->param_child != ROUTER_NONE) {
+            route_idx = router_match(inst, node->param_child, pos, params_count, method_bits,
+                                     path_matched);
+            if (route_idx != ROUTER_NONE) return route_idx;
+        }
+    }
+
+    route_idx = router_route_for_methods(router, node->prefix_route, method_bits, path_matched);
+    if (route_idx != ROUTER_NONE) {
+        inst->conn->route_params_count = params_count;
+        inst->conn->route_rest =
+            (struct httpsrvdev_slice) { .ptr = path + pos, .len = strlen(path + pos) };
+    }
+    return route_idx;
+}
+
+// Find the route for the current request, or set `inst->err`
+static struct router_route* router_dispatch(struct httpsrvdev_inst* inst) {
+    struct httpsrvdev_router* router = inst->router;
+    if (router == NULL || !router->frozen || router->nodes_count == 0) {
+        inst->err = httpsrvdev_NO_ROUTE;
+        return NULL;
+    }
+    uint32_t method_bits = httpsrvdev_METHOD_BIT(inst->conn->req_method);
+    if (inst->conn->req_method == httpsrvdev_HEAD) {
+        method_bits |= httpsrvdev_METHOD_BIT(httpsrvdev_GET);
+    }
+    bool     path_matched = false;
+    uint32_t route_idx    = router_match(inst, 0, 0, 0, method_bits, &path_matched);
+    if (route_idx == ROUTER_NONE) {
+        inst->conn->route_idx          = -1;
+        inst->conn->route_params_count = 0;
+        inst->err = path_matched ? httpsrvdev_METHOD_NOT_ALLOWED : httpsrvdev_NO_ROUTE;
+        return NULL;
+    }
+    inst->conn->route_idx = route_idx;
+    return &router->routes[route_idx];
+}
+
+// Serve the current request with the handler of the route that matches it,
+// returning what the handler returns. Fails without responding with
+// `httpsrvdev_NO_ROUTE` if no route matches the path, or with
+// `httpsrvdev_METHOD_NOT_ALLOWED` if none of those that do serve the method.
+bool httpsrvdev_res_route(struct httpsrvdev_inst* inst) {
+    struct router_route* route = router_dispatch(inst);
+    if (route == NULL) return false;
+    return route->handler(inst, route->ctx);
+}
+
+// What the parameter `name` of the route that the current request was
+// dispatched to matched, or an empty slice if it has no such parameter
+struct httpsrvdev_slice httpsrvdev_route_param(struct httpsrvdev_inst* inst, char* name) {
+    struct httpsrvdev_router* router = inst->router;
+    if (router == NULL || inst->conn->route_idx == -1) {
+        return (struct httpsrvdev_slice) { .ptr = "", .len = 0 };
+    }
+    struct router_route* route    = &router->routes[inst->conn->route_idx];
+    size_t               name_len = strlen(name);
+    for (int i = 0; i < route->params_count && i < inst->conn->route_params_count; ++i) {
+        if (route->param_names[i].len == name_len &&
+            memcmp(route->param_names[i].ptr, name, name_len) == 0
+        ) {
+            return inst->conn->route_params[i];
+        }
+    }
+    return (struct httpsrvdev_slice) { .ptr = "", .len = 0 };
+}
+
+// --------------------------------------------------------
+// Coroutines
+// --------------------------------------------------------
+
+// `httpsrvdev_serve` hands each accepted connection to a coroutine, which
+// receives the request, runs the handler and closes the connection on a
+// stack of its own. Where serving the connection would block on a socket --
+// in `conn_wait` and `proxy_wait` -- the coroutine is suspended instead, with
+// the socket in the epoll set, and the scheduler serves other connections
+// until the socket is ready or a timeout expires. Handlers are thus written
+// like the code after `httpsrvdev_res_begin`, straight-line and blocking.
+//
+// Each coroutine has a `struct httpsrvdev_conn` of its own, which
+// `inst->conn` points to while it runs, like `inst->timers->conn` to its
+// timers. Only what lies outside of it -- `inst->err`, the embedder's
+// `coros_locals` and the TLS session -- is saved when the coroutine is
+// suspended and restored when it is resumed. Requests on HTTP/2 streams
+// are served to the end on the scheduler's stack, as their state lives in
+// the shared connection, and so block while waiting on the file system
+// workers.
+
+// Named for the assembly below
+static void coro_main(struct httpsrvdev_inst* inst)
+    __asm__("httpsrvdev_coro_main") __attribute__((used));
+
+// Switching stacks. On x86-64 only the registers that a call doesn't already
+// save are switched, in user space; elsewhere `swapcontext` also switches
+// the signal mask, which takes a system call each time.
+#if defined(__x86_64__)
+struct coro_ctx {
+    void* sp;  // The registers are pushed below it
 };
 
+void coro_ctx_switch_asm(void** from_sp, void* to_sp) __asm__("httpsrvdev_coro_switch");
+void coro_ctx_start_asm(void)                        __asm__("httpsrvdev_coro_start");
+__asm__(
+    ".text\n"
+    "httpsrvdev_coro_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq  %rsp, (%rdi)\n"
+    "    movq  %rsi, %rsp\n"
+    "    popq  %r15\n"
+    "    popq  %r14\n"
+    "    popq  %r13\n"
+    "    popq  %r12\n"
+    "    popq  %rbx\n"
+    "    popq  %rbp\n"
+    "    ret\n"
+    // New stacks are first switched to here, with `inst` in r12
+    "httpsrvdev_coro_start:\n"
+    "    movq  %r12, %rdi\n"
+    "    call  httpsrvdev_coro_main\n"
+    "    ud2\n"
+);
+#else
+struct coro_ctx {
+    ucontext_t uc;
+};
 
-static FileTypeInfo default_faile_type_info = {
-    .ext_encoding = 0,
-    .mime_type    = "",
-    .charset_utf8 = true,
+// The pointer to `inst` is split into halves, as `makecontext` passes `int`s
+static void coro_main_uc(unsigned int inst_hi, unsigned int inst_lo) {
+    coro_main((struct httpsrvdev_inst*) (uintptr_t) ((uint64_t) inst_hi << 32 | inst_lo));
+}
+#endif
+
+// Prepare `ctx` to run `coro_main` on the stack [`stack`, `stack` + `stack_size`)
+static void coro_ctx_init(struct coro_ctx* ctx, char* stack, size_t stack_size,
+    struct httpsrvdev_inst* inst
+) {
+#if defined(__x86_64__)
+    void** sp = (void**) (stack + stack_size);
+    // `coro_main` is called with the stack 16-byte aligned
+    *--sp = NULL;
+    *--sp = NULL;
+    *--sp = (void*) coro_ctx_start_asm;
+    *--sp = NULL;  // rbp
+    *--sp = NULL;  // rbx
+    *--sp = inst;  // r12
+    *--sp = NULL;  // r13
+    *--sp = NULL;  // r14
+    *--sp = NULL;  // r15
+    ctx->sp = sp;
+#else
+    getcontext(&ctx->uc);
+    ctx->uc.uc_stack.ss_sp   = stack;
+    ctx->uc.uc_stack.ss_size = stack_size;
+    ctx->uc.uc_link          = NULL;
+    uint64_t inst_bits = (uintptr_t) inst;
+    makecontext(&ctx->uc, (void (*)(void)) coro_main_uc, 2,
+                (unsigned int) (inst_bits >> 32), (unsigned int) inst_bits);
+#endif
+}
+
+static void coro_ctx_swap(struct coro_ctx* from, struct coro_ctx* to) {
+#if defined(__x86_64__)
+    coro_ctx_switch_asm(&from->sp, to->sp);
+#else
+    swapcontext(&from->uc, &to->uc);
+#endif
+}
+
+struct coro {
+    struct coro_ctx ctx;
+    char*      stack;  // Above the guard page
+    size_t     stack_size;
+
+    bool is_active;      // Serving a connection
+    bool is_waiting;     // Suspended in `coro_wait`
+    bool is_ready;       // In the ready queue
+    bool waits_on_conn;  // Rather than e.g. on an upstream
+    int          wait_fd;
+    uint32_t     wait_events;  // Reported by epoll; 0 if it timed out
+    struct timer wait_timer;
+    // Signaled by the file system workers; in the epoll set from its
+    // creation on first use
+    int          fs_event_fd;
+
+    struct conn_timers timers;
+
+    struct httpsrvdev_conn* conn;
+    // Of `inst` while suspended
+    int   err;
+    void* locals;
+#ifdef HTTPSRVDEV_TLS
+    SSL*  tls_conn_ssl;
+    bool  tls_conn_ktls_send;
+    short tls_conn_wait_events;
+#endif
 };
 
-static FileTypeInfo* get_file_type_info_(struct httpsrvdev_inst* inst, char* file_path) {
-    uint64_t ext_encoding = httpsrvdev_file_encode_ext(inst, file_path);
-    if (ext_encoding == 0) {
-        if (inst->default_file_mime_type[0] == '\0') {
-            inst->err = httpsrvdev_FILE_HAS_NO_EXT;
+struct httpsrvdev_coros {
+    struct coro* coros;
+    int          count;
+    int          active_count;
+    // The most recently used, whose stack is warm, last
+    struct coro** idle;
+    int           idle_count;
+    // Ring buffer of the coroutines to resume
+    struct coro** ready;
+    int           ready_head;
+    int           ready_count;
+    // The coroutine waiting on each file descriptor, if any
+    struct coro** by_fd;
+    int           by_fd_cap;
+    bool          listen_paused;
+
+    struct coro*    current;  // NULL on the scheduler
+    struct coro_ctx scheduler_ctx;
+    // For AddressSanitizer, which has to be told about stack switches
+    const void*  scheduler_stack;
+    size_t       scheduler_stack_size;
+
+    httpsrvdev_serve_fn handler;
+    void*               ctx;
+};
+
+static int coros_active_count(struct httpsrvdev_inst* inst) {
+    return inst->coros == NULL ? 0 : inst->coros->active_count;
+}
+
+static int coros_ready_count(struct httpsrvdev_inst* inst) {
+    return inst->coros == NULL ? 0 : inst->coros->ready_count;
+}
+
+// Whether waiting suspends the current coroutine
+static bool coro_can_wait(struct httpsrvdev_inst* inst) {
+    return inst->coros != NULL && inst->coros->current != NULL && !h2_stream_is_current(inst);
+}
+
+static void coro_wake(struct httpsrvdev_inst* inst, struct coro* coro) {
+    struct httpsrvdev_coros* coros = inst->coros;
+    if (!coro->is_waiting || coro->is_ready) return;
+    coro->is_ready = true;
+    coros->ready[(coros->ready_head + coros->ready_count) % coros->count] = coro;
+    ++coros->ready_count;
+}
+
+// For the timers of the connection, which only end waits on the connection
+static void coro_wake_on_conn(struct httpsrvdev_inst* inst, struct coro* coro) {
+    if (coro != NULL && coro->waits_on_conn) coro_wake(inst, coro);
+}
+
+static void coro_on_wait_timeout(struct httpsrvdev_inst* inst, struct timer* timer) {
+    coro_wake(inst, (struct coro*) ((char*) timer - offsetof(struct coro, wait_timer)));
+}
+
+// Wake up the coroutine waiting on `fd`, if there is one
+static bool coros_on_poll_event(struct httpsrvdev_inst* inst, int fd, uint32_t events) {
+    struct httpsrvdev_coros* coros = inst->coros;
+    if (coros == NULL || fd >= coros->by_fd_cap || coros->by_fd[fd] == NULL) return false;
+    // The eventfd of its file system jobs stays registered while it waits on
+    // something else, or on nothing
+    struct coro* coro = coros->by_fd[fd];
+    if (coro->is_waiting && coro->wait_fd == fd) {
+        coro->wait_events |= events;
+        coro_wake(inst, coro);
+    }
+    return true;
+}
+
+// Switch from the running context, saving it to `from`, to `to`, which runs
+// on `to_stack`
+static void coro_switch(struct httpsrvdev_coros* coros, struct coro_ctx* from,
+    struct coro_ctx* to, const void* to_stack, size_t to_stack_size
+) {
+#ifdef __SANITIZE_ADDRESS__
+    void* fake_stack = NULL;
+    __sanitizer_start_switch_fiber(&fake_stack, to_stack, to_stack_size);
+#endif
+    coro_ctx_swap(from, to);
+#ifdef __SANITIZE_ADDRESS__
+    const void* from_stack;
+    size_t      from_stack_size;
+    __sanitizer_finish_switch_fiber(fake_stack, &from_stack, &from_stack_size);
+    // Coroutines are only switched to from the scheduler
+    if (coros->current != NULL) {
+        coros->scheduler_stack      = from_stack;
+        coros->scheduler_stack_size = from_stack_size;
+    }
+#endif
+}
+
+static void coro_resume(struct httpsrvdev_inst* inst, struct coro* coro) {
+    struct httpsrvdev_coros* coros = inst->coros;
+    coros->current     = coro;
+    inst->conn         = coro->conn;
+    inst->timers->conn = &coro->timers;
+    coro_switch(coros, &coros->scheduler_ctx, &coro->ctx, coro->stack, coro->stack_size);
+}
+
+static void coro_yield(struct httpsrvdev_inst* inst, struct coro* coro) {
+    struct httpsrvdev_coros* coros = inst->coros;
+    coros->current     = NULL;
+    inst->conn         = &inst->conn_default;
+    inst->timers->conn = &inst->timers->conn_default;
+    coro_switch(coros, &coro->ctx, &coros->scheduler_ctx,
+                coros->scheduler_stack, coros->scheduler_stack_size);
+}
+
+// Move the state of the current connection that lies outside of its `conn`
+// to `coro`
+static void coro_state_save(struct httpsrvdev_inst* inst, struct coro* coro) {
+    coro->err = inst->err;
+    if (inst->coros_locals_size > 0) {
+        memcpy(coro->locals, inst->coros_locals, inst->coros_locals_size);
+    }
+#ifdef HTTPSRVDEV_TLS
+    if (inst->tls != NULL) {
+        coro->tls_conn_ssl         = inst->tls->conn_ssl;
+        coro->tls_conn_ktls_send   = inst->tls->conn_ktls_send;
+        coro->tls_conn_wait_events = inst->tls->conn_wait_events;
+        inst->tls->conn_ssl         = NULL;
+        inst->tls->conn_ktls_send   = false;
+        inst->tls->conn_wait_events = 0;
+    }
+#endif
+}
+
+static void coro_state_restore(struct httpsrvdev_inst* inst, struct coro* coro) {
+    inst->err = coro->err;
+    if (inst->coros_locals_size > 0) {
+        memcpy(inst->coros_locals, coro->locals, inst->coros_locals_size);
+    }
+#ifdef HTTPSRVDEV_TLS
+    if (inst->tls != NULL) {
+        inst->tls->conn_ssl         = coro->tls_conn_ssl;
+        inst->tls->conn_ktls_send   = coro->tls_conn_ktls_send;
+        inst->tls->conn_wait_events = coro->tls_conn_wait_events;
+    }
+#endif
+}
+
+static bool coros_by_fd_reserve(struct httpsrvdev_coros* coros, int fd) {
+    if (fd < coros->by_fd_cap) return true;
+    int new_cap = coros->by_fd_cap == 0 ? 1024 : coros->by_fd_cap;
+    while (new_cap <= fd) new_cap *= 2;
+    struct coro** new_by_fd = realloc(coros->by_fd, new_cap*sizeof(new_by_fd[0]));
+    if (new_by_fd == NULL) return false;
+    memset(new_by_fd + coros->by_fd_cap, 0,
+           (new_cap - coros->by_fd_cap)*sizeof(new_by_fd[0]));
+    coros->by_fd     = new_by_fd;
+    coros->by_fd_cap = new_cap;
+    return true;
+}
+
+// Suspend the current coroutine until `fd`, which is in the epoll set and
+// `coros->by_fd`, is reported ready or `timeout_ms` have passed. Returns 1 or
+// 0 like `poll`.
+static int coro_park(struct httpsrvdev_inst* inst, int fd, int timeout_ms) {
+    struct coro* coro = inst->coros->current;
+    coro->is_waiting    = true;
+    coro->waits_on_conn = fd == inst->conn->conn_sock_fd;
+    coro->wait_fd       = fd;
+    coro->wait_events   = 0;
+    if (timeout_ms >= 0) timer_arm(inst->timers, &coro->wait_timer, timeout_ms);
+
+    coro_state_save(inst, coro);
+    coro_yield(inst, coro);
+    coro_state_restore(inst, coro);
+
+    timer_cancel(inst->timers, &coro->wait_timer);
+    coro->is_waiting = false;
+    return coro->wait_events != 0 ? 1 : 0;
+}
+
+// Suspend the current coroutine until `fd` is ready for `events` (POLLIN/
+// POLLOUT) or `timeout_ms` have passed -- or, with -1 on the connection,
+// until one of its timers fires. Returns 1, 0 or -1 like `poll`.
+static int coro_wait(struct httpsrvdev_inst* inst, int fd, short events, int timeout_ms) {
+    struct httpsrvdev_coros* coros = inst->coros;
+    if (!coros_by_fd_reserve(coros, fd)) return -1;
+    // The descriptor is only in the epoll set while waited on
+    struct epoll_event event = {
+        .events = (events & POLLIN ? EPOLLIN : 0) | (events & POLLOUT ? EPOLLOUT : 0),
+        .data   = { .fd = fd },
+    };
+    if (epoll_ctl(inst->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) return -1;
+    coros->by_fd[fd] = coros->current;
+    int n_ready = coro_park(inst, fd, timeout_ms);
+    epoll_ctl(inst->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    coros->by_fd[fd] = NULL;
+    return n_ready;
+}
+
+// The eventfd of the current coroutine for the file system workers to
+// signal, or -1 if it can't be created. Edge-triggered, as the count is only
+// read once the job is done.
+static int coro_fs_event_fd(struct httpsrvdev_inst* inst) {
+    struct httpsrvdev_coros* coros = inst->coros;
+    struct coro*             coro  = coros->current;
+    if (coro->fs_event_fd != -1) return coro->fs_event_fd;
+
+    int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fd == -1) return -1;
+    struct epoll_event event = { .events = EPOLLIN | EPOLLET, .data = { .fd = fd } };
+    if (!coros_by_fd_reserve(coros, fd) ||
+        epoll_ctl(inst->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1
+    ) {
+        close(fd);
+        return -1;
+    }
+    coros->by_fd[fd]  = coro;
+    coro->fs_event_fd = fd;
+    return fd;
+}
+
+// Close the connection without a response, e.g. after a failure
+static void coro_conn_abort(struct httpsrvdev_inst* inst) {
+    conn_timers_cancel(inst);
+    conn_tls_end(inst, false);
+    if (inst->conn->conn_sock_fd != -1) close(inst->conn->conn_sock_fd);
+    inst->conn->conn_sock_fd = -1;
+    httpsrvdev_arena_clear(&inst->conn->arena);
+}
+
+// Serve the request that has begun, ending whatever the handler left open,
+// e.g. after failing halfway
+static void coros_handle(struct httpsrvdev_inst* inst) {
+    struct httpsrvdev_coros* coros = inst->coros;
+    coros->handler(inst, coros->ctx);
+    if (inst->conn->conn_sock_fd != -1 || h2_stream_is_current(inst)) conn_close(inst);
+}
+
+// Serve one connection after the other, from accepting it on
+// `inst->conn->listen_sock_fd`
+static void coro_main(struct httpsrvdev_inst* inst) {
+    struct httpsrvdev_coros* coros = inst->coros;
+#ifdef __SANITIZE_ADDRESS__
+    __sanitizer_finish_switch_fiber(NULL, &coros->scheduler_stack, &coros->scheduler_stack_size);
+#endif
+
+    while (true) {
+        struct coro* coro = coros->current;
+        // Unless it turned out to be HTTP/2 without a request yet
+        if (conn_begin(inst) && (inst->conn->conn_sock_fd != -1 || h2_stream_is_current(inst))) {
+            coros_handle(inst);
         }
-        default_faile_type_info.ext_encoding = ext_encoding;
-        default_faile_type_info.mime_type    = inst->default_file_mime_type;
-        default_faile_type_info.charset_utf8 = true;
-        return &default_faile_type_info;
+        coro_conn_abort(inst);
+
+        coro->is_active = false;
+        --coros->active_count;
+        coros->idle[coros->idle_count++] = coro;
+        coro_yield(inst, coro);
+    }
+}
+
+// Map the stack, which only takes up memory as far as it is used, below a
+// guard page that a stack overflow runs into
+static bool coro_create(struct httpsrvdev_inst* inst, struct coro* coro) {
+    size_t page_size  = sysconf(_SC_PAGESIZE);
+    size_t stack_size = (inst->coro_stack_size + page_size - 1)/page_size*page_size;
+    char*  map = mmap(NULL, page_size + stack_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (map == MAP_FAILED) goto err;
+    if (mprotect(map, page_size, PROT_NONE) == -1) goto err_unmap;
+
+    coro->conn   = malloc(sizeof(*coro->conn));
+    coro->locals = inst->coros_locals_size > 0 ? malloc(inst->coros_locals_size) : NULL;
+    if (coro->conn == NULL || (inst->coros_locals_size > 0 && coro->locals == NULL)) {
+        free(coro->conn);
+        free(coro->locals);
+        coro->conn   = NULL;
+        coro->locals = NULL;
+        goto err_unmap;
     }
+    conn_init(coro->conn);
+    coro->stack       = map + page_size;
+    coro->stack_size  = stack_size;
+    coro->wait_fd     = -1;
+    coro->fs_event_fd = -1;
+    coro->wait_timer.fire = coro_on_wait_timeout;
+    conn_timers_init(&coro->timers, coro);
+
+    coro_ctx_init(&coro->ctx, coro->stack, coro->stack_size, inst);
+    return true;
 
-    // TODO: Do something faster than a linear search
-    for (size_t i = 0; i < sizeof(file_type_infos)/sizeof(file_type_infos[0]); ++i) {
-        if (file_type_infos[i].ext_encoding == ext_encoding) {
-            return &file_type_infos[i];
+err_unmap:
+    munmap(map, page_size + stack_size);
+err:
+    inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+    return false;
+}
+
+// Serve the connection waiting on `inst->conn->listen_sock_fd` on an idle
+// coroutine
+static void coro_start(struct httpsrvdev_inst* inst) {
+    struct httpsrvdev_coros* coros = inst->coros;
+    struct coro*             coro  = coros->idle[coros->idle_count - 1];
+    if (coro->stack == NULL && !coro_create(inst, coro)) {
+        // Served without suspending instead
+        if (conn_begin(inst) && (inst->conn->conn_sock_fd != -1 || h2_stream_is_current(inst))) {
+            coros_handle(inst);
         }
+        coro_conn_abort(inst);
+        return;
     }
+    --coros->idle_count;
+    coro->is_active = true;
+    ++coros->active_count;
+    // Accepted from the listening socket that is ready, and served from the
+    // default root
+    coro->conn->listen_sock_fd = inst->conn->listen_sock_fd;
+    strcpy(coro->conn->root_path, inst->conn->root_path);
+    coro_resume(inst, coro);
+}
 
-    inst->err = httpsrvdev_LIB_IMPL_ERR;
-    default_faile_type_info.ext_encoding = ext_encoding;
-    default_faile_type_info.mime_type    = inst->default_file_mime_type;
-    default_faile_type_info.charset_utf8 = true;
-    return &default_faile_type_info;
+// Resume the coroutines that are ready, each until it is suspended again or
+// done. Those woken up meanwhile are left for the next round.
+static void coros_run_ready(struct httpsrvdev_inst* inst) {
+    struct httpsrvdev_coros* coros = inst->coros;
+    if (coros == NULL) return;
+    for (int n = coros->ready_count; n > 0; --n) {
+        struct coro* coro = coros->ready[coros->ready_head];
+        coros->ready_head = (coros->ready_head + 1) % coros->count;
+        --coros->ready_count;
+        coro->is_ready = false;
+        coro_resume(inst, coro);
+    }
 }
 
-bool httpsrvdev_res_file(struct httpsrvdev_inst* inst, char* path) {
-    FileTypeInfo* file_type_info = get_file_type_info_(inst, path);
+// Take the listening sockets out of the epoll set, or put them back
+static bool coros_listen_pause(struct httpsrvdev_inst* inst, bool pause) {
+    struct httpsrvdev_coros* coros = inst->coros;
+    if (coros->listen_paused == pause) return true;
+    for (int i = 0; i < inst->listen_addrs_count; ++i) {
+        int fd = inst->listen_sock_fds[i];
+        if (fd == -1) continue;
+        struct epoll_event event = { .events = EPOLLIN, .data = { .fd = fd } };
+        if (epoll_ctl(inst->epoll_fd, pause ? EPOLL_CTL_DEL : EPOLL_CTL_ADD, fd, &event) == -1) {
+            inst->err = httpsrvdev_COULD_NOT_POLL | (errno & httpsrvdev_MASK_ERRNO);
+            return false;
+        }
+    }
+    coros->listen_paused = pause;
+    return true;
+}
 
-    int fd = open(path, O_RDONLY);
-    if (fd == -1) {
-        inst->err = httpsrvdev_COULD_NOT_OPEN_FILE | (errno & httpsrvdev_MASK_ERRNO);
-        // Goto ensures that file descriptor is closed
-        close(fd);
-        return false;
+static bool coros_init(struct httpsrvdev_inst* inst) {
+    struct httpsrvdev_coros* coros = calloc(1, sizeof(*coros));
+    if (coros == NULL) goto err;
+    inst->coros = coros;
+
+    // The stacks are mapped as the coroutines are first needed
+    coros->count = inst->coros_max;
+    coros->coros = calloc(coros->count, sizeof(coros->coros[0]));
+    coros->idle  = calloc(coros->count, sizeof(coros->idle[0]));
+    coros->ready = calloc(coros->count, sizeof(coros->ready[0]));
+    if (coros->coros == NULL || coros->idle == NULL || coros->ready == NULL) goto err;
+    for (int i = 0; i < coros->count; ++i) {
+        coros->idle[i] = &coros->coros[coros->count - 1 - i];
+    }
+    coros->idle_count = coros->count;
+    return true;
+
+err:
+    inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+    coros_free(inst);
+    return false;
+}
+
+// Free the coroutines, closing the connections of those that are suspended
+static void coros_free(struct httpsrvdev_inst* inst) {
+    struct httpsrvdev_coros* coros = inst->coros;
+    if (coros == NULL) return;
+
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    for (int i = 0; coros->coros != NULL && i < coros->count; ++i) {
+        struct coro* coro = &coros->coros[i];
+        // Not the one running, e.g. when stopped by a signal handler
+        if (coro == coros->current) continue;
+        if (coro->is_active) {
+            struct httpsrvdev_conn* conn = inst->conn;
+            coro_state_restore(inst, coro);
+            inst->conn = coro->conn;
+            // E.g. an upstream connection; others on its stack are leaked
+            if (coro->is_waiting && coro->wait_fd != inst->conn->conn_sock_fd &&
+                coro->wait_fd != coro->fs_event_fd
+            ) close(coro->wait_fd);
+            inst->timers->conn = &coro->timers;
+            coro_conn_abort(inst);
+            inst->timers->conn = &inst->timers->conn_default;
+            inst->conn         = conn;
+        }
+        if (inst->timers != NULL) timer_cancel(inst->timers, &coro->wait_timer);
+        if (coro->fs_event_fd != -1) close(coro->fs_event_fd);
+        if (coro->stack != NULL) munmap(coro->stack - page_size, page_size + coro->stack_size);
+        free(coro->conn);
+        free(coro->locals);
+    }
+    free(coros->coros);
+    free(coros->idle);
+    free(coros->ready);
+    free(coros->by_fd);
+    free(coros);
+    inst->coros = NULL;
+}
+
+bool httpsrvdev_serve(struct httpsrvdev_inst* inst, httpsrvdev_serve_fn handler, void* ctx) {
+    if (inst->coros_max <= 0) {
+        while (true) {
+            if (httpsrvdev_res_begin(inst)) {
+                handler(inst, ctx);
+            } else if (inst->err == httpsrvdev_HANDED_OFF) {
+                return false;
+            }
+        }
+    }
+
+    // Waits on coroutines always have timers and the epoll set at hand
+    if (inst->timers == NULL && !timers_init(inst)) return false;
+    if (!listen_socks_poll(inst))                    return false;
+    if (inst->coros == NULL && !coros_init(inst))    return false;
+    struct httpsrvdev_coros* coros = inst->coros;
+    coros->handler = handler;
+    coros->ctx     = ctx;
+
+    while (true) {
+        coros_run_ready(inst);
+        if (h2_has_ready_stream(inst)) {
+            if (h2_req_begin(inst)) coros_handle(inst);
+            continue;
+        }
+        if (coros->ready_count > 0) continue;
+
+        // Connections are accepted while there are coroutines to serve them
+        if (!coros_listen_pause(inst, coros->idle_count == 0)) return false;
+        if (inst->live_reload != NULL) {
+            if (!live_reload_wait_for_conn(inst)) return false;
+        } else {
+            if (!listen_socks_wait(inst))         return false;
+        }
+        if (inst->conn->listen_sock_fd != -1) coro_start(inst);
+    }
+}
+
+// --------------------------------------------------------
+// Snapshots
+// --------------------------------------------------------
+
+// A snapshot holds the complete response -- headers and body -- for every
+// file and directory under a root in one contiguous memory image, found by
+// URL path through an open-addressing hash table. Serving from it is a single
+// hash lookup and `send`.
+
+#define SNAPSHOT_HUGE_PAGE_SIZE (2*1024*1024)
+#define SNAPSHOT_MAX_THREADS    64
+
+struct snapshot_entry {
+    uint64_t hash;
+    char*    key;       // URL path without leading or trailing '/'; NULL for an empty slot
+    size_t   key_len;
+    char*    res;
+    size_t   res_len;
+    int      status;
+    bool     res_owned; // `res` was malloc'd by an update rather than being in the image
+    bool     removed;
+};
+
+struct httpsrvdev_snapshot {
+    char* root_path;
+
+    char*  image;
+    size_t image_size;
+
+    struct snapshot_entry* entries;
+    size_t                 entries_cap; // Power of 2
+    size_t                 entries_count;
+
+    struct httpsrvdev_snapshot_stats stats;
+};
+
+// What to put into a snapshot: found by walking the tree, then laid out and
+// loaded in one go
+struct snapshot_plan_file {
+    char*  path;
+    char*  key;
+    off_t  size;
+    bool   inject_live_reload_script;
+    struct httpsrvdev_prebuilt_res headers;
+    char*  res; // Where the response goes once laid out
+};
+
+struct snapshot_plan_dir {
+    char*  key;
+    // Either the key of the directory's index file or its listing
+    char*  index_key;
+    struct httpsrvdev_prebuilt_res listing;
+    char*  res;
+};
+
+struct snapshot_plan {
+    struct snapshot_plan_file* files;
+    size_t                     files_count;
+    size_t                     files_cap;
+    struct snapshot_plan_dir*  dirs;
+    size_t                     dirs_count;
+    size_t                     dirs_cap;
+
+    // For the loader threads
+    atomic_size_t next_file;
+    atomic_int    err;
+};
+
+static char* str_join3(char* a, char* b, char* c) {
+    size_t a_len = strlen(a);
+    size_t b_len = strlen(b);
+    size_t c_len = strlen(c);
+    char* result = malloc(a_len + b_len + c_len + 1);
+    if (result == NULL) return NULL;
+    memcpy(result,                 a, a_len);
+    memcpy(result + a_len,         b, b_len);
+    memcpy(result + a_len + b_len, c, c_len + 1);
+    return result;
+}
+
+static void snapshot_plan_free(struct snapshot_plan* plan) {
+    for (size_t i = 0; i < plan->files_count; ++i) {
+        free(plan->files[i].path);
+        free(plan->files[i].key);
+        httpsrvdev_prebuilt_free(&plan->files[i].headers);
+    }
+    for (size_t i = 0; i < plan->dirs_count; ++i) {
+        free(plan->dirs[i].key);
+        free(plan->dirs[i].index_key);
+        httpsrvdev_prebuilt_free(&plan->dirs[i].listing);
+    }
+    free(plan->files);
+    free(plan->dirs);
+}
+
+static bool snapshot_plan_file(struct httpsrvdev_inst* inst, struct snapshot_plan* plan,
+    char* path, char* key, off_t size
+) {
+    if (plan->files_count == plan->files_cap) {
+        size_t new_cap = plan->files_cap == 0 ? 64 : 2*plan->files_cap;
+        struct snapshot_plan_file* new_files =
+            realloc(plan->files, new_cap*sizeof(plan->files[0]));
+        if (new_files == NULL) goto err_mem;
+        plan->files     = new_files;
+        plan->files_cap = new_cap;
     }
+    struct snapshot_plan_file* file = &plan->files[plan->files_count];
+    *file = (struct snapshot_plan_file) { .size = size };
+    file->path = strdup(path);
+    file->key  = strdup(key);
+    if (file->path == NULL || file->key == NULL) {
+        free(file->path);
+        free(file->key);
+        goto err_mem;
+    }
+    ++plan->files_count;
 
-    if (lseek(fd, 0, SEEK_SET) == -1) {
-        inst->err = httpsrvdev_FILE_SYS_ERR | (errno & httpsrvdev_MASK_ERRNO);
-        close(fd);
-        return false;
+    FileTypeInfo* file_type_info = get_file_type_info_(inst, path);
+    file->inject_live_reload_script = inst->live_reload != NULL &&
+                                      strcmp(file_type_info->mime_type, "text/html") == 0;
+    off_t content_length = size;
+    if (file->inject_live_reload_script) {
+        content_length += sizeof(live_reload_script) - 1;
     }
-    int content_length = lseek(fd, 0, SEEK_END);
-    if (content_length == -1) {
-        inst->err = httpsrvdev_COULD_NOT_GET_FILE_CONTENT_LENGTH |
-                    (errno & httpsrvdev_MASK_ERRNO);
-        close(fd);
-        return false;
+
+    // Record the headers as `httpsrvdev_res_file` would send them
+    httpsrvdev_prebuilt_begin(inst, &file->headers);
+    bool ok = res_file_headers(inst, file_type_info, content_length) &&
+              httpsrvdev_res_send_n(inst, "\r\n", 2);
+    inst->conn->res_recording = NULL;
+    return ok;
+
+err_mem:
+    inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+    return false;
+}
+
+// Plan the directory at `path`, served at `key`, and -- if `recursive` -- the
+// files and directories within it
+static bool snapshot_plan_dir(struct httpsrvdev_inst* inst, struct snapshot_plan* plan,
+    char* path, char* key, bool recursive
+) {
+    if (plan->dirs_count == plan->dirs_cap) {
+        size_t new_cap = plan->dirs_cap == 0 ? 16 : 2*plan->dirs_cap;
+        struct snapshot_plan_dir* new_dirs =
+            realloc(plan->dirs, new_cap*sizeof(plan->dirs[0]));
+        if (new_dirs == NULL) {
+            inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+            return false;
+        }
+        plan->dirs     = new_dirs;
+        plan->dirs_cap = new_cap;
     }
-    if (lseek(fd, 0, SEEK_SET) == -1) {
-        inst->err = httpsrvdev_FILE_SYS_ERR | (errno & httpsrvdev_MASK_ERRNO);
-        close(fd);
+    size_t dir_idx = plan->dirs_count;
+    plan->dirs[dir_idx] = (struct snapshot_plan_dir) { .key = strdup(key) };
+    if (plan->dirs[dir_idx].key == NULL) {
+        inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
         return false;
     }
+    ++plan->dirs_count;
 
-    char content_length_value_buf[20];
-    sprintf(content_length_value_buf, "%d", content_length);
-    if (!httpsrvdev_res_status_line(inst, 200) ||
-        !httpsrvdev_res_header(inst, "Content-Length", content_length_value_buf)
-    ) {
-        close(fd);
+    struct dirent** entries;
+    int n_entries = scandir(path, &entries, NULL, alphasort);
+    if (n_entries == -1) {
+        inst->err = httpsrvdev_COULD_NOT_OPEN_DIR | (errno & httpsrvdev_MASK_ERRNO);
         return false;
     }
-    if (file_type_info->charset_utf8) {
-        if(!httpsrvdev_res_headerf(inst,
-            "Content-Type", "%s; charset=utf-8", file_type_info->mime_type)
-        ) {
-            close(fd);
-            return false;
+
+    bool   ok = true;
+    char*  key_prefix = key[0] == '\0' ? "" : "/";
+    char*  index_name = NULL;
+    for (size_t i = 0; i < sizeof(index_files)/sizeof(index_files[0]) && index_name == NULL; ++i) {
+        for (int j = 0; j < n_entries; ++j) {
+            if (strcmp(entries[j]->d_name, index_files[i] + 1) == 0 &&
+                entries[j]->d_type != DT_DIR
+            ) {
+                index_name = index_files[i] + 1;
+                break;
+            }
+        }
+    }
+    if (index_name != NULL) {
+        plan->dirs[dir_idx].index_key = str_join3(key, key_prefix, index_name);
+        if (plan->dirs[dir_idx].index_key == NULL) {
+            inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+            ok = false;
         }
     } else {
-        if(!httpsrvdev_res_header(inst, "Content-Type", file_type_info->mime_type)) {
-            close(fd);
-            return false;
+        // Record the listing as `httpsrvdev_res_dir` would send it
+        struct httpsrvdev_prebuilt_res listing;
+        httpsrvdev_prebuilt_begin(inst, &listing);
+        ok = httpsrvdev_res_listing_begin(inst);
+        char entry_href[PATH_MAX];
+        for (int i = 0; ok && i < n_entries; ++i) {
+            char* name = entries[i]->d_name;
+            int href_len = snprintf(entry_href, sizeof(entry_href), "/%s%s%s%s",
+                                    key, key_prefix, name,
+                                    entries[i]->d_type == DT_DIR ? "/" : "");
+            if (href_len < 0 || href_len >= sizeof(entry_href)) continue;
+            ok = httpsrvdev_res_listing_entry(inst, entry_href, name);
         }
+        ok = ok && httpsrvdev_res_listing_end(inst);
+        inst->conn->res_recording = NULL;
+        // The plan's array may have moved while recursing, so index it anew
+        plan->dirs[dir_idx].listing = listing;
     }
-    if (!httpsrvdev_res_header (inst, "Connection", "Keep-Alive")) {
-        close(fd);
-        return false;
+
+    for (int i = 0; i < n_entries; ++i) {
+        char* name = entries[i]->d_name;
+        bool  is_dot_or_dot_dot = name[0] == '.' &&
+                                  (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+        if (ok && recursive && !is_dot_or_dot_dot) {
+            char* entry_path = str_join3(path, "/", name);
+            char* entry_key  = str_join3(key, key_prefix, name);
+            struct stat entry_stat;
+            if (entry_path == NULL || entry_key == NULL) {
+                inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+                ok = false;
+            } else if (entries[i]->d_type == DT_DIR) {
+                // Symbolic links to directories are listed but not followed,
+                // which also rules out cycles
+                ok = snapshot_plan_dir(inst, plan, entry_path, entry_key, true);
+            } else if (stat(entry_path, &entry_stat) != -1 &&
+                       (entry_stat.st_mode & S_IFMT) == S_IFREG
+            ) {
+                ok = snapshot_plan_file(inst, plan, entry_path, entry_key, entry_stat.st_size);
+            }
+            free(entry_path);
+            free(entry_key);
+        }
+        free(entries[i]);
     }
+    free(entries);
 
-    if (!httpsrvdev_res_send_n(inst, "\r\n", 2)) return false;
+    return ok;
+}
 
-    size_t chunk_size = 2048;
-    char   chunk[chunk_size];
-    while (true) {
-        int n_bytes_read = read(fd, chunk, chunk_size);
-        if (n_bytes_read == -1) {
+static size_t snapshot_plan_file_res_len(struct snapshot_plan_file* file) {
+    return file->headers.len + file->size +
+           (file->inject_live_reload_script ? sizeof(live_reload_script) - 1 : 0);
+}
+
+// Read the body of `file` into its response, after the headers
+static int snapshot_load_file(struct snapshot_plan_file* file) {
+    char* body = file->res + file->headers.len;
+    int fd = open(file->path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return errno;
+    off_t n_read = 0;
+    while (n_read < file->size) {
+        ssize_t n = pread(fd, body + n_read, file->size - n_read, n_read);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            // The file shrank since it was planned
+            int err = n == 0 ? EIO : errno;
             close(fd);
-            return false;
+            return err;
         }
-        if (!httpsrvdev_res_send_n(inst, chunk, n_bytes_read)) return false;
-        if (n_bytes_read < chunk_size) break;
+        n_read += n;
     }
+    close(fd);
+    if (file->inject_live_reload_script) {
+        memcpy(body + file->size, live_reload_script, sizeof(live_reload_script) - 1);
+    }
+    return 0;
+}
 
-    if (close(fd) == -1) {
-        inst->err = httpsrvdev_COULD_NOT_CLOSE_FILE | (errno & httpsrvdev_MASK_ERRNO);
-        return false;
+static void* snapshot_loader_main(void* arg) {
+    struct snapshot_plan* plan = arg;
+    while (atomic_load(&plan->err) == 0) {
+        size_t i = atomic_fetch_add(&plan->next_file, 1);
+        if (i >= plan->files_count) break;
+        int err = snapshot_load_file(&plan->files[i]);
+        if (err != 0) atomic_store(&plan->err, err);
     }
+    return NULL;
+}
 
-    if (!httpsrvdev_res_end(inst)) return false;
+static struct snapshot_entry* snapshot_find_slot(struct httpsrvdev_snapshot* snapshot,
+    char* key, size_t key_len, uint64_t hash
+) {
+    size_t mask = snapshot->entries_cap - 1;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        struct snapshot_entry* entry = &snapshot->entries[i];
+        if (entry->key == NULL ||
+            (entry->hash == hash && entry->key_len == key_len &&
+             memcmp(entry->key, key, key_len) == 0)
+        ) {
+            return entry;
+        }
+    }
+}
 
-    return true;
+static struct snapshot_entry* snapshot_find(struct httpsrvdev_snapshot* snapshot,
+    char* key, size_t key_len
+) {
+    if (snapshot->entries_cap == 0) return NULL;
+    struct snapshot_entry* entry =
+        snapshot_find_slot(snapshot, key, key_len, hash_fnv1a(key, key_len));
+    return entry->key == NULL || entry->removed ? NULL : entry;
 }
 
-static char* index_files[] = {"/index.html", "index.htm"};
+// Point `key` at `res`, taking ownership of `res` if `res_owned`
+static bool snapshot_put(struct httpsrvdev_inst* inst, struct httpsrvdev_snapshot* snapshot,
+    char* key, char* res, size_t res_len, int status, bool res_owned
+) {
+    // Keep the load factor at or below 1/2
+    if (2*(snapshot->entries_count + 1) > snapshot->entries_cap) {
+        size_t old_cap = snapshot->entries_cap;
+        struct snapshot_entry* old_entries = snapshot->entries;
+        size_t new_cap = old_cap == 0 ? 64 : 2*old_cap;
+        struct snapshot_entry* new_entries = calloc(new_cap, sizeof(new_entries[0]));
+        if (new_entries == NULL) {
+            inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+            if (res_owned) free(res);
+            return false;
+        }
+        snapshot->entries     = new_entries;
+        snapshot->entries_cap = new_cap;
+        for (size_t i = 0; i < old_cap; ++i) {
+            if (old_entries[i].key == NULL) continue;
+            *snapshot_find_slot(snapshot, old_entries[i].key, old_entries[i].key_len,
+                                old_entries[i].hash) = old_entries[i];
+        }
+        free(old_entries);
+    }
 
-bool httpsrvdev_res_dir(struct httpsrvdev_inst* inst, char* dir_path) {
-    // Respond with the index.htm(l) file of existent in the directory
-    for (size_t i = 0; i < sizeof(index_files)/sizeof(index_files[0]); ++i) {
-        char* index_file_path = same_scope_tmp_alloc(inst, 1024);
-        strcpy(stpcpy(index_file_path, dir_path), index_files[i]);
-        struct stat index_file_path_stat;
+    size_t key_len = strlen(key);
+    uint64_t hash = hash_fnv1a(key, key_len);
+    struct snapshot_entry* entry = snapshot_find_slot(snapshot, key, key_len, hash);
+    if (entry->key == NULL) {
+        entry->key = strdup(key);
+        if (entry->key == NULL) {
+            inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+            if (res_owned) free(res);
+            return false;
+        }
+        entry->key_len = key_len;
+        entry->hash    = hash;
+        ++snapshot->entries_count;
+    } else if (entry->res_owned) {
+        free(entry->res);
+    }
+    entry->res       = res;
+    entry->res_len   = res_len;
+    entry->status    = status;
+    entry->res_owned = res_owned;
+    entry->removed   = false;
 
-        if (stat(index_file_path, &index_file_path_stat) == -1 ||
-            (index_file_path_stat.st_mode & S_IFMT) != S_IFREG
-        ) continue;
+    return true;
+}
 
-        return httpsrvdev_res_file(inst, index_file_path);
+// Lay out, load and index `plan`. Into a new image if `into_image`,
+// otherwise -- for updates -- into separately allocated responses.
+static bool snapshot_apply_plan(struct httpsrvdev_inst* inst,
+    struct httpsrvdev_snapshot* snapshot, struct snapshot_plan* plan,
+    bool into_image, int threads_count
+) {
+    size_t image_size = 0;
+    for (size_t i = 0; i < plan->files_count; ++i) {
+        image_size += snapshot_plan_file_res_len(&plan->files[i]);
+    }
+    for (size_t i = 0; i < plan->dirs_count; ++i) {
+        image_size += plan->dirs[i].listing.len;
     }
 
-    // Construct buffer containing "<dir_path>/" that will act as the prefix
-    // for the path to each directory entry
-    char entry_path_buf[1024];
-    if (!path_with_root_to_path_rel_to_root(inst, dir_path, entry_path_buf))
-        return false;
-    char* entry_name_in_path_start = entry_path_buf + strlen(entry_path_buf);
-    if (*(entry_name_in_path_start - 1) != '/') {
-        *entry_name_in_path_start = '/';
-        ++entry_name_in_path_start;
+    if (into_image) {
+        size_t map_size = (image_size + SNAPSHOT_HUGE_PAGE_SIZE - 1) &
+                          ~(size_t) (SNAPSHOT_HUGE_PAGE_SIZE - 1);
+        if (map_size == 0) map_size = SNAPSHOT_HUGE_PAGE_SIZE;
+        // Prefer explicit huge pages, which only exist if reserved by the
+        // admin, and else ask for transparent ones before faulting the image in
+        char* image = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+        snapshot->stats.huge_pages = image != MAP_FAILED;
+        if (image == MAP_FAILED) {
+            image = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (image == MAP_FAILED) {
+                inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+                return false;
+            }
+            madvise(image, map_size, MADV_HUGEPAGE);
+            #ifdef MADV_POPULATE_WRITE
+                madvise(image, map_size, MADV_POPULATE_WRITE);
+            #endif
+        }
+        snapshot->image      = image;
+        snapshot->image_size = map_size;
+        snapshot->stats.image_size = image_size;
+
+        char* next = image;
+        for (size_t i = 0; i < plan->files_count; ++i) {
+            plan->files[i].res = next;
+            next += snapshot_plan_file_res_len(&plan->files[i]);
+        }
+        for (size_t i = 0; i < plan->dirs_count; ++i) {
+            plan->dirs[i].res = next;
+            next += plan->dirs[i].listing.len;
+        }
+    } else {
+        for (size_t i = 0; i < plan->files_count; ++i) {
+            plan->files[i].res = malloc(snapshot_plan_file_res_len(&plan->files[i]) + 1);
+            if (plan->files[i].res == NULL) goto err_mem;
+        }
+        for (size_t i = 0; i < plan->dirs_count; ++i) {
+            plan->dirs[i].res = malloc(plan->dirs[i].listing.len + 1);
+            if (plan->dirs[i].res == NULL) goto err_mem;
+        }
     }
 
-    // Create the directory listing
-    httpsrvdev_res_listing_begin(inst);
-    struct dirent** entries;
-    int n_entries = scandir(dir_path, &entries, NULL, alphasort);
-    if (n_entries == -1) {
-        inst->err = httpsrvdev_COULD_NOT_OPEN_DIR | (errno & httpsrvdev_MASK_ERRNO);
-        return false;
+    for (size_t i = 0; i < plan->files_count; ++i) {
+        memcpy(plan->files[i].res, plan->files[i].headers.data, plan->files[i].headers.len);
     }
-    for (size_t i = 0; i < n_entries; ++i) {
-        struct dirent* entry = entries[i];
-        char* entry_name = entry->d_name;
-        char* path_end = stpcpy(entry_name_in_path_start, entry_name);
-        // Add trailing '/' to entry path if it's a directory.
-        // This ensures that the directory is kept in URL.
-        if (entry->d_type == DT_DIR) {
-            *(path_end++) = '/';
-            *path_end = '\0';
+    for (size_t i = 0; i < plan->dirs_count; ++i) {
+        if (plan->dirs[i].listing.len > 0) {
+            memcpy(plan->dirs[i].res, plan->dirs[i].listing.data, plan->dirs[i].listing.len);
         }
-        httpsrvdev_res_listing_entry(inst, entry_path_buf, entry_name);
     }
-    httpsrvdev_res_listing_end(inst);
-
-    return true;
-}
 
-bool httpsrvdev_res_file_sys_entry(struct httpsrvdev_inst* inst, char* path) {
-    struct stat path_stat;
-    if (stat(path, &path_stat) == -1) {
-        inst->err = httpsrvdev_COULD_NOT_STAT | (errno & httpsrvdev_MASK_ERRNO);
-        return false;
+    // Load the files' contents in parallel
+    atomic_init(&plan->next_file, 0);
+    atomic_init(&plan->err, 0);
+    pthread_t threads[SNAPSHOT_MAX_THREADS];
+    if (threads_count > SNAPSHOT_MAX_THREADS) threads_count = SNAPSHOT_MAX_THREADS;
+    if (threads_count > plan->files_count)    threads_count = plan->files_count;
+    int threads_started = 0;
+    for (int i = 1; i < threads_count; ++i) {
+        if (pthread_create(&threads[i], NULL, snapshot_loader_main, plan) != 0) break;
+        ++threads_started;
+    }
+    snapshot_loader_main(plan);
+    for (int i = 1; i <= threads_started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    if (atomic_load(&plan->err) != 0) {
+        inst->err = httpsrvdev_COULD_NOT_READ_FILE | (atomic_load(&plan->err) & httpsrvdev_MASK_ERRNO);
+        goto err_free_res;
     }
 
-    int file_type = path_stat.st_mode & S_IFMT;
-    switch (file_type) {
-        case S_IFREG:
-            return httpsrvdev_res_file(inst, path);
-        case S_IFDIR:
-            return httpsrvdev_res_dir(inst, path);
+    // Index the responses. Ownership of separately allocated responses
+    // passes to the snapshot here.
+    bool ok = true;
+    for (size_t i = 0; i < plan->files_count; ++i) {
+        struct snapshot_plan_file* file = &plan->files[i];
+        if (ok) {
+            // Frees the response itself on failure
+            ok = snapshot_put(inst, snapshot, file->key, file->res,
+                              snapshot_plan_file_res_len(file), 200, !into_image);
+        } else if (!into_image) {
+            free(file->res);
+        }
+        file->res = NULL;
+    }
+    for (size_t i = 0; i < plan->dirs_count; ++i) {
+        struct snapshot_plan_dir* dir = &plan->dirs[i];
+        if (dir->index_key != NULL) {
+            // Share the index file's response
+            struct snapshot_entry* index_entry =
+                snapshot_find(snapshot, dir->index_key, strlen(dir->index_key));
+            if (ok && index_entry != NULL) {
+                ok = snapshot_put(inst, snapshot, dir->key, index_entry->res,
+                                  index_entry->res_len, index_entry->status, false);
+            }
+            if (!into_image) free(dir->res);
+        } else if (ok) {
+            ok = snapshot_put(inst, snapshot, dir->key, dir->res,
+                              dir->listing.len, 200, !into_image);
+        } else if (!into_image) {
+            free(dir->res);
+        }
+        dir->res = NULL;
     }
+    snapshot->stats.files_count += plan->files_count;
+    snapshot->stats.dirs_count  += plan->dirs_count;
 
-    inst->err = httpsrvdev_UNHANDLED_FILE_TYPE | (file_type & httpsrvdev_MASK_FILE_TYPE);
-    return false;
-}
+    if (into_image) mprotect(snapshot->image, snapshot->image_size, PROT_READ);
 
-bool httpsrvdev_res_filef(struct httpsrvdev_inst* inst, char* fmt, ...) {
-    char str_buf[512];
-    SPRINTF_TO_STR_FROM_FMT_AND_VARGS;
-    return httpsrvdev_res_file(inst, str_buf);
-}
+    return ok;
 
-bool httpsrvdev_res_dirf(struct httpsrvdev_inst* inst, char* fmt, ...) {
-    char str_buf[512];
-    SPRINTF_TO_STR_FROM_FMT_AND_VARGS;
-    return httpsrvdev_res_dir(inst, str_buf);
+err_mem:
+    inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+err_free_res:
+    if (!into_image) {
+        for (size_t i = 0; i < plan->files_count; ++i) free(plan->files[i].res);
+        for (size_t i = 0; i < plan->dirs_count;  ++i) free(plan->dirs[i].res);
+    }
+    return false;
 }
 
-bool httpsrvdev_res_file_sys_entryf(struct httpsrvdev_inst* inst, char* fmt, ...) {
-    char str_buf[512];
-    SPRINTF_TO_STR_FROM_FMT_AND_VARGS;
-    return httpsrvdev_res_file_sys_entry(inst, str_buf);
-}
+struct httpsrvdev_snapshot* httpsrvdev_snapshot_build(struct httpsrvdev_inst* inst,
+    char* root_path, int threads_count
+) {
+    uint64_t start_ns = monotonic_ns();
 
-bool httpsrvdev_res_rel_file(struct httpsrvdev_inst* inst, char* path) {
-    char resolved_path[512];
-    path_rel_to_root_to_path_with_root(inst, path, resolved_path);
-    return httpsrvdev_res_file(inst, resolved_path);
-}
+    struct httpsrvdev_snapshot* snapshot = calloc(1, sizeof(*snapshot));
+    if (snapshot == NULL) {
+        inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+        return NULL;
+    }
+    snapshot->image = MAP_FAILED;
+    snapshot->root_path = strdup(root_path);
+    if (snapshot->root_path == NULL) {
+        inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+        goto err;
+    }
 
-bool httpsrvdev_res_rel_dir(struct httpsrvdev_inst* inst, char* path) {
-    char resolved_path[512];
-    path_rel_to_root_to_path_with_root(inst, path, resolved_path);
-    return httpsrvdev_res_dir(inst, resolved_path);
-}
+    struct snapshot_plan plan = {0};
+    bool ok = snapshot_plan_dir(inst, &plan, root_path, "", true) &&
+              snapshot_apply_plan(inst, snapshot, &plan, true, threads_count);
+    snapshot_plan_free(&plan);
+    httpsrvdev_arena_clear(&inst->conn->arena);
+    if (!ok) goto err;
 
-bool httpsrvdev_res_rel_file_sys_entry(struct httpsrvdev_inst* inst, char* path) {
-    char resolved_path[512];
-    path_rel_to_root_to_path_with_root(inst, path, resolved_path);
-    return httpsrvdev_res_dir(inst, resolved_path);
-}
+    snapshot->stats.build_ns = monotonic_ns() - start_ns;
+    return snapshot;
 
-bool httpsrvdev_res_rel_filef(struct httpsrvdev_inst* inst, char* fmt, ...) {
-    char str_buf[512];
-    SPRINTF_TO_STR_FROM_FMT_AND_VARGS;
-    char resolved_path[512];
-    path_rel_to_root_to_path_with_root(inst, str_buf, resolved_path);
-    return httpsrvdev_res_file(inst, resolved_path);
+err:
+    httpsrvdev_snapshot_free(snapshot);
+    return NULL;
 }
 
-bool httpsrvdev_res_rel_dirf(struct httpsrvdev_inst* inst, char* fmt, ...) {
-    char str_buf[512];
-    SPRINTF_TO_STR_FROM_FMT_AND_VARGS;
-    char resolved_path[512];
-    path_rel_to_root_to_path_with_root(inst, str_buf, resolved_path);
-    return httpsrvdev_res_dir(inst, resolved_path);
-}
+void httpsrvdev_snapshot_free(struct httpsrvdev_snapshot* snapshot) {
+    if (snapshot == NULL) return;
 
-bool httpsrvdev_res_rel_file_sys_entryf(struct httpsrvdev_inst* inst, char* fmt, ...) {
-    char str_buf[512];
-    SPRINTF_TO_STR_FROM_FMT_AND_VARGS;
-    char resolved_path[512];
-    path_rel_to_root_to_path_with_root(inst, str_buf, resolved_path);
-    return httpsrvdev_res_file_sys_entry(inst, resolved_path);
+    for (size_t i = 0; i < snapshot->entries_cap; ++i) {
+        free(snapshot->entries[i].key);
+        if (snapshot->entries[i].res_owned) free(snapshot->entries[i].res);
+    }
+    free(snapshot->entries);
+    if (snapshot->image != MAP_FAILED) munmap(snapshot->image, snapshot->image_size);
+    free(snapshot->root_path);
+    free(snapshot);
 }
 
-bool httpsrvdev_res_listing_begin(struct httpsrvdev_inst* inst) {
-    httpsrvdev_res_status_line(inst, 200);
-    httpsrvdev_res_header(inst, "Content-Type", "text/html");
-    httpsrvdev_res_header(inst, "Transfer-Encoding", "chunked");
-    httpsrvdev_res_send_n(inst, "\r\n", 2);
-    char* chunk = same_scope_tmp_alloc(inst, 256);
-    size_t chunk_size = sprintf(chunk,
-        "<!DOCTYPE html>\n"
-        "<html><body style=\"font-family:sans-serif;\n"
-        "background-color:#000;margin:2em\">\n");
-    dprintf(inst->conn_sock_fd, "%lX\r\n%s\r\n", chunk_size, chunk);
+// Rebuild the snapshot from scratch, keeping the old one if that fails
+static void snapshot_rebuild(struct httpsrvdev_inst* inst) {
+    struct httpsrvdev_snapshot* snapshot = inst->snapshot;
+    struct httpsrvdev_snapshot* fresh =
+        httpsrvdev_snapshot_build(inst, snapshot->root_path, 1);
+    if (fresh == NULL) return;
+
+    struct httpsrvdev_snapshot old = *snapshot;
+    *snapshot = *fresh;
+    *fresh    = old;
+    httpsrvdev_snapshot_free(fresh);
+}
 
-    return true;
+struct httpsrvdev_snapshot_stats httpsrvdev_snapshot_stats(struct httpsrvdev_snapshot* snapshot) {
+    return snapshot->stats;
 }
 
-bool httpsrvdev_res_listing_entry(struct httpsrvdev_inst* inst,
-    char* path, char* link_text
+// Bring the snapshot up to date after a change to `path`, which must be
+// within the snapshot's root: re-read it (recursively for directories) or
+// drop it if it's gone, then re-render its parent directory.
+static bool snapshot_update(struct httpsrvdev_inst* inst,
+    struct httpsrvdev_snapshot* snapshot, char* path
 ) {
-    bool path_is_abs = path[0] == '/';
-    char* anchor_target;
-    if (path_is_abs) {
-        anchor_target = "_top";
+    size_t root_path_len = strlen(snapshot->root_path);
+    if (strncmp(path, snapshot->root_path, root_path_len) != 0 ||
+        path[root_path_len] != '/'
+    ) return true;
+    char* key = path + root_path_len;
+    while (*key == '/') ++key;
+    size_t key_len = strlen(key);
+    if (key_len == 0) return true;
+
+    bool ok = true;
+    struct snapshot_plan plan = {0};
+    struct stat path_stat;
+    if (stat(path, &path_stat) == -1) {
+        // Drop the entry and, for directories, everything within
+        for (size_t i = 0; i < snapshot->entries_cap; ++i) {
+            struct snapshot_entry* entry = &snapshot->entries[i];
+            if (entry->key == NULL || entry->removed) continue;
+            if (strncmp(entry->key, key, key_len) == 0 &&
+                (entry->key[key_len] == '\0' || entry->key[key_len] == '/')
+            ) {
+                if (entry->res_owned) free(entry->res);
+                entry->res       = NULL;
+                entry->res_len   = 0;
+                entry->res_owned = false;
+                entry->removed   = true;
+            }
+        }
+    } else if ((path_stat.st_mode & S_IFMT) == S_IFDIR) {
+        ok = snapshot_plan_dir(inst, &plan, path, key, true);
+    } else if ((path_stat.st_mode & S_IFMT) == S_IFREG) {
+        ok = snapshot_plan_file(inst, &plan, path, key, path_stat.st_size);
+    }
+
+    // Re-render the parent directory, whose listing or index file may have changed
+    char* parent_path = strdup(path);
+    char* parent_key  = strdup(key);
+    if (parent_path == NULL || parent_key == NULL) {
+        inst->err = httpsrvdev_MEM_ERR | (errno & httpsrvdev_MASK_ERRNO);
+        ok = false;
     } else {
-        anchor_target = "_self";
+        *strrchr(parent_path, '/') = '\0';
+        char* parent_key_end = strrchr(parent_key, '/');
+        if (parent_key_end != NULL) {
+            *parent_key_end = '\0';
+        } else {
+            parent_key[0] = '\0';
+        }
+        ok = ok && snapshot_plan_dir(inst, &plan, parent_path, parent_key, false);
     }
-    char* chunk = same_scope_tmp_alloc(inst, 256);
-    size_t chunk_size = sprintf(chunk,
-        "<a style=\"color:#FFF;text-decoration:underline;"
-                   "display:block;margin-bottom:0.5em\" "
-            "href=\"%s\" "
-            "target=\"%s\" "
-        ">%s</a>",
-        path, anchor_target, link_text);
-    dprintf(inst->conn_sock_fd, "%lX\r\n%s\r\n", chunk_size, chunk);
+    free(parent_path);
+    free(parent_key);
 
-    return true;
+    ok = ok && snapshot_apply_plan(inst, snapshot, &plan, false, 1);
+    snapshot_plan_free(&plan);
+    return ok;
 }
 
-bool httpsrvdev_res_listing_end(struct httpsrvdev_inst* inst) {
-    char* chunk = same_scope_tmp_alloc(inst, 256);
-    size_t chunk_size = sprintf(chunk,
-        "</body></html>");
-    dprintf(inst->conn_sock_fd, "%lX\r\n%s\r\n0\r\n", chunk_size, chunk);
-    httpsrvdev_res_end(inst);
+bool httpsrvdev_res_snapshot(struct httpsrvdev_inst* inst,
+    struct httpsrvdev_snapshot* snapshot, char* path
+) {
+    while (*path == '/') ++path;
+    size_t path_len = strlen(path);
+    while (path_len > 0 && path[path_len - 1] == '/') --path_len;
 
-    return true;
+    struct snapshot_entry* entry = snapshot_find(snapshot, path, path_len);
+    if (entry == NULL) {
+        inst->err = httpsrvdev_COULD_NOT_STAT | ENOENT;
+        return false;
+    }
+
+    inst->conn->res_status = entry->status;
+    if (!httpsrvdev_res_send_n(inst, entry->res, entry->res_len)) return false;
+    return conn_close(inst);
 }
 
 uint64_t httpsrvdev_file_encode_ext(struct httpsrvdev_inst* inst, char* file_path) {
@@ -1272,6 +9436,130 @@ uint64_t httpsrvdev_file_encode_ext(struct httpsrvdev_inst* inst, char* file_pat
     return 0;
 }
 
+// Parse one of
+//     unix:PATH       -- a Unix domain socket
+//     [IPV6]:PORT     -- e.g. "[::1]:8080"
+//     IPV4:PORT       -- e.g. "127.0.0.1:8080"
+// The ":PORT" may be left out to use `inst->port`, and the host to use
+// `inst->ip`.
+bool httpsrvdev_addr_parse(struct httpsrvdev_inst* inst, char* str,
+    struct httpsrvdev_addr* addr
+) {
+    *addr = (struct httpsrvdev_addr) { .sock_addr_size = 0 };
+
+    if (strncmp(str, "unix:", 5) == 0) {
+        char* path = str + 5;
+        struct sockaddr_un* addr_un = (struct sockaddr_un*) &addr->sock_addr;
+        size_t path_len = strlen(path);
+        if (path_len == 0 || path_len >= sizeof(addr_un->sun_path)) goto err;
+        addr_un->sun_family = AF_UNIX;
+        memcpy(addr_un->sun_path, path, path_len + 1);
+        addr->sock_addr_size = offsetof(struct sockaddr_un, sun_path) + path_len + 1;
+        return true;
+    }
+
+    // Split into host and port
+    char   host[INET6_ADDRSTRLEN];
+    size_t host_len;
+    char*  port_str;
+    bool   is_ipv6 = str[0] == '[';
+    if (is_ipv6) {
+        char* host_end = strchr(str, ']');
+        if (host_end == NULL) goto err;
+        host_len = host_end - (str + 1);
+        if (host_len >= sizeof(host)) goto err;
+        memcpy(host, str + 1, host_len);
+        port_str = host_end + 1;
+        if (*port_str != '\0' && *port_str != ':') goto err;
+    } else {
+        port_str = strchr(str, ':');
+        if (port_str == NULL) port_str = str + strlen(str);
+        host_len = port_str - str;
+        if (host_len >= sizeof(host)) goto err;
+        memcpy(host, str, host_len);
+    }
+    host[host_len] = '\0';
+
+    int port = inst->port;
+    if (*port_str == ':') {
+        port = httpsrvdev_port_parse(inst, port_str + 1);
+        if (port == -1) return false;
+    }
+
+    if (is_ipv6) {
+        struct sockaddr_in6* addr_in6 = (struct sockaddr_in6*) &addr->sock_addr;
+        addr_in6->sin6_family = AF_INET6;
+        addr_in6->sin6_port   = htons(port);
+        if (inet_pton(AF_INET6, host, &addr_in6->sin6_addr) != 1) goto err;
+        addr->sock_addr_size = sizeof(*addr_in6);
+    } else {
+        int64_t ip = inst->ip;
+        if (host_len > 0) {
+            ip = httpsrvdev_ipv4_parse(inst, host);
+            if (ip == -1) return false;
+        }
+        struct sockaddr_in* addr_in = (struct sockaddr_in*) &addr->sock_addr;
+        addr_in->sin_family      = AF_INET;
+        addr_in->sin_port        = htons(port);
+        addr_in->sin_addr.s_addr = htonl(ip);
+        addr->sock_addr_size = sizeof(*addr_in);
+    }
+    return true;
+
+err:
+    inst->err = httpsrvdev_INVALID_ADDR;
+    return false;
+}
+
+// Write `addr` in the form accepted by `httpsrvdev_addr_parse`
+bool httpsrvdev_addr_to_str(struct httpsrvdev_inst* inst,
+    struct httpsrvdev_addr* addr, char* buf, size_t buf_size
+) {
+    int len = -1;
+    switch (addr->sock_addr.ss_family) {
+        case AF_UNIX: {
+            struct sockaddr_un* addr_un = (struct sockaddr_un*) &addr->sock_addr;
+            len = snprintf(buf, buf_size, "unix:%s", addr_un->sun_path);
+        } break;
+        case AF_INET6: {
+            struct sockaddr_in6* addr_in6 = (struct sockaddr_in6*) &addr->sock_addr;
+            char host[INET6_ADDRSTRLEN];
+            inet_ntop(AF_INET6, &addr_in6->sin6_addr, host, sizeof(host));
+            len = snprintf(buf, buf_size, "[%s]:%d", host, ntohs(addr_in6->sin6_port));
+        } break;
+        case AF_INET: {
+            struct sockaddr_in* addr_in = (struct sockaddr_in*) &addr->sock_addr;
+            uint32_t ip = ntohl(addr_in->sin_addr.s_addr);
+            len = snprintf(buf, buf_size, "%d.%d.%d.%d:%d",
+                           (ip>>24)&0xFF, (ip>>16)&0xFF, (ip>>8)&0xFF, (ip>>0)&0xFF,
+                           ntohs(addr_in->sin_port));
+        } break;
+        default:
+            inst->err = httpsrvdev_INVALID_ADDR;
+            return false;
+    }
+    if (len < 0 || (size_t) len >= buf_size) {
+        inst->err = httpsrvdev_BUF_TOO_SMALL;
+        return false;
+    }
+    return true;
+}
+
+bool httpsrvdev_listen_addr_add(struct httpsrvdev_inst* inst, struct httpsrvdev_addr* addr) {
+    if (inst->listen_addrs_count == httpsrvdev_LISTEN_ADDRS_MAX) {
+        inst->err = httpsrvdev_BUF_TOO_SMALL;
+        return false;
+    }
+    inst->listen_addrs[inst->listen_addrs_count++] = *addr;
+    return true;
+}
+
+bool httpsrvdev_listen_addr_from_str(struct httpsrvdev_inst* inst, char* str) {
+    struct httpsrvdev_addr addr;
+    if (!httpsrvdev_addr_parse(inst, str, &addr)) return false;
+    return httpsrvdev_listen_addr_add(inst, &addr);
+}
+
 bool httpsrvdev_ipv4_from_str(struct httpsrvdev_inst* inst, char* str) {
     int64_t ip = httpsrvdev_ipv4_parse(inst, str);
     if (ip == -1) {
@@ -1296,7 +9584,7 @@ int64_t httpsrvdev_ipv4_parse(struct httpsrvdev_inst* inst, char* str) {
             byte += decimal_exp*(str[i--] - '0');
 
             if (byte > 255)             goto err_return;
-            if (str[i] == '.' || i < 0) break;
+            if (i < 0 || str[i] == '.') break;
         }
         ip |= (byte << (8*j));
     }
@@ -1320,7 +9608,9 @@ bool httpsrvdev_port_from_str(struct httpsrvdev_inst* inst, char* str) {
 int httpsrvdev_port_parse(struct httpsrvdev_inst* inst, char* str) {
     int port = 0;
     int decimal_exp = 1;
-    for (int i = strlen(str) - 1; i > -1; --i) {
+    int len = strnlen(str, 6);
+    if (len == 0 || len > 5) goto err;
+    for (int i = len - 1; i > -1; --i) {
         if (!('0' <= str[i] && str[i] <= '9')) goto err;
 
         port += decimal_exp*(str[i] - '0');
@@ -1337,6 +9627,60 @@ err:
     return -1;
 }
 
+bool httpsrvdev_root_path_from_str(struct httpsrvdev_inst* inst, char* str) {
+    size_t len = strlen(str);
+    if (len >= sizeof(inst->conn->root_path)) {
+        inst->err = httpsrvdev_BUF_TOO_SMALL;
+        return false;
+    }
+    memcpy(inst->conn->root_path, str, len + 1);
+    return true;
+}
+
+#ifdef HTTPSRVDEV_TEST_HOOKS
+    bool httpsrvdev_test_parse_req(struct httpsrvdev_inst* inst) {
+        return parse_req(inst);
+    }
+
+    char* httpsrvdev_test_get_file_mime_type(struct httpsrvdev_inst* inst, char* file_path) {
+        return get_file_type_info_(inst, file_path)->mime_type;
+    }
+
+    bool httpsrvdev_test_path_rel_to_root_to_path_with_root(struct httpsrvdev_inst* inst,
+        char* path, char* result_path
+    ) {
+        return path_rel_to_root_to_path_with_root(inst, path, result_path);
+    }
+
+    bool httpsrvdev_test_path_with_root_to_path_rel_to_root(struct httpsrvdev_inst* inst,
+        char* path, char* result_path
+    ) {
+        return path_with_root_to_path_rel_to_root(inst, path, result_path);
+    }
+
+    bool httpsrvdev_test_target_normalize(struct httpsrvdev_inst* inst) {
+        return target_normalize(inst);
+    }
+
+    size_t httpsrvdev_test_escape_html_text(char* dest, char* src, size_t len) {
+        return escape(ESCAPE_HTML_TEXT, dest, src, len);
+    }
+
+    size_t httpsrvdev_test_escape_url_path(char* dest, char* src, size_t len) {
+        return escape(ESCAPE_URL_PATH, dest, src, len);
+    }
+
+    // Dispatch without calling the handler, compiling the routes first if
+    // `httpsrvdev_start` hasn't
+    bool httpsrvdev_test_route_match(struct httpsrvdev_inst* inst, void** ctx) {
+        if (!router_freeze(inst)) return false;
+        struct router_route* route = router_dispatch(inst);
+        if (route == NULL) return false;
+        *ctx = route->ctx;
+        return true;
+    }
+#endif
+
 // General TODOs:
 // - Add err_msg to inst and set err_msg at each error site
 // - Revaluate use of fixed sized buffers ->
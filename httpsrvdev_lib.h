@@ -15,8 +15,30 @@
 #define httpsrvdev_TRACE   8
 #define httpsrvdev_PATCH   9
 
+// Well-known request headers. `parse_req` classifies these while scanning so
+// their values can be read in O(1) with `httpsrvdev_req_header`. Any other
+// header is still available through `inst->req_headers`.
+#define httpsrvdev_HDR_HOST              0
+#define httpsrvdev_HDR_CONNECTION        1
+#define httpsrvdev_HDR_ACCEPT            2
+#define httpsrvdev_HDR_ACCEPT_ENCODING   3
+#define httpsrvdev_HDR_IF_NONE_MATCH     4
+#define httpsrvdev_HDR_IF_MODIFIED_SINCE 5
+#define httpsrvdev_HDR_RANGE             6
+#define httpsrvdev_HDR_IF_RANGE          7
+#define httpsrvdev_HDR_CONTENT_LENGTH    8
+#define httpsrvdev_HDR_CONTENT_TYPE      9
+#define httpsrvdev_HDR_TRANSFER_ENCODING 10
+#define httpsrvdev_HDR_UPGRADE           11
+#define httpsrvdev_HDR_USER_AGENT        12
+#define httpsrvdev_HDR_COUNT             13
+
 #define httpsrvdev_NO_ERR                            (int64_t) -1
+#define httpsrvdev_REQ_ERR                           (int64_t) 0x01FF000
 #define httpsrvdev_CANNOT_PARSE_REQ                  (int64_t) 0x0100000
+#define httpsrvdev_NO_ROUTE                          (int64_t) 0x0101000
+#define httpsrvdev_METHOD_NOT_ALLOWED                (int64_t) 0x0102000
+#define httpsrvdev_INVALID_ROUTE                     (int64_t) 0x0104000
 
 #define httpsrvdev_FILE_SYS_ERR                      (int64_t) 0x02FF000
 #define httpsrvdev_COULD_NOT_OPEN_FILE               (int64_t) 0x0200000
@@ -27,27 +49,184 @@
 #define httpsrvdev_COULD_NOT_OPEN_DIR                (int64_t) 0x0210000
 #define httpsrvdev_COULD_NOT_STAT                    (int64_t) 0x0211000
 #define httpsrvdev_UNHANDLED_FILE_TYPE               (int64_t) 0x0212000
+#define httpsrvdev_COULD_NOT_WATCH                   (int64_t) 0x0214000
+#define httpsrvdev_COULD_NOT_READ_ARCHIVE            (int64_t) 0x0218000
+#define httpsrvdev_UNACCEPTABLE_ENCODING             (int64_t) 0x0220000
+#define httpsrvdev_COULD_NOT_OPEN_RECORDING          (int64_t) 0x0224000
 
 #define httpsrvdev_INVALID_IP                        (int64_t) 0x0400000
 #define httpsrvdev_INVALID_PORT                      (int64_t) 0x0410000
+#define httpsrvdev_INVALID_ADDR                      (int64_t) 0x0420000
 
 #define httpsrvdev_MEM_ERR                           (int64_t) 0x08FF000
 #define httpsrvdev_BUF_TOO_SMALL                     (int64_t) 0x0800000
 
+#define httpsrvdev_SOCK_ERR                          (int64_t) 0x10FF000
+#define httpsrvdev_COULD_NOT_POLL                    (int64_t) 0x1000000
+#define httpsrvdev_COULD_NOT_CREATE_SOCK             (int64_t) 0x1001000
+#define httpsrvdev_COULD_NOT_SET_SOCK_OPT            (int64_t) 0x1002000
+#define httpsrvdev_COULD_NOT_BIND                    (int64_t) 0x1004000
+#define httpsrvdev_COULD_NOT_LISTEN                  (int64_t) 0x1008000
+#define httpsrvdev_COULD_NOT_ACCEPT                  (int64_t) 0x1010000
+#define httpsrvdev_TIMED_OUT                         (int64_t) 0x1011000
+#define httpsrvdev_COULD_NOT_HAND_OFF                (int64_t) 0x1020000
+#define httpsrvdev_HANDED_OFF                        (int64_t) 0x1040000
+#define httpsrvdev_SHED                              (int64_t) 0x1080000
+
+#define httpsrvdev_TLS_ERR                           (int64_t) 0x20FF000
+#define httpsrvdev_TLS_NOT_BUILT_IN                  (int64_t) 0x2000000
+#define httpsrvdev_COULD_NOT_LOAD_TLS_CERT           (int64_t) 0x2001000
+#define httpsrvdev_TLS_HANDSHAKE_FAILED              (int64_t) 0x2002000
+
+#define httpsrvdev_PROXY_ERR                         (int64_t) 0x40FF000
+#define httpsrvdev_INVALID_UPSTREAM_URL              (int64_t) 0x4000000
+#define httpsrvdev_UPSTREAM_CONN_FAILED              (int64_t) 0x4001000
+#define httpsrvdev_UPSTREAM_TIMED_OUT                (int64_t) 0x4002000
+#define httpsrvdev_BAD_UPSTREAM_RES                  (int64_t) 0x4004000
+#define httpsrvdev_UNSUPPORTED_REQ_BODY              (int64_t) 0x4008000
+
 #define httpsrvdev_LIB_IMPL_ERR                      (int64_t) 0x8000000
 
 #define httpsrvdev_MASK_ERRNO                        (int64_t) 0x0000FFF
 #define httpsrvdev_MASK_FILE_TYPE                    (int64_t) 0x0000FFF
 
-struct httpsrvdev_inst {
-    int err;
+struct httpsrvdev_inst;
 
-    uint32_t ip;
-    int port;
+// Route that `httpsrvdev_res_live_reload_events` should be served on. The
+// script injected into HTML responses connects to it.
+#define httpsrvdev_LIVE_RELOAD_EVENTS_PATH "/__httpsrvdev/live-reload"
+
+struct httpsrvdev_live_reload;
+struct httpsrvdev_fs_pool;
+struct httpsrvdev_archive;
+struct httpsrvdev_snapshot;
+struct httpsrvdev_admission;
+struct httpsrvdev_timers;
+struct httpsrvdev_h2;
+struct httpsrvdev_tls;
+struct httpsrvdev_upstream;
+struct httpsrvdev_fcgi;
+struct httpsrvdev_router;
+struct httpsrvdev_coros;
+
+struct httpsrvdev_snapshot_stats {
+    size_t   files_count;
+    size_t   dirs_count;
+    size_t   image_size;  // Bytes of responses in the image
+    bool     huge_pages;  // Whether the image is backed by explicit huge pages
+    uint64_t build_ns;
+};
+
+#define httpsrvdev_ARENA_ALIGN       16
+#define httpsrvdev_ARENA_INLINE_SIZE 8192
+
+struct httpsrvdev_arena_block;
+
+/* A bump allocator for small, short-lived allocations. There is one per
+ * connection; it is cleared at the start and end of every request.
+ *
+ * Allocations are first served from the inline `mem` region. When that is
+ * full, further blocks are chained from a page pool that is shared by all
+ * arenas, so the arena never overwrites live allocations and has no fixed size
+ * limit. Use `httpsrvdev_arena_save`/`httpsrvdev_arena_reset` to free
+ * everything allocated after a point, e.g. within a loop.
+ *
+ * Built with -DDEV or -DHTTPSRVDEV_ARENA_DEBUG, freed regions are overwritten
+ * with 0xDD and, under AddressSanitizer, poisoned. */
+struct httpsrvdev_arena {
+    // Overflow blocks, most recent first. NULL while everything fits in `mem`.
+    struct httpsrvdev_arena_block* blocks;
+    // Bytes used in the most recent block, or in `mem` if `blocks` is NULL
+    size_t used;
+    _Alignas(httpsrvdev_ARENA_ALIGN) char mem[httpsrvdev_ARENA_INLINE_SIZE];
+};
+
+struct httpsrvdev_arena_mark {
+    struct httpsrvdev_arena_block* blocks;
+    size_t used;
+};
+
+/* A complete response, recorded once with `httpsrvdev_prebuilt_begin` and
+ * sent any number of times with `httpsrvdev_res_prebuilt`. */
+struct httpsrvdev_prebuilt_res {
+    char*  data;
+    size_t len;
+    size_t cap;
+    int    status;
+};
+
+/* Passed to each instrumentation hook. `time_ns` is read from
+ * CLOCK_MONOTONIC at the point the hook fires; the byte counts are the totals
+ * for the current request/response up to that point. */
+struct httpsrvdev_hook_event {
+    uint64_t time_ns;
+    size_t   req_bytes;
+    size_t   res_bytes;
+};
+
+typedef void (*httpsrvdev_hook_fn)(struct httpsrvdev_inst* inst,
+                                   struct httpsrvdev_hook_event* event);
+
+/* Optional instrumentation callbacks. Set `inst->hooks` to a table of these
+ * to measure the phases of a request; any entry may be NULL. When
+ * `inst->hooks` is NULL (the default) no clock is read and the only cost is a
+ * single, predicted-not-taken branch per hook site. */
+struct httpsrvdev_hooks {
+    httpsrvdev_hook_fn conn_accept;     // After `accept()` returns
+    httpsrvdev_hook_fn parse_complete;  // After the request has been parsed
+    httpsrvdev_hook_fn first_byte_sent; // After the first response write
+    httpsrvdev_hook_fn res_end;         // After the connection has been closed
+    httpsrvdev_hook_fn conn_shed;       // After admission control refused it
+    void*              ctx;             // Free for use by the embedder
+};
+
+/* A socket address: IPv4, IPv6 or the path of a Unix domain socket. See
+ * `httpsrvdev_addr_parse` for the string forms. */
+struct httpsrvdev_addr {
+    struct sockaddr_storage sock_addr;
+    socklen_t               sock_addr_size;
+};
+
+#define httpsrvdev_LISTEN_ADDRS_MAX 16
+
+/* A run of bytes within a buffer that outlives it, not NUL-terminated */
+struct httpsrvdev_slice {
+    char*  ptr;
+    size_t len;
+};
+
+// Mask of request methods that a route serves; GET includes HEAD
+#define httpsrvdev_METHOD_BIT(method) ((uint32_t) 1 << (method))
+#define httpsrvdev_ANY_METHOD         ((uint32_t) -1)
+
+#define httpsrvdev_ROUTE_PARAMS_MAX 8
+
+/* Recordings (see `record_path`) start with the magic, followed by a record
+ * per request: a head of its arrival time in nanoseconds since the Unix epoch
+ * (8 bytes) and its length (4 bytes), both little-endian, and then the request
+ * as received. Recordings of several runs may be appended to the same file. */
+#define httpsrvdev_RECORD_MAGIC     "HSDVREC1"
+#define httpsrvdev_RECORD_MAGIC_LEN 8
+#define httpsrvdev_RECORD_HEAD_LEN  12
+
+/* Serves a request that matched a route, like the code after
+ * `httpsrvdev_res_begin` would. `ctx` is what the route was added with. */
+typedef bool (*httpsrvdev_route_fn)(struct httpsrvdev_inst* inst, void* ctx);
+
+/* Serves a request received by `httpsrvdev_serve`, like the code after
+ * `httpsrvdev_res_begin` would. `ctx` is what `httpsrvdev_serve` was called
+ * with. */
+typedef bool (*httpsrvdev_serve_fn)(struct httpsrvdev_inst* inst, void* ctx);
+
+/* The state of a connection and of the request on it that is being served.
+ * `httpsrvdev_serve` gives each coroutine one of its own and points
+ * `inst->conn` to that of the coroutine that runs, so that switching between
+ * connections copies none of it. */
+struct httpsrvdev_conn {
+    // The listening socket that the connection was accepted from
     int listen_sock_fd;
-    int   conn_sock_fd;
-    struct sockaddr_in listen_sock_addr;
-    size_t             listen_sock_addr_size;
+    int conn_sock_fd;
+    struct httpsrvdev_addr conn_addr;
 
     // Request stuff
     char   req_buf[2048];
@@ -55,21 +234,169 @@ struct httpsrvdev_inst {
     int    req_method;
     char*  req_method_str;
     char*  req_target;
+    // The target's path, percent-decoded and normalized, e.g. "/a b/c.txt"
+    // for "/a%20b/./c.txt?v=2" -- see `target_normalize` -- and what follows
+    // its '?', or NULL
+    char*  req_path;
+    char*  req_query;
+    char   req_path_buf[2048];
     char*  req_headers[128][2];
     int    req_headers_count;
+    // Values of the well-known headers, indexed by `httpsrvdev_HDR_*`;
+    // NULL when the header is absent. For duplicates, the first one wins.
+    char*  req_known_headers[httpsrvdev_HDR_COUNT];
     char*  req_body;
+    // Of the route that `httpsrvdev_res_route` dispatched to: its index (-1
+    // if none), the segments its ":param"s matched, in order, and what its
+    // '*' matched. Both slice `req_path`.
+    int                     route_idx;
+    struct httpsrvdev_slice route_params[httpsrvdev_ROUTE_PARAMS_MAX];
+    int                     route_params_count;
+    struct httpsrvdev_slice route_rest;
 
     // Response stuff
-    int res_status;
+    int    res_status;
+    size_t res_bytes_sent;
+    // While not NULL, responses are appended here instead of being sent
+    struct httpsrvdev_prebuilt_res* res_recording;
+    // Of the last `httpsrvdev_res_proxy` or `httpsrvdev_res_fcgi`: whether a
+    // connection to the upstream was taken at all, how long getting it took,
+    // whether it was an idle one that was reused, and how long the upstream
+    // took to respond once the request was sent
+    bool     res_upstream_conn_taken;
+    uint64_t res_upstream_connect_ns;
+    bool     res_upstream_reused;
+    uint64_t res_upstream_response_ns;
+    // Between `httpsrvdev_res_listing_begin` and `httpsrvdev_res_listing_end`:
+    // the entries that haven't been sent yet, which are sent in large chunks
+    char*    res_listing_buf;
+    size_t   res_listing_len;
 
-    char* default_file_mime_type;
 
+    // What the `_rel_` functions resolve paths against. Each connection of
+    // `httpsrvdev_serve` starts out with that of `inst->conn_default`.
     char root_path[512];
 
-    /* A region of memory reserved for small, short-lived allocations. */
-    char   same_scope_tmp_mem[8192];
-    size_t same_scope_tmp_mem_size;
-    size_t same_scope_tmp_mem_alloc_offset;
+    /* Memory for small, short-lived allocations -- see `httpsrvdev_arena` */
+    struct httpsrvdev_arena arena;
+};
+
+struct httpsrvdev_inst {
+    int err;
+
+    struct httpsrvdev_hooks* hooks;
+
+    // The address that is listened on if none are added with
+    // `httpsrvdev_listen_addr_add`
+    uint32_t ip;
+    int port;
+    // All listening sockets are served by the same loop
+    struct httpsrvdev_addr listen_addrs[httpsrvdev_LISTEN_ADDRS_MAX];
+    int                    listen_addrs_count;
+    int                    listen_sock_fds[httpsrvdev_LISTEN_ADDRS_MAX];
+    bool                   listen_socks_polled;
+    // Index of the address that `httpsrvdev_start` failed to listen on
+    int                    listen_addr_failed;
+
+    // Socket tuning, applied by `httpsrvdev_start` and on accept. 0 leaves
+    // the system default.
+    int  listen_backlog;      // Default SOMAXCONN
+    bool tcp_nodelay;         // Send small writes without waiting for ACKs
+    int  tcp_fastopen_qlen;   // Pending TCP Fast Open connections
+    int  tcp_defer_accept_s;  // Accept once data arrives, for at most this long
+    int  sock_sndbuf_size;
+    int  sock_rcvbuf_size;
+
+    // Hot restart -- if set, `httpsrvdev_start` takes over the listening
+    // sockets of the server serving the control socket at this path and then
+    // serves it in turn. Once a newer process takes over, `res_begin` and
+    // `httpsrvdev_serve` fail with `httpsrvdev_HANDED_OFF`; see
+    // `httpsrvdev_drain`.
+    char* handoff_path;
+    int   handoff_sock_fd;
+    int   listen_socks_taken_over;
+
+    // Admission control, checked after a request arrives but before it is
+    // parsed. Refused requests get a prebuilt 503 with Retry-After and
+    // `res_begin` fails with `httpsrvdev_SHED`. 0 disables each limit.
+    int admission_max_conns;      // Open connections, including event streams
+    int admission_max_queued;     // Connections waiting to be accepted
+    int admission_ip_rate;        // Requests per second per client IP...
+    int admission_ip_burst;       // ...in bursts of up to this many. Default the rate.
+    int admission_retry_after_s;  // Default 1
+    struct httpsrvdev_admission* admission;
+    uint64_t admission_shed_count;
+    int      admission_queued_count;  // At the last accept
+
+    // Connection timeouts, enforced with a timing wheel. A connection that
+    // runs into one is closed, failing `res_begin` or the sending function
+    // with `httpsrvdev_TIMED_OUT`. 0 disables each.
+    int conn_header_timeout_ms;  // To receive the request headers. Default 10 s.
+    int conn_idle_timeout_ms;    // Without receiving or sending. Default 5 s.
+    int conn_min_send_rate;      // Bytes per second, checked each second
+    struct httpsrvdev_timers* timers;
+
+    // HTTP/2 over cleartext TCP, with prior knowledge or upgraded from
+    // HTTP/1.1. Requests on HTTP/2 streams are served like any other; the
+    // connections stay open in the background between them.
+    bool h2c;
+    struct httpsrvdev_h2* h2;
+
+    // HTTPS, if a certificate is set. Requires building with HTTPSRVDEV_TLS
+    // and OpenSSL. The session keys go to the kernel (kTLS) where possible,
+    // so that files are still sent with `sendfile`.
+    char* tls_cert_path;  // PEM certificate chain
+    char* tls_key_path;   // PEM private key. Default the certificate's file.
+    struct httpsrvdev_tls* tls;
+
+    // Traffic recording -- if set, `httpsrvdev_start` opens the file at this
+    // path and each request is appended to it as received into `req_buf`,
+    // before it is parsed or refused. See `httpsrvdev_RECORD_MAGIC` for the
+    // format.
+    char* record_path;
+    int   record_fd;
+
+    // Routes added with `httpsrvdev_route_add`, compiled by `httpsrvdev_start`
+    // and dispatched to by `httpsrvdev_res_route`
+    struct httpsrvdev_router* router;
+
+    // Connections served by `httpsrvdev_serve` each get a coroutine: a stack
+    // of their own, below a guard page, that is suspended wherever serving
+    // them would block on a socket so that other connections are served
+    // meanwhile. Each has a `conn` of its own; what is at `coros_locals`,
+    // e.g. the embedder's per-request globals, is saved and restored as they
+    // are switched.
+    int    coros_max;        // Default 64. 0 serves one connection at a time.
+    size_t coro_stack_size;  // Default 256 KiB
+    void*  coros_locals;
+    size_t coros_locals_size;
+    struct httpsrvdev_coros* coros;
+
+    // Shared by everything the server waits on
+    int epoll_fd;
+
+    // The current connection: `conn_default` unless a coroutine of
+    // `httpsrvdev_serve` is running. Set by `httpsrvdev_init_end`.
+    struct httpsrvdev_conn* conn;
+    struct httpsrvdev_conn  conn_default;
+
+    char* default_file_mime_type;
+
+    // Live reload state -- NULL until `httpsrvdev_live_reload_watch` is first
+    // called. Changes are collected for `live_reload_debounce_ms` after the
+    // first one of a burst before the connected clients are notified.
+    struct httpsrvdev_live_reload* live_reload;
+    int                            live_reload_debounce_ms;
+
+    // Number of threads that `stat`, `scandir` and reads of files that aren't
+    // in the page cache are offloaded to, so that a slow disk or network file
+    // system doesn't stall the server. 0 (the default) does all file system
+    // access inline. The pool is started by `httpsrvdev_start`.
+    int                        fs_workers_count;
+    struct httpsrvdev_fs_pool* fs_pool;
+
+    // If set, the live reload watcher keeps this snapshot up to date
+    struct httpsrvdev_snapshot* snapshot;
 };
 
 struct httpsrvdev_inst httpsrvdev_init_begin();
@@ -77,6 +404,10 @@ bool     httpsrvdev_init_end               (struct httpsrvdev_inst* inst);
 bool     httpsrvdev_start                  (struct httpsrvdev_inst* inst);
 bool     httpsrvdev_stop                   (struct httpsrvdev_inst* inst);
 bool     httpsrvdev_res_begin              (struct httpsrvdev_inst* inst);
+bool     httpsrvdev_serve                  (struct httpsrvdev_inst* inst,
+                                                httpsrvdev_serve_fn handler, void* ctx);
+bool     httpsrvdev_drain                  (struct httpsrvdev_inst* inst, int grace_ms);
+char*    httpsrvdev_req_header             (struct httpsrvdev_inst* inst, int hdr);
 bool     httpsrvdev_res_send_n             (struct httpsrvdev_inst* inst,
                                                 char* str, size_t n);
 bool     httpsrvdev_res_send               (struct httpsrvdev_inst* inst, char* str);
@@ -107,10 +438,84 @@ bool     httpsrvdev_res_listing_begin      (struct httpsrvdev_inst* inst);
 bool     httpsrvdev_res_listing_entry      (struct httpsrvdev_inst* inst,
                                                 char* path, char* link_text);
 bool     httpsrvdev_res_listing_end        (struct httpsrvdev_inst* inst);
+bool     httpsrvdev_prebuilt_begin         (struct httpsrvdev_inst* inst,
+                                                struct httpsrvdev_prebuilt_res* res);
+bool     httpsrvdev_res_prebuilt           (struct httpsrvdev_inst* inst,
+                                                struct httpsrvdev_prebuilt_res* res);
+void     httpsrvdev_prebuilt_free          (struct httpsrvdev_prebuilt_res* res);
+struct httpsrvdev_archive*
+         httpsrvdev_archive_open           (struct httpsrvdev_inst* inst, char* path);
+void     httpsrvdev_archive_close          (struct httpsrvdev_archive* archive);
+bool     httpsrvdev_res_archive_member     (struct httpsrvdev_inst* inst,
+                                                struct httpsrvdev_archive* archive,
+                                                char* path);
+struct httpsrvdev_upstream*
+         httpsrvdev_upstream_open          (struct httpsrvdev_inst* inst, char* url);
+void     httpsrvdev_upstream_close         (struct httpsrvdev_upstream* upstream);
+bool     httpsrvdev_res_proxy              (struct httpsrvdev_inst* inst,
+                                                struct httpsrvdev_upstream* upstream,
+                                                size_t prefix_len);
+struct httpsrvdev_fcgi*
+         httpsrvdev_fcgi_open              (struct httpsrvdev_inst* inst, char* addr);
+void     httpsrvdev_fcgi_close             (struct httpsrvdev_fcgi* fcgi);
+bool     httpsrvdev_res_fcgi               (struct httpsrvdev_inst* inst,
+                                                struct httpsrvdev_fcgi* fcgi,
+                                                char* script_path, char* path_info);
+bool     httpsrvdev_res_rel_fcgi           (struct httpsrvdev_inst* inst,
+                                                struct httpsrvdev_fcgi* fcgi,
+                                                char* path, char* path_info);
+struct httpsrvdev_snapshot*
+         httpsrvdev_snapshot_build         (struct httpsrvdev_inst* inst,
+                                                char* root_path, int threads_count);
+void     httpsrvdev_snapshot_free          (struct httpsrvdev_snapshot* snapshot);
+struct httpsrvdev_snapshot_stats
+         httpsrvdev_snapshot_stats         (struct httpsrvdev_snapshot* snapshot);
+bool     httpsrvdev_res_snapshot           (struct httpsrvdev_inst* inst,
+                                                struct httpsrvdev_snapshot* snapshot,
+                                                char* path);
 uint64_t httpsrvdev_file_encode_ext        (struct httpsrvdev_inst* inst, char* file_path);
+bool     httpsrvdev_addr_parse             (struct httpsrvdev_inst* inst, char* str,
+                                                struct httpsrvdev_addr* addr);
+bool     httpsrvdev_addr_to_str            (struct httpsrvdev_inst* inst,
+                                                struct httpsrvdev_addr* addr,
+                                                char* buf, size_t buf_size);
+bool     httpsrvdev_listen_addr_add        (struct httpsrvdev_inst* inst,
+                                                struct httpsrvdev_addr* addr);
+bool     httpsrvdev_listen_addr_from_str   (struct httpsrvdev_inst* inst, char* str);
 bool     httpsrvdev_ipv4_from_str          (struct httpsrvdev_inst* inst, char* str);
 int64_t  httpsrvdev_ipv4_parse             (struct httpsrvdev_inst* inst, char* str);
 bool     httpsrvdev_port_from_str          (struct httpsrvdev_inst* inst, char* str);
 int      httpsrvdev_port_parse             (struct httpsrvdev_inst* inst, char* str);
+bool     httpsrvdev_root_path_from_str     (struct httpsrvdev_inst* inst, char* str);
+bool     httpsrvdev_route_add              (struct httpsrvdev_inst* inst, uint32_t methods,
+                                                char* pattern, httpsrvdev_route_fn handler,
+                                                void* ctx);
+bool     httpsrvdev_res_route              (struct httpsrvdev_inst* inst);
+struct httpsrvdev_slice
+         httpsrvdev_route_param            (struct httpsrvdev_inst* inst, char* name);
+bool     httpsrvdev_live_reload_watch      (struct httpsrvdev_inst* inst, char* path);
+bool     httpsrvdev_res_live_reload_events (struct httpsrvdev_inst* inst);
+
+void*    httpsrvdev_arena_alloc            (struct httpsrvdev_arena* arena, size_t size);
+struct httpsrvdev_arena_mark
+         httpsrvdev_arena_save             (struct httpsrvdev_arena* arena);
+void     httpsrvdev_arena_reset            (struct httpsrvdev_arena* arena,
+                                                struct httpsrvdev_arena_mark mark);
+void     httpsrvdev_arena_clear            (struct httpsrvdev_arena* arena);
+
+#ifdef HTTPSRVDEV_TEST_HOOKS
+    // Entry points into the library's static functions, for use by
+    // httpsrvdev_microbench.c. Only compiled with -DHTTPSRVDEV_TEST_HOOKS.
+    bool  httpsrvdev_test_parse_req          (struct httpsrvdev_inst* inst);
+    char* httpsrvdev_test_get_file_mime_type (struct httpsrvdev_inst* inst, char* file_path);
+    bool  httpsrvdev_test_path_rel_to_root_to_path_with_root(struct httpsrvdev_inst* inst,
+                                                             char* path, char* result_path);
+    bool  httpsrvdev_test_path_with_root_to_path_rel_to_root(struct httpsrvdev_inst* inst,
+                                                             char* path, char* result_path);
+    bool  httpsrvdev_test_target_normalize   (struct httpsrvdev_inst* inst);
+    size_t httpsrvdev_test_escape_html_text  (char* dest, char* src, size_t len);
+    size_t httpsrvdev_test_escape_url_path   (char* dest, char* src, size_t len);
+    bool  httpsrvdev_test_route_match        (struct httpsrvdev_inst* inst, void** ctx);
+#endif
 
 #endif // HTTPSRVDEV_H
@@ -0,0 +1,457 @@
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "httpsrvdev_lib.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <x86intrin.h>
+    #define HAVE_TSC 1
+#else
+    #define HAVE_TSC 0
+#endif
+
+// Function-level benchmarks for the request parser, target normalization,
+// MIME lookup, path helpers and escaping of httpsrvdev_lib.c.
+//
+// Each benchmark cycles through a small set of recorded, realistic inputs in a
+// tight loop. After a warm-up that also calibrates the iteration count, the
+// loop is timed for a number of repetitions and the median, minimum and
+// standard deviation of ns/op are printed, one JSON object per line, together
+// with the median TSC cycles/op.
+//
+// Must be compiled with -DHTTPSRVDEV_TEST_HOOKS to reach the static functions
+// of the library, see `dev.sh microbench`.
+
+#define INFO 1
+#define WARN 2
+#define ERR  3
+
+#define MAX_REPS 1000
+
+size_t opt_reps        = 15;
+double opt_rep_time_ms = 20;
+char*  opt_filter      = NULL;
+char*  opt_files_dir   = "test_files_for_serving";
+
+struct httpsrvdev_inst inst;
+
+// Keep the compiler from optimizing away results that are otherwise unused
+#define DO_NOT_OPTIMIZE(value) __asm__ volatile("" : : "g"(value) : "memory")
+
+void log_fmt(int log_level, char* fmt, ...) {
+    char* prefix = "";
+    switch (log_level) {
+        case INFO: prefix = "(httpsrvdev-microbench) INFO : "; break;
+        case WARN: prefix = "(httpsrvdev-microbench) WARN : "; break;
+        case ERR:  prefix = "(httpsrvdev-microbench) ERROR: "; break;
+    }
+    va_list args;
+    va_start(args, fmt);
+    fputs(prefix, stderr);
+    vfprintf(stderr, fmt, args);
+    fputc('\n', stderr);
+    va_end(args);
+}
+
+// --------------------------------------------------------
+// Recorded inputs
+// --------------------------------------------------------
+
+char* reqs[] = {
+    // curl/7.88
+    "GET /hello_world.txt HTTP/1.1\r\n"
+    "Host: 127.0.0.1:8080\r\n"
+    "User-Agent: curl/7.88.1\r\n"
+    "Accept: */*\r\n"
+    "\r\n",
+
+    // Firefox page navigation
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:121.0) Gecko/20100101 Firefox/121.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,"
+        "image/webp,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-Site: none\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "If-Modified-Since: Tue, 02 Jan 2024 10:00:00 GMT\r\n"
+    "\r\n",
+
+    // Chrome ES module subresource
+    "GET /src/components/app-shell/app-shell.mjs HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Not_A Brand\";v=\"8\", \"Chromium\";v=\"120\"\r\n"
+    "Origin: http://localhost:8080\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+        "(KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Accept: */*\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: cors\r\n"
+    "Sec-Fetch-Dest: script\r\n"
+    "Referer: http://localhost:8080/\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-GB,en-US;q=0.9,en;q=0.8\r\n"
+    "\r\n",
+
+    // fetch() POST with a JSON body
+    "POST /api/items HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "Content-Type: application/json\r\n"
+    "Content-Length: 26\r\n"
+    "Accept: application/json\r\n"
+    "\r\n"
+    "{\"name\":\"item\",\"count\":42}",
+};
+char* req_names[] = {"curl", "firefox_nav", "chrome_module", "post_json"};
+
+char* file_paths[] = {
+    "index.html", "src/app.js", "styles/main.css", "components/button.mjs",
+    "img/logo.png", "fonts/inter.woff2", "data/users.json", "README.md",
+    "img/photo.jpeg", "dist/archive.tar", "main.c", "favicon.ico",
+};
+
+char* ipv4_strs[] = {
+    "127.0.0.1", "0.0.0.0", "192.168.178.21", "10.1.2.3", "255.255.255.255",
+};
+
+char* rel_paths[] = {
+    "hello_world.txt", "index.html", "1MiB_file.txt", "", "hello_world.html",
+};
+char* abs_paths[sizeof(rel_paths)/sizeof(rel_paths[0])];
+
+// Request targets, mostly already normal
+char* targets[] = {
+    "/index.html", "/src/components/app-shell/app-shell.mjs", "/styles/main.css?v=1718000000",
+    "/img/my%20photo.jpeg", "/docs/./guide/../api//index.html", "/.well-known/security.txt",
+};
+
+// Directory entry names as listed, mostly needing no escaping
+char* entry_names[] = {
+    "index.html", "node_modules/", "app-shell.mjs", "README.md",
+    "photo_2024-01-02_10-00-00.jpeg", "Q&A <draft>.txt", "100% done.md",
+    "very-long-generated-file-name.chunk.3f9a2c1b7e.min.js",
+};
+
+// A small REST API's routes, and normalized paths for them
+char* route_patterns[] = {
+    "/", "/api/users", "/api/users/:id", "/api/users/:id/posts", "/api/users/:id/posts/:post",
+    "/api/users/me", "/api/posts", "/api/posts/:id", "/static/*", "/__httpsrvdev/live-reload",
+};
+
+char* route_paths[] = {
+    "/", "/api/users/42", "/api/users/me", "/api/users/42/posts/7", "/static/js/app.mjs",
+    "/__httpsrvdev/live-reload", "/api/nothing/here",
+};
+
+#define COUNT(array) (sizeof(array)/sizeof(array[0]))
+
+// --------------------------------------------------------
+// Benchmarked operations
+// --------------------------------------------------------
+
+// Copying the request into `req_buf` is part of every parse_req op since the
+// parser modifies the buffer in place. `parse_req/copy_only` measures the
+// copy alone so that it can be subtracted.
+size_t req_lens[COUNT(reqs)];
+
+void op_copy_req(size_t input_idx, size_t req_idx) {
+    memcpy(inst.conn->req_buf, reqs[req_idx], req_lens[req_idx] + 1);
+    inst.conn->req_len = req_lens[req_idx];
+    DO_NOT_OPTIMIZE(inst.conn->req_buf[0]);
+}
+
+void op_parse_req(size_t input_idx, size_t req_idx) {
+    memcpy(inst.conn->req_buf, reqs[req_idx], req_lens[req_idx] + 1);
+    inst.conn->req_len = req_lens[req_idx];
+    bool ok = httpsrvdev_test_parse_req(&inst);
+    DO_NOT_OPTIMIZE(ok);
+}
+
+void op_file_encode_ext(size_t input_idx, size_t _) {
+    uint64_t encoding = httpsrvdev_file_encode_ext(&inst, file_paths[input_idx]);
+    DO_NOT_OPTIMIZE(encoding);
+}
+
+void op_get_file_type_info(size_t input_idx, size_t _) {
+    char* mime_type = httpsrvdev_test_get_file_mime_type(&inst, file_paths[input_idx]);
+    DO_NOT_OPTIMIZE(mime_type);
+}
+
+void op_ipv4_parse(size_t input_idx, size_t _) {
+    int64_t ip = httpsrvdev_ipv4_parse(&inst, ipv4_strs[input_idx]);
+    DO_NOT_OPTIMIZE(ip);
+}
+
+char path_result_buf[4096];
+
+void op_path_rel_to_root_to_path_with_root(size_t input_idx, size_t _) {
+    bool ok = httpsrvdev_test_path_rel_to_root_to_path_with_root(&inst,
+        rel_paths[input_idx], path_result_buf);
+    DO_NOT_OPTIMIZE(ok);
+}
+
+void op_path_with_root_to_path_rel_to_root(size_t input_idx, size_t _) {
+    bool ok = httpsrvdev_test_path_with_root_to_path_rel_to_root(&inst,
+        abs_paths[input_idx], path_result_buf);
+    DO_NOT_OPTIMIZE(ok);
+}
+
+void op_target_normalize(size_t input_idx, size_t _) {
+    inst.conn->req_target = targets[input_idx];
+    bool ok = httpsrvdev_test_target_normalize(&inst);
+    DO_NOT_OPTIMIZE(ok);
+}
+
+char escape_result_buf[4096];
+
+void op_escape_html_text(size_t input_idx, size_t _) {
+    char*  name = entry_names[input_idx];
+    size_t len  = httpsrvdev_test_escape_html_text(escape_result_buf, name, strlen(name));
+    DO_NOT_OPTIMIZE(len);
+}
+
+void op_escape_url_path(size_t input_idx, size_t _) {
+    char*  name = entry_names[input_idx];
+    size_t len  = httpsrvdev_test_escape_url_path(escape_result_buf, name, strlen(name));
+    DO_NOT_OPTIMIZE(len);
+}
+
+bool route_handler(struct httpsrvdev_inst* inst, void* ctx) {
+    return true;
+}
+
+void op_route_match(size_t input_idx, size_t _) {
+    inst.conn->req_method = httpsrvdev_GET;
+    inst.conn->req_path   = route_paths[input_idx];
+    void* ctx       = NULL;
+    bool  ok        = httpsrvdev_test_route_match(&inst, &ctx);
+    DO_NOT_OPTIMIZE(ok);
+    DO_NOT_OPTIMIZE(ctx);
+}
+
+// --------------------------------------------------------
+// Harness
+// --------------------------------------------------------
+
+struct bench {
+    char* name;
+    void (*op)(size_t input_idx, size_t arg);
+    // Number of inputs to cycle through, and a fixed argument passed to
+    // every call (e.g. the request to parse)
+    size_t n_inputs;
+    size_t arg;
+};
+
+uint64_t now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec*1000000000 + now.tv_nsec;
+}
+
+uint64_t now_cycles() {
+#if HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+int cmp_double(const void* a, const void* b) {
+    double x = *(double*) a;
+    double y = *(double*) b;
+    return (x > y) - (x < y);
+}
+
+void run_loop(struct bench* bench, size_t n_iters) {
+    size_t input_idx = 0;
+    for (size_t i = 0; i < n_iters; ++i) {
+        bench->op(input_idx, bench->arg);
+        if (++input_idx == bench->n_inputs) input_idx = 0;
+    }
+}
+
+void run_bench(struct bench* bench) {
+    if (opt_filter != NULL && strstr(bench->name, opt_filter) == NULL) return;
+
+    // Warm up caches and branch predictors while calibrating the number of
+    // iterations per repetition to roughly `opt_rep_time_ms`
+    size_t n_iters = bench->n_inputs;
+    while (true) {
+        uint64_t start = now_ns();
+        run_loop(bench, n_iters);
+        uint64_t elapsed = now_ns() - start;
+        if (elapsed >= opt_rep_time_ms*1e6/4) {
+            n_iters = n_iters*(opt_rep_time_ms*1e6/elapsed) + 1;
+            break;
+        }
+        n_iters *= 2;
+    }
+    run_loop(bench, n_iters);
+
+    double ns_per_op    [MAX_REPS];
+    double cycles_per_op[MAX_REPS];
+    for (size_t rep = 0; rep < opt_reps; ++rep) {
+        uint64_t start_ns     = now_ns();
+        uint64_t start_cycles = now_cycles();
+        run_loop(bench, n_iters);
+        uint64_t end_cycles   = now_cycles();
+        uint64_t end_ns       = now_ns();
+
+        ns_per_op    [rep] = (double) (end_ns     - start_ns    )/n_iters;
+        cycles_per_op[rep] = (double) (end_cycles - start_cycles)/n_iters;
+    }
+
+    double mean = 0;
+    for (size_t rep = 0; rep < opt_reps; ++rep) mean += ns_per_op[rep];
+    mean /= opt_reps;
+    double variance = 0;
+    for (size_t rep = 0; rep < opt_reps; ++rep) {
+        variance += (ns_per_op[rep] - mean)*(ns_per_op[rep] - mean);
+    }
+    double stddev = opt_reps > 1 ? sqrt(variance/(opt_reps - 1)) : 0;
+
+    qsort(ns_per_op,     opt_reps, sizeof(double), cmp_double);
+    qsort(cycles_per_op, opt_reps, sizeof(double), cmp_double);
+
+    printf("{\"bench\":\"%s\",\"inputs\":%zu,\"iters\":%zu,\"reps\":%zu,"
+           "\"ns_per_op\":{\"median\":%.2f,\"min\":%.2f,\"mean\":%.2f,\"stddev\":%.2f},",
+           bench->name, bench->n_inputs, n_iters, opt_reps,
+           ns_per_op[opt_reps/2], ns_per_op[0], mean, stddev);
+    if (HAVE_TSC) {
+        printf("\"cycles_per_op\":{\"median\":%.1f,\"min\":%.1f}}\n",
+               cycles_per_op[opt_reps/2], cycles_per_op[0]);
+    } else {
+        printf("\"cycles_per_op\":null}\n");
+    }
+    fflush(stdout);
+}
+
+void print_usage(char* this_exe_name) {
+    printf(
+        "%s [OPTIONS]\n"
+        "\n"
+        "Run function-level benchmarks of httpsrvdev_lib.c and print the results\n"
+        "as one JSON object per line.\n"
+        "\n"
+        "[OPTIONS]\n"
+        "--filter SUBSTR ...... Only run benchmarks whose name contains SUBSTR.\n"
+        "--reps N ............. Number of timed repetitions. Default 15.\n"
+        "--rep-time MS ........ Target duration of each repetition. Default 20.\n"
+        "--files-dir DIR ...... Directory used as the root for path helper\n"
+        "                       benchmarks. Default \"test_files_for_serving\".\n"
+        "-h/--help ............ Display this usage message.\n",
+        this_exe_name);
+}
+
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        char* arg = argv[i];
+        if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+            print_usage(argv[0]);
+            return 0;
+        }
+        if (i + 1 >= argc) {
+            log_fmt(ERR, "Unknown flag or missing value for '%s'!", arg);
+            return 1;
+        }
+        char* value = argv[++i];
+        if (strcmp(arg, "--filter") == 0) {
+            opt_filter = value;
+        } else if (strcmp(arg, "--reps") == 0) {
+            opt_reps = strtoul(value, NULL, 10);
+        } else if (strcmp(arg, "--rep-time") == 0) {
+            opt_rep_time_ms = strtod(value, NULL);
+        } else if (strcmp(arg, "--files-dir") == 0) {
+            opt_files_dir = value;
+        } else {
+            log_fmt(ERR, "Unknown option '%s'!", arg);
+            return 1;
+        }
+    }
+    if (opt_reps < 1 || opt_reps > MAX_REPS || opt_rep_time_ms <= 0) {
+        log_fmt(ERR, "Invalid --reps or --rep-time!");
+        return 1;
+    }
+
+    inst = httpsrvdev_init_begin();
+    inst.default_file_mime_type = "application/octet-stream";
+    httpsrvdev_init_end(&inst);
+
+    for (size_t i = 0; i < COUNT(route_patterns); ++i) {
+        if (!httpsrvdev_route_add(&inst, httpsrvdev_METHOD_BIT(httpsrvdev_GET), route_patterns[i],
+                                  route_handler, route_patterns[i])
+        ) {
+            log_fmt(ERR, "Could not add the route '%s'!", route_patterns[i]);
+            return 1;
+        }
+    }
+
+    for (size_t i = 0; i < COUNT(reqs); ++i) {
+        req_lens[i] = strlen(reqs[i]);
+        memcpy(inst.conn->req_buf, reqs[i], req_lens[i] + 1);
+        inst.conn->req_len = req_lens[i];
+        if (!httpsrvdev_test_parse_req(&inst)) {
+            log_fmt(ERR, "Recorded request '%s' does not parse!", req_names[i]);
+            return 1;
+        }
+    }
+
+    // Path helpers resolve paths relative to `inst.conn->root_path`
+    char* files_dir_resolved = realpath(opt_files_dir, NULL);
+    bool  have_files_dir     = files_dir_resolved != NULL &&
+                               strlen(files_dir_resolved) < sizeof(inst.conn->root_path);
+    if (have_files_dir) {
+        strcpy(inst.conn->root_path, files_dir_resolved);
+        for (size_t i = 0; i < COUNT(rel_paths); ++i) {
+            abs_paths[i] = malloc(strlen(files_dir_resolved) + strlen(rel_paths[i]) + 2);
+            sprintf(abs_paths[i], "%s/%s", files_dir_resolved, rel_paths[i]);
+        }
+    } else {
+        log_fmt(WARN, "Could not resolve '%s', skipping path helper benchmarks!",
+                opt_files_dir);
+    }
+
+    char req_bench_names[COUNT(reqs)][2][64];
+    for (size_t i = 0; i < COUNT(reqs); ++i) {
+        snprintf(req_bench_names[i][0], 64, "parse_req/%s", req_names[i]);
+        snprintf(req_bench_names[i][1], 64, "parse_req/copy_only/%s", req_names[i]);
+        struct bench parse_bench = { req_bench_names[i][0], op_parse_req, 1, i };
+        struct bench copy_bench  = { req_bench_names[i][1], op_copy_req,  1, i };
+        run_bench(&parse_bench);
+        run_bench(&copy_bench);
+    }
+
+    struct bench benches[] = {
+        { "file_encode_ext",    op_file_encode_ext,    COUNT(file_paths), 0 },
+        { "get_file_type_info", op_get_file_type_info, COUNT(file_paths), 0 },
+        { "ipv4_parse",         op_ipv4_parse,         COUNT(ipv4_strs),  0 },
+        { "target_normalize",   op_target_normalize,   COUNT(targets),    0 },
+        { "escape_html_text",   op_escape_html_text,   COUNT(entry_names), 0 },
+        { "escape_url_path",    op_escape_url_path,    COUNT(entry_names), 0 },
+        { "route_match",        op_route_match,        COUNT(route_paths), 0 },
+    };
+    for (size_t i = 0; i < COUNT(benches); ++i) run_bench(&benches[i]);
+
+    if (have_files_dir) {
+        struct bench path_benches[] = {
+            { "path_rel_to_root_to_path_with_root",
+              op_path_rel_to_root_to_path_with_root, COUNT(rel_paths), 0 },
+            { "path_with_root_to_path_rel_to_root",
+              op_path_with_root_to_path_rel_to_root, COUNT(abs_paths), 0 },
+        };
+        for (size_t i = 0; i < COUNT(path_benches); ++i) run_bench(&path_benches[i]);
+    }
+
+    return 0;
+}
@@ -0,0 +1,937 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "httpsrvdev_lib.h"
+
+// Replays traffic recorded with `httpsrvdev --record FILE` against a running
+// server.
+//
+// The recorded requests are sent byte for byte, in order, each when it is
+// due: at the recorded pace, scaled by --speed, or as fast as the
+// connections allow. Each request goes out on one of a fixed number of
+// connections from a single epoll loop. Requests that find all connections
+// busy wait for one, and how late they were sent is reported alongside the
+// response latencies.
+//
+// Responses are summarized by their status and a checksum of their body.
+// Responses that differ where they shouldn't are counted as mismatches:
+// those to byte-identical requests within a replay, or with --expect, those
+// to the same requests in an earlier replay saved with --save, e.g. against
+// a known-good build. The results are printed as a single JSON object on
+// stdout, like httpsrvdev-bench does.
+
+#define INFO 1
+#define WARN 2
+#define ERR  3
+
+#define MAX_CONNS   4096
+#define IN_BUF_SIZE (64*1024)
+// Mismatches beyond this many are only counted, not logged
+#define MAX_LOGGED_MISMATCHES 10
+
+// --------------------------------------------------------
+// Options
+// --------------------------------------------------------
+
+char*  opt_recording_path = NULL;
+char*  opt_host           = "127.0.0.1";
+int    opt_port           = 8080;
+size_t opt_conns          = 64;
+double opt_speed          = 1.0; // 0 = as fast as possible
+int    opt_max_gap_ms     = 0;   // 0 = keep the recorded pauses
+int    opt_timeout_ms     = 10000;
+bool   opt_keep_alive     = false;
+char*  opt_save_path      = NULL;
+char*  opt_expect_path    = NULL;
+
+// --------------------------------------------------------
+// Recording
+// --------------------------------------------------------
+
+#define REC_PENDING  0
+#define REC_SKIPPED  1
+#define REC_FAILED   2
+#define REC_ANSWERED 3
+
+struct record {
+    char*    data;
+    uint32_t len;
+    bool     is_head;
+    // When the request is due, from the start of the replay
+    uint64_t due_ns;
+
+    int      state;
+    int      res_status;
+    uint64_t res_checksum;
+    uint64_t sent_ns;
+    uint64_t latency_ns;
+};
+struct record* records       = NULL;
+size_t         records_count = 0;
+
+// --------------------------------------------------------
+// Connections
+// --------------------------------------------------------
+
+#define RES_STATUS_LINE    1
+#define RES_HEADERS        2
+#define RES_BODY_LEN       3
+#define RES_BODY_CHUNKED   4
+#define RES_CHUNK_DATA     5
+#define RES_CHUNK_CRLF     6
+#define RES_CHUNK_TRAILER  7
+#define RES_BODY_UNTIL_EOF 8
+
+// Special values of `res_remaining` while parsing headers
+#define BODY_LEN_UNKNOWN  UINT64_MAX
+#define BODY_LEN_CHUNKED (UINT64_MAX - 1)
+
+#define NO_RECORD SIZE_MAX
+
+struct conn {
+    int    fd;
+    bool   connected;
+    bool   is_reused;
+    // The record whose request is in flight, or NO_RECORD while idle
+    size_t rec_idx;
+    size_t out_off;
+
+    char   in_buf[IN_BUF_SIZE];
+    size_t in_len;
+
+    int      res_state;
+    int      res_status;
+    uint64_t res_remaining;
+    uint64_t res_checksum;
+    bool     res_conn_close;
+};
+struct conn* conns;
+// Indices of the connections without a request in flight, as a stack
+size_t* idle_conns;
+size_t  idle_conns_count = 0;
+
+int      epoll_fd;
+struct sockaddr_in server_addr;
+uint64_t start_ns;
+
+// --------------------------------------------------------
+// Results
+// --------------------------------------------------------
+
+uint64_t n_done       = 0; // Skipped, failed or answered
+uint64_t n_skipped    = 0;
+uint64_t n_errors     = 0;
+uint64_t n_timeouts   = 0;
+uint64_t n_connects   = 0;
+uint64_t n_bytes      = 0;
+uint64_t n_status_classes[6]; // By the hundreds digit, 1xx to 5xx
+uint64_t n_compared   = 0;
+uint64_t n_mismatches = 0;
+
+void log_(int log_level, char* msg) {
+    FILE* out_file = stderr;
+    char* prefix = "";
+    switch (log_level) {
+        case INFO: prefix = "(httpsrvdev-replay) INFO : "; break;
+        case WARN: prefix = "(httpsrvdev-replay) WARN : "; break;
+        case ERR:  prefix = "(httpsrvdev-replay) ERROR: "; break;
+    }
+    fputs(prefix, out_file);
+    fputs(msg, out_file);
+    fputc('\n', out_file);
+    fflush(out_file);
+}
+
+void log_fmt(int log_level, char* fmt, ...) {
+    va_list sprintf_args;
+    va_start(sprintf_args, fmt);
+    char msg_buf[1024];
+    vsnprintf(msg_buf, sizeof(msg_buf), fmt, sprintf_args);
+    va_end(sprintf_args);
+
+    log_(log_level, msg_buf);
+}
+
+uint64_t now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec*1000000000 + now.tv_nsec;
+}
+
+// 64-bit FNV-1a, continuing from `hash`
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ull
+uint64_t fnv1a(uint64_t hash, char* data, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        hash ^= (uint8_t) data[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+uint64_t read_le(uint8_t* ptr, int n) {
+    uint64_t value = 0;
+    for (int i = 0; i < n; ++i) value |= (uint64_t) ptr[i] << 8*i;
+    return value;
+}
+
+// The length of the request line of `rec`, for logging
+int record_line_len(struct record* rec) {
+    char* end = memchr(rec->data, '\r', rec->len);
+    return end == NULL ? (int) rec->len : (int) (end - rec->data);
+}
+
+// Map the recording and schedule its requests
+bool records_load() {
+    int fd = open(opt_recording_path, O_RDONLY | O_CLOEXEC);
+    struct stat rec_stat;
+    if (fd == -1 || fstat(fd, &rec_stat) == -1) {
+        log_fmt(ERR, "Failed to open the recording '%s': %s", opt_recording_path,
+                strerror(errno));
+        return false;
+    }
+    size_t size = rec_stat.st_size;
+    if (size < httpsrvdev_RECORD_MAGIC_LEN) {
+        log_fmt(ERR, "'%s' isn't a recording!", opt_recording_path);
+        return false;
+    }
+    uint8_t* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        log_fmt(ERR, "Failed to map the recording: %s", strerror(errno));
+        return false;
+    }
+    if (memcmp(data, httpsrvdev_RECORD_MAGIC, httpsrvdev_RECORD_MAGIC_LEN) != 0) {
+        log_fmt(ERR, "'%s' isn't a recording!", opt_recording_path);
+        return false;
+    }
+
+    // Count first, to allocate once
+    size_t pos = httpsrvdev_RECORD_MAGIC_LEN;
+    while (pos + httpsrvdev_RECORD_HEAD_LEN <= size) {
+        uint32_t len = read_le(data + pos + 8, 4);
+        if (len > size - pos - httpsrvdev_RECORD_HEAD_LEN) break;
+        pos += httpsrvdev_RECORD_HEAD_LEN + len;
+        ++records_count;
+    }
+    if (pos != size) {
+        // E.g. the server was killed while writing the last one
+        log_(WARN, "The recording ends with a partial record, which is left out.");
+    }
+    records = calloc(records_count + 1, sizeof(records[0]));
+    if (records == NULL) {
+        log_(ERR, "Out of memory!");
+        return false;
+    }
+
+    // Recordings appended to each other may have pauses of days in between,
+    // and clocks may have been set back in between
+    uint64_t max_gap_ns = opt_max_gap_ms > 0 ? (uint64_t) opt_max_gap_ms*1000000 : UINT64_MAX;
+    uint64_t offset_ns  = 0;
+    uint64_t prev_time_ns = 0;
+    pos = httpsrvdev_RECORD_MAGIC_LEN;
+    for (size_t i = 0; i < records_count; ++i) {
+        struct record* rec = &records[i];
+        uint64_t time_ns = read_le(data + pos, 8);
+        rec->len  = read_le(data + pos + 8, 4);
+        rec->data = (char*) data + pos + httpsrvdev_RECORD_HEAD_LEN;
+        pos += httpsrvdev_RECORD_HEAD_LEN + rec->len;
+
+        if (i > 0 && time_ns > prev_time_ns) {
+            uint64_t gap_ns = time_ns - prev_time_ns;
+            offset_ns += gap_ns < max_gap_ns ? gap_ns : max_gap_ns;
+        }
+        prev_time_ns = time_ns;
+        rec->due_ns  = opt_speed > 0 ? (uint64_t) (offset_ns/opt_speed) : 0;
+        rec->is_head = rec->len >= 5 && memcmp(rec->data, "HEAD ", 5) == 0;
+
+        // Live reload event streams stay open until the server stops
+        char events_line[] = "GET " httpsrvdev_LIVE_RELOAD_EVENTS_PATH " ";
+        if (rec->len >= sizeof(events_line) - 1 &&
+            memcmp(rec->data, events_line, sizeof(events_line) - 1) == 0
+        ) {
+            rec->state = REC_SKIPPED;
+            ++n_skipped;
+            ++n_done;
+        }
+    }
+    return true;
+}
+
+// --------------------------------------------------------
+// Connections
+// --------------------------------------------------------
+
+void conn_close(struct conn* conn) {
+    if (conn->fd != -1) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+        close(conn->fd);
+    }
+    conn->fd        = -1;
+    conn->connected = false;
+    conn->is_reused = false;
+    conn->in_len    = 0;
+    conn->res_state = RES_STATUS_LINE;
+}
+
+bool conn_open(struct conn* conn) {
+    conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (conn->fd == -1) {
+        log_fmt(ERR, "Failed to create socket: %s", strerror(errno));
+        return false;
+    }
+    if (connect(conn->fd, (struct sockaddr*) &server_addr, sizeof(server_addr)) == -1 &&
+        errno != EINPROGRESS
+    ) {
+        close(conn->fd);
+        conn->fd = -1;
+        return false;
+    }
+    struct epoll_event event = {
+        .events   = EPOLLIN | EPOLLOUT | EPOLLRDHUP,
+        .data.ptr = conn,
+    };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->fd, &event);
+    ++n_connects;
+    return true;
+}
+
+// Be done with the request in flight on `conn`, which becomes idle
+void conn_finish(struct conn* conn, int state) {
+    struct record* rec = &records[conn->rec_idx];
+    rec->state = state;
+    if (state == REC_ANSWERED) {
+        rec->res_status   = conn->res_status;
+        rec->res_checksum = conn->res_checksum;
+        rec->latency_ns   = now_ns() - start_ns - rec->sent_ns;
+        if (conn->res_status >= 100 && conn->res_status < 600) {
+            ++n_status_classes[conn->res_status/100];
+        }
+    } else {
+        ++n_errors;
+    }
+    ++n_done;
+
+    conn->rec_idx = NO_RECORD;
+    conn->out_off = 0;
+    idle_conns[idle_conns_count++] = conn - conns;
+    if (state != REC_ANSWERED || !opt_keep_alive || conn->res_conn_close) conn_close(conn);
+}
+
+// Send the request of `records[rec_idx]` on an idle connection
+void conn_issue(struct conn* conn, size_t rec_idx) {
+    conn->rec_idx   = rec_idx;
+    conn->out_off   = 0;
+    conn->is_reused = conn->fd != -1;
+    conn->res_state = RES_STATUS_LINE;
+    records[rec_idx].sent_ns = now_ns() - start_ns;
+    if (conn->fd == -1 && !conn_open(conn)) {
+        conn_finish(conn, REC_FAILED);
+        return;
+    }
+    // Kept-alive connections only wait for input between requests
+    if (conn->connected) {
+        struct epoll_event event = {
+            .events   = EPOLLIN | EPOLLOUT | EPOLLRDHUP,
+            .data.ptr = conn,
+        };
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+    }
+}
+
+// Fail the request in flight -- unless the server closed the kept-alive
+// connection before answering, as servers may do with connections that they
+// consider idle, in which case it is sent again on a new connection
+void conn_fail(struct conn* conn) {
+    if (conn->is_reused && conn->res_state == RES_STATUS_LINE && conn->in_len == 0) {
+        conn_close(conn);
+        conn->out_off = 0;
+        if (conn_open(conn)) return;
+    }
+    conn_finish(conn, REC_FAILED);
+}
+
+void conn_res_complete(struct conn* conn) {
+    // Interim responses, e.g. 100 Continue, are followed by the real one --
+    // except for 101 Switching Protocols, after which there's no more HTTP/1.1
+    if (conn->res_status >= 100 && conn->res_status < 200 && conn->res_status != 101) {
+        conn->res_state = RES_STATUS_LINE;
+        return;
+    }
+    if (conn->res_status == 101) conn->res_conn_close = true;
+    conn_finish(conn, REC_ANSWERED);
+}
+
+// Find "\r\n" in `buf[0..len)`, returning the length of the line or -1
+ssize_t find_line(char* buf, size_t len) {
+    char* end = memchr(buf, '\n', len);
+    if (end == NULL) return -1;
+    return end - buf + 1;
+}
+
+// Consume the response in `conn->in_buf` as far as it has arrived, adding
+// its body to the checksum. Returns false on a malformed response.
+bool conn_parse(struct conn* conn) {
+    size_t i = 0;
+    while (i < conn->in_len && conn->rec_idx != NO_RECORD) {
+        char*  p     = conn->in_buf + i;
+        size_t avail = conn->in_len - i;
+        ssize_t line_len;
+
+        switch (conn->res_state) {
+            case RES_STATUS_LINE:
+                // Tolerate stray CRLFs between responses
+                if (p[0] == '\r' || p[0] == '\n') { ++i; continue; }
+                if ((line_len = find_line(p, avail)) == -1) goto need_more;
+                if (line_len < 12 || memcmp(p, "HTTP/1.", 7) != 0) return false;
+                conn->res_status     = atoi(p + 9);
+                conn->res_remaining  = BODY_LEN_UNKNOWN;
+                conn->res_checksum   = FNV_OFFSET_BASIS;
+                conn->res_conn_close = !opt_keep_alive;
+                conn->res_state      = RES_HEADERS;
+                i += line_len;
+                break;
+
+            case RES_HEADERS: {
+                if ((line_len = find_line(p, avail)) == -1) goto need_more;
+                i += line_len;
+                if (line_len > 2) {
+                    if (strncasecmp(p, "Content-Length:", 15) == 0) {
+                        conn->res_remaining = strtoull(p + 15, NULL, 10);
+                    } else if (strncasecmp(p, "Transfer-Encoding:", 18) == 0) {
+                        conn->res_remaining = BODY_LEN_CHUNKED;
+                    } else if (strncasecmp(p, "Connection:", 11) == 0) {
+                        char* value = p + 11;
+                        while (*value == ' ') ++value;
+                        if (strncasecmp(value, "close", 5) == 0) conn->res_conn_close = true;
+                    }
+                    break;
+                }
+                // Responses to HEAD and these statuses have no body, whatever
+                // their headers say
+                int status = conn->res_status;
+                if (records[conn->rec_idx].is_head || status < 200 || status == 204 ||
+                    status == 304 || conn->res_remaining == 0
+                ) {
+                    conn_res_complete(conn);
+                } else if (conn->res_remaining == BODY_LEN_CHUNKED) {
+                    conn->res_state = RES_BODY_CHUNKED;
+                } else if (conn->res_remaining == BODY_LEN_UNKNOWN) {
+                    conn->res_state = RES_BODY_UNTIL_EOF;
+                } else {
+                    conn->res_state = RES_BODY_LEN;
+                }
+                break;
+            }
+
+            case RES_BODY_LEN: {
+                size_t n = avail < conn->res_remaining ? avail : conn->res_remaining;
+                conn->res_checksum   = fnv1a(conn->res_checksum, p, n);
+                conn->res_remaining -= n;
+                i += n;
+                if (conn->res_remaining == 0) conn_res_complete(conn);
+                break;
+            }
+
+            case RES_BODY_CHUNKED:
+                if ((line_len = find_line(p, avail)) == -1) goto need_more;
+                conn->res_remaining = strtoull(p, NULL, 16);
+                i += line_len;
+                conn->res_state = conn->res_remaining == 0 ? RES_CHUNK_TRAILER
+                                                           : RES_CHUNK_DATA;
+                break;
+
+            case RES_CHUNK_DATA: {
+                size_t n = avail < conn->res_remaining ? avail : conn->res_remaining;
+                conn->res_checksum   = fnv1a(conn->res_checksum, p, n);
+                conn->res_remaining -= n;
+                i += n;
+                if (conn->res_remaining == 0) conn->res_state = RES_CHUNK_CRLF;
+                break;
+            }
+
+            case RES_CHUNK_CRLF:
+                if ((line_len = find_line(p, avail)) == -1) goto need_more;
+                i += line_len;
+                conn->res_state = RES_BODY_CHUNKED;
+                break;
+
+            case RES_CHUNK_TRAILER:
+                if ((line_len = find_line(p, avail)) == -1) goto need_more;
+                i += line_len;
+                if (line_len <= 2) conn_res_complete(conn);
+                break;
+
+            case RES_BODY_UNTIL_EOF:
+                conn->res_checksum = fnv1a(conn->res_checksum, p, avail);
+                i += avail;
+                break;
+        }
+    }
+
+need_more:
+    // What follows a response, before the next request was even sent, can't
+    // be the next response
+    if (conn->rec_idx == NO_RECORD) {
+        conn->in_len = 0;
+        return true;
+    }
+    memmove(conn->in_buf, conn->in_buf + i, conn->in_len - i);
+    conn->in_len -= i;
+    if (conn->in_len == sizeof(conn->in_buf)) return false;
+    return true;
+}
+
+void conn_on_event(struct conn* conn, uint32_t events) {
+    // Kept-alive connections that the server closes, or sends anything on,
+    // while idle are replaced by new ones
+    if (conn->rec_idx == NO_RECORD) {
+        if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) conn_close(conn);
+        return;
+    }
+    struct record* rec = &records[conn->rec_idx];
+
+    if (!conn->connected && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        int err = 0;
+        socklen_t err_len = sizeof(err);
+        getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+        if (err != 0) {
+            conn_finish(conn, REC_FAILED);
+            return;
+        }
+        conn->connected = true;
+    }
+
+    if ((events & EPOLLOUT) && conn->connected) {
+        while (conn->out_off < rec->len) {
+            ssize_t n = send(conn->fd, rec->data + conn->out_off, rec->len - conn->out_off,
+                             MSG_NOSIGNAL);
+            if (n == -1) {
+                if (errno == EAGAIN) break;
+                conn_fail(conn);
+                return;
+            }
+            conn->out_off += n;
+        }
+        // Only wait for the response from here on
+        if (conn->out_off == rec->len) {
+            struct epoll_event event = {
+                .events   = EPOLLIN | EPOLLRDHUP,
+                .data.ptr = conn,
+            };
+            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+        }
+    }
+
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        while (conn->rec_idx != NO_RECORD) {
+            ssize_t n = read(conn->fd, conn->in_buf + conn->in_len,
+                             sizeof(conn->in_buf) - conn->in_len);
+            if (n == -1) {
+                if (errno == EAGAIN) break;
+                conn_fail(conn);
+                return;
+            }
+            if (n == 0) {
+                // Server closed the connection: a close-delimited body ends
+                // here, anything else was cut short
+                if (conn->res_state == RES_BODY_UNTIL_EOF) {
+                    conn->res_conn_close = true;
+                    conn_res_complete(conn);
+                } else {
+                    conn_fail(conn);
+                }
+                return;
+            }
+            n_bytes += n;
+            conn->in_len += n;
+            if (!conn_parse(conn)) {
+                log_fmt(WARN, "Malformed response to '%.*s'!",
+                        record_line_len(rec), rec->data);
+                conn_finish(conn, REC_FAILED);
+                return;
+            }
+        }
+    }
+}
+
+// Fail the requests that have waited for their response for too long
+void conns_check_timeouts() {
+    uint64_t now = now_ns() - start_ns;
+    for (size_t i = 0; i < opt_conns; ++i) {
+        struct conn* conn = &conns[i];
+        if (conn->rec_idx == NO_RECORD) continue;
+        if (now - records[conn->rec_idx].sent_ns < (uint64_t) opt_timeout_ms*1000000) continue;
+        ++n_timeouts;
+        conn_finish(conn, REC_FAILED);
+    }
+}
+
+// --------------------------------------------------------
+// Checksums
+// --------------------------------------------------------
+
+// Saved checksums are a line "STATUS CHECKSUM" per record, in order, with
+// STATUS 0 for requests that got no response
+
+bool checksums_save() {
+    FILE* file = fopen(opt_save_path, "w");
+    if (file == NULL) {
+        log_fmt(ERR, "Failed to create '%s': %s", opt_save_path, strerror(errno));
+        return false;
+    }
+    for (size_t i = 0; i < records_count; ++i) {
+        struct record* rec = &records[i];
+        bool answered = rec->state == REC_ANSWERED;
+        fprintf(file, "%d %016lx\n",
+                answered ? rec->res_status : 0, answered ? rec->res_checksum : 0);
+    }
+    if (fclose(file) != 0) {
+        log_fmt(ERR, "Failed to write '%s': %s", opt_save_path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+void log_mismatch(struct record* rec, int status, uint64_t checksum, char* other) {
+    if (++n_mismatches > MAX_LOGGED_MISMATCHES) return;
+    log_fmt(WARN, "Mismatch: '%.*s' got %d (%016lx), %s %d (%016lx)",
+            record_line_len(rec), rec->data, rec->res_status, rec->res_checksum,
+            other, status, checksum);
+}
+
+// Compare against the checksums saved by an earlier replay
+bool checksums_expect() {
+    FILE* file = fopen(opt_expect_path, "r");
+    if (file == NULL) {
+        log_fmt(ERR, "Failed to open '%s': %s", opt_expect_path, strerror(errno));
+        return false;
+    }
+    size_t i = 0;
+    int      status;
+    uint64_t checksum;
+    while (fscanf(file, "%d %lx", &status, &checksum) == 2) {
+        if (i == records_count) break;
+        struct record* rec = &records[i++];
+        if (rec->state != REC_ANSWERED || status == 0) continue;
+        ++n_compared;
+        if (rec->res_status != status || rec->res_checksum != checksum) {
+            log_mismatch(rec, status, checksum, "expected");
+        }
+    }
+    if (i != records_count || !feof(file)) {
+        log_fmt(WARN, "'%s' wasn't saved for this recording; "
+                      "only its first %zu requests were compared.", opt_expect_path, i);
+    }
+    fclose(file);
+    return true;
+}
+
+// Compare the responses to byte-identical requests with each other, using an
+// open-addressing table of the first answered record of each request
+bool checksums_compare_identical() {
+    size_t cap = 16;
+    while (cap < records_count*2) cap *= 2;
+    size_t* table = malloc(cap*sizeof(table[0]));
+    if (table == NULL) {
+        log_(ERR, "Out of memory!");
+        return false;
+    }
+    for (size_t i = 0; i < cap; ++i) table[i] = NO_RECORD;
+
+    for (size_t i = 0; i < records_count; ++i) {
+        struct record* rec = &records[i];
+        if (rec->state != REC_ANSWERED) continue;
+        size_t slot = fnv1a(FNV_OFFSET_BASIS, rec->data, rec->len) & (cap - 1);
+        while (table[slot] != NO_RECORD) {
+            struct record* first = &records[table[slot]];
+            if (first->len == rec->len && memcmp(first->data, rec->data, rec->len) == 0) break;
+            slot = (slot + 1) & (cap - 1);
+        }
+        if (table[slot] == NO_RECORD) {
+            table[slot] = i;
+            continue;
+        }
+        struct record* first = &records[table[slot]];
+        ++n_compared;
+        if (rec->res_status != first->res_status || rec->res_checksum != first->res_checksum) {
+            log_mismatch(rec, first->res_status, first->res_checksum, "earlier got");
+        }
+    }
+    free(table);
+    return true;
+}
+
+// --------------------------------------------------------
+// Reporting
+// --------------------------------------------------------
+
+int cmp_u64(const void* a, const void* b) {
+    uint64_t x = *(uint64_t*) a;
+    uint64_t y = *(uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+// Percentile in microseconds of an already sorted array
+double percentile_us(uint64_t* sorted, size_t n, double p) {
+    if (n == 0) return 0;
+    size_t idx = (size_t) (p*(n - 1) + 0.5);
+    return sorted[idx]/1000.0;
+}
+
+// Print `str` as a JSON string, quotes included
+void print_json_str(char* str) {
+    putchar('"');
+    for (unsigned char* c = (unsigned char*) str; *c != '\0'; ++c) {
+        if (*c == '"' || *c == '\\') {
+            printf("\\%c", *c);
+        } else if (*c < 0x20) {
+            printf("\\u%04x", *c);
+        } else {
+            putchar(*c);
+        }
+    }
+    putchar('"');
+}
+
+void print_latencies_json(uint64_t* latencies, size_t n) {
+    qsort(latencies, n, sizeof(latencies[0]), cmp_u64);
+    printf("{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}",
+           percentile_us(latencies, n, 0.50),
+           percentile_us(latencies, n, 0.90),
+           percentile_us(latencies, n, 0.99),
+           percentile_us(latencies, n, 0.999),
+           n > 0 ? latencies[n - 1]/1000.0 : 0.0);
+}
+
+void print_results_json(double elapsed_s) {
+    uint64_t* latencies = malloc((records_count + 1)*sizeof(uint64_t));
+    uint64_t* lags      = malloc((records_count + 1)*sizeof(uint64_t));
+    size_t    n_answered = 0;
+    size_t    n_sent     = 0;
+    for (size_t i = 0; i < records_count; ++i) {
+        struct record* rec = &records[i];
+        if (rec->state == REC_SKIPPED) continue;
+        lags[n_sent++] = rec->sent_ns > rec->due_ns ? rec->sent_ns - rec->due_ns : 0;
+        if (rec->state == REC_ANSWERED) latencies[n_answered++] = rec->latency_ns;
+    }
+
+    printf("{\"recording\":");
+    print_json_str(opt_recording_path);
+    printf(",\"host\":\"%s\",\"port\":%d,\"connections\":%zu,"
+           "\"keep_alive\":%s,\"speed\":%.3f,\"duration_s\":%.3f,",
+           opt_host, opt_port, opt_conns,
+           opt_keep_alive ? "true" : "false", opt_speed, elapsed_s);
+    printf("\"requests\":%zu,\"skipped\":%lu,\"answered\":%zu,\"errors\":%lu,"
+           "\"timeouts\":%lu,\"connects\":%lu,\"bytes\":%lu,\"req_per_s\":%.1f,",
+           records_count, n_skipped, n_answered, n_errors, n_timeouts, n_connects, n_bytes,
+           n_answered/elapsed_s);
+    printf("\"status\":{\"1xx\":%lu,\"2xx\":%lu,\"3xx\":%lu,\"4xx\":%lu,\"5xx\":%lu},",
+           n_status_classes[1], n_status_classes[2], n_status_classes[3],
+           n_status_classes[4], n_status_classes[5]);
+    printf("\"checksums\":{\"against\":\"%s\",\"compared\":%lu,\"mismatches\":%lu},",
+           opt_expect_path != NULL ? "expected" : "identical_requests",
+           n_compared, n_mismatches);
+
+    // How long each request took to be answered once sent, and how long after
+    // it was due it was sent
+    printf("\"latency_us\":");
+    print_latencies_json(latencies, n_answered);
+    printf(",\"lag_us\":");
+    print_latencies_json(lags, n_sent);
+    printf("}\n");
+
+    free(latencies);
+    free(lags);
+}
+
+// --------------------------------------------------------
+
+void print_usage(char* this_exe_name) {
+    printf(
+        "%s [OPTIONS/FLAGS] RECORDING\n"
+        "\n"
+        "Replay the requests recorded with `httpsrvdev --record RECORDING`\n"
+        "against a running server and print the results as JSON.\n"
+        "\n"
+        "[OPTIONS/FLAGS]\n"
+        "--host ADDRESS ....... IPv4 address of the server. Default \"127.0.0.1\".\n"
+        "-p/--port PORT ....... Port of the server.         Default \"8080\".\n"
+        "-c/--conns N ......... Number of concurrent connections. Default 64.\n"
+        "-s/--speed X ......... Send the requests X times as fast as they were\n"
+        "                       recorded. 0 sends them as fast as the\n"
+        "                       connections allow. Default 1.\n"
+        "--max-gap MS ......... Shorten longer pauses between requests to MS,\n"
+        "                       e.g. between recordings appended to the same\n"
+        "                       file. Default 0 (off).\n"
+        "-k/--keep-alive ...... Reuse connections for multiple requests.\n"
+        "--timeout MS ......... Give up on responses after MS. Default 10000.\n"
+        "--save FILE .......... Save the status and body checksum of each\n"
+        "                       response to FILE.\n"
+        "--expect FILE ........ Compare the responses to those saved with\n"
+        "                       --save by an earlier replay. Otherwise the\n"
+        "                       responses to identical requests are compared.\n"
+        "-h/--help ............ Display this usage message.\n",
+        this_exe_name);
+}
+
+char* arg_value(int argc, char* argv[], int* i) {
+    if (*i + 1 >= argc) {
+        log_fmt(ERR, "No value provided after %s!", argv[*i]);
+        exit(1);
+    }
+    return argv[++*i];
+}
+
+void handle_cli_args(int argc, char* argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        char* arg = argv[i];
+        if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+            print_usage(argv[0]);
+            exit(0);
+        } else if (strcmp(arg, "--host") == 0) {
+            opt_host = arg_value(argc, argv, &i);
+        } else if (strcmp(arg, "-p") == 0 || strcmp(arg, "--port") == 0) {
+            opt_port = atoi(arg_value(argc, argv, &i));
+        } else if (strcmp(arg, "-c") == 0 || strcmp(arg, "--conns") == 0) {
+            opt_conns = strtoul(arg_value(argc, argv, &i), NULL, 10);
+        } else if (strcmp(arg, "-s") == 0 || strcmp(arg, "--speed") == 0) {
+            opt_speed = strtod(arg_value(argc, argv, &i), NULL);
+        } else if (strcmp(arg, "--max-gap") == 0) {
+            opt_max_gap_ms = atoi(arg_value(argc, argv, &i));
+        } else if (strcmp(arg, "-k") == 0 || strcmp(arg, "--keep-alive") == 0) {
+            opt_keep_alive = true;
+        } else if (strcmp(arg, "--timeout") == 0) {
+            opt_timeout_ms = atoi(arg_value(argc, argv, &i));
+        } else if (strcmp(arg, "--save") == 0) {
+            opt_save_path = arg_value(argc, argv, &i);
+        } else if (strcmp(arg, "--expect") == 0) {
+            opt_expect_path = arg_value(argc, argv, &i);
+        } else if (arg[0] == '-' || opt_recording_path != NULL) {
+            log_fmt(ERR, "Unknown option/flag '%s'!", arg);
+            exit(1);
+        } else {
+            opt_recording_path = arg;
+        }
+    }
+
+    if (opt_recording_path == NULL) {
+        log_(ERR, "No recording provided!");
+        exit(1);
+    }
+    if (opt_port < 1 || opt_port > 0xFFFF) {
+        log_(ERR, "Invalid port!");
+        exit(1);
+    }
+    if (opt_conns < 1 || opt_conns > MAX_CONNS) {
+        log_fmt(ERR, "Number of connections must be between 1 and %d!", MAX_CONNS);
+        exit(1);
+    }
+    if (opt_speed < 0) {
+        log_(ERR, "Speed can't be negative!");
+        exit(1);
+    }
+    if (opt_max_gap_ms < 0 || opt_timeout_ms < 1) {
+        log_(ERR, "--max-gap can't be negative and --timeout must be positive!");
+        exit(1);
+    }
+    if (inet_pton(AF_INET, opt_host, &server_addr.sin_addr) != 1) {
+        log_fmt(ERR, "Failed to parse IPv4 address '%s'!", opt_host);
+        exit(1);
+    }
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port   = htons(opt_port);
+}
+
+int main(int argc, char* argv[]) {
+    handle_cli_args(argc, argv);
+    if (!records_load()) return 1;
+
+    epoll_fd   = epoll_create1(0);
+    conns      = calloc(opt_conns, sizeof(conns[0]));
+    idle_conns = calloc(opt_conns, sizeof(idle_conns[0]));
+    if (epoll_fd == -1 || conns == NULL || idle_conns == NULL) {
+        log_(ERR, "Failed to set up event loop!");
+        return 1;
+    }
+    // Popped from the end, so that the first connections are used first
+    for (size_t i = 0; i < opt_conns; ++i) {
+        struct conn* conn = &conns[opt_conns - 1 - i];
+        conn->fd      = -1;
+        conn->rec_idx = NO_RECORD;
+        conn_close(conn);
+        idle_conns[idle_conns_count++] = opt_conns - 1 - i;
+    }
+
+    log_fmt(INFO, "Replaying %zu request(s) against http://%s:%d with %zu connection(s)...",
+            records_count, opt_host, opt_port, opt_conns);
+
+    start_ns = now_ns();
+    size_t   next_rec_idx      = 0;
+    uint64_t timeouts_check_ns = 0;
+    struct epoll_event events[256];
+    while (n_done < records_count) {
+        // Send the requests that are due while connections are free
+        uint64_t now = now_ns() - start_ns;
+        while (next_rec_idx < records_count && idle_conns_count > 0) {
+            struct record* rec = &records[next_rec_idx];
+            if (rec->state == REC_SKIPPED) {
+                ++next_rec_idx;
+                continue;
+            }
+            if (rec->due_ns > now) break;
+            conn_issue(&conns[idle_conns[--idle_conns_count]], next_rec_idx++);
+        }
+
+        // Wake up for the next request, if it can be sent, and to time out
+        // the ones in flight
+        int timeout_ms = 100;
+        if (next_rec_idx < records_count && idle_conns_count > 0) {
+            uint64_t due_ns = records[next_rec_idx].due_ns;
+            uint64_t wait_ms = due_ns > now ? (due_ns - now + 999999)/1000000 : 0;
+            if (wait_ms < timeout_ms) timeout_ms = wait_ms;
+        }
+        int n_events = epoll_wait(epoll_fd, events, 256, timeout_ms);
+        if (n_events == -1) {
+            if (errno == EINTR) continue;
+            log_fmt(ERR, "epoll_wait failed: %s", strerror(errno));
+            return 1;
+        }
+        for (int i = 0; i < n_events; ++i) {
+            conn_on_event(events[i].data.ptr, events[i].events);
+        }
+
+        now = now_ns() - start_ns;
+        if (now - timeouts_check_ns >= 100000000) {
+            conns_check_timeouts();
+            timeouts_check_ns = now;
+        }
+    }
+    double elapsed_s = (now_ns() - start_ns)/1e9;
+
+    for (size_t i = 0; i < opt_conns; ++i) conn_close(&conns[i]);
+
+    if (opt_save_path != NULL && !checksums_save()) return 1;
+    if (opt_expect_path != NULL ? !checksums_expect() : !checksums_compare_identical()) {
+        return 1;
+    }
+    if (n_mismatches > MAX_LOGGED_MISMATCHES) {
+        log_fmt(WARN, "...and %lu more mismatches.", n_mismatches - MAX_LOGGED_MISMATCHES);
+    }
+
+    print_results_json(elapsed_s);
+
+    return 0;
+}